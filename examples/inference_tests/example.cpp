@@ -0,0 +1,1829 @@
+
+/*---------------------------------------------------------------------------*
+ |                               UPGM++                                      |
+ |                   Undirected Graphical Models in C++                      |
+ |                                                                           |
+ |              Copyright (C) 2014 Jose Raul Ruiz Sarmiento                  |
+ |                 University of Malaga (jotaraul@uma.es)                    |
+ |                                                                           |
+ |   This program is free software: you can redistribute it and/or modify    |
+ |   it under the terms of the GNU General Public License as published by    |
+ |   the Free Software Foundation, either version 3 of the License, or       |
+ |   (at your option) any later version.                                     |
+ |                                                                           |
+ |   This program is distributed in the hope that it will be useful,         |
+ |   but WITHOUT ANY WARRANTY; without even the implied warranty of          |
+ |   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           |
+ |   GNU General Public License for more details.                            |
+ |   <http://www.gnu.org/licenses/>                                          |
+ |                                                                           |
+ *---------------------------------------------------------------------------*/
+
+
+#include "base.hpp"
+#include "inference_MAP.hpp"
+#include "inference_marginal.hpp"
+#include "inference_maxflow.hpp"
+#include "inference_utils.hpp"
+
+#include <boost/random.hpp>
+
+#include <iostream>
+#include <cstdlib>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <new>
+#include <map>
+#include <set>
+
+using namespace UPGMpp;
+using namespace std;
+using namespace Eigen;
+
+typedef boost::mt19937 RandomGenerator;
+typedef boost::uniform_real<double> UniformDistribution;
+
+/*---------------------------------------------------------------------------*
+ *
+ * Regression tests of the inference methods. Each test builds small random
+ * graphs and checks the methods against brute force, or against properties
+ * they guarantee (bounds, determinism, no allocations...). Failed checks
+ * are reported, and the program returns their number, so it can be run by
+ * ctest.
+ *
+ *---------------------------------------------------------------------------*/
+
+size_t N_failures = 0;
+
+void check( bool condition, const string &name )
+{
+    if ( !condition )
+    {
+        cout << "[FAILED] " << name << endl;
+        N_failures++;
+    }
+    else
+        cout << "[OK] " << name << endl;
+}
+
+/*------------------------------------------------------------------------------
+ *
+ *                           ALLOCATION COUNTING
+ *
+ *----------------------------------------------------------------------------*/
+
+// Counting operator new catches the standard containers. Eigen allocates
+// through malloc, so it is also counted when using glibc.
+
+size_t N_allocations = 0;
+
+#if __cplusplus >= 201103L
+#define THROW_BAD_ALLOC
+#define THROW_NOTHING noexcept
+#else
+#define THROW_BAD_ALLOC throw( std::bad_alloc )
+#define THROW_NOTHING throw()
+#endif
+
+void* operator new( size_t size ) THROW_BAD_ALLOC
+{
+    N_allocations++;
+
+    void *pointer = std::malloc( size ? size : 1 );
+
+    if ( !pointer )
+        throw std::bad_alloc();
+
+    return pointer;
+}
+
+void operator delete( void *pointer ) THROW_NOTHING
+{
+    std::free( pointer );
+}
+
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc( size_t size );
+
+extern "C" void *malloc( size_t size )
+{
+    N_allocations++;
+
+    return __libc_malloc( size );
+}
+#endif
+
+/*------------------------------------------------------------------------------
+ *
+ *                                 GRAPHS
+ *
+ *----------------------------------------------------------------------------*/
+
+/** Random graph with N_nodes nodes of N_classes classes, linked by a random
+  * spanning tree plus N_extraEdges random edges. Log potentials are uniform
+  * in [-strength,strength].
+  */
+void buildRandomGraph( CGraph &graph,
+                       size_t N_nodes,
+                       size_t N_classes,
+                       size_t N_extraEdges,
+                       double strength,
+                       unsigned int seed )
+{
+    RandomGenerator rng( seed );
+    UniformDistribution uniform( -strength, strength );
+    UniformDistribution unit( 0, 1 );
+
+    CNodeTypePtr nodeType( new CNodeType( N_classes, 1 ) );
+    CEdgeTypePtr edgeType( new CEdgeType( 1, nodeType, nodeType ) );
+
+    VectorXd features(1);
+    features << 1;
+
+    vector<CNodePtr> nodes;
+
+    for ( size_t i = 0; i < N_nodes; i++ )
+    {
+        CNodePtr node( new CNode( nodeType, features ) );
+
+        VectorXd nodePotentials( N_classes );
+
+        for ( size_t k = 0; k < N_classes; k++ )
+            nodePotentials(k) = exp( uniform(rng) );
+
+        node->setFinalPotentials( nodePotentials );
+
+        graph.addNode( node );
+        nodes.push_back( node );
+    }
+
+    set<pair<size_t,size_t> > linked;
+
+    for ( size_t i = 1; i < N_nodes + N_extraEdges; i++ )
+    {
+        // The first N_nodes-1 edges link each node with a previous one
+        size_t node1 = ( i < N_nodes ) ? i : (size_t)( unit(rng)*N_nodes );
+        size_t node2 = (size_t)( unit(rng)*( ( i < N_nodes ) ? i : N_nodes ) );
+
+        if ( ( node1 == node2 ) || linked.count( make_pair( min(node1,node2), max(node1,node2) ) ) )
+            continue;
+
+        linked.insert( make_pair( min(node1,node2), max(node1,node2) ) );
+
+        CEdgePtr edge( new CEdge( nodes[node1], nodes[node2], edgeType, features ) );
+
+        MatrixXd edgePotentials( N_classes, N_classes );
+
+        for ( size_t row = 0; row < N_classes; row++ )
+            for ( size_t col = 0; col < N_classes; col++ )
+                edgePotentials(row,col) = exp( uniform(rng) );
+
+        edge->setFinalPotentials( edgePotentials );
+
+        graph.addEdge( edge );
+    }
+}
+
+/** Exact MAP, node and edge marginals and logZ of a small graph, by
+  * enumerating all its assignations.
+  */
+void getBruteForce( CGraph &graph,
+                    map<size_t,size_t> &MAP,
+                    map<size_t,VectorXd> &nodeMarginals,
+                    map<size_t,MatrixXd> &edgeMarginals,
+                    double &logZ )
+{
+    vector<CNodePtr> &nodes = graph.getNodes();
+    vector<CEdgePtr> &edges = graph.getEdges();
+
+    vector<map<size_t,size_t> > assignations;
+    vector<double>              logLikelihoods;
+
+    map<size_t,size_t> assignation;
+
+    for ( size_t i = 0; i < nodes.size(); i++ )
+        assignation[ nodes[i]->getID() ] = 0;
+
+    for ( bool done = false; !done; )
+    {
+        assignations.push_back( assignation );
+        logLikelihoods.push_back( graph.getUnnormalizedLogLikelihood( assignation ) );
+
+        // Next assignation
+        done = true;
+
+        for ( size_t i = 0; ( i < nodes.size() ) && done; i++ )
+        {
+            size_t &nodeClass = assignation[ nodes[i]->getID() ];
+
+            if ( ++nodeClass < nodes[i]->getType()->getNumberOfClasses() )
+                done = false;
+            else
+                nodeClass = 0;
+        }
+    }
+
+    size_t best = max_element( logLikelihoods.begin(), logLikelihoods.end() ) - logLikelihoods.begin();
+
+    MAP = assignations[best];
+
+    double Z = 0;
+
+    for ( size_t a = 0; a < assignations.size(); a++ )
+        Z += exp( logLikelihoods[a] - logLikelihoods[best] );
+
+    logZ = logLikelihoods[best] + log( Z );
+
+    nodeMarginals.clear();
+    edgeMarginals.clear();
+
+    for ( size_t i = 0; i < nodes.size(); i++ )
+        nodeMarginals[ nodes[i]->getID() ] = VectorXd::Zero( nodes[i]->getType()->getNumberOfClasses() );
+
+    for ( size_t e = 0; e < edges.size(); e++ )
+        edgeMarginals[ edges[e]->getID() ] = MatrixXd::Zero( edges[e]->getPotentials().rows(),
+                                                             edges[e]->getPotentials().cols() );
+
+    for ( size_t a = 0; a < assignations.size(); a++ )
+    {
+        double probability = exp( logLikelihoods[a] - logZ );
+
+        for ( size_t i = 0; i < nodes.size(); i++ )
+            nodeMarginals[ nodes[i]->getID() ]( assignations[a][ nodes[i]->getID() ] ) += probability;
+
+        for ( size_t e = 0; e < edges.size(); e++ )
+        {
+            size_t ID1, ID2;
+            edges[e]->getNodesID( ID1, ID2 );
+
+            edgeMarginals[ edges[e]->getID() ]( assignations[a][ID1], assignations[a][ID2] ) += probability;
+        }
+    }
+}
+
+/** Max absolute difference between two sets of beliefs. */
+template <typename T>
+double getMaxDifference( map<size_t,T> &beliefs1, map<size_t,T> &beliefs2 )
+{
+    if ( beliefs1.size() != beliefs2.size() )
+        return numeric_limits<double>::infinity();
+
+    double difference = 0;
+
+    typename map<size_t,T>::iterator it;
+
+    for ( it = beliefs1.begin(); it != beliefs1.end(); it++ )
+    {
+        T &other = beliefs2[ it->first ];
+
+        if ( ( other.rows() != it->second.rows() ) || ( other.cols() != it->second.cols() ) )
+            return numeric_limits<double>::infinity();
+
+        difference = max( difference, ( it->second - other ).cwiseAbs().maxCoeff() );
+    }
+
+    return difference;
+}
+
+/*------------------------------------------------------------------------------
+ *
+ *                                  TESTS
+ *
+ *----------------------------------------------------------------------------*/
+
+/** messagesLBP works over preallocated buffers, so its allocations do not
+  * depend on the number of iterations.
+  */
+void testMessagesAllocations()
+{
+    CGraph graph;
+    buildRandomGraph( graph, 60, 3, 40, 1.0, 1 );
+
+    // A first call, so the one-time allocations (e.g. those of the OpenMP
+    // runtime) are not counted
+    {
+        TInferenceOptions options;
+        options.particularD["numberOfThreads"] = 1;
+
+        vector<vector<VectorXd> > messages;
+        messagesLBP( graph, options, messages, false );
+    }
+
+    const char *orders[2] = { "", "RBP" };
+
+    for ( size_t logDomain = 0; logDomain < 2; logDomain++ )
+        for ( size_t maximize = 0; maximize < 2; maximize++ )
+            for ( size_t order = 0; order < 2; order++ )
+            {
+                size_t N_iterationsAllocations[2];
+                size_t N_iterations[2] = { 2, 20 };
+
+                for ( size_t run = 0; run < 2; run++ )
+                {
+                    TInferenceOptions options;
+                    options.maxIterations = N_iterations[run];
+                    options.convergency   = -1; // Do all the iterations
+                    options.particularS["order"] = orders[order];
+                    options.particularB["logDomain"] = logDomain;
+                    options.particularD["numberOfThreads"] = 1;
+
+                    vector<vector<VectorXd> > messages;
+
+                    size_t N_initialAllocations = N_allocations;
+
+                    messagesLBP( graph, options, messages, maximize );
+
+                    N_iterationsAllocations[run] = N_allocations - N_initialAllocations;
+                }
+
+                check( N_iterationsAllocations[0] == N_iterationsAllocations[1],
+                       string("messagesLBP allocations do not depend on the iterations (")
+                       + ( logDomain ? "log, " : "linear, " )
+                       + ( maximize ? "max" : "sum" )
+                       + ( order ? ", RBP)" : ")" ) );
+            }
+}
+
+/** The messages of LBP are computed from a cavity of the node belief,
+  * with prefix and suffix products when there are zero potentials, so it
+  * must stay exact on trees.
+  */
+void testCavityMessages()
+{
+    double maxDifference = 0;
+
+    for ( unsigned int seed = 0; seed < 10; seed++ )
+    {
+        CGraph graph;
+        buildRandomGraph( graph, 9, 3, 0, 1.0, seed );
+
+        // Exact zeros in some potentials
+        if ( seed % 2 )
+        {
+            CNodePtr node = graph.getNodes()[ seed % 9 ];
+            VectorXd nodePotentials = node->getPotentials();
+            nodePotentials(0) = 0;
+            node->setFinalPotentials( nodePotentials );
+
+            CEdgePtr edge = graph.getEdges()[ seed % 8 ];
+            MatrixXd edgePotentials = edge->getPotentials();
+            edgePotentials(1,2) = 0;
+            edge->setFinalPotentials( edgePotentials );
+        }
+
+        map<size_t,size_t>   MAP;
+        map<size_t,VectorXd> exactNodeBeliefs, nodeBeliefs;
+        map<size_t,MatrixXd> exactEdgeBeliefs, edgeBeliefs;
+        double               exactLogZ, logZ;
+
+        getBruteForce( graph, MAP, exactNodeBeliefs, exactEdgeBeliefs, exactLogZ );
+
+        TInferenceOptions options;
+        options.convergency = 1e-10;
+        options.particularB["skipExactTrees"] = true;
+
+        CLBPInferenceMarginal LBP;
+        LBP.setOptions( options );
+        LBP.infer( graph, nodeBeliefs, edgeBeliefs, logZ );
+
+        maxDifference = max( maxDifference, getMaxDifference( exactNodeBeliefs, nodeBeliefs ) );
+        maxDifference = max( maxDifference, getMaxDifference( exactEdgeBeliefs, edgeBeliefs ) );
+    }
+
+    check( maxDifference < 1e-6, "LBP marginals are exact on trees, also with zero potentials" );
+}
+
+/** Log domain message passing gives the same beliefs as the linear one,
+  * does not overflow with large potentials, decodes the exact MAP of trees
+  * in both domains, and its Bethe logZ is exact on trees.
+  */
+void testLogDomain()
+{
+    {
+        CGraph graph;
+        buildRandomGraph( graph, 12, 3, 8, 1.0, 1 );
+
+        map<size_t,VectorXd> nodeBeliefs[2];
+        map<size_t,MatrixXd> edgeBeliefs[2];
+        double               logZ[2];
+
+        for ( size_t logDomain = 0; logDomain < 2; logDomain++ )
+        {
+            TInferenceOptions options;
+            options.convergency = 1e-10;
+            options.particularB["logDomain"] = logDomain;
+
+            CLBPInferenceMarginal LBP;
+            LBP.setOptions( options );
+            LBP.infer( graph, nodeBeliefs[logDomain], edgeBeliefs[logDomain], logZ[logDomain] );
+        }
+
+        check( ( getMaxDifference( nodeBeliefs[0], nodeBeliefs[1] ) < 1e-6 ) &&
+               ( getMaxDifference( edgeBeliefs[0], edgeBeliefs[1] ) < 1e-6 ) &&
+               ( fabs( logZ[0] - logZ[1] ) < 1e-6 ),
+               "Log domain LBP gives the same beliefs and logZ as the linear one" );
+    }
+
+    {
+        CGraph graph;
+        buildRandomGraph( graph, 30, 3, 30, 600.0, 2 );
+
+        TInferenceOptions options;
+        options.particularB["logDomain"] = true;
+
+        map<size_t,VectorXd> nodeBeliefs;
+        map<size_t,MatrixXd> edgeBeliefs;
+        double               logZ;
+
+        CLBPInferenceMarginal LBP;
+        LBP.setOptions( options );
+        LBP.infer( graph, nodeBeliefs, edgeBeliefs, logZ );
+
+        bool finite = ( logZ == logZ ) && ( fabs( logZ ) < numeric_limits<double>::infinity() );
+
+        for ( map<size_t,VectorXd>::iterator it = nodeBeliefs.begin(); it != nodeBeliefs.end(); it++ )
+            finite = finite && ( it->second.array() == it->second.array() ).all();
+
+        check( finite, "Log domain LBP does not overflow with large potentials" );
+    }
+
+    bool   exactMAP  = true;
+    double logZError = 0;
+
+    for ( unsigned int seed = 0; seed < 10; seed++ )
+    {
+        CGraph graph;
+        buildRandomGraph( graph, 9, 3, 0, 2.0, seed );
+
+        map<size_t,size_t>   MAP;
+        map<size_t,VectorXd> nodeBeliefs;
+        map<size_t,MatrixXd> edgeBeliefs;
+        double               exactLogZ, logZ;
+
+        getBruteForce( graph, MAP, nodeBeliefs, edgeBeliefs, exactLogZ );
+
+        double maxLogLikelihood = graph.getUnnormalizedLogLikelihood( MAP );
+
+        for ( size_t logDomain = 0; logDomain < 2; logDomain++ )
+        {
+            TInferenceOptions options;
+            options.convergency = 1e-10;
+            options.particularB["logDomain"] = logDomain;
+            options.particularB["skipExactTrees"] = true;
+
+            map<size_t,size_t> results;
+
+            CLBPInferenceMAP LBP;
+            LBP.setOptions( options );
+            LBP.infer( graph, results );
+
+            exactMAP = exactMAP && ( graph.getUnnormalizedLogLikelihood( results ) > maxLogLikelihood - 1e-9 );
+
+            CLBPInferenceMarginal LBPMarginal;
+            LBPMarginal.setOptions( options );
+            LBPMarginal.infer( graph, nodeBeliefs, edgeBeliefs, logZ );
+
+            logZError = max( logZError, fabs( logZ - exactLogZ ) );
+        }
+    }
+
+    check( exactMAP, "LBP max-product decodes the exact MAP of trees in both domains" );
+    check( logZError < 1e-6, "The Bethe logZ of LBP is exact on trees" );
+}
+
+/** The Jacobi schedule is exact on trees, and its messages do not depend
+  * on the number of threads.
+  */
+void testJacobiSchedule()
+{
+    double maxDifference = 0;
+
+    for ( unsigned int seed = 0; seed < 5; seed++ )
+    {
+        CGraph graph;
+        buildRandomGraph( graph, 9, 3, 0, 1.0, seed );
+
+        map<size_t,size_t>   MAP;
+        map<size_t,VectorXd> exactNodeBeliefs, nodeBeliefs;
+        map<size_t,MatrixXd> exactEdgeBeliefs, edgeBeliefs;
+        double               exactLogZ, logZ;
+
+        getBruteForce( graph, MAP, exactNodeBeliefs, exactEdgeBeliefs, exactLogZ );
+
+        TInferenceOptions options;
+        options.convergency = 1e-10;
+        options.particularS["schedule"] = "Jacobi";
+        options.particularB["skipExactTrees"] = true;
+
+        CLBPInferenceMarginal LBP;
+        LBP.setOptions( options );
+        LBP.infer( graph, nodeBeliefs, edgeBeliefs, logZ );
+
+        maxDifference = max( maxDifference, getMaxDifference( exactNodeBeliefs, nodeBeliefs ) );
+    }
+
+    check( maxDifference < 1e-6, "Jacobi LBP marginals are exact on trees" );
+
+    CGraph graph;
+    buildRandomGraph( graph, 40, 3, 40, 0.5, 3 );
+
+    vector<vector<VectorXd> > messages[2];
+
+    for ( size_t run = 0; run < 2; run++ )
+    {
+        TInferenceOptions options;
+        options.particularS["schedule"] = "Jacobi";
+        options.particularD["numberOfThreads"] = 1 + 2*run;
+
+        messagesLBP( graph, options, messages[run], false );
+    }
+
+    check( getMessagesResidual( messages[0], messages[1] ) == 0,
+           "Jacobi LBP messages do not depend on the number of threads" );
+}
+
+/** Splash belief propagation is exact on trees. */
+void testSplash()
+{
+    double maxDifference = 0;
+    bool   exactMAP      = true;
+
+    for ( unsigned int seed = 0; seed < 5; seed++ )
+    {
+        CGraph graph;
+        buildRandomGraph( graph, 9, 3, 0, 1.0, seed );
+
+        map<size_t,size_t>   MAP, results;
+        map<size_t,VectorXd> exactNodeBeliefs, nodeBeliefs;
+        map<size_t,MatrixXd> exactEdgeBeliefs, edgeBeliefs;
+        double               exactLogZ, logZ;
+
+        getBruteForce( graph, MAP, exactNodeBeliefs, exactEdgeBeliefs, exactLogZ );
+
+        TInferenceOptions options;
+        options.convergency = 1e-10;
+        options.particularD["splashSize"] = 3;
+
+        CSplashInferenceMarginal splash;
+        splash.setOptions( options );
+        splash.infer( graph, nodeBeliefs, edgeBeliefs, logZ );
+
+        maxDifference = max( maxDifference, getMaxDifference( exactNodeBeliefs, nodeBeliefs ) );
+
+        CSplashInferenceMAP splashMAP;
+        splashMAP.setOptions( options );
+        splashMAP.infer( graph, results );
+
+        exactMAP = exactMAP && ( graph.getUnnormalizedLogLikelihood( results ) >
+                                 graph.getUnnormalizedLogLikelihood( MAP ) - 1e-9 );
+    }
+
+    check( maxDifference < 1e-6, "Splash marginals are exact on trees" );
+    check( exactMAP, "Splash decodes the exact MAP of trees" );
+}
+
+/** LBP reports how it finished: once converged, the residual is under the
+  * convergency threshold.
+  */
+void testConvergenceStatus()
+{
+    CGraph graph;
+    buildRandomGraph( graph, 30, 3, 20, 0.3, 4 );
+
+    TInferenceOptions options;
+    options.convergency   = 1e-8;
+    options.maxIterations = 1000;
+    options.particularB["skipExactTrees"] = true;
+
+    map<size_t,VectorXd> nodeBeliefs;
+    map<size_t,MatrixXd> edgeBeliefs;
+    double               logZ;
+
+    CLBPInferenceMarginal LBP;
+    LBP.setOptions( options );
+    LBP.infer( graph, nodeBeliefs, edgeBeliefs, logZ );
+
+    const TInferenceStatus &status = LBP.getStatus();
+
+    check( ( status.stopCause == "Converged" ) &&
+           ( status.residual < options.convergency ) &&
+           ( status.iterations > 0 ) && ( status.iterations < options.maxIterations ),
+           "LBP reports its convergence, residual and iterations" );
+}
+
+/** MAP message passing can stop once the decoded labels are stable,
+  * never doing more iterations than waiting for the messages to converge.
+  */
+void testDecisionStability()
+{
+    bool   fewerIterations = true;
+    size_t N_stableStops   = 0;
+
+    for ( unsigned int seed = 0; seed < 10; seed++ )
+    {
+        CGraph graph;
+        buildRandomGraph( graph, 40, 3, 100, 1.0, seed );
+
+        TInferenceOptions options;
+        options.convergency   = 1e-12;
+        options.maxIterations = 500;
+        options.particularB["skipExactTrees"] = true;
+
+        map<size_t,size_t> results;
+
+        CLBPInferenceMAP LBP;
+        LBP.setOptions( options );
+        LBP.infer( graph, results );
+
+        options.particularD["decisionStabilitySweeps"] = 3;
+
+        map<size_t,size_t> stableResults;
+
+        CLBPInferenceMAP stableLBP;
+        stableLBP.setOptions( options );
+        stableLBP.infer( graph, stableResults );
+
+        fewerIterations = fewerIterations &&
+                          ( stableLBP.getStatus().iterations <= LBP.getStatus().iterations );
+
+        if ( stableLBP.getStatus().stopCause == "StableDecisions" )
+            N_stableStops++;
+    }
+
+    check( fewerIterations && ( N_stableStops > 0 ), "LBP decoding stops once the decisions are stable" );
+}
+
+/** TRW-S decodes the exact MAP of trees closing the duality gap, and its
+  * lower bound never exceeds the optimal energy.
+  */
+void testTRWS()
+{
+    bool exactMAP   = true;
+    bool validBound = true;
+
+    for ( unsigned int seed = 0; seed < 10; seed++ )
+    {
+        CGraph graph;
+        buildRandomGraph( graph, 9, 3, ( seed % 2 ) ? 6 : 0, 1.0, seed );
+
+        map<size_t,size_t>   MAP, results;
+        map<size_t,VectorXd> nodeBeliefs;
+        map<size_t,MatrixXd> edgeBeliefs;
+        double               logZ;
+
+        getBruteForce( graph, MAP, nodeBeliefs, edgeBeliefs, logZ );
+
+        double minEnergy = -graph.getUnnormalizedLogLikelihood( MAP );
+
+        TInferenceOptions options;
+        options.convergency = 1e-10;
+
+        CTRWSInferenceMAP TRWS;
+        TRWS.setOptions( options );
+        TRWS.infer( graph, results );
+
+        double energy = -graph.getUnnormalizedLogLikelihood( results );
+
+        validBound = validBound && ( TRWS.getLowerBound() <= minEnergy + 1e-9 ) &&
+                                   ( fabs( TRWS.getEnergy() - energy ) < 1e-9 );
+
+        if ( !( seed % 2 ) )
+            exactMAP = exactMAP && ( energy < minEnergy + 1e-9 ) && ( TRWS.getDualityGap() < 1e-6 );
+    }
+
+    check( exactMAP, "TRW-S decodes the exact MAP of trees" );
+    check( validBound, "TRW-S lower bound does not exceed the min energy" );
+}
+
+/** TRW-BP returns an upper bound of logZ, exact on trees. */
+void testTRWBP()
+{
+    bool   upperBound = true;
+    double treeError  = 0;
+
+    for ( unsigned int seed = 0; seed < 10; seed++ )
+    {
+        CGraph graph;
+        buildRandomGraph( graph, 9, 3, ( seed % 2 ) ? 6 : 0, 1.0, seed );
+
+        map<size_t,size_t>   MAP;
+        map<size_t,VectorXd> exactNodeBeliefs, nodeBeliefs;
+        map<size_t,MatrixXd> exactEdgeBeliefs, edgeBeliefs;
+        double               exactLogZ, logZ;
+
+        getBruteForce( graph, MAP, exactNodeBeliefs, exactEdgeBeliefs, exactLogZ );
+
+        TInferenceOptions options;
+        options.convergency   = 1e-10;
+        options.maxIterations = 1000;
+
+        CTRWBPInferenceMarginal TRWBP;
+        TRWBP.setOptions( options );
+        TRWBP.infer( graph, nodeBeliefs, edgeBeliefs, logZ );
+
+        upperBound = upperBound && ( logZ > exactLogZ - 1e-6 );
+
+        if ( !( seed % 2 ) )
+            treeError = max( treeError, fabs( logZ - exactLogZ ) );
+    }
+
+    check( upperBound, "TRW-BP logZ is an upper bound" );
+    check( treeError < 1e-6, "TRW-BP logZ is exact on trees" );
+}
+
+/** Viterbi and forward-backward are exact on forests. */
+void testForestSolvers()
+{
+    bool   exactMAP      = true;
+    double maxDifference = 0;
+
+    for ( unsigned int seed = 0; seed < 10; seed++ )
+    {
+        // Two trees
+        CGraph graph;
+        buildRandomGraph( graph, 5, 3, 0, 2.0, seed );
+        buildRandomGraph( graph, 4, 2, 0, 2.0, seed + 100 );
+
+        map<size_t,size_t>   MAP, results;
+        map<size_t,VectorXd> exactNodeBeliefs, nodeBeliefs;
+        map<size_t,MatrixXd> exactEdgeBeliefs, edgeBeliefs;
+        double               exactLogZ, logZ;
+
+        getBruteForce( graph, MAP, exactNodeBeliefs, exactEdgeBeliefs, exactLogZ );
+
+        TInferenceOptions options;
+
+        CTreeInferenceMAP tree;
+        tree.setOptions( options );
+        tree.infer( graph, results );
+
+        exactMAP = exactMAP && ( graph.getUnnormalizedLogLikelihood( results ) >
+                                 graph.getUnnormalizedLogLikelihood( MAP ) - 1e-9 );
+
+        CTreeInferenceMarginal treeMarginal;
+        treeMarginal.setOptions( options );
+        treeMarginal.infer( graph, nodeBeliefs, edgeBeliefs, logZ );
+
+        maxDifference = max( maxDifference, getMaxDifference( exactNodeBeliefs, nodeBeliefs ) );
+        maxDifference = max( maxDifference, getMaxDifference( exactEdgeBeliefs, edgeBeliefs ) );
+        maxDifference = max( maxDifference, fabs( exactLogZ - logZ ) );
+    }
+
+    check( exactMAP, "Viterbi decodes the exact MAP of forests" );
+    check( maxDifference < 1e-9, "Forward-backward marginals and logZ are exact on forests" );
+}
+
+/** The junction tree gives the exact MAP, marginals and logZ. */
+void testJunctionTree()
+{
+    bool   exactMAP      = true;
+    double maxDifference = 0;
+
+    const char *orders[2] = { "MinFill", "MinDegree" };
+
+    for ( unsigned int seed = 0; seed < 10; seed++ )
+    {
+        CGraph graph;
+        buildRandomGraph( graph, 9, 3, 8, 1.0, seed );
+
+        map<size_t,size_t>   MAP, results;
+        map<size_t,VectorXd> exactNodeBeliefs, nodeBeliefs;
+        map<size_t,MatrixXd> exactEdgeBeliefs, edgeBeliefs;
+        double               exactLogZ, logZ;
+
+        getBruteForce( graph, MAP, exactNodeBeliefs, exactEdgeBeliefs, exactLogZ );
+
+        TInferenceOptions options;
+        options.particularS["eliminationOrder"] = orders[ seed % 2 ];
+
+        CJunctionTreeInferenceMAP junctionTree;
+        junctionTree.setOptions( options );
+        junctionTree.infer( graph, results );
+
+        exactMAP = exactMAP && ( graph.getUnnormalizedLogLikelihood( results ) >
+                                 graph.getUnnormalizedLogLikelihood( MAP ) - 1e-9 );
+
+        CJunctionTreeInferenceMarginal junctionTreeMarginal;
+        junctionTreeMarginal.setOptions( options );
+        junctionTreeMarginal.infer( graph, nodeBeliefs, edgeBeliefs, logZ );
+
+        maxDifference = max( maxDifference, getMaxDifference( exactNodeBeliefs, nodeBeliefs ) );
+        maxDifference = max( maxDifference, getMaxDifference( exactEdgeBeliefs, edgeBeliefs ) );
+        maxDifference = max( maxDifference, fabs( exactLogZ - logZ ) );
+    }
+
+    check( exactMAP, "Junction tree decodes the exact MAP" );
+    check( maxDifference < 1e-9, "Junction tree marginals and logZ are exact" );
+}
+
+/** Branch and bound decodes the exact MAP, with any number of threads. */
+void testBranchAndBound()
+{
+    bool exactMAP = true;
+
+    for ( unsigned int seed = 0; seed < 10; seed++ )
+    {
+        CGraph graph;
+        buildRandomGraph( graph, 9, 3, 8, 1.0, seed );
+
+        map<size_t,size_t>   MAP;
+        map<size_t,VectorXd> nodeBeliefs;
+        map<size_t,MatrixXd> edgeBeliefs;
+        double               logZ;
+
+        getBruteForce( graph, MAP, nodeBeliefs, edgeBeliefs, logZ );
+
+        for ( size_t N_threads = 1; N_threads <= 3; N_threads += 2 )
+        {
+            TInferenceOptions options;
+            options.particularD["numberOfThreads"] = N_threads;
+
+            map<size_t,size_t> results;
+
+            CExactInferenceMAP exact;
+            exact.setOptions( options );
+            exact.infer( graph, results );
+
+            exactMAP = exactMAP && ( graph.getUnnormalizedLogLikelihood( results ) >
+                                     graph.getUnnormalizedLogLikelihood( MAP ) - 1e-9 );
+        }
+    }
+
+    check( exactMAP, "Branch and bound decodes the exact MAP" );
+}
+
+/** Variable elimination gives the exact MAP and logZ, and upper bounds
+  * when mini-buckets are needed.
+  */
+void testVariableElimination()
+{
+    bool exact       = true;
+    bool upperBounds = true;
+
+    for ( unsigned int seed = 0; seed < 10; seed++ )
+    {
+        CGraph graph;
+        buildRandomGraph( graph, 9, 3, 10, 1.0, seed );
+
+        map<size_t,size_t>   MAP, results;
+        map<size_t,VectorXd> nodeBeliefs;
+        map<size_t,MatrixXd> edgeBeliefs;
+        double               exactLogZ, logZ;
+
+        getBruteForce( graph, MAP, nodeBeliefs, edgeBeliefs, exactLogZ );
+
+        double maxLogLikelihood = graph.getUnnormalizedLogLikelihood( MAP );
+
+        TInferenceOptions options;
+
+        CVariableEliminationInferenceMAP elimination;
+        elimination.setOptions( options );
+        elimination.infer( graph, results );
+
+        CVariableEliminationInferenceMarginal eliminationMarginal;
+        eliminationMarginal.setOptions( options );
+        eliminationMarginal.infer( graph, nodeBeliefs, edgeBeliefs, logZ );
+
+        exact = exact && eliminationMarginal.isExact() &&
+                ( fabs( logZ - exactLogZ ) < 1e-9 ) &&
+                ( graph.getUnnormalizedLogLikelihood( results ) > maxLogLikelihood - 1e-9 ) &&
+                ( fabs( elimination.getBound() - maxLogLikelihood ) < 1e-9 );
+
+        // Mini-buckets
+        options.particularD["maxTableSize"] = 9;
+
+        CVariableEliminationInferenceMAP miniBuckets;
+        miniBuckets.setOptions( options );
+        miniBuckets.infer( graph, results );
+
+        CVariableEliminationInferenceMarginal miniBucketsMarginal;
+        miniBucketsMarginal.setOptions( options );
+        miniBucketsMarginal.infer( graph, nodeBeliefs, edgeBeliefs, logZ );
+
+        upperBounds = upperBounds && ( logZ > exactLogZ - 1e-9 ) &&
+                      ( miniBuckets.getBound() > maxLogLikelihood - 1e-9 );
+    }
+
+    check( exact, "Variable elimination gives the exact MAP and logZ" );
+    check( upperBounds, "Mini-buckets give upper bounds of logZ and the max log likelihood" );
+}
+
+/** Random flow network: terminal capacities and edges with a capacity and a
+  * reverse capacity.
+  */
+struct TRandomNetwork
+{
+    size_t          N_nodes;
+    vector<double>  sourceCapacities;
+    vector<double>  sinkCapacities;
+    vector<size_t>  edgeNodes; //!< [2*edge] and [2*edge+1]
+    vector<double>  edgeCapacities; //!< [2*edge] and reverse [2*edge+1]
+
+    TRandomNetwork( size_t N, unsigned int seed ) : N_nodes( N )
+    {
+        RandomGenerator rng( seed );
+        UniformDistribution unit( 0, 1 );
+
+        for ( size_t node = 0; node < N_nodes; node++ )
+        {
+            sourceCapacities.push_back( ( unit(rng) < 0.3 ) ? 0 : 3*unit(rng) );
+            sinkCapacities.push_back( ( unit(rng) < 0.3 ) ? 0 : 3*unit(rng) );
+        }
+
+        for ( size_t i = 0; i < 2*N_nodes; i++ )
+        {
+            size_t node1 = unit(rng)*N_nodes;
+            size_t node2 = unit(rng)*N_nodes;
+
+            if ( node1 == node2 )
+                continue;
+
+            edgeNodes.push_back( node1 );
+            edgeNodes.push_back( node2 );
+            edgeCapacities.push_back( ( unit(rng) < 0.3 ) ? 0 : 2*unit(rng) );
+            edgeCapacities.push_back( ( unit(rng) < 0.5 ) ? 0 : 2*unit(rng) );
+        }
+    }
+
+    void fill( CMaxFlow &maxFlow ) const
+    {
+        maxFlow.reset( N_nodes );
+
+        for ( size_t node = 0; node < N_nodes; node++ )
+            maxFlow.addTerminalWeights( node, sourceCapacities[node], sinkCapacities[node] );
+
+        for ( size_t edge = 0; edge < edgeNodes.size()/2; edge++ )
+            maxFlow.addEdge( edgeNodes[2*edge], edgeNodes[2*edge+1],
+                             edgeCapacities[2*edge], edgeCapacities[2*edge+1] );
+    }
+
+    /** Capacity of the cut having in the sink segment the nodes set in
+      * sinkSegment.
+      */
+    double getCut( const vector<bool> &sinkSegment ) const
+    {
+        double cut = 0;
+
+        for ( size_t node = 0; node < N_nodes; node++ )
+            cut += sinkSegment[node] ? sourceCapacities[node] : sinkCapacities[node];
+
+        for ( size_t edge = 0; edge < edgeNodes.size()/2; edge++ )
+        {
+            bool sink1 = sinkSegment[ edgeNodes[2*edge] ];
+            bool sink2 = sinkSegment[ edgeNodes[2*edge+1] ];
+
+            if ( !sink1 && sink2 )
+                cut += edgeCapacities[2*edge];
+            else if ( sink1 && !sink2 )
+                cut += edgeCapacities[2*edge+1];
+        }
+
+        return cut;
+    }
+
+    double getMinCut() const
+    {
+        double minCut = numeric_limits<double>::max();
+
+        vector<bool> sinkSegment( N_nodes );
+
+        for ( size_t cut = 0; cut < ( size_t(1) << N_nodes ); cut++ )
+        {
+            for ( size_t node = 0; node < N_nodes; node++ )
+                sinkSegment[node] = ( cut >> node ) & 1;
+
+            minCut = min( minCut, getCut( sinkSegment ) );
+        }
+
+        return minCut;
+    }
+};
+
+/** Cut given by the segments of a solved max-flow. */
+double getSolvedCut( const TRandomNetwork &network, const CMaxFlow &maxFlow )
+{
+    vector<bool> sinkSegment( network.N_nodes );
+
+    for ( size_t node = 0; node < network.N_nodes; node++ )
+        sinkSegment[node] = maxFlow.isSinkSegment( node );
+
+    return network.getCut( sinkSegment );
+}
+
+/** Boykov-Kolmogorov computes the min cut. */
+void testBKMaxFlow()
+{
+    bool minCut = true;
+
+    for ( unsigned int seed = 0; seed < 200; seed++ )
+    {
+        TRandomNetwork network( 2 + seed % 10, seed );
+
+        CBKMaxFlow maxFlow;
+        network.fill( maxFlow );
+
+        double flow = maxFlow.maxFlow();
+        double best = network.getMinCut();
+
+        minCut = minCut && ( fabs( flow - best ) < 1e-9 ) &&
+                           ( fabs( getSolvedCut( network, maxFlow ) - best ) < 1e-9 );
+    }
+
+    check( minCut, "Boykov-Kolmogorov max-flow gives the min cut" );
+}
+
+/** Push-relabel computes the same flow and min cut as Boykov-Kolmogorov. */
+void testPushRelabelMaxFlow()
+{
+    bool sameCut = true;
+
+    for ( unsigned int seed = 0; seed < 200; seed++ )
+    {
+        TRandomNetwork network( 2 + seed % 30, seed );
+
+        CBKMaxFlow BKMaxFlow;
+        network.fill( BKMaxFlow );
+
+        double BKFlow = BKMaxFlow.maxFlow();
+
+        for ( size_t N_threads = 1; N_threads <= 3; N_threads += 2 )
+        {
+            CPushRelabelMaxFlow pushRelabelMaxFlow( N_threads );
+            network.fill( pushRelabelMaxFlow );
+
+            double flow = pushRelabelMaxFlow.maxFlow();
+
+            sameCut = sameCut && ( fabs( flow - BKFlow ) < 1e-9 ) &&
+                      ( fabs( getSolvedCut( network, pushRelabelMaxFlow ) - BKFlow ) < 1e-9 );
+        }
+    }
+
+    check( sameCut, "Push-relabel and Boykov-Kolmogorov give the same min cut" );
+}
+
+/** Editing the capacities of a solved Boykov-Kolmogorov network and
+  * solving it again gives the same flow as solving the final network from
+  * scratch, and alpha-expansion gives the same results with dynamic and
+  * static graph cuts.
+  */
+void testDynamicGraphCuts()
+{
+    bool sameFlow = true;
+
+    for ( unsigned int seed = 0; seed < 100; seed++ )
+    {
+        TRandomNetwork network( 2 + seed % 20, seed );
+
+        CBKMaxFlow dynamicMaxFlow;
+        network.fill( dynamicMaxFlow );
+        dynamicMaxFlow.maxFlow();
+
+        RandomGenerator rng( seed );
+        UniformDistribution unit( 0, 1 );
+
+        for ( size_t step = 0; step < 3; step++ )
+        {
+            // Change some capacities, keeping them non negative
+            for ( size_t node = 0; node < network.N_nodes; node++ )
+            {
+                double sourceChange = unit(rng) - network.sourceCapacities[node]*unit(rng);
+                double sinkChange   = unit(rng) - network.sinkCapacities[node]*unit(rng);
+
+                network.sourceCapacities[node] += sourceChange;
+                network.sinkCapacities[node]   += sinkChange;
+
+                dynamicMaxFlow.addTerminalWeights( node, sourceChange, sinkChange );
+            }
+
+            for ( size_t edge = 0; edge < network.edgeNodes.size()/2; edge++ )
+            {
+                double change        = unit(rng) - network.edgeCapacities[2*edge]*unit(rng);
+                double reverseChange = unit(rng) - network.edgeCapacities[2*edge+1]*unit(rng);
+
+                network.edgeCapacities[2*edge]   += change;
+                network.edgeCapacities[2*edge+1] += reverseChange;
+
+                dynamicMaxFlow.addEdgeCapacities( edge, change, reverseChange );
+            }
+
+            double flow = dynamicMaxFlow.maxFlow();
+
+            CBKMaxFlow staticMaxFlow;
+            network.fill( staticMaxFlow );
+
+            sameFlow = sameFlow && ( fabs( flow - staticMaxFlow.maxFlow() ) < 1e-9 ) &&
+                       ( fabs( getSolvedCut( network, dynamicMaxFlow ) - flow ) < 1e-9 );
+        }
+    }
+
+    check( sameFlow, "Dynamic Boykov-Kolmogorov max-flow reuses the flow correctly" );
+
+    bool sameResults = true;
+
+    for ( unsigned int seed = 0; seed < 5; seed++ )
+    {
+        CGraph graph;
+        buildRandomGraph( graph, 30, 4, 30, 1.0, seed );
+
+        map<size_t,size_t> results[2];
+
+        for ( size_t run = 0; run < 2; run++ )
+        {
+            TInferenceOptions options;
+            options.particularB["staticGraphCuts"] = run;
+
+            CAlphaExpansionInferenceMAP expansion;
+            expansion.setOptions( options );
+            expansion.infer( graph, results[run] );
+        }
+
+        sameResults = sameResults && ( fabs( graph.getUnnormalizedLogLikelihood( results[0] ) -
+                                             graph.getUnnormalizedLogLikelihood( results[1] ) ) < 1e-9 );
+    }
+
+    check( sameResults, "Alpha-expansion gives the same results with dynamic and static graph cuts" );
+}
+
+/** Sets Potts edge potentials (exp(weight) for equal classes, 1 otherwise),
+  * so the move energies are submodular.
+  */
+void setPottsEdges( CGraph &graph, double weight )
+{
+    vector<CEdgePtr> &edges = graph.getEdges();
+
+    for ( size_t e = 0; e < edges.size(); e++ )
+    {
+        MatrixXd edgePotentials = MatrixXd::Ones( edges[e]->getPotentials().rows(),
+                                                  edges[e]->getPotentials().cols() );
+
+        for ( size_t k = 0; k < (size_t)min( edgePotentials.rows(), edgePotentials.cols() ); k++ )
+            edgePotentials(k,k) = exp( weight );
+
+        edges[e]->setFinalPotentials( edgePotentials );
+    }
+}
+
+/** Log likelihood of the initial assignation of the decoding methods. */
+double getInitialLogLikelihood( CGraph &graph )
+{
+    TInferenceOptions options;
+    map<size_t,size_t> assignation;
+
+    getMostProbableNodeAssignation( graph, assignation, options );
+
+    return graph.getUnnormalizedLogLikelihood( assignation );
+}
+
+/** The expansion and swap moves built from the label arrays decode the
+  * exact MAP of binary submodular graphs, and never worsen the initial
+  * assignation.
+  */
+void testMoveNetworks()
+{
+    bool exactMAP = true;
+    bool improved = true;
+
+    for ( unsigned int seed = 0; seed < 10; seed++ )
+    {
+        CGraph binaryGraph;
+        buildRandomGraph( binaryGraph, 10, 2, 10, 1.0, seed );
+        setPottsEdges( binaryGraph, 0.8 );
+
+        map<size_t,size_t>   MAP;
+        map<size_t,VectorXd> nodeBeliefs;
+        map<size_t,MatrixXd> edgeBeliefs;
+        double               logZ;
+
+        getBruteForce( binaryGraph, MAP, nodeBeliefs, edgeBeliefs, logZ );
+
+        double maxLogLikelihood = binaryGraph.getUnnormalizedLogLikelihood( MAP );
+
+        CGraph graph;
+        buildRandomGraph( graph, 30, 4, 30, 1.0, seed );
+        setPottsEdges( graph, 0.8 );
+
+        double initialLogLikelihood = getInitialLogLikelihood( graph );
+
+        TInferenceOptions options;
+
+        map<size_t,size_t> results;
+
+        CAlphaExpansionInferenceMAP expansion;
+        expansion.setOptions( options );
+        expansion.infer( binaryGraph, results );
+
+        exactMAP = exactMAP && ( binaryGraph.getUnnormalizedLogLikelihood( results ) > maxLogLikelihood - 1e-9 );
+
+        expansion.infer( graph, results );
+
+        improved = improved && ( graph.getUnnormalizedLogLikelihood( results ) > initialLogLikelihood - 1e-9 );
+
+        CAlphaBetaSwapInferenceMAP swap;
+        swap.setOptions( options );
+        swap.infer( binaryGraph, results );
+
+        exactMAP = exactMAP && ( binaryGraph.getUnnormalizedLogLikelihood( results ) > maxLogLikelihood - 1e-9 );
+
+        swap.infer( graph, results );
+
+        improved = improved && ( graph.getUnnormalizedLogLikelihood( results ) > initialLogLikelihood - 1e-9 );
+    }
+
+    check( exactMAP, "Alpha-expansion and swap decode the exact MAP of binary submodular graphs" );
+    check( improved, "Alpha-expansion and swap do not worsen the initial assignation" );
+}
+
+/** The partial labeling of QPBO is persistent: completing it with any
+  * labeling does not increase its energy. Probing and improving can not
+  * worsen the initial assignation of graph cuts either.
+  */
+void testQPBO()
+{
+    bool persistent = true;
+
+    for ( unsigned int seed = 0; seed < 100; seed++ )
+    {
+        RandomGenerator rng( seed );
+        UniformDistribution uniform( -2, 2 );
+        UniformDistribution unit( 0, 1 );
+
+        size_t N_nodes = 2 + seed % 8;
+
+        vector<double> nodeEnergies( 2*N_nodes );
+        vector<size_t> edgeNodes;
+        vector<double> edgeEnergies;
+
+        CQPBO QPBO;
+        QPBO.reset( N_nodes );
+
+        for ( size_t node = 0; node < N_nodes; node++ )
+        {
+            nodeEnergies[2*node]   = uniform(rng);
+            nodeEnergies[2*node+1] = uniform(rng);
+
+            QPBO.addNodeEnergies( node, nodeEnergies[2*node], nodeEnergies[2*node+1] );
+        }
+
+        for ( size_t i = 0; i < 2*N_nodes; i++ )
+        {
+            size_t node1 = unit(rng)*N_nodes;
+            size_t node2 = unit(rng)*N_nodes;
+
+            if ( node1 == node2 )
+                continue;
+
+            edgeNodes.push_back( node1 );
+            edgeNodes.push_back( node2 );
+
+            for ( size_t k = 0; k < 4; k++ )
+                edgeEnergies.push_back( uniform(rng) );
+
+            QPBO.addEdgeEnergies( node1, node2,
+                                  edgeEnergies[ edgeEnergies.size()-4 ], edgeEnergies[ edgeEnergies.size()-3 ],
+                                  edgeEnergies[ edgeEnergies.size()-2 ], edgeEnergies[ edgeEnergies.size()-1 ] );
+        }
+
+        QPBO.solve();
+
+        vector<size_t> labels( N_nodes ), completed( N_nodes );
+
+        for ( size_t labeling = 0; labeling < ( size_t(1) << N_nodes ); labeling++ )
+        {
+            double energies[2] = { 0, 0 };
+
+            for ( size_t node = 0; node < N_nodes; node++ )
+            {
+                labels[node]    = ( labeling >> node ) & 1;
+                completed[node] = ( QPBO.getLabel( node ) >= 0 ) ? QPBO.getLabel( node ) : labels[node];
+            }
+
+            for ( size_t node = 0; node < N_nodes; node++ )
+            {
+                energies[0] += nodeEnergies[ 2*node + labels[node] ];
+                energies[1] += nodeEnergies[ 2*node + completed[node] ];
+            }
+
+            for ( size_t edge = 0; edge < edgeNodes.size()/2; edge++ )
+            {
+                energies[0] += edgeEnergies[ 4*edge + 2*labels[ edgeNodes[2*edge] ] + labels[ edgeNodes[2*edge+1] ] ];
+                energies[1] += edgeEnergies[ 4*edge + 2*completed[ edgeNodes[2*edge] ] + completed[ edgeNodes[2*edge+1] ] ];
+            }
+
+            persistent = persistent && ( energies[1] <= energies[0] + 1e-9 );
+        }
+    }
+
+    check( persistent, "QPBO partial labelings are persistent" );
+
+    bool improved = true;
+
+    // Integer log potentials, whose ties made probing increase the energy
+    for ( unsigned int seed = 0; seed < 2000; seed++ )
+    {
+        CGraph graph;
+        buildRandomGraph( graph, 3 + seed % 9, 2, 3 + seed % 9, 1.0, seed );
+
+        RandomGenerator rng( seed );
+        boost::uniform_int<> uniform( -3, 2 );
+
+        vector<CNodePtr> &nodes = graph.getNodes();
+        vector<CEdgePtr> &edges = graph.getEdges();
+
+        for ( size_t i = 0; i < nodes.size(); i++ )
+        {
+            VectorXd nodePotentials(2);
+            nodePotentials << exp( uniform(rng) ), exp( uniform(rng) );
+            nodes[i]->setFinalPotentials( nodePotentials );
+        }
+
+        for ( size_t e = 0; e < edges.size(); e++ )
+        {
+            MatrixXd edgePotentials(2,2);
+            edgePotentials << exp( uniform(rng) ), exp( uniform(rng) ),
+                              exp( uniform(rng) ), exp( uniform(rng) );
+            edges[e]->setFinalPotentials( edgePotentials );
+        }
+
+        double initialLogLikelihood = getInitialLogLikelihood( graph );
+
+        for ( size_t improve = 0; improve < 2; improve++ )
+        {
+            TInferenceOptions options;
+            options.particularS["submodularApproach"] = "QPBO";
+            options.particularB["probeQPBO"] = true;
+            options.particularB["improveQPBO"] = improve;
+
+            map<size_t,size_t> results;
+
+            CGraphCutsInferenceMAP graphCuts;
+            graphCuts.setOptions( options );
+            graphCuts.infer( graph, results );
+
+            improved = improved && ( graph.getUnnormalizedLogLikelihood( results ) > initialLogLikelihood - 1e-9 );
+        }
+    }
+
+    check( improved, "Graph cuts with QPBO probing does not worsen the initial assignation" );
+}
+
+/** Parallel alpha-expansion gives the same results with any number of
+  * threads, for both parallel modes, and does not worsen the initial
+  * assignation.
+  */
+void testParallelAlphaExpansion()
+{
+    const char *modes[] = { "Labels", "Regions" };
+
+    for ( size_t mode = 0; mode < 2; mode++ )
+    {
+        bool deterministic = true;
+        bool improved      = true;
+
+        for ( unsigned int seed = 0; seed < 10; seed++ )
+        {
+            CGraph graph;
+            buildRandomGraph( graph, 40, 4, 40, 1.0, seed );
+            setPottsEdges( graph, 0.8 );
+
+            double initialLogLikelihood = getInitialLogLikelihood( graph );
+
+            map<size_t,size_t> results[2];
+
+            for ( size_t run = 0; run < 2; run++ )
+            {
+                TInferenceOptions options;
+                options.particularS["parallelMode"] = modes[mode];
+                options.particularD["regions"] = 3;
+                options.particularD["seed"] = seed;
+                options.particularD["numberOfThreads"] = run ? 3 : 1;
+
+                CParallelAlphaExpansionInferenceMAP expansion;
+                expansion.setOptions( options );
+                expansion.infer( graph, results[run] );
+            }
+
+            deterministic = deterministic && ( results[0] == results[1] ) && !results[0].empty();
+            improved = improved && ( graph.getUnnormalizedLogLikelihood( results[0] ) > initialLogLikelihood - 1e-9 );
+        }
+
+        check( deterministic, string("Parallel alpha-expansion (") + modes[mode] + ") does not depend on the threads" );
+        check( improved, string("Parallel alpha-expansion (") + modes[mode] + ") does not worsen the initial assignation" );
+    }
+}
+
+/** Ishikawa decodes the exact MAP when the edge energies are convex on the
+  * order of the classes.
+  */
+void testIshikawa()
+{
+    bool exactMAP = true;
+
+    for ( unsigned int seed = 0; seed < 20; seed++ )
+    {
+        CGraph graph;
+        buildRandomGraph( graph, 7, 4, 4, 1.0, seed );
+
+        vector<CEdgePtr> &edges = graph.getEdges();
+
+        for ( size_t e = 0; e < edges.size(); e++ )
+        {
+            MatrixXd edgePotentials( 4, 4 );
+            double weight = 0.2 + 0.1*( ( seed + e ) % 5 );
+
+            for ( size_t k = 0; k < 4; k++ )
+                for ( size_t l = 0; l < 4; l++ )
+                    edgePotentials(k,l) = exp( -weight*std::abs( (double)k - (double)l ) );
+
+            edges[e]->setFinalPotentials( edgePotentials );
+        }
+
+        map<size_t,size_t>   MAP;
+        map<size_t,VectorXd> nodeBeliefs;
+        map<size_t,MatrixXd> edgeBeliefs;
+        double               logZ;
+
+        getBruteForce( graph, MAP, nodeBeliefs, edgeBeliefs, logZ );
+
+        TInferenceOptions options;
+        map<size_t,size_t> results;
+
+        CIshikawaInferenceMAP ishikawa;
+        ishikawa.setOptions( options );
+        ishikawa.infer( graph, results );
+
+        exactMAP = exactMAP && ( std::abs( graph.getUnnormalizedLogLikelihood( results ) -
+                                           graph.getUnnormalizedLogLikelihood( MAP ) ) < 1e-9 );
+    }
+
+    check( exactMAP, "Ishikawa decodes the exact MAP with convex edges" );
+}
+
+/** Restarts give the same results with the same seed, with any number of
+  * threads, and fusing them is not worse than keeping the best one.
+  */
+void testRestarts()
+{
+    bool deterministic = true;
+    bool fusionBetter  = true;
+
+    for ( unsigned int seed = 0; seed < 10; seed++ )
+    {
+        CGraph graph;
+        buildRandomGraph( graph, 30, 3, 30, 1.5, seed );
+
+        map<size_t,size_t> results[3];
+        const char *combinations[] = { "Best", "Best", "Fusion" };
+
+        for ( size_t run = 0; run < 3; run++ )
+        {
+            TInferenceOptions options;
+            options.particularS["combination"] = combinations[run];
+            options.particularD["numberOfRestarts"] = 6;
+            options.particularD["seed"] = seed;
+            options.particularD["numberOfThreads"] = ( run == 1 ) ? 3 : 1;
+
+            CRestartsInferenceMAP restarts;
+            restarts.setOptions( options );
+            restarts.infer( graph, results[run] );
+        }
+
+        deterministic = deterministic && ( results[0] == results[1] ) && !results[0].empty();
+        fusionBetter = fusionBetter && ( graph.getUnnormalizedLogLikelihood( results[2] ) >
+                                         graph.getUnnormalizedLogLikelihood( results[0] ) - 1e-9 );
+    }
+
+    check( deterministic, "Restarts with a seed do not depend on the threads" );
+    check( fusionBetter, "Fusing the restarts is not worse than the best one" );
+}
+
+/** True if no node can change its class increasing the likelihood. */
+bool isLocalOptimum( CGraph &graph, map<size_t,size_t> &results )
+{
+    TInferenceOptions options;
+    TCompactGraph cg;
+    getCompactGraph( graph, options, cg );
+    getLogPotentials( cg );
+
+    vector<size_t> labels( cg.N_nodes );
+
+    for ( size_t nodeIndex = 0; nodeIndex < cg.N_nodes; nodeIndex++ )
+        labels[nodeIndex] = results[ cg.nodeIDs[nodeIndex] ];
+
+    VectorXd scores;
+
+    for ( size_t nodeIndex = 0; nodeIndex < cg.N_nodes; nodeIndex++ )
+    {
+        getLocalScores( cg, labels, nodeIndex, scores );
+
+        if ( scores.maxCoeff() > scores( labels[nodeIndex] ) + 1e-9 )
+            return false;
+    }
+
+    return true;
+}
+
+/** Greedy ICM stops at a local optimum, not worse than the initial
+  * assignation.
+  */
+void testGreedyICM()
+{
+    bool localOptimum = true;
+    bool improved     = true;
+
+    for ( unsigned int seed = 0; seed < 20; seed++ )
+    {
+        CGraph graph;
+        buildRandomGraph( graph, 50, 3, 50, 1.5, seed );
+
+        TInferenceOptions options;
+        options.maxIterations = 1000;
+
+        map<size_t,size_t> results;
+
+        CICMGreedyInferenceMAP ICMGreedy;
+        ICMGreedy.setOptions( options );
+        ICMGreedy.infer( graph, results );
+
+        localOptimum = localOptimum && isLocalOptimum( graph, results );
+        improved = improved && ( graph.getUnnormalizedLogLikelihood( results ) >
+                                 getInitialLogLikelihood( graph ) - 1e-9 );
+    }
+
+    check( localOptimum, "Greedy ICM stops at a local optimum" );
+    check( improved, "Greedy ICM does not worsen the initial assignation" );
+}
+
+/** True if the cached colors of the graph are valid: no two neighbors
+  * have the same color.
+  */
+bool hasValidColors( CGraph &graph )
+{
+    TInferenceOptions options;
+    TCompactGraph cg;
+    getCompactGraph( graph, options, cg );
+
+    vector<size_t> colors;
+    size_t N_colors = getNodeColors( graph, cg, colors );
+
+    if ( colors.size() != cg.N_nodes )
+        return false;
+
+    for ( size_t nodeIndex = 0; nodeIndex < cg.N_nodes; nodeIndex++ )
+    {
+        if ( colors[nodeIndex] >= N_colors )
+            return false;
+
+        for ( size_t adj = cg.adjOffsets[nodeIndex]; adj < cg.adjOffsets[nodeIndex+1]; adj++ )
+            if ( colors[nodeIndex] == colors[ cg.adjNeighbor[adj] ] )
+                return false;
+    }
+
+    return true;
+}
+
+/** Chromatic ICM stops at a local optimum, with the same results with any
+  * number of threads. The colors are still valid after adding or deleting
+  * nodes.
+  */
+void testChromaticICM()
+{
+    bool localOptimum  = true;
+    bool deterministic = true;
+
+    for ( unsigned int seed = 0; seed < 20; seed++ )
+    {
+        CGraph graph;
+        buildRandomGraph( graph, 50, 3, 50, 1.5, seed );
+
+        map<size_t,size_t> results[2];
+
+        for ( size_t run = 0; run < 2; run++ )
+        {
+            TInferenceOptions options;
+            options.maxIterations = 1000;
+            options.particularD["numberOfThreads"] = run ? 3 : 1;
+
+            CICMInferenceMAP ICM;
+            ICM.setOptions( options );
+            ICM.infer( graph, results[run] );
+        }
+
+        localOptimum = localOptimum && isLocalOptimum( graph, results[0] );
+        deterministic = deterministic && ( results[0] == results[1] );
+    }
+
+    check( localOptimum, "Chromatic ICM stops at a local optimum" );
+    check( deterministic, "Chromatic ICM does not depend on the threads" );
+
+    // Decodings sharing a fresh graph fill its cache of colors concurrently
+    bool sharedGraph = true;
+
+    for ( unsigned int seed = 0; seed < 10; seed++ )
+    {
+        CGraph freshGraph;
+        buildRandomGraph( freshGraph, 50, 3, 50, 1.5, seed );
+
+        map<size_t,size_t> results[4];
+
+        #pragma omp parallel for num_threads(4)
+        for ( int run = 0; run < 4; run++ )
+        {
+            TInferenceOptions options;
+            options.particularD["numberOfThreads"] = 1;
+
+            CICMInferenceMAP ICM;
+            ICM.setOptions( options );
+            ICM.infer( freshGraph, results[run] );
+        }
+
+        for ( size_t run = 1; run < 4; run++ )
+            sharedGraph = sharedGraph && ( results[run] == results[0] );
+
+        sharedGraph = sharedGraph && hasValidColors( freshGraph );
+
+        // Fresh graphs have different node IDs, so their results are
+        // compared through their likelihoods
+        double logLikelihoods[2];
+
+        for ( size_t run = 0; run < 2; run++ )
+        {
+            CGraph restartsGraph;
+            buildRandomGraph( restartsGraph, 50, 3, 50, 1.5, seed );
+
+            TInferenceOptions options;
+            options.particularD["numberOfRestarts"] = 8;
+            options.particularD["seed"] = seed;
+            options.particularD["numberOfThreads"] = run ? 4 : 1;
+
+            CRestartsInferenceMAP restarts;
+            restarts.setOptions( options );
+            map<size_t,size_t> restartsResults;
+
+            restarts.infer( restartsGraph, restartsResults );
+
+            logLikelihoods[run] = restartsGraph.getUnnormalizedLogLikelihood( restartsResults );
+
+            sharedGraph = sharedGraph && hasValidColors( restartsGraph ) &&
+                          ( restartsResults.size() == 50 );
+        }
+
+        sharedGraph = sharedGraph && ( logLikelihoods[0] == logLikelihoods[1] );
+    }
+
+    check( sharedGraph, "Chromatic ICM can share a fresh graph among threads" );
+
+    CGraph graph;
+    buildRandomGraph( graph, 20, 3, 20, 1.0, 0 );
+
+    bool validColors = hasValidColors( graph );
+
+    graph.deleteNode( graph.getNodes()[5]->getID() );
+
+    validColors = validColors && hasValidColors( graph );
+
+    // A new node linked with all the others needs a new color
+    vector<CNodePtr> nodes = graph.getNodes();
+    CEdgeTypePtr edgeType = graph.getEdges()[0]->getType();
+    MatrixXd edgePotentials = graph.getEdges()[0]->getPotentials();
+
+    CNodePtr newNode( new CNode( nodes[0]->getType(), nodes[0]->getFeatures() ) );
+    newNode->setFinalPotentials( nodes[0]->getPotentials() );
+    graph.addNode( newNode );
+
+    for ( size_t i = 0; i < nodes.size(); i++ )
+    {
+        CEdgePtr edge( new CEdge( newNode, nodes[i], edgeType, graph.getEdges()[0]->getFeatures() ) );
+        edge->setFinalPotentials( edgePotentials );
+        graph.addEdge( edge );
+    }
+
+    validColors = validColors && hasValidColors( graph );
+
+    check( validColors, "Node colors are updated when nodes are added or deleted" );
+}
+
+/** Gibbs sampling approximates the exact marginals, its chains mix, and
+  * the samples do not depend on the threads.
+  */
+void testGibbs()
+{
+    CGraph graph;
+    buildRandomGraph( graph, 8, 3, 4, 0.7, 0 );
+
+    map<size_t,size_t>   MAP;
+    map<size_t,VectorXd> nodeMarginals;
+    map<size_t,MatrixXd> edgeMarginals;
+    double               exactLogZ;
+
+    getBruteForce( graph, MAP, nodeMarginals, edgeMarginals, exactLogZ );
+
+    map<size_t,VectorXd> nodeBeliefs[2];
+    map<size_t,MatrixXd> edgeBeliefs[2];
+    double               logZ[2];
+    double               rHat = 0;
+
+    for ( size_t run = 0; run < 2; run++ )
+    {
+        TInferenceOptions options;
+        options.particularD["samples"] = 5000;
+        options.particularD["burnIn"] = 100;
+        options.particularD["chains"] = 4;
+        options.particularD["seed"] = 1;
+        options.particularD["numberOfThreads"] = run ? 3 : 1;
+
+        CGibbsInferenceMarginal gibbs;
+        gibbs.setOptions( options );
+        gibbs.infer( graph, nodeBeliefs[run], edgeBeliefs[run], logZ[run] );
+
+        rHat = gibbs.getRHat();
+    }
+
+    check( getMaxDifference( nodeBeliefs[0], nodeMarginals ) < 0.02, "Gibbs node beliefs approximate the exact marginals" );
+    check( getMaxDifference( edgeBeliefs[0], edgeMarginals ) < 0.02, "Gibbs edge beliefs approximate the exact marginals" );
+    check( rHat < 1.05, "Gibbs chains mix (R-hat < 1.05)" );
+    check( ( getMaxDifference( nodeBeliefs[0], nodeBeliefs[1] ) == 0 ) &&
+           ( getMaxDifference( edgeBeliefs[0], edgeBeliefs[1] ) == 0 ),
+           "Gibbs samples do not depend on the threads" );
+}
+
+/** The mean-field ELBO is a lower bound of logZ, and the beliefs do not
+  * depend on the threads.
+  */
+void testMeanField()
+{
+    bool lowerBound    = true;
+    bool deterministic = true;
+
+    for ( unsigned int seed = 0; seed < 20; seed++ )
+    {
+        CGraph graph;
+        buildRandomGraph( graph, 8, 3, 6, 1.0, seed );
+
+        map<size_t,size_t>   MAP;
+        map<size_t,VectorXd> nodeMarginals;
+        map<size_t,MatrixXd> edgeMarginals;
+        double               exactLogZ;
+
+        getBruteForce( graph, MAP, nodeMarginals, edgeMarginals, exactLogZ );
+
+        map<size_t,VectorXd> nodeBeliefs[2];
+        map<size_t,MatrixXd> edgeBeliefs[2];
+        double               logZ[2];
+
+        for ( size_t run = 0; run < 2; run++ )
+        {
+            TInferenceOptions options;
+            options.particularD["damping"] = 0.5;
+            options.particularD["numberOfThreads"] = run ? 3 : 1;
+
+            CMeanFieldInferenceMarginal meanField;
+            meanField.setOptions( options );
+            meanField.infer( graph, nodeBeliefs[run], edgeBeliefs[run], logZ[run] );
+        }
+
+        lowerBound = lowerBound && ( logZ[0] <= exactLogZ + 1e-9 );
+        deterministic = deterministic && ( logZ[0] == logZ[1] ) &&
+                        ( getMaxDifference( nodeBeliefs[0], nodeBeliefs[1] ) == 0 );
+    }
+
+    check( lowerBound, "Mean-field ELBO is a lower bound of logZ" );
+    check( deterministic, "Mean field does not depend on the threads" );
+}
+
+int main (int argc, char* argv[])
+{
+    cout << endl;
+    cout << "      INFERENCE REGRESSION TESTS";
+    cout << endl << endl;
+
+    testMessagesAllocations();
+    testCavityMessages();
+    testLogDomain();
+    testJacobiSchedule();
+    testSplash();
+    testConvergenceStatus();
+    testDecisionStability();
+    testTRWS();
+    testTRWBP();
+    testForestSolvers();
+    testJunctionTree();
+    testBranchAndBound();
+    testVariableElimination();
+    testBKMaxFlow();
+    testPushRelabelMaxFlow();
+    testDynamicGraphCuts();
+    testMoveNetworks();
+    testQPBO();
+    testParallelAlphaExpansion();
+    testIshikawa();
+    testRestarts();
+    testGreedyICM();
+    testChromaticICM();
+    testGibbs();
+    testMeanField();
+
+    cout << endl << N_failures << " failed checks" << endl << endl;
+
+    return N_failures;
+}
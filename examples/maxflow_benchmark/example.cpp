@@ -0,0 +1,230 @@
+
+/*---------------------------------------------------------------------------*
+ |                               UPGM++                                      |
+ |                   Undirected Graphical Models in C++                      |
+ |                                                                           |
+ |              Copyright (C) 2014 Jose Raul Ruiz Sarmiento                  |
+ |                 University of Malaga (jotaraul@uma.es)                    |
+ |                                                                           |
+ |   This program is free software: you can redistribute it and/or modify    |
+ |   it under the terms of the GNU General Public License as published by    |
+ |   the Free Software Foundation, either version 3 of the License, or       |
+ |   (at your option) any later version.                                     |
+ |                                                                           |
+ |   This program is distributed in the hope that it will be useful,         |
+ |   but WITHOUT ANY WARRANTY; without even the implied warranty of          |
+ |   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           |
+ |   GNU General Public License for more details.                            |
+ |   <http://www.gnu.org/licenses/>                                          |
+ |                                                                           |
+ *---------------------------------------------------------------------------*/
+
+
+#include "base.hpp"
+#include "inference_MAP.hpp"
+#include "inference_maxflow.hpp"
+
+#include <boost/random.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cmath>
+#include <map>
+
+#ifdef UPGMpp_USING_OMPENMP
+#include <omp.h>
+#endif
+
+using namespace UPGMpp;
+using namespace std;
+using namespace Eigen;
+
+typedef boost::mt19937 RandomGenerator;
+typedef boost::uniform_real<double> UniformDistribution;
+
+/*---------------------------------------------------------------------------*
+ *
+ * This example compares the max-flow solvers used by the graph cuts based
+ * decoding methods: the serial Boykov-Kolmogorov one (CBKMaxFlow) and the
+ * parallel push-relabel (CPushRelabelMaxFlow). The work flow is:
+ * 1. Solve flow networks with the shape of a 4-connected grid, with random
+ *    terminal weights, using both solvers.
+ * 2. Decode binary grid graphs with CGraphCutsInferenceMAP, choosing the
+ *    solver through particularS["maxflow"].
+ *
+ * Usage: maxflow_benchmark [max grid width] [number of threads]
+ *
+ *---------------------------------------------------------------------------*/
+
+void fillGridNetwork( CMaxFlow &maxFlow, size_t width, unsigned int seed )
+{
+    RandomGenerator rng( seed );
+    UniformDistribution uniform( 0, 1 );
+
+    maxFlow.reset( width*width );
+
+    for ( size_t node = 0; node < width*width; node++ )
+    {
+        maxFlow.addTerminalWeights( node, uniform(rng), uniform(rng) );
+
+        if ( node % width )
+            maxFlow.addEdge( node, node - 1, 0.3, 0.3 );
+
+        if ( node >= width )
+            maxFlow.addEdge( node, node - width, 0.3, 0.3 );
+    }
+}
+
+double timeMaxFlow( CMaxFlow &maxFlow, double &flow )
+{
+    boost::posix_time::ptime start( boost::posix_time::microsec_clock::local_time() );
+
+    flow = maxFlow.maxFlow();
+
+    boost::posix_time::ptime end( boost::posix_time::microsec_clock::local_time() );
+
+    return ( end - start ).total_microseconds()*pow(10,-6);
+}
+
+void buildGridGraph( CGraph &graph, size_t width, unsigned int seed )
+{
+    RandomGenerator rng( seed );
+    UniformDistribution uniform( 0, 1 );
+
+    CNodeTypePtr nodeType( new CNodeType( 2, 1 ) );
+    CEdgeTypePtr edgeType( new CEdgeType( 1, nodeType, nodeType ) );
+
+    VectorXd features(1);
+    features << 1;
+
+    // Potts edge potentials, so the graph is submodular
+    MatrixXd edgePotentials(2,2);
+    edgePotentials << 2, 1,
+                      1, 2;
+
+    vector<CNodePtr> nodes;
+
+    for ( size_t i = 0; i < width*width; i++ )
+    {
+        CNodePtr node( new CNode( nodeType, features ) );
+
+        VectorXd nodePotentials(2);
+        nodePotentials << exp( 2*uniform(rng) ), exp( 2*uniform(rng) );
+        node->setFinalPotentials( nodePotentials );
+
+        graph.addNode( node );
+        nodes.push_back( node );
+    }
+
+    for ( size_t i = 0; i < width*width; i++ )
+    {
+        if ( i % width )
+        {
+            CEdgePtr edge( new CEdge( nodes[i-1], nodes[i], edgeType, features ) );
+            edge->setFinalPotentials( edgePotentials );
+            graph.addEdge( edge );
+        }
+
+        if ( i >= width )
+        {
+            CEdgePtr edge( new CEdge( nodes[i-width], nodes[i], edgeType, features ) );
+            edge->setFinalPotentials( edgePotentials );
+            graph.addEdge( edge );
+        }
+    }
+}
+
+int main (int argc, char* argv[])
+{
+    cout << endl;
+    cout << "      MAX-FLOW SOLVERS BENCHMARK";
+    cout << endl << endl;
+
+    size_t maxWidth  = ( argc > 1 ) ? atoi( argv[1] ) : 800;
+    size_t N_threads = ( argc > 2 ) ? atoi( argv[2] ) : 0;
+
+#ifdef UPGMpp_USING_OMPENMP
+    if ( !N_threads )
+        N_threads = omp_get_max_threads();
+#else
+    N_threads = 1;
+#endif
+
+    cout << "Using " << N_threads << " threads in the push-relabel solver" << endl << endl;
+
+/*------------------------------------------------------------------------------
+ *
+ *                              FLOW NETWORKS
+ *
+ *----------------------------------------------------------------------------*/
+
+    cout << "   Grid      BK (s)    Push-relabel (s)   Same flow" << endl;
+
+    for ( size_t width = 100; width <= maxWidth; width *= 2 )
+    {
+        CBKMaxFlow          BKMaxFlow;
+        CPushRelabelMaxFlow pushRelabelMaxFlow( N_threads );
+
+        fillGridNetwork( BKMaxFlow, width, width );
+        fillGridNetwork( pushRelabelMaxFlow, width, width );
+
+        double BKFlow, pushRelabelFlow;
+
+        double BKTime          = timeMaxFlow( BKMaxFlow, BKFlow );
+        double pushRelabelTime = timeMaxFlow( pushRelabelMaxFlow, pushRelabelFlow );
+
+        bool sameFlow = ( fabs( BKFlow - pushRelabelFlow ) <= 1e-6*fabs( BKFlow ) );
+
+        cout << setw(4) << width << "x" << setw(4) << left << width << right
+             << setw(12) << BKTime
+             << setw(20) << pushRelabelTime
+             << setw(12) << ( sameFlow ? "yes" : "NO" ) << endl;
+    }
+
+/*------------------------------------------------------------------------------
+ *
+ *                           GRAPH CUTS DECODING
+ *
+ *----------------------------------------------------------------------------*/
+
+    cout << endl << "   Grid      BK (s)    Push-relabel (s)   Same energy" << endl;
+
+    for ( size_t width = 100; width <= maxWidth/2; width *= 2 )
+    {
+        CGraph graph;
+        buildGridGraph( graph, width, width );
+
+        TInferenceOptions options;
+        options.particularD["numberOfThreads"] = N_threads;
+
+        map<size_t,size_t> BKResults, pushRelabelResults;
+
+        CGraphCutsInferenceMAP BKDecoding;
+        options.particularS["maxflow"] = "BK";
+        BKDecoding.setOptions( options );
+        BKDecoding.infer( graph, BKResults );
+
+        CGraphCutsInferenceMAP pushRelabelDecoding;
+        options.particularS["maxflow"] = "PushRelabel";
+        pushRelabelDecoding.setOptions( options );
+        pushRelabelDecoding.infer( graph, pushRelabelResults );
+
+        // Both are optimal, although the labels can differ in ties
+        double BKLikelihood          = graph.getUnnormalizedLogLikelihood( BKResults );
+        double pushRelabelLikelihood = graph.getUnnormalizedLogLikelihood( pushRelabelResults );
+
+        bool sameEnergy = ( fabs( BKLikelihood - pushRelabelLikelihood )
+                            <= 1e-6*fabs( BKLikelihood ) );
+
+        cout << setw(4) << width << "x" << setw(4) << left << width << right
+             << setw(12) << BKDecoding.getExecutionTime()
+             << setw(20) << pushRelabelDecoding.getExecutionTime()
+             << setw(12) << ( sameEnergy ? "yes" : "NO" ) << endl;
+    }
+
+    cout << endl;
+
+    return 0;
+}
@@ -68,6 +68,8 @@ namespace UPGMpp
         size_t                    m_nFeatures;    //!< Number of edge features.
         std::vector< std::string> m_featureNames; //!< Name of the edge features. Not mandatory.
 
+        bool        m_convex;   //!< Are its energies convex on the order of the classes?
+
         /** Private function for obtaning the ID of a new edge type.
          */
         size_t setID(){ static size_t ID = 0; return ID++; }
@@ -76,7 +78,7 @@ namespace UPGMpp
 
         /** Default constructor
          */
-        CEdgeType(): m_nFeatures(0)
+        CEdgeType(): m_nFeatures(0), m_convex(false)
         {
             m_computePotentialsFunction = &linearModelEdge;
 
@@ -88,7 +90,7 @@ namespace UPGMpp
         CEdgeType( size_t N_features,
                    CNodeTypePtr nodeType1,
                    CNodeTypePtr nodeType2,
-                   std::string label="")
+                   std::string label="") : m_convex(false)
         {
             m_computePotentialsFunction = &linearModelEdge;
 
@@ -135,7 +137,7 @@ namespace UPGMpp
                    CNodeTypePtr nodeType1,
                    CNodeTypePtr nodeType2,
                    const std::string label="")
-            : m_featureNames( featureNames )
+            : m_featureNames( featureNames ), m_convex(false)
 
         {
             m_computePotentialsFunction = &linearModelEdge;
@@ -263,6 +265,19 @@ namespace UPGMpp
         inline std::vector<std::string> getFeatureNames(){ return m_featureNames; }
 
 
+        /** Declares that the classes of both node types are ordered, and the
+         *  energies (minus the log potentials) of the edges of this type are
+         *  convex on that order, e.g. functions of the classes difference
+         *  like |c1-c2| or (c1-c2)^2. Inference methods as Ishikawa use it.
+         * \param convex: Are they convex?
+         */
+        inline void setConvex( bool convex ) { m_convex = convex; }
+
+        /** Have the edges of this type convex energies? (see setConvex)
+         * \return True if they have been declared convex.
+         */
+        inline bool isConvex() const { return m_convex; }
+
         /** Function that computes the potentials of an edge given their features.
          * \param features: features of the edge.
          * \return The edge potentials.
@@ -320,6 +335,7 @@ namespace UPGMpp
 
             ar & m_nFeatures;
             ar & m_featureNames;
+            ar & m_convex;
         }
         template<class Archive>
         void load(Archive & ar, const unsigned int version)
@@ -332,6 +348,11 @@ namespace UPGMpp
 
             ar & m_nFeatures;
             ar & m_featureNames;
+
+            if ( version >= 2 )
+                ar & m_convex;
+            else
+                m_convex = false;
         }
         BOOST_SERIALIZATION_SPLIT_MEMBER()
 
@@ -339,6 +360,6 @@ namespace UPGMpp
 
 }
 
-BOOST_CLASS_VERSION(UPGMpp::CEdgeType, 1)
+BOOST_CLASS_VERSION(UPGMpp::CEdgeType, 2)
 
 #endif //_UPGMpp_EDGE_TYPE_
@@ -135,3 +135,71 @@ using namespace std;
 //    return unlikelihood;
 //}
 
+
+/*------------------------------------------------------------------------------
+
+                            getConnectedComponents
+
+------------------------------------------------------------------------------*/
+
+void CGraph::getConnectedComponents( std::vector<std::vector<size_t> > &components,
+                                     std::vector<bool> &acyclic )
+{
+    components.clear();
+    acyclic.clear();
+
+    size_t N_nodes = m_nodes.size();
+
+    map<size_t,size_t> nodePositions;
+
+    for ( size_t i = 0; i < N_nodes; i++ )
+        nodePositions[ m_nodes[i]->getID() ] = i;
+
+    vector<bool> visited( N_nodes, false );
+
+    for ( size_t first = 0; first < N_nodes; first++ )
+    {
+        if ( visited[first] )
+            continue;
+
+        components.push_back( vector<size_t>() );
+        vector<size_t> &component = components.back();
+
+        component.push_back( first );
+        visited[first] = true;
+
+        // Each edge is found from both of its nodes
+        size_t N_edgeEnds = 0;
+
+        for ( size_t i = 0; i < component.size(); i++ )
+        {
+            size_t nodeID = m_nodes[ component[i] ]->getID();
+
+            std::pair<multimap<size_t,CEdgePtr>::iterator,multimap<size_t,CEdgePtr>::iterator >
+                    neighbors = m_edges_f.equal_range( nodeID );
+
+            for ( multimap<size_t,CEdgePtr>::iterator it = neighbors.first; it != neighbors.second; it++ )
+            {
+                size_t ID1, ID2;
+                it->second->getNodesID( ID1, ID2 );
+
+                size_t neighborID = ( ID1 == nodeID ) ? ID2 : ID1;
+
+                map<size_t,size_t>::iterator itNeighbor = nodePositions.find( neighborID );
+
+                if ( itNeighbor == nodePositions.end() )
+                    continue;
+
+                N_edgeEnds++;
+
+                if ( !visited[ itNeighbor->second ] )
+                {
+                    visited[ itNeighbor->second ] = true;
+                    component.push_back( itNeighbor->second );
+                }
+            }
+        }
+
+        acyclic.push_back( N_edgeEnds/2 + 1 == component.size() );
+    }
+}
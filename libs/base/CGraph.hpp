@@ -54,6 +54,8 @@ namespace UPGMpp
         std::vector<CNodePtr>            m_nodes;   //!< Vector of graph nodes.
         std::vector<CNodeTypePtr>        m_nodeTypes; //!< Vector of node types.
         size_t                           m_id;      //!< Graph ID.
+        std::vector<double>              m_edgeAppearanceProbs; //!< Cache of the edge appearance probabilities (tree-reweighted methods).
+        std::vector<size_t>              m_nodeColors; //!< Cache of the colors of the nodes (chromatic ICM).
 
         /** Private function for obtaning the ID of a new graph.
          */
@@ -97,6 +99,9 @@ namespace UPGMpp
 
             if ( !nodeTypeAlreadyInserted )
                 m_nodeTypes.push_back(node->getType());
+
+            m_edgeAppearanceProbs.clear();
+            m_nodeColors.clear();
         }
 
         /** Get the graph node laying in a certain position of the vector of nodes.
@@ -268,8 +273,27 @@ namespace UPGMpp
 
             m_edges_f.insert( std::pair<size_t, CEdgePtr> (n1_id,edge) );
             m_edges_f.insert( std::pair<size_t, CEdgePtr> (n2_id,edge) );
+
+            m_edgeAppearanceProbs.clear();
+            m_nodeColors.clear();
         }
 
+        /** Get the cache of the edge appearance probabilities of the graph
+         * edges, in the same order than the edges vector. It is empty until
+         * computed by getEdgeAppearanceProbabilities (inference), and cleared
+         * when the nodes or edges of the graph change.
+         * \return A reference to the cache.
+         */
+        inline std::vector<double>& getEdgeAppearanceProbs() { return m_edgeAppearanceProbs; }
+
+        /** Get the cache of the colors of the graph nodes, in the same order
+         * than the nodes vector, so neighbors have different colors. It is
+         * empty until computed by getNodeColors (inference), and cleared when
+         * the nodes or edges of the graph change.
+         * \return A reference to the cache.
+         */
+        inline std::vector<size_t>& getNodeColors() { return m_nodeColors; }
+
         /** Delete a node from the graph. It could also produce the deletion of
          * its associated edges.
          * \param ID: ID of the node to delete from the graph.
@@ -296,6 +320,9 @@ namespace UPGMpp
             if ( it != m_nodes.end() )
                 m_nodes.erase( it );
 
+            m_edgeAppearanceProbs.clear();
+            m_nodeColors.clear();
+
             // Check if other nodes have the same nodeType, and delete that type if not.
 
             bool nodeTypeStillInUse = false;
@@ -389,6 +416,9 @@ namespace UPGMpp
 
                 // Delete the edge from the edges vector
                 m_edges.erase( it );
+
+                m_edgeAppearanceProbs.clear();
+                m_nodeColors.clear();
             }
         }
 
@@ -408,6 +438,16 @@ namespace UPGMpp
             return true;
         }
 
+        /** Computes the connected components of the graph, and checks which
+         * of them are acyclic (trees), i.e. have one edge less than nodes.
+         * Parallel edges and self loops are cycles.
+         * \param components: Positions (in the vector of nodes) of the nodes
+         * of each component, in breadth-first order from its first node.
+         * \param acyclic: Is each component a tree?
+         */
+        void getConnectedComponents( std::vector<std::vector<size_t> > &components,
+                                     std::vector<bool> &acyclic );
+
         /** Method for dumping a graph to a stream.
          * \param output: output stream.
          * \param g: graph to dump.
@@ -711,6 +751,9 @@ namespace UPGMpp
 
                 m_edges_f.insert( std::pair<size_t, CEdgePtr> ( ID , edgePtr) );
             }
+
+            m_edgeAppearanceProbs.clear();
+            m_nodeColors.clear();
         }
         BOOST_SERIALIZATION_SPLIT_MEMBER()
 
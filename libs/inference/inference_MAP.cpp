@@ -21,7 +21,11 @@
 
 #include <stdio.h>
 #include "inference_MAP.hpp"
+#include "inference_maxflow.hpp"
 #include <time.h>
+#include <algorithm>
+#include <queue>
+#include <boost/random.hpp>
 
 
 using namespace UPGMpp;
@@ -76,16 +80,20 @@ void CICMInferenceMAP::infer( CGraph &graph, std::map<size_t,size_t> &results, b
 {
     TIMER_START
 
+    //
+    // Method workflow:
+    // 1. Color the graph (or take the colors cached in it), so nodes with
+    //    the same color are not neighbors.
+    // 2. Sweep the colors until no node changes its class: the nodes of a
+    //    color take in parallel their best class given their neighbors,
+    //    which have other colors, so the likelihood never decreases.
+    //
+
     DEBUG("Satarting ICM decoding...");
 
     if ( graph.isEmpty() )
         return;
 
-    // Direct access to useful vbles
-    const std::vector<CNodePtr> &nodes = graph.getNodes();
-    std::multimap<size_t,CEdgePtr> &edges_f = graph.getEdgesF();
-    size_t N_nodes = nodes.size();
-
     // Initialize the results vector
     results.clear();
 
@@ -96,6 +104,15 @@ void CICMInferenceMAP::infer( CGraph &graph, std::map<size_t,size_t> &results, b
         applyMaskToPotentials(graph,m_mask);
     }
 
+    TCompactGraph cg;
+    getCompactGraph( graph, m_options, cg );
+    getLogPotentials( cg );
+
+    size_t N_nodes   = cg.N_nodes;
+#ifdef UPGMpp_USING_OMPENMP
+    size_t N_threads = getNumberOfThreads( m_options );
+#endif
+
     // Initial class assignation
 
     if ( m_options.initialAssignation == "MaxNodePotential" )
@@ -107,8 +124,36 @@ void CICMInferenceMAP::infer( CGraph &graph, std::map<size_t,size_t> &results, b
     else
         cout << "[ERROR] Undefined method for performing the initial assignation." << endl;
 
+    vector<size_t> labels( N_nodes );
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        labels[nodeIndex] = results[ cg.nodeIDs[nodeIndex] ];
+
+    //
+    // 1. Nodes of each color, the color c having the nodes in
+    //    [colorOffsets[c],colorOffsets[c+1]) of colorNodes
+    //
+
+    vector<size_t> colors;
+    size_t N_colors = getNodeColors( graph, cg, colors );
 
-    std::map<size_t,size_t>::iterator it;
+    vector<size_t> colorOffsets( N_colors+1, 0 );
+    vector<size_t> colorNodes( N_nodes );
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        colorOffsets[ colors[nodeIndex]+1 ]++;
+
+    for ( size_t color = 0; color < N_colors; color++ )
+        colorOffsets[color+1] += colorOffsets[color];
+
+    vector<size_t> position( colorOffsets.begin(), colorOffsets.end()-1 );
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        colorNodes[ position[ colors[nodeIndex] ]++ ] = nodeIndex;
+
+    //
+    // 2. Sweep the colors
+    //
 
     // Set the stop conditions
     bool keep_iterating = true;
@@ -120,76 +165,47 @@ void CICMInferenceMAP::infer( CGraph &graph, std::map<size_t,size_t> &results, b
     {
         DEBUGD("Iteration: ", iteration);
 
-        bool changes = false;
+        int N_changes = 0;
 
-        // Iterate over all the nodes, and check if a more promissing class
-        // is waiting for us
-        for ( size_t index = 0; index < N_nodes; index++ )
+        #pragma omp parallel num_threads(N_threads)
         {
-            Eigen::VectorXd potentials = nodes[index]->getPotentials( m_options.considerNodeFixedValues );
-            size_t nodeID = nodes[index]->getID();
-
-            pair<multimap<size_t,CEdgePtr>::iterator,multimap<size_t,CEdgePtr>::iterator > neighbors;
+            VectorXd scores;
 
-            neighbors = edges_f.equal_range(nodeID);
-
-            // Iterating over the neighbors, multiplying the potential of the
-            // corresponding col. in the edgePotentials, according to their class
-            for ( multimap<size_t,CEdgePtr>::iterator it = neighbors.first; it != neighbors.second; it++ )
+            for ( size_t color = 0; color < N_colors; color++ )
             {
-                size_t neighborID;
-                size_t ID1, ID2;
-
-                CEdgePtr edgePtr( (*it).second );
-
-                edgePtr->getNodesID(ID1,ID2);
-                Eigen::MatrixXd edgePotentials = edgePtr->getPotentials();
-
-                if ( ID1 == nodeID )
-                {
-                    neighborID = ID2;
-                    potentials = potentials.cwiseProduct(
-                                 edgePotentials.col(results[neighborID])
-                                 );
-                }
-                else
+                // The implicit barrier at the end of the loop keeps the
+                // colors in order
+                #pragma omp for schedule(static) reduction(+:N_changes)
+                for ( int i = colorOffsets[color]; i < (int)colorOffsets[color+1]; i++ )
                 {
-                    neighborID = ID1;
-                    potentials = potentials.cwiseProduct(
-                                 edgePotentials.row(results[neighborID]).transpose()
-                                 );
-                }
-
-                //cout << "Testing edge <" << ID1 << "," << ID2 << ">" << endl;
-
-
-                //cout << "Edge potentials" << edgePotentials.col(results[neighborID]) << endl;
-
-
-            }
+                    size_t nodeIndex = colorNodes[i];
 
-            //cout << "Potentials" << endl << potentials << endl;
-            size_t class_res;
-            potentials.maxCoeff(&class_res);
+                    getLocalScores( cg, labels, nodeIndex, scores );
 
-            if ( class_res != results[nodeID] )
-            {
-                changes = true;
-                size_t previous = results[nodeID];
-                results[nodeID] = class_res;
+                    // Only strictly better classes are taken, so it can not
+                    // cycle between classes with the same score
+                    size_t class_res;
+                    double max_score = scores.maxCoeff( &class_res );
 
-                //cout << "Changing node " << index << " from " << previous << " to " << class_res << endl;
+                    if ( max_score > scores( labels[nodeIndex] ) )
+                    {
+                        labels[nodeIndex] = class_res;
+                        N_changes++;
+                    }
+                }
             }
-
         }
 
         // If any change done, stop iterating, convergence achieved!
-        if ( !changes )
+        if ( !N_changes )
             keep_iterating = false;
 
         iteration++;
     }
 
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        results[ cg.nodeIDs[nodeIndex] ] = labels[nodeIndex];
+
     TIMER_END(m_executionTime)
 
     // TODO: It could be interesting return the case of stopping iterating
@@ -207,23 +223,29 @@ void CICMGreedyInferenceMAP::infer( CGraph &graph,
 {
     TIMER_START
 
+    //
+    // Method workflow:
+    // 1. Compute the initial assignation, and the gain (increase of the log
+    //    likelihood) of moving each node to its best class given its
+    //    neighbors, stored in a max-heap.
+    // 2. Move the node with the highest gain, and update the gains of its
+    //    neighbors, until no move increases the likelihood. The heap entries
+    //    of the nodes whose gain changed are discarded when popped.
+    //
+
     DEBUG("Decoding ICM Greedy");
 
     if ( graph.isEmpty() )
         return;
 
-    // Direct access to useful vbles
-    const std::vector<CNodePtr> &nodes = graph.getNodes();
-    std::multimap<size_t,CEdgePtr> &edges_f = graph.getEdgesF();
-    size_t N_nodes = nodes.size();
-
-
     // Intilize the results vector
     results.clear();
 
-    Eigen::VectorXd v_potentials;
-    v_potentials.resize( N_nodes );
-    v_potentials.setZero();
+    TCompactGraph cg;
+    getCompactGraph( graph, m_options, cg );
+    getLogPotentials( cg );
+
+    size_t N_nodes = cg.N_nodes;
 
     // Initial assignation
 
@@ -236,94 +258,82 @@ void CICMGreedyInferenceMAP::infer( CGraph &graph,
     else
         cout << "[ERROR] Undefined method for performing the initial assignation." << endl;
 
-    // Set the stop conditions
-    bool keep_iterating = true;
+    vector<size_t> labels( N_nodes );
 
-    size_t iteration = 1;
-    Eigen::VectorXd v_new_potentials;
-    v_new_potentials.resize( N_nodes );
-    v_potentials.setZero();
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        labels[nodeIndex] = results[ cg.nodeIDs[nodeIndex] ];
 
-    map<size_t,size_t> new_results;
+    //
+    // 1. Gains of the nodes
+    //
 
-    DEBUG("Iterating...");
+    vector<double> gains( N_nodes );
+    vector<size_t> bestClasses( N_nodes );
+    VectorXd       scores;
 
-    // Let's go!
-    while ( (keep_iterating) && ( iteration <= m_options.maxIterations) )
+    std::priority_queue<std::pair<double,size_t> > queue;
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
     {
-        DEBUGD("Iteration ", iteration);
+        getLocalScores( cg, labels, nodeIndex, scores );
 
-        // Iterate over all the nodes, and check if a more promissing class
-        // is waiting for us
-        for ( size_t index = 0; index < N_nodes; index++ )
-        {            
-            size_t ID = nodes[index]->getID();
+        gains[nodeIndex] = scores.maxCoeff( &bestClasses[nodeIndex] ) - scores( labels[nodeIndex] );
 
-            Eigen::VectorXd potentials = nodes[index]->getPotentials( m_options.considerNodeFixedValues );
+        if ( gains[nodeIndex] > 0 )
+            queue.push( std::make_pair( gains[nodeIndex], nodeIndex ) );
+    }
 
-            pair<multimap<size_t,CEdgePtr>::iterator,multimap<size_t,CEdgePtr>::iterator > neighbors;
+    //
+    // 2. Move the best node until convergence, or until doing
+    //    maxIterations moves per node
+    //
 
-            neighbors = edges_f.equal_range(ID);
+    DEBUG("Iterating...");
 
-            // Iterating over the neighbors, multiplying the potential of the
-            // corresponding col. in the edgePotentials, according to their class
-            for ( multimap<size_t,CEdgePtr>::iterator it = neighbors.first; it != neighbors.second; it++ )
-            {
-                size_t neighborID;
-                size_t ID1, ID2;
+    size_t maxMoves = m_options.maxIterations * N_nodes;
+    size_t moves    = 0;
 
-                CEdgePtr edgePtr( (*it).second );
+    while ( !queue.empty() && ( moves < maxMoves ) )
+    {
+        double gain      = queue.top().first;
+        size_t nodeIndex = queue.top().second;
 
-                edgePtr->getNodesID(ID1,ID2);
-                Eigen::MatrixXd edgePotentials = edgePtr->getPotentials();
+        queue.pop();
 
-                if ( ID1 == ID )
-                {
-                    neighborID = ID2;
-                    potentials = potentials.cwiseProduct(
-                                 edgePotentials.col(results[neighborID])
-                                 );
-                }
-                else
-                {
-                    neighborID = ID1;
-                    potentials = potentials.cwiseProduct(
-                                 edgePotentials.row(results[neighborID]).transpose()
-                                 );
-                }
-            }
+        if ( gain != gains[nodeIndex] ) // Outdated entry
+            continue;
 
-            size_t class_res;
-            double max_potential = potentials.maxCoeff(&class_res);
+        labels[nodeIndex] = bestClasses[nodeIndex];
+        gains[nodeIndex]  = 0;
+        moves++;
 
-            v_new_potentials(index) = max_potential;
-            new_results[ID] = class_res;
+        for ( size_t p = cg.adjOffsets[nodeIndex]; p < cg.adjOffsets[nodeIndex+1]; p++ )
+        {
+            size_t neighbor = cg.adjNeighbor[p];
 
-        }
+            if ( neighbor == nodeIndex )
+                continue;
 
-        //  cout << "Iteration Potentials" << endl << v_new_potentials << endl;
+            getLocalScores( cg, labels, neighbor, scores );
 
-        Eigen::VectorXd difference = v_new_potentials - v_potentials;
+            double newGain = scores.maxCoeff( &bestClasses[neighbor] ) - scores( labels[neighbor] );
 
-       // cout << "Difference" << difference << endl;
-        size_t node;
-        double max_difference = difference.maxCoeff(&node);
+            if ( newGain != gains[neighbor] )
+            {
+                gains[neighbor] = newGain;
 
-        if ( max_difference > 0 )
-        {
-            v_potentials(node) = v_new_potentials(node);
-            size_t IDNodeToChange = nodes[node]->getID();
-            results[IDNodeToChange] = new_results[IDNodeToChange];
+                if ( newGain > 0 )
+                    queue.push( std::make_pair( newGain, neighbor ) );
+            }
         }
-        else
-            keep_iterating = false;
-
-        iteration++;
     }
 
-    TIMER_END(m_executionTime)
+    DEBUGD("Moves done: ", moves);
 
-    // TODO: It could be interesting return the case of stopping iterating
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        results[ cg.nodeIDs[nodeIndex] ] = labels[nodeIndex];
+
+    TIMER_END(m_executionTime)
 }
 
 
@@ -333,243 +343,395 @@ void CICMGreedyInferenceMAP::infer( CGraph &graph,
 
 ------------------------------------------------------------------------------*/
 
-void decodeExactRec( CGraph &graph,
-                const std::map<size_t,vector<size_t> > &mask,
-                size_t index,
-                map<size_t,size_t> &nodesAndValuesToTest,
-                std::map<size_t,size_t> &results,
-                double &maxLikelihood,
-                bool debug );
-
-void CExactInferenceMAP::infer(CGraph &graph, std::map<size_t,size_t> &results, bool debug )
+namespace
 {
-    TIMER_START
+    /** Branch and bound search over the nodes in a fixed order, maximizing
+      * the log score (log potentials as in getLogPotentials). The score of
+      * the assigned nodes is kept incrementally, and bounded for the rest as
+      * the sum over the unassigned nodes of the max over their classes of
+      * their unary plus the edges to assigned nodes plus the best values of
+      * the edges to later nodes, so each edge is counted once.
+      */
+    class CBranchAndBound
+    {
+    private:
+        const TCompactGraph             &m_cg;
+        const vector<size_t>            &m_order;
+        const vector<size_t>            &m_position;
+        const vector<vector<size_t> >   &m_classes;   //!< Classes to check of each node.
+        const vector<VectorXd>          &m_laterMax;  //!< Best values of the edges to later nodes.
+
+        vector<size_t>      m_labels;
+        vector<VectorXd>    m_contrib;    //!< Unary, edges to assigned nodes and later edges maxima.
+        vector<double>      m_maxContrib; //!< Max over the classes to check of m_contrib.
+        double              m_score;      //!< Log score of the assigned nodes.
+        double              m_restBound;  //!< Sum of m_maxContrib of the unassigned nodes.
+        vector<double>      m_undo;
+
+        size_t maxClass( size_t nodeIndex, double &maxValue )
+        {
+            const vector<size_t> &classes = m_classes[nodeIndex];
+            size_t best = classes[0];
 
-    if ( graph.isEmpty() )
-        return;
+            for ( size_t i = 1; i < classes.size(); i++ )
+                if ( m_contrib[nodeIndex]( classes[i] ) > m_contrib[nodeIndex]( best ) )
+                    best = classes[i];
 
-    results.clear();
+            maxValue = m_contrib[nodeIndex]( best );
 
-    double maxLikelihood = std::numeric_limits<double>::min();
-    map<size_t,size_t>  nodesAndValuesToTest;
-    std::vector<CNodePtr> &nodes = graph.getNodes();
-    size_t index = 0;
+            return best;
+        }
 
-    if ( debug )
-    {
-        size_t N_nodes = nodes.size();
-        size_t N_combinations = 1;
-        size_t N_combinationsWithMask = 1;
-        for ( size_t i = 0; i < N_nodes; i++ )
+    public:
+
+        size_t  N_explored;
+
+        CBranchAndBound( const TCompactGraph &cg,
+                         const vector<size_t> &order,
+                         const vector<size_t> &position,
+                         const vector<vector<size_t> > &classes,
+                         const vector<VectorXd> &unary,
+                         const vector<VectorXd> &laterMax )
+            : m_cg( cg ), m_order( order ), m_position( position ),
+              m_classes( classes ), m_laterMax( laterMax ),
+              m_labels( cg.N_nodes, 0 ), m_contrib( cg.N_nodes ),
+              m_maxContrib( cg.N_nodes ), m_score( 0 ), m_restBound( 0 ),
+              N_explored( 0 )
         {
-            size_t nodeID = nodes[i]->getID() ;
-            size_t N_classes = nodes[i]->getType()->getNumberOfClasses();
-            N_combinations *= N_classes;
-
-            if ( !m_mask.empty() && m_mask.count( nodeID ) )
+            for ( size_t nodeIndex = 0; nodeIndex < cg.N_nodes; nodeIndex++ )
             {
-                size_t N_classesToCheck = m_mask.at(nodeID).size();
-                N_combinationsWithMask *= N_classesToCheck;
+                m_contrib[nodeIndex] = unary[nodeIndex] + laterMax[nodeIndex];
+                maxClass( nodeIndex, m_maxContrib[nodeIndex] );
+                m_restBound += m_maxContrib[nodeIndex];
             }
-            else
-                N_combinationsWithMask *= N_classes;
         }
 
-        cout << "Doing exact decoding..." << endl;
-        cout << "Number of nodes                : " <<  N_nodes << endl;
-        cout << "Number of possible combinations: " << N_combinations << endl;
-        if ( !m_mask.empty() )
-            cout << "Using masks, combinations      : " << N_combinationsWithMask << endl;
-
-    }
+        inline double getBound() const { return m_score + m_restBound; }
 
+        inline const vector<size_t>& getLabels() const { return m_labels; }
 
-    decodeExactRec( graph, m_mask, index, nodesAndValuesToTest, results, maxLikelihood, debug );
+        /** Assigns the node at a given depth, updating its later neighbors. */
+        void assign( size_t depth, size_t label )
+        {
+            size_t nodeIndex = m_order[depth];
 
-    TIMER_END(m_executionTime)
+            m_labels[nodeIndex] = label;
+            m_score     += m_contrib[nodeIndex]( label ) - m_laterMax[nodeIndex]( label );
+            m_restBound -= m_maxContrib[nodeIndex];
 
-}
+            for ( size_t p = m_cg.adjOffsets[nodeIndex]; p < m_cg.adjOffsets[nodeIndex+1]; p++ )
+            {
+                size_t neighbor = m_cg.adjNeighbor[p];
 
-void decodeExactRec( CGraph &graph,
-                const std::map<size_t,vector<size_t> > &mask,
-                size_t index,
-                map<size_t,size_t> &nodesAndValuesToTest,
-                std::map<size_t,size_t> &results,
-                double &maxLikelihood,
-                bool debug)
-{
-    static size_t N_test = 0;
-    const CNodePtr node = graph.getNode( index );
-    const size_t  nodeID = node->getID();
-    const CNodeTypePtr &nodeType = node->getType();
-    size_t nodeClasses = nodeType->getNumberOfClasses();
-    size_t totalNodes = graph.getNodes().size();
-    vector<size_t> classesToCheck;
-    static time_t start;
-    static bool first = true;
-
-    if ( first )
-    {
-        time(&start);
-        first = false;
-    }
+                if ( m_position[neighbor] <= depth )
+                    continue;
 
-    for ( size_t i = 0; i < nodeClasses; i++ )
-        classesToCheck.push_back(i);
+                const MatrixXd &logEdgePotentials = m_cg.logEdgePotentials[ m_cg.adjEdge[p] ];
 
-    if ( !mask.empty() )
-    {
-        if ( mask.count( nodeID ) )
-            classesToCheck = mask.at(nodeID);
-    }
+                if ( m_cg.adjFirst[p] )
+                    m_contrib[neighbor] += logEdgePotentials.row( label ).transpose();
+                else
+                    m_contrib[neighbor] += logEdgePotentials.col( label );
 
-    for ( size_t i = 0; i < classesToCheck.size(); i++ )
-    {
-        size_t classToCheck = classesToCheck[i];
+                m_undo.push_back( m_maxContrib[neighbor] );
+                m_restBound -= m_maxContrib[neighbor];
+                maxClass( neighbor, m_maxContrib[neighbor] );
+                m_restBound += m_maxContrib[neighbor];
+            }
+        }
 
-        if ( index == totalNodes - 1 )
+        /** Undoes the last assignment, of the node at a given depth. */
+        void unassign( size_t depth )
         {
-            nodesAndValuesToTest[nodeID] = classToCheck;
-            double likelihood = graph.getUnnormalizedLogLikelihood( nodesAndValuesToTest );
+            size_t nodeIndex = m_order[depth];
+            size_t label     = m_labels[nodeIndex];
 
-            /*cout << "Testing..." ;
-            for ( map<size_t,size_t>::iterator it = nodesAndValuesToTest.begin(); it != nodesAndValuesToTest.end(); it++ )
+            for ( size_t p = m_cg.adjOffsets[nodeIndex+1]; p-- > m_cg.adjOffsets[nodeIndex]; )
             {
-                std::cout << "[ID:" << it->first << " ,value " << it->second << "]";
-            }
-            cout << " Likelihood: " << likelihood << " Max: " << maxLikelihood<< endl ;*/
+                size_t neighbor = m_cg.adjNeighbor[p];
 
-            if ( likelihood > maxLikelihood )
-            {
-                results = nodesAndValuesToTest;
-                maxLikelihood = likelihood;
+                if ( m_position[neighbor] <= depth )
+                    continue;
+
+                const MatrixXd &logEdgePotentials = m_cg.logEdgePotentials[ m_cg.adjEdge[p] ];
+
+                if ( m_cg.adjFirst[p] )
+                    m_contrib[neighbor] -= logEdgePotentials.row( label ).transpose();
+                else
+                    m_contrib[neighbor] -= logEdgePotentials.col( label );
+
+                m_restBound -= m_maxContrib[neighbor];
+                m_maxContrib[neighbor] = m_undo.back();
+                m_restBound += m_maxContrib[neighbor];
+                m_undo.pop_back();
             }
 
-            if ( debug )
+            m_restBound += m_maxContrib[nodeIndex];
+            m_score     -= m_contrib[nodeIndex]( label ) - m_laterMax[nodeIndex]( label );
+        }
+
+        /** Depth first search from a depth, trying first the classes with
+          * the best bound, and pruning the branches whose bound is not over
+          * the shared incumbent.
+          */
+        void search( size_t depth, double &bestScore, vector<size_t> &bestLabels )
+        {
+            N_explored++;
+
+            double incumbent;
+
+            #pragma omp atomic read
+            incumbent = bestScore;
+
+            if ( getBound() <= incumbent )
+                return;
+
+            if ( depth == m_order.size() )
             {
-                N_test++;
-                if ( !( N_test % 1000000 ) )
+                #pragma omp critical(branchAndBoundIncumbent)
                 {
-                    time_t stop;
-                    time(&stop);
+                    if ( m_score > bestScore )
+                    {
+                        bestLabels = m_labels;
 
-                    cout << "N_test: " << N_test << endl;
-                    cout << "Finished in " <<  difftime(stop, start) << " seconds." << endl;
+                        #pragma omp atomic write
+                        bestScore = m_score;
+                    }
                 }
+
+                return;
             }
-        }
-        else
-        {
-            nodesAndValuesToTest[nodeID] = classToCheck;
-            decodeExactRec( graph, mask, index + 1, nodesAndValuesToTest, results, maxLikelihood, debug);
-        }
-    }
-}
 
+            size_t          nodeIndex = m_order[depth];
+            vector<size_t>  classes   = m_classes[nodeIndex];
+            VectorXd        &contrib  = m_contrib[nodeIndex];
 
-/*------------------------------------------------------------------------------
+            // Best classes first (insertion sort, there are a few of them)
+            for ( size_t i = 1; i < classes.size(); i++ )
+                for ( size_t j = i; ( j > 0 ) && ( contrib( classes[j] ) > contrib( classes[j-1] ) ); j-- )
+                    std::swap( classes[j], classes[j-1] );
 
-                                CDecodeLBP
+            for ( size_t i = 0; i < classes.size(); i++ )
+            {
+                #pragma omp atomic read
+                incumbent = bestScore;
 
-------------------------------------------------------------------------------*/
+                // The bound of the next classes is not better
+                if ( m_score + m_restBound - m_maxContrib[nodeIndex] + contrib( classes[i] ) <= incumbent )
+                    break;
 
-void CLBPInferenceMAP::infer( CGraph &graph,
-                         std::map<size_t,size_t> &results, bool debug )
+                assign( depth, classes[i] );
+                search( depth+1, bestScore, bestLabels );
+                unassign( depth );
+            }
+        }
+    };
+}
+
+void CExactInferenceMAP::infer(CGraph &graph, std::map<size_t,size_t> &results, bool debug )
 {
     TIMER_START
 
-    DEBUG("Decoding LBP");
-
     if ( graph.isEmpty() )
         return;
 
     results.clear();
-    const vector<CNodePtr> nodes = graph.getNodes();
-    const vector<CEdgePtr> edges = graph.getEdges();
-    multimap<size_t,CEdgePtr> edges_f = graph.getEdgesF();
 
-    size_t N_nodes = nodes.size();
-    size_t N_edges = edges.size();
+    //
+    // 1. Log potentials and classes to check of each node
+    //
 
-    DEBUG("Getting messages...")
+    TCompactGraph cg;
+    getCompactGraph( graph, m_options, cg );
+    getLogPotentials( cg );
 
-    vector<vector<VectorXd> > messages;
-    messagesLBP( graph, m_options, messages );
+    size_t N_nodes = cg.N_nodes;
 
-    //cout << "Convergency achieved in " << iteration << " interations";
-    //cout << " of a maximum of " << m_options.maxIterations << endl;
+    vector<vector<size_t> > classes( N_nodes );
+    vector<VectorXd>        unary( cg.logNodePotentials );
+
+    double N_combinations = 1;
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+    {
+        size_t nodeID = cg.nodeIDs[nodeIndex];
+
+        if ( m_mask.count( nodeID ) )
+            classes[nodeIndex] = m_mask[nodeID];
+        else
+            for ( size_t i = 0; i < cg.N_classes[nodeIndex]; i++ )
+                classes[nodeIndex].push_back( i );
+
+        if ( classes[nodeIndex].empty() )
+        {
+            cout << "[ERROR] No classes to check for the node " << nodeID << endl;
+            return;
+        }
+
+        N_combinations *= classes[nodeIndex].size();
+    }
+
+    // Self loops only depend on a node
+    for ( size_t edgeIndex = 0; edgeIndex < cg.N_edges; edgeIndex++ )
+        if ( cg.edgeNode1[edgeIndex] == cg.edgeNode2[edgeIndex] )
+            unary[ cg.edgeNode1[edgeIndex] ] += cg.logEdgePotentials[edgeIndex].diagonal();
 
     //
-    // Now that we have the messages, compute the final beliefs and fill the
-    // results map.
+    // 2. Variable ordering: start by the node with more neighbors, and take
+    //    next the node with more neighbors already ordered, so the edges
+    //    are scored as soon as possible
     //
 
-    DEBUG("Computing final beliefs and filling the results map...")
+    vector<size_t>  order;
+    vector<size_t>  position( N_nodes, N_nodes );
+    vector<size_t>  N_orderedNeighbors( N_nodes, 0 );
 
-    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+    for ( size_t step = 0; step < N_nodes; step++ )
     {
-        const CNodePtr nodePtr = graph.getNode( nodeIndex );
-        size_t nodeID          = nodePtr->getID();
-        VectorXd nodePotPlusIncMsg = nodePtr->getPotentials( m_options.considerNodeFixedValues );
+        size_t best = N_nodes;
 
-        pair<multimap<size_t,CEdgePtr>::iterator,multimap<size_t,CEdgePtr>::iterator > neighbors;
+        for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        {
+            if ( position[nodeIndex] != N_nodes )
+                continue;
+
+            if ( ( best == N_nodes )
+                 || ( N_orderedNeighbors[nodeIndex] > N_orderedNeighbors[best] )
+                 || ( ( N_orderedNeighbors[nodeIndex] == N_orderedNeighbors[best] )
+                      && ( cg.adjOffsets[nodeIndex+1] - cg.adjOffsets[nodeIndex]
+                           > cg.adjOffsets[best+1] - cg.adjOffsets[best] ) ) )
+                best = nodeIndex;
+        }
 
-        neighbors = edges_f.equal_range(nodeID);
+        position[best] = order.size();
+        order.push_back( best );
 
-        //
-        // Get the messages for all the neighbors, and multiply them with the node potential
-        //
-        for ( multimap<size_t,CEdgePtr>::iterator itNeigbhor = neighbors.first;
-              itNeigbhor != neighbors.second;
-              itNeigbhor++ )
+        for ( size_t p = cg.adjOffsets[best]; p < cg.adjOffsets[best+1]; p++ )
+            N_orderedNeighbors[ cg.adjNeighbor[p] ]++;
+    }
+
+    //
+    // 3. Best values of the edges to later nodes
+    //
+
+    vector<VectorXd> laterMax( N_nodes );
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+    {
+        laterMax[nodeIndex] = VectorXd::Zero( cg.N_classes[nodeIndex] );
+
+        for ( size_t p = cg.adjOffsets[nodeIndex]; p < cg.adjOffsets[nodeIndex+1]; p++ )
         {
-            CEdgePtr edgePtr( (*itNeigbhor).second );
-            size_t edgeIndex = graph.getEdgeIndex( edgePtr->getID() );
+            size_t neighbor = cg.adjNeighbor[p];
+
+            if ( position[neighbor] <= position[nodeIndex] )
+                continue;
+
+            const MatrixXd &logEdgePotentials = cg.logEdgePotentials[ cg.adjEdge[p] ];
+
+            for ( size_t k = 0; k < cg.N_classes[nodeIndex]; k++ )
+            {
+                double maxValue = -std::numeric_limits<double>::max();
+
+                for ( size_t i = 0; i < classes[neighbor].size(); i++ )
+                {
+                    double value = cg.adjFirst[p] ? logEdgePotentials( k, classes[neighbor][i] )
+                                                  : logEdgePotentials( classes[neighbor][i], k );
+                    maxValue = std::max( maxValue, value );
+                }
 
-            if ( !edgePtr->getNodePosition( nodeID ) ) // nodeID is the first node in the edge
-                nodePotPlusIncMsg = nodePotPlusIncMsg.cwiseProduct(messages[ edgeIndex ][ 1 ]);
-            else // nodeID is the second node in the dege
-                nodePotPlusIncMsg = nodePotPlusIncMsg.cwiseProduct(messages[ edgeIndex ][ 0 ]);
+                laterMax[nodeIndex](k) += maxValue;
+            }
         }
+    }
+
+    //
+    // 4. Split the search tree by assigning the first nodes, so each thread
+    //    takes the subtrees starting by the most promising prefixes
+    //
 
-        // Normalize
-        nodePotPlusIncMsg = nodePotPlusIncMsg / nodePotPlusIncMsg.sum();
+    size_t N_threads = getNumberOfThreads( m_options );
+    size_t N_prefixNodes = 0;
+    double N_prefixes = 1;
 
-        // Now the class with the higher value is the boss!
-        size_t nodeMAP;
+    while ( ( N_threads > 1 ) && ( N_prefixNodes < N_nodes ) && ( N_prefixes < 8*N_threads ) )
+        N_prefixes *= classes[ order[N_prefixNodes++] ].size();
+
+    vector<vector<size_t> >         prefixes( 1 );
+    vector<std::pair<double,size_t> > prefixBounds;
 
-        nodePotPlusIncMsg.maxCoeff(&nodeMAP);
+    for ( size_t depth = 0; depth < N_prefixNodes; depth++ )
+    {
+        const vector<size_t> &nodeClasses = classes[ order[depth] ];
+        vector<vector<size_t> > expanded;
+
+        for ( size_t i = 0; i < prefixes.size(); i++ )
+            for ( size_t j = 0; j < nodeClasses.size(); j++ )
+            {
+                expanded.push_back( prefixes[i] );
+                expanded.back().push_back( nodeClasses[j] );
+            }
 
-        results[nodeID] = nodeMAP;
+        prefixes.swap( expanded );
     }
 
-    TIMER_END(m_executionTime)
+    CBranchAndBound root( cg, order, position, classes, unary, laterMax );
 
-}
+    for ( size_t i = 0; i < prefixes.size(); i++ )
+    {
+        for ( size_t depth = 0; depth < N_prefixNodes; depth++ )
+            root.assign( depth, prefixes[i][depth] );
 
+        prefixBounds.push_back( std::make_pair( -root.getBound(), i ) );
 
-/*------------------------------------------------------------------------------
+        for ( size_t depth = N_prefixNodes; depth-- > 0; )
+            root.unassign( depth );
+    }
 
-                                CDecodeRBP
+    std::sort( prefixBounds.begin(), prefixBounds.end() );
 
-------------------------------------------------------------------------------*/
+    if ( debug )
+    {
+        cout << "Doing exact decoding..." << endl;
+        cout << "Number of nodes                : " << N_nodes << endl;
+        cout << "Number of possible combinations: " << N_combinations << endl;
+        cout << "Number of subtrees             : " << prefixes.size() << endl;
+    }
 
-void CRBPInferenceMAP::infer( CGraph &graph,
-                         std::map<size_t,size_t> &results, bool debug )
-{
-    TIMER_START
+    //
+    // 5. Search
+    //
 
-    DEBUG("Setting RBP message passing...")
+    double          bestScore = -std::numeric_limits<double>::max();
+    vector<size_t>  bestLabels( N_nodes, 0 );
+    size_t          N_explored = 0;
 
-    CLBPInferenceMAP decodeLBP;
+    #pragma omp parallel num_threads(N_threads) reduction(+:N_explored)
+    {
+        CBranchAndBound searcher( cg, order, position, classes, unary, laterMax );
 
-    m_options.particularS["order"] = "RBP";
+        #pragma omp for schedule(dynamic,1)
+        for ( int i = 0; i < (int)prefixBounds.size(); i++ )
+        {
+            const vector<size_t> &prefix = prefixes[ prefixBounds[i].second ];
 
-    decodeLBP.setOptions( m_options );
+            for ( size_t depth = 0; depth < N_prefixNodes; depth++ )
+                searcher.assign( depth, prefix[depth] );
 
-    DEBUG("Executing LBP with RBP message passing...")
+            searcher.search( N_prefixNodes, bestScore, bestLabels );
 
-    decodeLBP.infer( graph, results, debug );
+            for ( size_t depth = N_prefixNodes; depth-- > 0; )
+                searcher.unassign( depth );
+        }
+
+        N_explored += searcher.N_explored;
+    }
+
+    if ( debug )
+        cout << "Explored search nodes          : " << N_explored << endl;
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        results[ cg.nodeIDs[nodeIndex] ] = bestLabels[nodeIndex];
 
     TIMER_END(m_executionTime)
 
@@ -578,25 +740,195 @@ void CRBPInferenceMAP::infer( CGraph &graph,
 
 /*------------------------------------------------------------------------------
 
-                                CDecodeTRPBP
+                                CDecodeTree
 
 ------------------------------------------------------------------------------*/
 
-void CTRPBPInferenceMAP::infer( CGraph &graph,
+void CTreeInferenceMAP::infer( CGraph &graph,
                          std::map<size_t,size_t> &results, bool debug )
 {
     TIMER_START
 
-    if ( graph.isEmpty() )
+    DEBUG("Decoding Tree");
+
+    results.clear();
+
+    getForestMAP( graph, m_options, results );
+
+    TIMER_END(m_executionTime)
+}
+
+
+/*------------------------------------------------------------------------------
+
+                            CDecodeJunctionTree
+
+------------------------------------------------------------------------------*/
+
+void CJunctionTreeInferenceMAP::infer( CGraph &graph,
+                         std::map<size_t,size_t> &results, bool debug )
+{
+    TIMER_START
+
+    DEBUG("Decoding Junction Tree");
+
+    results.clear();
+
+    getJunctionTreeMAP( graph, m_options, results );
+
+    TIMER_END(m_executionTime)
+}
+
+
+/*------------------------------------------------------------------------------
+
+                        CDecodeVariableElimination
+
+------------------------------------------------------------------------------*/
+
+void CVariableEliminationInferenceMAP::infer( CGraph &graph,
+                         std::map<size_t,size_t> &results, bool debug )
+{
+    TIMER_START
+
+    DEBUG("Decoding Variable Elimination");
+
+    results.clear();
+
+    m_bound = eliminateVariables( graph, m_options, true, &results, &m_exact );
+
+    if ( debug && !m_exact )
+        cout << "Mini-buckets used, the max log score is bounded by " << m_bound << endl;
+
+    TIMER_END(m_executionTime)
+}
+
+
+/*------------------------------------------------------------------------------
+
+                                CDecodeLBP
+
+------------------------------------------------------------------------------*/
+
+void CLBPInferenceMAP::infer( CGraph &graph,
+                         std::map<size_t,size_t> &results, bool debug )
+{
+    TIMER_START
+
+    DEBUG("Decoding LBP");
+
+    if ( graph.isEmpty() )
+        return;
+
+    results.clear();
+
+    //
+    // Solve exactly the components without cycles, keeping the others
+    //
+
+    CGraph  cyclicPart;
+    bool    exactTrees = !m_options.particularB["skipExactTrees"];
+
+    if ( exactTrees )
+    {
+        DEBUG("Solving the acyclic components...")
+
+        getForestMAP( graph, m_options, results, &cyclicPart );
+
+        if ( cyclicPart.isEmpty() )
+        {
+            m_status = TInferenceStatus();
+            m_status.stopCause = "ExactTrees";
+
+            TIMER_END(m_executionTime)
+            return;
+        }
+    }
+
+    CGraph &loopyGraph = exactTrees ? cyclicPart : graph;
+
+    DEBUG("Getting messages...")
+
+    vector<vector<VectorXd> > messages;
+    messagesLBP( loopyGraph, m_options, messages, true, vector<size_t>(), &m_status );
+
+    //cout << "Convergency achieved in " << iteration << " interations";
+    //cout << " of a maximum of " << m_options.maxIterations << endl;
+
+    //
+    // Now that we have the messages, compute the final beliefs and fill the
+    // results map.
+    //
+
+    DEBUG("Computing final beliefs and filling the results map...")
+
+    map<size_t,VectorXd> nodeBeliefs;
+    getNodeBeliefs( loopyGraph, m_options, messages, nodeBeliefs );
+
+    for ( map<size_t,VectorXd>::iterator it = nodeBeliefs.begin(); it != nodeBeliefs.end(); it++ )
+    {
+        // Now the class with the higher value is the boss!
+        size_t nodeMAP;
+
+        it->second.maxCoeff(&nodeMAP);
+
+        results[it->first] = nodeMAP;
+    }
+
+    TIMER_END(m_executionTime)
+
+}
+
+
+/*------------------------------------------------------------------------------
+
+                                CDecodeRBP
+
+------------------------------------------------------------------------------*/
+
+void CRBPInferenceMAP::infer( CGraph &graph,
+                         std::map<size_t,size_t> &results, bool debug )
+{
+    TIMER_START
+
+    DEBUG("Setting RBP message passing...")
+
+    CLBPInferenceMAP decodeLBP;
+
+    m_options.particularS["order"] = "RBP";
+
+    decodeLBP.setOptions( m_options );
+
+    DEBUG("Executing LBP with RBP message passing...")
+
+    decodeLBP.infer( graph, results, debug );
+
+    m_status = decodeLBP.getStatus();
+
+    TIMER_END(m_executionTime)
+
+}
+
+
+/*------------------------------------------------------------------------------
+
+                                CDecodeTRPBP
+
+------------------------------------------------------------------------------*/
+
+void CTRPBPInferenceMAP::infer( CGraph &graph,
+                         std::map<size_t,size_t> &results, bool debug )
+{
+    TIMER_START
+
+    if ( graph.isEmpty() )
         return;
 
     results.clear();
     const vector<CNodePtr> nodes = graph.getNodes();
     const vector<CEdgePtr> edges = graph.getEdges();
-    multimap<size_t,CEdgePtr> edges_f = graph.getEdgesF();
 
     size_t N_nodes = nodes.size();
-    size_t N_edges = edges.size();
 
     //
     // 1. Create spanning trees
@@ -645,72 +977,71 @@ void CTRPBPInferenceMAP::infer( CGraph &graph,
     //
 
     vector<vector<VectorXd> >   messages;
+    vector<vector<VectorXd> >   previousMessages;
+    map<size_t,VectorXd>        nodeBeliefs;
     bool                        maximize = true;
 
-    double totalSumOfMsgs = std::numeric_limits<double>::max();
+    // Stop also if the decoded labels are stable along the iterations
+    CDecisionStability stability( m_options, N_nodes );
+
+    m_status = TInferenceStatus();
+    m_status.stopCause = "MaxIterations";
 
     size_t iteration;
 
     for ( iteration = 0; iteration < m_options.maxIterations; iteration++ )
     {
+        previousMessages = messages;
 
         for ( size_t i_tree=0; i_tree < v_trees.size(); i_tree++ )
             messagesLBP( graph, m_options, messages, maximize, v_trees[i_tree] );
 
-        double newTotalSumOfMsgs = 0;
-        for ( size_t i = 0; i < N_edges; i++ )
+        m_status.residual = getMessagesResidual( previousMessages, messages );
+
+        if ( m_status.residual < m_options.convergency )
         {
-            newTotalSumOfMsgs += messages[i][0].sum() + messages[i][1].sum();
+            m_status.stopCause = "Converged";
+            iteration++;
+            break;
         }
 
-        if ( std::abs( totalSumOfMsgs - newTotalSumOfMsgs ) <
-             m_options.convergency )
-            break;
+        if ( stability.isEnabled() )
+        {
+            getNodeBeliefs( graph, m_options, messages, nodeBeliefs );
 
-        totalSumOfMsgs = newTotalSumOfMsgs;
+            for ( size_t i_node = 0; i_node < N_nodes; i_node++ )
+            {
+                size_t nodeMAP;
+                nodeBeliefs[ nodes[i_node]->getID() ].maxCoeff(&nodeMAP);
+                stability.setLabel( i_node, nodeMAP );
+            }
 
+            if ( stability.endSweep() )
+            {
+                m_status.stopCause = "StableDecisions";
+                iteration++;
+                break;
+            }
+        }
     }
 
+    m_status.iterations = iteration;
+
     //
     // Now that we have the messages, compute the final beliefs and fill the
     // results map.
     //
 
-    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
-    {
-        const CNodePtr nodePtr = graph.getNode( nodeIndex );
-        size_t nodeID          = nodePtr->getID();
-        VectorXd nodePotPlusIncMsg = nodePtr->getPotentials( m_options.considerNodeFixedValues );
-
-        pair<multimap<size_t,CEdgePtr>::iterator,multimap<size_t,CEdgePtr>::iterator > neighbors;
-
-        neighbors = edges_f.equal_range(nodeID);
-
-        //
-        // Get the messages for all the neighbors, and multiply them with the node potential
-        //
-        for ( multimap<size_t,CEdgePtr>::iterator itNeigbhor = neighbors.first;
-              itNeigbhor != neighbors.second;
-              itNeigbhor++ )
-        {
-            CEdgePtr edgePtr( (*itNeigbhor).second );
-            size_t edgeIndex = graph.getEdgeIndex( edgePtr->getID() );
-
-            if ( !edgePtr->getNodePosition( nodeID ) ) // nodeID is the first node in the edge
-                nodePotPlusIncMsg = nodePotPlusIncMsg.cwiseProduct(messages[ edgeIndex ][ 1 ]);
-            else // nodeID is the second node in the dege
-                nodePotPlusIncMsg = nodePotPlusIncMsg.cwiseProduct(messages[ edgeIndex ][ 0 ]);
-        }
-
-        // Normalize
-        nodePotPlusIncMsg = nodePotPlusIncMsg / nodePotPlusIncMsg.sum();
+    getNodeBeliefs( graph, m_options, messages, nodeBeliefs );
 
+    for ( map<size_t,VectorXd>::iterator it = nodeBeliefs.begin(); it != nodeBeliefs.end(); it++ )
+    {
         // Now the class with the higher value is the boss!
         size_t nodeMAP;
 
-        nodePotPlusIncMsg.maxCoeff(&nodeMAP);
+        it->second.maxCoeff(&nodeMAP);
 
-        results[nodeID] = nodeMAP;
+        results[it->first] = nodeMAP;
     }
 
     TIMER_END(m_executionTime)
@@ -719,283 +1050,1494 @@ void CTRPBPInferenceMAP::infer( CGraph &graph,
 
 /*------------------------------------------------------------------------------
 
-                              CDecodeGraphCuts
+                                CDecodeSplash
 
 ------------------------------------------------------------------------------*/
 
-void CGraphCutsInferenceMAP::infer( CGraph &graph,
+void CSplashInferenceMAP::infer( CGraph &graph,
                          std::map<size_t,size_t> &results, bool debug )
 {
     TIMER_START
 
-    //cout << "Decoding graph cuts..." << endl;
+    DEBUG("Decoding Splash BP");
 
-    // Decoding method overview:
-    // 1. Check binary states and sub-modularity conditions.
-    // 2. Pepare energies and capacities.
-    // 3. Solve the Max-Flow Min-Cut problem.
+    if ( graph.isEmpty() )
+        return;
 
-    //
-    // 1. Check binary states and sub-modularity conditions.
-    //
+    results.clear();
 
-    // Check that all the node and edge types have two states.
-    // This method is only for binary problems.
+    DEBUG("Getting messages...")
 
-    // First edges
+    vector<vector<VectorXd> > messages;
+    messagesSplash( graph, m_options, messages, true, &m_status );
 
-    vector<CEdgePtr> &v_edges = graph.getEdges();
-    vector<CEdgePtr>::const_iterator edgesIt;
+    DEBUG("Computing final beliefs and filling the results map...")
 
-    bool submodular = true;
+    map<size_t,VectorXd> nodeBeliefs;
+    getNodeBeliefs( graph, m_options, messages, nodeBeliefs );
 
-    for ( edgesIt = v_edges.begin(); edgesIt != v_edges.end(); edgesIt++ )
+    for ( map<size_t,VectorXd>::iterator it = nodeBeliefs.begin(); it != nodeBeliefs.end(); it++ )
     {
-        CEdgePtr edgePtr = (*edgesIt);
-        MatrixXd &potentials = edgePtr->getPotentials();
-
-        if ( (potentials.cols() != 2) || ( potentials.rows() != 2 ) )
-        {
-            cout << "[ERROR] The number of classes of a node into an edge is not two." << endl;
-            return;
-        }
-
-        MatrixXd energies = -(potentials.array().log());
+        // Now the class with the higher value is the boss!
+        size_t nodeMAP;
 
-        //cout << "Energies: " << energies << endl;
+        it->second.maxCoeff(&nodeMAP);
 
-        // Check submodularity
-        if ( energies(0,0) + energies(1,1) > energies(0,1) + energies(1,0) + exp(-15) )
-            submodular = false;
+        results[it->first] = nodeMAP;
     }
 
-    // Now nodes
-
-    vector<CNodeTypePtr> &nodeTypes= graph.getNodeTypes();
-    vector<CNodeTypePtr>::iterator nodeTypesIt;
+    TIMER_END(m_executionTime)
 
-    for ( nodeTypesIt = nodeTypes.begin();
-          nodeTypesIt != nodeTypes.end(); nodeTypesIt++ )
-    {
-        if ( (*nodeTypesIt)->getNumberOfClasses() != 2 )
-        {
-            cout << "[ERROR] The number of classes of a node type used in the graph is not 2." << endl;
-            return;
-        }
-    }
+}
 
-    //
-    // 2. Pepare energies and capacities.
-    //
+/*------------------------------------------------------------------------------
 
-    // Make node energies
-    map<size_t,Vector2d> nodeEnergies;
-    map<size_t,size_t>   nodesMap;
+                                CDecodeTRWS
 
-    vector<CNodePtr> &v_nodes = graph.getNodes();
-    vector<CNodePtr>::const_iterator nodesIt;
-    size_t index = 1;
+------------------------------------------------------------------------------*/
 
-    for ( nodesIt = v_nodes.begin(); nodesIt != v_nodes.end(); nodesIt++ )
+namespace
+{
+    /** Min-marginalizes the energies of the edge of the directed edge p plus
+      * a function "in" of the classes of the node sending through it, that
+      * is, out(xj) = min_xi ( in(xi) + E(xi,xj) ), xj being the classes of
+      * the neighbor.
+      */
+    void minMarginalize( const TCompactGraph &cg,
+                         const vector<MatrixXd> &edgeEnergies,
+                         size_t p,
+                         const VectorXd &in,
+                         VectorXd &out )
     {
-        size_t ID           = (*nodesIt)->getID();
-        Vector2d potentials = (*nodesIt)->getPotentials();
-        Vector2d energies   = -(potentials.array().log());
+        const MatrixXd &energies = edgeEnergies[ cg.adjEdge[p] ];
+        const size_t N_classes   = cg.N_classes[ cg.adjNeighbor[p] ];
 
-        nodeEnergies[ID] = energies;
-        nodesMap[ID] = index++;
+        if ( cg.adjFirst[p] )
+            for ( size_t xj = 0; xj < N_classes; xj++ )
+                out(xj) = ( energies.col(xj) + in.head( energies.rows() ) ).minCoeff();
+        else
+            for ( size_t xj = 0; xj < N_classes; xj++ )
+                out(xj) = ( energies.row(xj).transpose() + in.head( energies.cols() ) ).minCoeff();
     }
 
-    size_t N_nodes      = v_nodes.size();
-    size_t N_nodesGraph = (submodular) ? N_nodes + 2 : N_nodes*2 + 2;
-
-    //(submodular) ? cout << "SUBMODULAR" << endl : cout << "NO SUBMODULAR" << endl;
-
-    // Capacities according to the graph edges
-
-    MatrixXd capacities(N_nodesGraph,N_nodesGraph);
-    capacities.setZero();
-
-    for ( edgesIt = v_edges.begin(); edgesIt != v_edges.end(); edgesIt++ )
+    /** Energy of a node plus all its incoming messages. */
+    void getReparametrizedEnergy( const TCompactGraph &cg,
+                                  const vector<VectorXd> &nodeEnergies,
+                                  const VectorXd &messages,
+                                  size_t nodeIndex,
+                                  VectorXd &energy )
     {
-        CEdgePtr edgePtr = (*edgesIt);
-        MatrixXd &potentials = edgePtr->getPotentials();
+        const size_t N_classes = cg.N_classes[nodeIndex];
 
-        MatrixXd edgeEnergies = -(potentials.array().log());
+        energy = nodeEnergies[nodeIndex];
 
-        // Reparametrization, so the graph is in the normal form
-
-        size_t ID1, ID2;
-        edgePtr->getNodesID(ID1, ID2);
-
-        // Check if the edge node1->node2 is in normal form i.e:
-        // min{edgeEnergy00,edgeEnergy10} = 0 and min{edgeEnergy01,edgeEnergy11} = 0
-        double delta1 = min( edgeEnergies(0,0), edgeEnergies(1,0) );
-        double delta2 = min( edgeEnergies(0,1), edgeEnergies(1,1) );
+        for ( size_t q = cg.adjOffsets[nodeIndex]; q < cg.adjOffsets[nodeIndex+1]; q++ )
+            energy += messages.segment( cg.msgOffsets[ cg.adjReverse[q] ], N_classes );
+    }
 
-        if ( delta1 != 0 ) // If it isn't in a normal form
+    /** Decodes a labeling visiting the nodes in order, each one taking the
+      * class minimizing its energy plus the edge energies with the previous
+      * nodes (already labeled) and the messages from the following ones.
+      * \return The energy of the labeling.
+      */
+    double decodeTRWS( const TCompactGraph &cg,
+                       const vector<VectorXd> &nodeEnergies,
+                       const vector<MatrixXd> &edgeEnergies,
+                       const vector<vector<size_t> > &before,
+                       const vector<vector<size_t> > &after,
+                       const VectorXd &messages,
+                       VectorXd &energy,
+                       vector<size_t> &labels )
+    {
+        for ( size_t nodeIndex = 0; nodeIndex < cg.N_nodes; nodeIndex++ )
         {
-            edgeEnergies(0,0) -= delta1;
-            edgeEnergies(1,0) -= delta1;
+            const size_t N_classes = cg.N_classes[nodeIndex];
+            VectorBlock<VectorXd> nodeEnergy = energy.head( N_classes );
 
-            nodeEnergies[ID2](0) += delta1;
-        }
-
-        if ( delta2 != 0 )
-        {
-            edgeEnergies(0,1) -= delta1;
-            edgeEnergies(1,1) -= delta1;
+            nodeEnergy = nodeEnergies[nodeIndex];
 
-            nodeEnergies[ID2](1) += delta1;
-        }
+            for ( size_t i = 0; i < before[nodeIndex].size(); i++ )
+            {
+                size_t p = before[nodeIndex][i];
+                const MatrixXd &energies = edgeEnergies[ cg.adjEdge[p] ];
+                size_t neighborLabel = labels[ cg.adjNeighbor[p] ];
 
-        // Now, do the same with the edge node2->node1
-        double delta3 = min( edgeEnergies(0,0), edgeEnergies(0,1) );
-        double delta4 = min( edgeEnergies(1,0), edgeEnergies(1,1) );
+                if ( cg.adjFirst[p] )
+                    nodeEnergy += energies.col( neighborLabel );
+                else
+                    nodeEnergy += energies.row( neighborLabel ).transpose();
+            }
 
-        if ( delta3 != 0 )
-        {
-            edgeEnergies(0,0) -= delta3;
-            edgeEnergies(0,1) -= delta3;
+            for ( size_t i = 0; i < after[nodeIndex].size(); i++ )
+            {
+                size_t p = after[nodeIndex][i];
+                nodeEnergy += messages.segment( cg.msgOffsets[ cg.adjReverse[p] ], N_classes );
+            }
 
-            nodeEnergies[ID1](0) += delta3;
+            nodeEnergy.minCoeff( &labels[nodeIndex] );
         }
 
-        if ( delta4 != 0 )
-        {
-            edgeEnergies(1,0) -= delta4;
-            edgeEnergies(1,1) -= delta4;
+        double totalEnergy = 0;
 
-            nodeEnergies[ID1](1) += delta4;
-        }
+        for ( size_t nodeIndex = 0; nodeIndex < cg.N_nodes; nodeIndex++ )
+            totalEnergy += nodeEnergies[nodeIndex]( labels[nodeIndex] );
 
+        for ( size_t edgeIndex = 0; edgeIndex < cg.N_edges; edgeIndex++ )
+            totalEnergy += edgeEnergies[edgeIndex]( labels[ cg.edgeNode1[edgeIndex] ],
+                                                    labels[ cg.edgeNode2[edgeIndex] ] );
 
-        if ( submodular )
-        {
-            capacities(nodesMap[ID1],nodesMap[ID2]) = edgeEnergies(0,1);
-            capacities(nodesMap[ID2],nodesMap[ID1]) = edgeEnergies(1,0);
-        }
-        else
-        {
-            size_t index_ID1      = nodesMap[ID1];
-            size_t index_ID1prima = N_nodes + nodesMap[ID1];
-            size_t index_ID2      = nodesMap[ID2];
-            size_t index_ID2prima = N_nodes + nodesMap[ID2];
+        return totalEnergy;
+    }
+}
 
-            capacities(index_ID1,index_ID2)            =
-            capacities(index_ID2prima, index_ID1prima) = 0.5*edgeEnergies(0,1);
+void CTRWSInferenceMAP::infer( CGraph &graph,
+                         std::map<size_t,size_t> &results, bool debug )
+{
+    TIMER_START
 
-            capacities(index_ID2,index_ID1)            =
-            capacities(index_ID1prima, index_ID2prima) = 0.5*edgeEnergies(1,0);
+    DEBUG("Decoding TRW-S");
 
-            capacities(index_ID1,index_ID2prima)  =
-            capacities(index_ID2, index_ID1prima) = 0.5*edgeEnergies(0,0);
+    if ( graph.isEmpty() )
+        return;
 
-            capacities(index_ID2prima,index_ID1)  =
-            capacities(index_ID1prima, index_ID2) = 0.5*edgeEnergies(1,1);
-        }
+    results.clear();
 
-    }
+    TCompactGraph cg;
+    getCompactGraph( graph, m_options, cg );
+    getLogPotentials( cg );
 
-    // Capacities according to the edges
+    size_t N_nodes = cg.N_nodes;
+    size_t N_edges = cg.N_edges;
 
-    map<size_t,Vector2d>::iterator itEnergies;
+    //
+    // 1. Compute the energies, the edge appearance weights and the
+    //    monotonic chains, only once.
+    //
 
-    for ( itEnergies = nodeEnergies.begin();
-          itEnergies != nodeEnergies.end();
-          itEnergies++ )
-    {
+    DEBUG("Setting energies, weights and chains...");
 
-        // Reparametrize nodes
+    vector<VectorXd> nodeEnergies( N_nodes );
+    vector<MatrixXd> edgeEnergies( N_edges );
 
-        double delta = min((itEnergies->second)(0),(itEnergies->second)(1));
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        nodeEnergies[nodeIndex] = -cg.logNodePotentials[nodeIndex];
 
-        Vector2d &energies = (itEnergies->second);
+    for ( size_t edgeIndex = 0; edgeIndex < N_edges; edgeIndex++ )
+        edgeEnergies[edgeIndex] = -cg.logEdgePotentials[edgeIndex];
 
-        if ( delta != 0 )
-        {
-            energies(0) -= delta;
-            energies(1) -= delta;
-        }
+    // Directed edges of each node to the previous and to the following nodes
+    vector<vector<size_t> > before( N_nodes );
+    vector<vector<size_t> > after( N_nodes );
 
-        size_t ID = itEnergies->first;
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        for ( size_t p = cg.adjOffsets[nodeIndex]; p < cg.adjOffsets[nodeIndex+1]; p++ )
+            if ( cg.adjNeighbor[p] < nodeIndex )
+                before[nodeIndex].push_back( p );
+            else
+                after[nodeIndex].push_back( p );
 
-        if ( submodular )
-        {
-            capacities(nodesMap[ID],N_nodesGraph-1) = energies(0);
-            capacities(0,nodesMap[ID])              = energies(1);
-        }
-        else
-        {
-            size_t index_ID      = nodesMap[ID];
-            size_t index_IDprima = N_nodes + nodesMap[ID];
+    // A node is in as many monotonic chains as the max of its number of
+    // previous and following neighbors, and the weight of the node in each
+    // chain is the inverse of that number. The k-th edge to a previous node
+    // and the k-th edge to a following one are in the same chain, so
+    // slotAtNeighbor[p] keeps the position of the directed edge p (going to
+    // a following node) in the "before" list of the neighbor.
+    vector<double> gamma( N_nodes );
+    vector<size_t> slotAtNeighbor( 2*N_edges, 0 );
 
-            capacities( index_ID, N_nodesGraph-1 )     =
-            capacities( 0, index_IDprima)              = 0.5*energies(0);
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+    {
+        size_t N_chains = std::max( before[nodeIndex].size(), after[nodeIndex].size() );
+        gamma[nodeIndex] = 1.0 / std::max( N_chains, (size_t)1 );
 
-            capacities( 0, index_ID )                  =
-            capacities( index_IDprima, N_nodesGraph-1) = 0.5* energies(1);
-        }
+        for ( size_t slot = 0; slot < before[nodeIndex].size(); slot++ )
+            slotAtNeighbor[ cg.adjReverse[ before[nodeIndex][slot] ] ] = slot;
     }
 
     //
-    // 3. Solve the Max-Flow Min-Cut problem.
+    // 2. Iterate forward and backward, updating the messages sent to the
+    //    following (previous) nodes.
     //
 
-    VectorXi cut(N_nodesGraph);
-    cut.setZero();
+    VectorXd messages = VectorXd::Zero( cg.msgOffsets.back() );
 
-    //cout << "Capacities: " << endl << capacities << endl;
+    vector<VectorXd> reparametrized( N_nodes );
+    VectorXd in( cg.maxClasses );
+    VectorXd out( cg.maxClasses );
+    VectorXd chain( cg.maxClasses );
 
-    fordFulkerson(capacities, 0, N_nodesGraph-1, cut);
+    vector<size_t> labels( N_nodes, 0 );
+    vector<size_t> bestLabels( N_nodes, 0 );
 
-    for ( nodesIt = v_nodes.begin(); nodesIt != v_nodes.end(); nodesIt++ )
-    {
-        size_t ID   = (*nodesIt)->getID();
+    m_energy     = decodeTRWS( cg, nodeEnergies, edgeEnergies, before, after, messages, in, bestLabels );
+    m_lowerBound = -std::numeric_limits<double>::infinity();
 
-        if ( submodular )
-            results[ID] = (cut[nodesMap[ID]]==1) ? 0 : 1;
-        else
+    double maxGap = m_options.particularD["dualityGap"];
+
+    m_status = TInferenceStatus();
+    m_status.stopCause = "MaxIterations";
+
+    size_t iteration;
+
+    for ( iteration = 0; iteration < m_options.maxIterations; iteration++ )
+    {
+        for ( size_t pass = 0; pass < 2; pass++ )
+            for ( size_t n = 0; n < N_nodes; n++ )
+            {
+                size_t nodeIndex = pass ? N_nodes-1-n : n;
+                const vector<size_t> &outgoing = pass ? before[nodeIndex] : after[nodeIndex];
+
+                if ( outgoing.empty() )
+                    continue;
+
+                const size_t N_classes = cg.N_classes[nodeIndex];
+
+                getReparametrizedEnergy( cg, nodeEnergies, messages, nodeIndex, reparametrized[nodeIndex] );
+
+                for ( size_t i = 0; i < outgoing.size(); i++ )
+                {
+                    size_t p = outgoing[i];
+                    size_t N_classesNeighbor = cg.N_classes[ cg.adjNeighbor[p] ];
+
+                    in.head( N_classes ) = gamma[nodeIndex]*reparametrized[nodeIndex] -
+                            messages.segment( cg.msgOffsets[ cg.adjReverse[p] ], N_classes );
+
+                    minMarginalize( cg, edgeEnergies, p, in, out );
+
+                    messages.segment( cg.msgOffsets[p], N_classesNeighbor ) =
+                            out.head( N_classesNeighbor ).array() - out.head( N_classesNeighbor ).minCoeff();
+                }
+            }
+
+        //
+        // Lower bound: sum of the min energies of the chains, the energy of
+        // each one being its part of the reparametrized energies (messages
+        // added to the nodes and subtracted from the edges).
+        //
+
+        for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+            getReparametrizedEnergy( cg, nodeEnergies, messages, nodeIndex, reparametrized[nodeIndex] );
+
+        double lowerBound = 0;
+
+        for ( size_t first = 0; first < N_nodes; first++ )
+        {
+            size_t N_chains = std::max( std::max( before[first].size(), after[first].size() ), (size_t)1 );
+
+            // Chains starting at this node
+            for ( size_t slot = before[first].size(); slot < N_chains; slot++ )
+            {
+                size_t nodeIndex = first;
+                size_t nodeSlot  = slot;
+
+                chain.head( cg.N_classes[nodeIndex] ) = gamma[nodeIndex]*reparametrized[nodeIndex];
+
+                while ( nodeSlot < after[nodeIndex].size() )
+                {
+                    size_t p        = after[nodeIndex][nodeSlot];
+                    size_t neighbor = cg.adjNeighbor[p];
+                    size_t N_classes = cg.N_classes[nodeIndex];
+                    size_t N_classesNeighbor = cg.N_classes[neighbor];
+
+                    in.head( N_classes ) = chain.head( N_classes ) -
+                            messages.segment( cg.msgOffsets[ cg.adjReverse[p] ], N_classes );
+
+                    minMarginalize( cg, edgeEnergies, p, in, out );
+
+                    chain.head( N_classesNeighbor ) = out.head( N_classesNeighbor ) -
+                            messages.segment( cg.msgOffsets[p], N_classesNeighbor ) +
+                            gamma[neighbor]*reparametrized[neighbor];
+
+                    nodeSlot  = slotAtNeighbor[p];
+                    nodeIndex = neighbor;
+                }
+
+                lowerBound += chain.head( cg.N_classes[nodeIndex] ).minCoeff();
+            }
+        }
+
+        //
+        // Upper bound: energy of the decoded labeling
+        //
+
+        double energy = decodeTRWS( cg, nodeEnergies, edgeEnergies, before, after, messages, in, labels );
+
+        if ( energy < m_energy )
+        {
+            m_energy   = energy;
+            bestLabels = labels;
+        }
+
+        // Keep the best bound, so it never decreases
+        double previousLowerBound = m_lowerBound;
+
+        if ( lowerBound > m_lowerBound )
+            m_lowerBound = lowerBound;
+
+        m_status.residual = m_lowerBound - previousLowerBound;
+
+        if ( debug )
+            cout << "  Iteration " << iteration << " lower bound: " << m_lowerBound
+                 << " energy: " << m_energy << endl;
+
+        //
+        // Check convergency!!
+        //
+
+        if ( m_energy - m_lowerBound <= maxGap + 1e-9*std::max( 1.0, std::abs( m_energy ) ) )
+        {
+            m_status.stopCause = "DualityGap";
+            iteration++;
+            break;
+        }
+
+        if ( m_status.residual < m_options.convergency )
+        {
+            m_status.stopCause = "Converged";
+            iteration++;
+            break;
+        }
+    }
+
+    m_status.iterations = iteration;
+
+    //
+    // Fill the results map
+    //
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        results[ cg.nodeIDs[nodeIndex] ] = bestLabels[nodeIndex];
+
+    TIMER_END(m_executionTime)
+
+}
+
+/*------------------------------------------------------------------------------
+
+                              CDecodeGraphCuts
+
+------------------------------------------------------------------------------*/
+
+namespace
+{
+    /** Is the binary energy of an edge, E00 E01 E10 E11, submodular? */
+    inline bool isSubmodular( const double *energies )
+    {
+        return ( energies[0] + energies[3] <= energies[1] + energies[2] + exp(-15) );
+    }
+
+    /** Decomposes the submodular energy of an edge into energies for the
+      * label 1 of its nodes, and the capacity of the arc node1->node2:
+      * E(x1,x2) = E00 + (E10-E00)x1 + (E11-E10)x2 + (E01+E10-E00-E11)(1-x1)x2
+      */
+    inline double decomposeSubmodular( const double *energies,
+                                       double &unary1,
+                                       double &unary2 )
+    {
+        unary1 = energies[2] - energies[0];
+        unary2 = energies[3] - energies[2];
+
+        return std::max( energies[1] + energies[2] - energies[0] - energies[3], 0.0 );
+    }
+
+    bool checkMaxFlowMethod( const string &method )
+    {
+        if ( ( method != "" ) && ( method != "BK" ) && ( method != "PushRelabel" ) )
+        {
+            cout << "[ERROR] Unknown max-flow method: " << method << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    /** Energy of a binary problem: the energies of the labels of each node,
+      * and the ones of the edges between them. Its buffers keep their memory
+      * when it is cleared, so filling it again does not allocate memory.
+      */
+    struct TBinaryEnergy
+    {
+        std::vector<double> nodeEnergies; //!< Energy of each label of each node, [2*node+label].
+        std::vector<size_t> edgeNode1;
+        std::vector<size_t> edgeNode2;
+        std::vector<double> edgeEnergies; //!< Energies of each edge, [4*edge+2*label1+label2].
+        bool                submodular;
+
+        void clear( size_t N_nodes )
+        {
+            nodeEnergies.assign( 2*N_nodes, 0 );
+            edgeNode1.clear();
+            edgeNode2.clear();
+            edgeEnergies.clear();
+            submodular = true;
+        }
+
+        /** Adds an edge. If its energy is not submodular, it is truncated
+          * (E11 is lowered) if submodularApproach is "truncate", ignored if
+          * it is "ignore", and kept otherwise ("QPBO").
+          */
+        void addEdge( size_t node1, size_t node2,
+                      double energy00, double energy01,
+                      double energy10, double energy11,
+                      const string &submodularApproach )
+        {
+            edgeNode1.push_back( node1 );
+            edgeNode2.push_back( node2 );
+
+            if ( energy00 + energy11 > energy01 + energy10 + exp(-15) )
+            {
+                if ( submodularApproach == "ignore" )
+                    energy00 = energy01 = energy10 = energy11 = 0;
+                else if ( submodularApproach == "truncate" )
+                    energy11 = energy01 + energy10 - energy00;
+                else
+                    submodular = false;
+            }
+
+            edgeEnergies.push_back( energy00 );
+            edgeEnergies.push_back( energy01 );
+            edgeEnergies.push_back( energy10 );
+            edgeEnergies.push_back( energy11 );
+        }
+
+        /** Energy of a labeling (0 or 1 for each node). */
+        double getEnergy( const vector<size_t> &labels ) const
+        {
+            double value = 0;
+
+            for ( size_t nodeIndex = 0; nodeIndex < labels.size(); nodeIndex++ )
+                value += nodeEnergies[ 2*nodeIndex + labels[nodeIndex] ];
+
+            for ( size_t edgeIndex = 0; edgeIndex < edgeNode1.size(); edgeIndex++ )
+                value += edgeEnergies[ 4*edgeIndex + 2*labels[ edgeNode1[edgeIndex] ]
+                                                   + labels[ edgeNode2[edgeIndex] ] ];
+
+            return value;
+        }
+    };
+
+    /** Fills a max-flow network with a submodular binary energy (its node
+      * energies are modified). Nodes in the source segment take the label 0.
+      */
+    void buildBinaryNetwork( CMaxFlow &maxFlow, TBinaryEnergy &energy )
+    {
+        vector<double> &nodeEnergies = energy.nodeEnergies;
+        size_t N_nodes = nodeEnergies.size()/2;
+
+        maxFlow.reset( N_nodes );
+
+        for ( size_t edgeIndex = 0; edgeIndex < energy.edgeNode1.size(); edgeIndex++ )
+        {
+            size_t node1 = energy.edgeNode1[edgeIndex];
+            size_t node2 = energy.edgeNode2[edgeIndex];
+
+            double unary1, unary2;
+            double capacity = decomposeSubmodular( &energy.edgeEnergies[4*edgeIndex], unary1, unary2 );
+
+            nodeEnergies[2*node1+1] += unary1;
+            nodeEnergies[2*node2+1] += unary2;
+
+            maxFlow.addEdge( node1, node2, capacity, 0 );
+        }
+
+        for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        {
+            // The source->node capacity is the energy of the label 1, and
+            // the node->sink one the energy of the label 0
+            double minEnergy = std::min( nodeEnergies[2*nodeIndex], nodeEnergies[2*nodeIndex+1] );
+
+            maxFlow.addTerminalWeights( nodeIndex,
+                                        nodeEnergies[2*nodeIndex+1] - minEnergy,
+                                        nodeEnergies[2*nodeIndex] - minEnergy );
+        }
+    }
+
+    /** Labels of the nodes of a binary network after computing its max-flow. */
+    void getBinaryLabels( const CMaxFlow &maxFlow, vector<size_t> &labels )
+    {
+        size_t N_nodes = maxFlow.getNumberOfNodes();
+
+        labels.resize( N_nodes );
+
+        for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+            labels[nodeIndex] = maxFlow.isSinkSegment( nodeIndex ) ? 1 : 0;
+    }
+
+    /** Solves binary energies. Submodular ones are solved with the max-flow
+      * solver chosen through particularS["maxflow"]: "BK" (Boykov-Kolmogorov,
+      * by default) or "PushRelabel" (parallel). The rest are solved with
+      * QPBO, the nodes left unlabeled keeping their current labels, so the
+      * energy does not increase. More nodes are labeled by probing them if
+      * particularB["probeQPBO"] is set, and all of them if
+      * particularB["improveQPBO"] is set. The labels found by probing are
+      * not persistent for any labeling of the rest of nodes, so the labeling
+      * they produce is only taken if its energy is not higher than the one
+      * of plain QPBO. The solvers are kept between calls, so their memory is
+      * reused.
+      */
+    class CBinarySolver
+    {
+        CBKMaxFlow          m_BKMaxFlow;
+        CPushRelabelMaxFlow m_pushRelabelMaxFlow;
+        CMaxFlow           *m_maxFlow;
+        CQPBO               m_QPBO;
+        bool                m_probe;
+        bool                m_improve;
+        vector<size_t>      m_extendedLabels; //!< Labels after probing or improving.
+
+        /** Labels given by QPBO, currentLabels for the unlabeled nodes. */
+        void getQPBOLabels( const vector<size_t> &currentLabels,
+                            vector<size_t> &labels ) const
+        {
+            size_t N_nodes = currentLabels.size();
+
+            labels.resize( N_nodes );
+
+            for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+            {
+                int label = m_QPBO.getLabel( nodeIndex );
+                labels[nodeIndex] = ( label >= 0 ) ? label : currentLabels[nodeIndex];
+            }
+        }
+
+    public:
+
+        CBinarySolver( TInferenceOptions &options ) :
+            m_pushRelabelMaxFlow( getNumberOfThreads( options ) ),
+            m_probe( options.particularB["probeQPBO"] ),
+            m_improve( options.particularB["improveQPBO"] )
         {
-            if ( ( cut[nodesMap[ID]] == 1 ) && ( cut[nodesMap[ID]+N_nodes] == 0) )
-                results[ID] = 0;
+            if ( options.particularS["maxflow"] == "PushRelabel" )
+                m_maxFlow = &m_pushRelabelMaxFlow;
             else
-                results[ID] = 1;
+                m_maxFlow = &m_BKMaxFlow;
+        }
+
+        /** currentLabels are the labels (0 or 1) kept by the nodes not
+          * labeled by QPBO.
+          */
+        void solve( TBinaryEnergy &energy,
+                    const vector<size_t> &currentLabels,
+                    vector<size_t> &labels )
+        {
+            if ( energy.submodular )
+            {
+                buildBinaryNetwork( *m_maxFlow, energy );
+                m_maxFlow->maxFlow();
+                getBinaryLabels( *m_maxFlow, labels );
+                return;
+            }
+
+            size_t N_nodes = energy.nodeEnergies.size()/2;
+
+            m_QPBO.reset( N_nodes );
+
+            for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+                m_QPBO.addNodeEnergies( nodeIndex,
+                                        energy.nodeEnergies[2*nodeIndex],
+                                        energy.nodeEnergies[2*nodeIndex+1] );
+
+            for ( size_t edgeIndex = 0; edgeIndex < energy.edgeNode1.size(); edgeIndex++ )
+            {
+                const double *energies = &energy.edgeEnergies[4*edgeIndex];
+
+                m_QPBO.addEdgeEnergies( energy.edgeNode1[edgeIndex],
+                                        energy.edgeNode2[edgeIndex],
+                                        energies[0], energies[1],
+                                        energies[2], energies[3] );
+            }
+
+            // The partial labeling of QPBO is persistent, so completing it
+            // with the current labels does not increase their energy
+
+            m_QPBO.solve();
+
+            getQPBOLabels( currentLabels, labels );
+
+            if ( !m_probe && !m_improve )
+                return;
+
+            if ( m_probe )
+                m_QPBO.probe();
+
+            if ( m_improve )
+                m_QPBO.improve( currentLabels );
+
+            getQPBOLabels( currentLabels, m_extendedLabels );
+
+            if ( energy.getEnergy( m_extendedLabels ) <= energy.getEnergy( labels ) )
+                labels.swap( m_extendedLabels );
+        }
+    };
+}
+
+void CGraphCutsInferenceMAP::infer( CGraph &graph,
+                         std::map<size_t,size_t> &results, bool debug )
+{
+    TIMER_START
+
+    // Decoding method overview:
+    // 1. Check binary states and sub-modularity conditions.
+    // 2. Build the flow network from the energies.
+    // 3. Solve the Max-Flow Min-Cut problem.
+
+    //
+    // 1. Check binary states and sub-modularity conditions.
+    //
+
+    if ( !checkMaxFlowMethod( m_options.particularS["maxflow"] ) )
+        return;
+
+    // Energies are minus the log potentials
+
+    TCompactGraph cg;
+    getCompactGraph( graph, m_options, cg );
+    getLogPotentials( cg );
+
+    size_t N_nodes = cg.N_nodes;
+
+    TBinaryEnergy energy;
+    energy.clear( N_nodes );
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+    {
+        if ( cg.N_classes[nodeIndex] != 2 )
+        {
+            cout << "[ERROR] The number of classes of a node type used in the graph is not 2." << endl;
+            return;
+        }
+
+        energy.nodeEnergies[2*nodeIndex]   = -cg.logNodePotentials[nodeIndex](0);
+        energy.nodeEnergies[2*nodeIndex+1] = -cg.logNodePotentials[nodeIndex](1);
+    }
+
+    for ( size_t edgeIndex = 0; edgeIndex < cg.N_edges; edgeIndex++ )
+    {
+        const MatrixXd &logPotentials = cg.logEdgePotentials[edgeIndex];
+
+        if ( ( logPotentials.rows() != 2 ) || ( logPotentials.cols() != 2 ) )
+        {
+            cout << "[ERROR] The number of classes of a node into an edge is not two." << endl;
+            return;
+        }
+
+        size_t node1 = cg.edgeNode1[edgeIndex];
+        size_t node2 = cg.edgeNode2[edgeIndex];
+
+        if ( node1 == node2 )
+        {
+            energy.nodeEnergies[2*node1]   -= logPotentials(0,0);
+            energy.nodeEnergies[2*node1+1] -= logPotentials(1,1);
+            continue;
         }
+
+        // Non submodular energies are kept, and solved with QPBO
+        energy.addEdge( node1, node2,
+                        -logPotentials(0,0), -logPotentials(0,1),
+                        -logPotentials(1,0), -logPotentials(1,1), "QPBO" );
     }
 
+    //
+    // 2. Build the flow network from the energies, and 3. solve the Max-Flow
+    //    Min-Cut problem.
+    //
+
+    // Nodes not labeled by QPBO take the label with the lower node energy
+
+    vector<size_t> currentLabels( N_nodes );
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        currentLabels[nodeIndex] = ( energy.nodeEnergies[2*nodeIndex+1] <
+                                     energy.nodeEnergies[2*nodeIndex] ) ? 1 : 0;
+
+    CBinarySolver  solver( m_options );
+    vector<size_t> labels;
+
+    solver.solve( energy, currentLabels, labels );
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        results[ cg.nodeIDs[nodeIndex] ] = labels[nodeIndex];
+
     TIMER_END(m_executionTime)
 }
 
 /*------------------------------------------------------------------------------
 
-                            CDecodeAlphaExpansion
+                                CDecodeIshikawa
+
+------------------------------------------------------------------------------*/
+
+void CIshikawaInferenceMAP::infer( CGraph &graph,
+                                   std::map<size_t,size_t> &results, bool debug )
+{
+    TIMER_START
+
+    // Decoding method overview:
+    // 1. Decompose the energies of the edges, checking that they are convex
+    //    (the Monge property) on the order of the classes.
+    // 2. Build the layered network: a chain of nodes for each node of the
+    //    graph, the node k being in the sink segment if the class is >= k.
+    // 3. Solve the Max-Flow Min-Cut problem, the class of each node being the
+    //    number of nodes of its chain in the sink segment.
+
+    results.clear();
+
+    if ( graph.isEmpty() )
+        return;
+
+    string &maxFlowMethod = m_options.particularS["maxflow"];
+
+    if ( !checkMaxFlowMethod( maxFlowMethod ) )
+        return;
+
+    // Energies are minus the log potentials
+
+    TCompactGraph cg;
+    getCompactGraph( graph, m_options, cg );
+    getLogPotentials( cg );
+
+    const vector<CEdgePtr> &edges = graph.getEdges();
+    size_t N_nodes = cg.N_nodes;
+
+    // Nodes of the chain of the node i are [chainOffsets[i],chainOffsets[i+1]),
+    // for the classes from 1 to N_classes-1
+
+    vector<size_t> chainOffsets( N_nodes+1, 0 );
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        chainOffsets[nodeIndex+1] = chainOffsets[nodeIndex] + cg.N_classes[nodeIndex] - 1;
+
+    size_t N_chainNodes = chainOffsets[N_nodes];
+
+    //
+    // 1. Decompose the energies. The energy of a node is a sum of terms
+    //    d_k*x_k, where x_k = [class >= k], and the one of an edge is
+    //    E(c1,0) + E(0,c2) - E(0,0) + sum_{k<=c1,l<=c2} D_kl, where
+    //    D_kl = E(k,l) - E(k-1,l) - E(k,l-1) + E(k-1,l-1) <= 0 if convex.
+    //    Each D_kl*x1_k*x2_l turns into D_kl*x1_k + |D_kl|*x1_k*(1-x2_l), an
+    //    arc from the node l of the second chain to the node k of the first
+    //    one.
+    //
+
+    vector<double> linear( N_chainNodes, 0 );
+    vector<size_t> arcTails;
+    vector<size_t> arcHeads;
+    vector<double> arcCapacities;
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+    {
+        const VectorXd &logPotentials = cg.logNodePotentials[nodeIndex];
+
+        for ( size_t k = 1; k < cg.N_classes[nodeIndex]; k++ )
+            linear[ chainOffsets[nodeIndex] + k-1 ] += logPotentials(k-1) - logPotentials(k);
+    }
+
+    for ( size_t edgeIndex = 0; edgeIndex < cg.N_edges; edgeIndex++ )
+    {
+        size_t node1 = cg.edgeNode1[edgeIndex];
+        size_t node2 = cg.edgeNode2[edgeIndex];
+        const MatrixXd &logPotentials = cg.logEdgePotentials[edgeIndex];
+
+        if ( node1 == node2 )
+        {
+            for ( size_t k = 1; k < cg.N_classes[node1]; k++ )
+                linear[ chainOffsets[node1] + k-1 ] += logPotentials(k-1,k-1) - logPotentials(k,k);
+
+            continue;
+        }
+
+        bool declaredConvex = edges[edgeIndex]->getType()->isConvex();
+
+        for ( size_t k = 1; k < cg.N_classes[node1]; k++ )
+            linear[ chainOffsets[node1] + k-1 ] += logPotentials(k-1,0) - logPotentials(k,0);
+
+        for ( size_t l = 1; l < cg.N_classes[node2]; l++ )
+            linear[ chainOffsets[node2] + l-1 ] += logPotentials(0,l-1) - logPotentials(0,l);
+
+        for ( size_t k = 1; k < cg.N_classes[node1]; k++ )
+            for ( size_t l = 1; l < cg.N_classes[node2]; l++ )
+            {
+                double D = logPotentials(k-1,l) + logPotentials(k,l-1)
+                         - logPotentials(k,l) - logPotentials(k-1,l-1);
+
+                if ( D > exp(-15) )
+                {
+                    // Edges of types declared convex are truncated, as
+                    // their violations come from the learned weights
+                    if ( declaredConvex )
+                        continue;
+
+                    cout << "[ERROR] The energies of an edge are not convex on the order of the classes." << endl;
+                    return;
+                }
+
+                if ( D < 0 )
+                {
+                    linear[ chainOffsets[node1] + k-1 ] += D;
+
+                    arcTails.push_back( chainOffsets[node2] + l-1 );
+                    arcHeads.push_back( chainOffsets[node1] + k-1 );
+                    arcCapacities.push_back( -D );
+                }
+            }
+    }
+
+    //
+    // 2. Build the layered network. The arcs of the chains have a capacity
+    //    higher than any cut without them, so the classes are consistent.
+    //
+
+    double infinity = 1;
+
+    for ( size_t i = 0; i < N_chainNodes; i++ )
+        infinity += std::fabs( linear[i] );
+
+    for ( size_t i = 0; i < arcCapacities.size(); i++ )
+        infinity += arcCapacities[i];
+
+    CBKMaxFlow          BKMaxFlow;
+    CPushRelabelMaxFlow pushRelabelMaxFlow( getNumberOfThreads( m_options ) );
+    CMaxFlow           &maxFlow = ( maxFlowMethod == "PushRelabel" ) ?
+                                  static_cast<CMaxFlow&>( pushRelabelMaxFlow ) :
+                                  static_cast<CMaxFlow&>( BKMaxFlow );
+
+    maxFlow.reset( N_chainNodes );
+
+    for ( size_t i = 0; i < N_chainNodes; i++ )
+    {
+        // A positive d_k is paid if the node is in the sink segment
+        if ( linear[i] > 0 )
+            maxFlow.addTerminalWeights( i, linear[i], 0 );
+        else
+            maxFlow.addTerminalWeights( i, 0, -linear[i] );
+    }
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        for ( size_t i = chainOffsets[nodeIndex]; i+1 < chainOffsets[nodeIndex+1]; i++ )
+            maxFlow.addEdge( i, i+1, infinity, 0 );
+
+    for ( size_t i = 0; i < arcCapacities.size(); i++ )
+        maxFlow.addEdge( arcTails[i], arcHeads[i], arcCapacities[i], 0 );
+
+    //
+    // 3. Solve the Max-Flow Min-Cut problem
+    //
+
+    DEBUG("Computing the max-flow of the layered network...");
+
+    maxFlow.maxFlow();
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+    {
+        size_t state = 0;
+
+        for ( size_t i = chainOffsets[nodeIndex]; i < chainOffsets[nodeIndex+1]; i++ )
+            if ( maxFlow.isSinkSegment( i ) )
+                state++;
+
+        results[ cg.nodeIDs[nodeIndex] ] = state;
+    }
+
+    TIMER_END(m_executionTime)
+}
+
+/*------------------------------------------------------------------------------
+
+                            CDecodeAlphaExpansion
+
+------------------------------------------------------------------------------*/
+
+namespace
+{
+    /** Flow network of the expansion moves of a class in the nodes of a
+      * type, kept along the iterations. Its capacities are edited with the
+      * changes in the energy of the move, so the flow and the search trees
+      * of the previous expansion of the class are reused (dynamic graph
+      * cuts). The edges of the move must be always the same, and submodular.
+      */
+    class CExpansionNetwork
+    {
+        CBKMaxFlow      m_maxFlow;
+        bool            m_built;
+        vector<double>  m_sourceWeights;
+        vector<double>  m_sinkWeights;
+        vector<double>  m_capacities;
+
+    public:
+
+        CExpansionNetwork() : m_built( false )
+        {}
+
+        void solve( TBinaryEnergy &energy, vector<size_t> &labels )
+        {
+            vector<double> &nodeEnergies = energy.nodeEnergies;
+            size_t N_nodes = nodeEnergies.size()/2;
+            size_t N_edges = energy.edgeNode1.size();
+
+            if ( !m_built )
+            {
+                m_maxFlow.reset( N_nodes );
+
+                for ( size_t edgeIndex = 0; edgeIndex < N_edges; edgeIndex++ )
+                    m_maxFlow.addEdge( energy.edgeNode1[edgeIndex], energy.edgeNode2[edgeIndex], 0, 0 );
+
+                m_sourceWeights.assign( N_nodes, 0 );
+                m_sinkWeights.assign( N_nodes, 0 );
+                m_capacities.assign( N_edges, 0 );
+                m_built = true;
+            }
+
+            // Only the differences with the previous capacities are added
+
+            for ( size_t edgeIndex = 0; edgeIndex < N_edges; edgeIndex++ )
+            {
+                double unary1, unary2;
+                double capacity = decomposeSubmodular( &energy.edgeEnergies[4*edgeIndex], unary1, unary2 );
+
+                nodeEnergies[ 2*energy.edgeNode1[edgeIndex]+1 ] += unary1;
+                nodeEnergies[ 2*energy.edgeNode2[edgeIndex]+1 ] += unary2;
+
+                if ( capacity != m_capacities[edgeIndex] )
+                {
+                    m_maxFlow.addEdgeCapacities( edgeIndex, capacity - m_capacities[edgeIndex], 0 );
+                    m_capacities[edgeIndex] = capacity;
+                }
+            }
+
+            for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+            {
+                double minEnergy = std::min( nodeEnergies[2*nodeIndex], nodeEnergies[2*nodeIndex+1] );
+                double source    = nodeEnergies[2*nodeIndex+1] - minEnergy;
+                double sink      = nodeEnergies[2*nodeIndex] - minEnergy;
+
+                if ( ( source != m_sourceWeights[nodeIndex] ) ||
+                     ( sink != m_sinkWeights[nodeIndex] ) )
+                {
+                    m_maxFlow.addTerminalWeights( nodeIndex,
+                                                  source - m_sourceWeights[nodeIndex],
+                                                  sink - m_sinkWeights[nodeIndex] );
+                    m_sourceWeights[nodeIndex] = source;
+                    m_sinkWeights[nodeIndex]   = sink;
+                }
+            }
+
+            m_maxFlow.maxFlow();
+            getBinaryLabels( m_maxFlow, labels );
+        }
+    };
+}
+
+void CAlphaExpansionInferenceMAP::infer( CGraph &graph,
+                                    std::map<size_t,size_t> &results, bool debug )
+{
+    TIMER_START
+
+    //
+    // Method workflow:
+    // 1. Compute the initial assignation to variables (the classes with the
+    //    higher node potential).
+    // 2. Do Aplha-expansions until convergence or a given number of iterations
+    //    is reached.
+    //      2.1 For each nodeType, and each of its classes (alpha), do an
+    //          alpha-expansion:
+    //          2.1.1 Compute the energies of the binary move, where the label
+    //                0 means moving to alpha and the label 1 keeping the
+    //                current class. Nodes of other types keep their classes,
+    //                so their edges turn into node energies.
+    //          2.1.2 Update the flow network of the move with the new
+    //                energies (or build it again if the move is not
+    //                submodular, or dynamic cuts are not used), and compute
+    //                its max-flow.
+    //          2.1.3 Move to alpha the nodes in the source segment.
+    //      2.2 Check convergency.
+    //
+
+    DEBUG("Decoding Alpha expansion");
+
+    if ( graph.isEmpty() )
+        return;
+
+    // Initialize the results vector
+    results.clear();
+
+    // Energies are minus the log potentials
+
+    TCompactGraph cg;
+    getCompactGraph( graph, m_options, cg );
+    getLogPotentials( cg );
+
+    const std::vector<CNodePtr> &nodes  = graph.getNodes();
+    size_t N_nodes                      = cg.N_nodes;
+
+    string &submodularApproach = m_options.particularS["submodularApproach"];
+    string &maxFlowMethod      = m_options.particularS["maxflow"];
+
+    if ( !checkMaxFlowMethod( maxFlowMethod ) )
+        return;
+
+    // Only the BK max-flow reuses the flow of previous moves. This can be
+    // disabled through particularB["staticGraphCuts"]
+    bool dynamic = ( maxFlowMethod != "PushRelabel" ) &&
+                   !m_options.particularB["staticGraphCuts"];
+
+    //
+    // 1. Initial assignation to vbles
+    //
+
+    std::map<size_t,size_t> assignation;
+
+    // Initial assignation
+
+    if ( m_options.initialAssignation == "MaxNodePotential" )
+        getMostProbableNodeAssignation( graph, assignation, m_options);
+
+    else if ( m_options.initialAssignation == "Random" )
+        getRandomAssignation( graph, assignation, m_options );
+
+    else
+        cout << "[ERROR] Undefined method for performing the initial assignation." << endl;
+
+    vector<size_t> labels( N_nodes );
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        labels[nodeIndex] = assignation[ cg.nodeIDs[nodeIndex] ];
+
+    DEBUG("Computing total potential...");
+
+    // Get the likelihood of this assignation. Useful for convergence checking
+    double totalPotential = graph.getUnnormalizedLogLikelihood( assignation, debug );
+
+    //
+    // Nodes of each type, their position among them, the edges between two
+    // nodes of each type and the rest of edges reaching them
+    //
+
+    vector<CNodeTypePtr> &nodeTypes = graph.getNodeTypes();
+    size_t N_types = nodeTypes.size();
+
+    map<size_t,size_t> typeIndices;
+
+    for ( size_t type = 0; type < N_types; type++ )
+        typeIndices[ nodeTypes[type]->getID() ] = type;
+
+    vector<size_t>          nodeType( N_nodes );
+    vector<size_t>          localIndex( N_nodes );
+    vector<vector<size_t> > typeNodes( N_types );
+    vector<vector<size_t> > typeEdges( N_types );
+    vector<vector<size_t> > typeOtherEdges( N_types );
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+    {
+        size_t type = typeIndices[ nodes[nodeIndex]->getType()->getID() ];
+
+        nodeType[nodeIndex]   = type;
+        localIndex[nodeIndex] = typeNodes[type].size();
+        typeNodes[type].push_back( nodeIndex );
+    }
+
+    for ( size_t edgeIndex = 0; edgeIndex < cg.N_edges; edgeIndex++ )
+    {
+        size_t node1 = cg.edgeNode1[edgeIndex];
+        size_t node2 = cg.edgeNode2[edgeIndex];
+        size_t type1 = nodeType[node1];
+        size_t type2 = nodeType[node2];
+
+        if ( ( type1 == type2 ) && ( node1 != node2 ) )
+            typeEdges[type1].push_back( edgeIndex );
+        else
+        {
+            typeOtherEdges[type1].push_back( edgeIndex );
+
+            if ( type2 != type1 )
+                typeOtherEdges[type2].push_back( edgeIndex );
+        }
+    }
+
+    // Flow networks of the moves, one for each class of each node type
+
+    vector<size_t> networkOffsets( N_types + 1, 0 );
+
+    for ( size_t type = 0; type < N_types; type++ )
+        networkOffsets[type+1] = networkOffsets[type] + nodeTypes[type]->getNumberOfClasses();
+
+    vector<CExpansionNetwork> networks( dynamic ? networkOffsets.back() : 0 );
+
+    //
+    // 2. Do Alpha-expansions until convergence or a given number of iterations is reached.
+    //
+
+    CBinarySolver  solver( m_options );
+    TBinaryEnergy  energy;
+    vector<size_t> moveLabels;
+    vector<size_t> keepLabels;
+    vector<size_t> labels_old;
+
+    bool convergence = false;
+    size_t iteration = 0;
+
+    while ( !convergence && ( iteration < m_options.maxIterations ) )
+    {
+        DEBUGD("Doing iteration... ",iteration);
+
+        // Store the previous assignation for convergence checking
+        labels_old = labels;
+
+        for ( size_t type = 0; type < N_types; type++ )
+        {
+            const vector<size_t> &typeNodesList = typeNodes[type];
+            size_t N_typeNodes = typeNodesList.size();
+            size_t N_classes   = nodeTypes[type]->getNumberOfClasses();
+
+            for ( size_t state = 0; state < N_classes; state++ )
+            {
+                if ( debug )
+                    cout << "Expanding state " << state << " in nodes of type " << nodeTypes[type]->getID()
+                         << " with label " << nodeTypes[type]->getLabel() << endl;
+
+                // Check if some node can be moved
+
+                bool movable = false;
+
+                for ( size_t i = 0; ( i < N_typeNodes ) && !movable; i++ )
+                    movable = ( labels[ typeNodesList[i] ] != state );
+
+                if ( !movable )
+                    continue;
+
+                //
+                // 2.1.1 Compute the energies of the binary move
+                //
+
+                energy.clear( N_typeNodes );
+
+                for ( size_t i = 0; i < N_typeNodes; i++ )
+                {
+                    size_t nodeIndex = typeNodesList[i];
+
+                    energy.nodeEnergies[2*i]   = -cg.logNodePotentials[nodeIndex]( state );
+                    energy.nodeEnergies[2*i+1] = -cg.logNodePotentials[nodeIndex]( labels[nodeIndex] );
+                }
+
+                for ( size_t i = 0; i < typeOtherEdges[type].size(); i++ )
+                {
+                    size_t edgeIndex = typeOtherEdges[type][i];
+                    size_t node1     = cg.edgeNode1[edgeIndex];
+                    size_t node2     = cg.edgeNode2[edgeIndex];
+                    const MatrixXd &logPotentials = cg.logEdgePotentials[edgeIndex];
+
+                    if ( node1 == node2 )
+                    {
+                        energy.nodeEnergies[ 2*localIndex[node1] ]   -= logPotentials( state, state );
+                        energy.nodeEnergies[ 2*localIndex[node1]+1 ] -= logPotentials( labels[node1], labels[node1] );
+                    }
+                    else if ( nodeType[node1] == type )
+                    {
+                        energy.nodeEnergies[ 2*localIndex[node1] ]   -= logPotentials( state, labels[node2] );
+                        energy.nodeEnergies[ 2*localIndex[node1]+1 ] -= logPotentials( labels[node1], labels[node2] );
+                    }
+                    else
+                    {
+                        energy.nodeEnergies[ 2*localIndex[node2] ]   -= logPotentials( labels[node1], state );
+                        energy.nodeEnergies[ 2*localIndex[node2]+1 ] -= logPotentials( labels[node1], labels[node2] );
+                    }
+                }
+
+                for ( size_t i = 0; i < typeEdges[type].size(); i++ )
+                {
+                    size_t edgeIndex = typeEdges[type][i];
+                    size_t node1     = cg.edgeNode1[edgeIndex];
+                    size_t node2     = cg.edgeNode2[edgeIndex];
+                    const MatrixXd &logPotentials = cg.logEdgePotentials[edgeIndex];
+
+                    energy.addEdge( localIndex[node1], localIndex[node2],
+                                    -logPotentials( state, state ),
+                                    -logPotentials( state, labels[node2] ),
+                                    -logPotentials( labels[node1], state ),
+                                    -logPotentials( labels[node1], labels[node2] ),
+                                    submodularApproach );
+                }
+
+                //
+                // 2.1.2 Solve the move
+                //
+
+                DEBUG("Executing graph cuts...");
+
+                if ( dynamic && energy.submodular )
+                    networks[ networkOffsets[type] + state ].solve( energy, moveLabels );
+                else
+                {
+                    // Nodes not labeled by QPBO keep their classes
+                    keepLabels.assign( N_typeNodes, 1 );
+                    solver.solve( energy, keepLabels, moveLabels );
+                }
+
+                //
+                // 2.1.3 Do the moves
+                //
+
+                for ( size_t i = 0; i < N_typeNodes; i++ )
+                    if ( moveLabels[i] == 0 )
+                        labels[ typeNodesList[i] ] = state;
+            }
+        }
+
+        DEBUG("Checking convergence...");
+
+        //
+        // 2.2 Check termination (convergence) conditions
+        //
+
+        if ( labels == labels_old ) // Same assignation
+        {
+            //cout << "Convergence achieved: the same assignation" << endl;
+            convergence = true;
+            continue;
+        }
+
+        for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+            assignation[ cg.nodeIDs[nodeIndex] ] = labels[nodeIndex];
+
+        double newTotalPotential = graph.getUnnormalizedLogLikelihood( assignation );
+
+        if ( newTotalPotential == totalPotential ) // Same likelihood
+        {
+            //cout << "Convergence achieved: the same likelihood" << endl;
+            convergence = true;
+            continue;
+        }
+        else
+            totalPotential = newTotalPotential;
+
+        iteration++;
+    }
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        assignation[ cg.nodeIDs[nodeIndex] ] = labels[nodeIndex];
+
+    results = assignation;
+
+    TIMER_END(m_executionTime)
+}
+
+
+/*------------------------------------------------------------------------------
+
+                        CDecodeParallelAlphaExpansion
+
+------------------------------------------------------------------------------*/
+
+namespace
+{
+    const size_t NOT_IN_MOVE = std::numeric_limits<size_t>::max();
+
+    /** Buffers of the moves done by a thread, so no memory is allocated
+      * after the first moves. localIndex is NOT_IN_MOVE for the nodes not
+      * in the current move.
+      */
+    struct TMoveBuffers
+    {
+        vector<size_t>  moveNodes;
+        vector<size_t>  localIndex;
+        vector<size_t>  proposal;
+        vector<size_t>  keepLabels;
+        vector<size_t>  moveLabels;
+        TBinaryEnergy   energy;
+
+        TMoveBuffers( size_t N_nodes ) : localIndex( N_nodes, NOT_IN_MOVE ),
+                                         proposal( N_nodes, 0 )
+        {}
+    };
+
+    /** Fusion move between the current labels and the proposed ones
+      * (buffers.proposal) in the candidate nodes: each node having a
+      * different proposed class can take it (label 0) or keep its class
+      * (label 1). The rest of nodes keep their classes, so their edges turn
+      * into node energies.
+      */
+    void fuse( const TCompactGraph &cg,
+               const vector<size_t> &candidates,
+               const string &submodularApproach,
+               CBinarySolver &solver,
+               TMoveBuffers &buffers,
+               vector<size_t> &labels )
+    {
+        vector<size_t> &moveNodes  = buffers.moveNodes;
+        vector<size_t> &localIndex = buffers.localIndex;
+        vector<size_t> &proposal   = buffers.proposal;
+        TBinaryEnergy  &energy     = buffers.energy;
+
+        moveNodes.clear();
+
+        for ( size_t i = 0; i < candidates.size(); i++ )
+        {
+            size_t nodeIndex = candidates[i];
+
+            if ( proposal[nodeIndex] != labels[nodeIndex] )
+            {
+                localIndex[nodeIndex] = moveNodes.size();
+                moveNodes.push_back( nodeIndex );
+            }
+        }
+
+        if ( moveNodes.empty() )
+            return;
+
+        size_t N_moveNodes = moveNodes.size();
+
+        energy.clear( N_moveNodes );
+
+        for ( size_t i = 0; i < N_moveNodes; i++ )
+        {
+            size_t nodeIndex = moveNodes[i];
+            size_t proposed  = proposal[nodeIndex];
+            size_t current   = labels[nodeIndex];
+            double *nodeEnergies = &energy.nodeEnergies[2*i];
+
+            nodeEnergies[0] = -cg.logNodePotentials[nodeIndex]( proposed );
+            nodeEnergies[1] = -cg.logNodePotentials[nodeIndex]( current );
+
+            for ( size_t p = cg.adjOffsets[nodeIndex]; p < cg.adjOffsets[nodeIndex+1]; p++ )
+            {
+                size_t neighbor = cg.adjNeighbor[p];
+                bool   first    = cg.adjFirst[p];
+                const MatrixXd &logPotentials = cg.logEdgePotentials[ cg.adjEdge[p] ];
+
+                if ( neighbor == nodeIndex )
+                {
+                    // Self loops appear twice
+                    if ( first )
+                    {
+                        nodeEnergies[0] -= logPotentials( proposed, proposed );
+                        nodeEnergies[1] -= logPotentials( current, current );
+                    }
+                }
+                else if ( localIndex[neighbor] != NOT_IN_MOVE )
+                {
+                    // Edges in the move are added from their first node
+                    if ( first )
+                    {
+                        size_t neighborProposed = proposal[neighbor];
+                        size_t neighborCurrent  = labels[neighbor];
+
+                        energy.addEdge( i, localIndex[neighbor],
+                                        -logPotentials( proposed, neighborProposed ),
+                                        -logPotentials( proposed, neighborCurrent ),
+                                        -logPotentials( current, neighborProposed ),
+                                        -logPotentials( current, neighborCurrent ),
+                                        submodularApproach );
+                    }
+                }
+                else
+                {
+                    size_t neighborLabel = labels[neighbor];
+
+                    if ( first )
+                    {
+                        nodeEnergies[0] -= logPotentials( proposed, neighborLabel );
+                        nodeEnergies[1] -= logPotentials( current, neighborLabel );
+                    }
+                    else
+                    {
+                        nodeEnergies[0] -= logPotentials( neighborLabel, proposed );
+                        nodeEnergies[1] -= logPotentials( neighborLabel, current );
+                    }
+                }
+            }
+        }
+
+        // Nodes not labeled by QPBO keep their classes
+        buffers.keepLabels.assign( N_moveNodes, 1 );
+        solver.solve( energy, buffers.keepLabels, buffers.moveLabels );
+
+        for ( size_t i = 0; i < N_moveNodes; i++ )
+        {
+            if ( buffers.moveLabels[i] == 0 )
+                labels[ moveNodes[i] ] = proposal[ moveNodes[i] ];
+
+            localIndex[ moveNodes[i] ] = NOT_IN_MOVE;
+        }
+    }
+
+    /** Expansion move of a class in the candidate nodes. */
+    void expand( const TCompactGraph &cg,
+                 const vector<size_t> &candidates,
+                 size_t state,
+                 const string &submodularApproach,
+                 CBinarySolver &solver,
+                 TMoveBuffers &buffers,
+                 vector<size_t> &labels )
+    {
+        for ( size_t i = 0; i < candidates.size(); i++ )
+            buffers.proposal[ candidates[i] ] = state;
+
+        fuse( cg, candidates, submodularApproach, solver, buffers, labels );
+    }
+
+    /** Splits the nodes into regions of consecutive nodes in breadth first
+      * order, so they are connected when possible.
+      */
+    void getRegions( const TCompactGraph &cg, size_t N_regions, vector<size_t> &region )
+    {
+        vector<size_t> order;
+        vector<bool>   visited( cg.N_nodes, false );
+
+        order.reserve( cg.N_nodes );
+
+        for ( size_t root = 0; root < cg.N_nodes; root++ )
+        {
+            if ( visited[root] )
+                continue;
+
+            visited[root] = true;
+            order.push_back( root );
+
+            for ( size_t i = order.size()-1; i < order.size(); i++ )
+            {
+                size_t nodeIndex = order[i];
+
+                for ( size_t p = cg.adjOffsets[nodeIndex]; p < cg.adjOffsets[nodeIndex+1]; p++ )
+                {
+                    size_t neighbor = cg.adjNeighbor[p];
+
+                    if ( !visited[neighbor] )
+                    {
+                        visited[neighbor] = true;
+                        order.push_back( neighbor );
+                    }
+                }
+            }
+        }
+
+        region.resize( cg.N_nodes );
 
-------------------------------------------------------------------------------*/
+        for ( size_t i = 0; i < cg.N_nodes; i++ )
+            region[ order[i] ] = i*N_regions/cg.N_nodes;
+    }
+}
 
-void CAlphaExpansionInferenceMAP::infer( CGraph &graph,
+void CParallelAlphaExpansionInferenceMAP::infer( CGraph &graph,
                                     std::map<size_t,size_t> &results, bool debug )
 {
     TIMER_START
 
     //
     // Method workflow:
-    // 1. Compute the initial assignation to variables (the classes with the
-    //    higher node potential).
-    // 2. Do Aplha-expansions until convergence or a given number of iterations
-    //    is reached.
-    //      2.1 For each nodeType, do alpha-expansions
-    //          2.1.1 Get a bound graph where nodes with the current state (alpha)
-    //                are bound to @state.
-    //          2.1.2 Binarize the bound graph, so only two states are possible:
-    //                alpha, and the previous one from the node.
-    //          2.1.3 Compute graph cuts decoding on the resultant graph.
-    //          2.1.4 For each node assigned to @state in the decoding result,
-    //                do an alpha move.
-    //      2.2 Check convergency.
-    //    
+    // 1. Compute the initial assignation to variables.
+    // 2. Do parallel alpha-expansions until convergence or a given number of
+    //    iterations is reached.
+    //      2.1 Shuffle the order of the expansions (each class of each node
+    //          type).
+    //      2.2 Labels mode: expand each class from the current labels in
+    //          parallel, and fuse the proposals (the nodes moved by each
+    //          expansion) into the labels in the shuffled order.
+    //          Regions mode: do all the expansions in each region in
+    //          parallel, the nodes of the rest of regions keeping their
+    //          classes, and fuse the result into the labels.
+    //      2.3 Check convergency.
+    //
 
-    DEBUG("Decoding Alpha expansion");
+    DEBUG("Decoding parallel Alpha expansion");
 
     if ( graph.isEmpty() )
         return;
@@ -1003,281 +2545,245 @@ void CAlphaExpansionInferenceMAP::infer( CGraph &graph,
     // Initialize the results vector
     results.clear();
 
-    // Direct access to useful vbles
+    if ( !checkMaxFlowMethod( m_options.particularS["maxflow"] ) )
+        return;
+
+    string &parallelMode = m_options.particularS["parallelMode"];
+
+    if ( ( parallelMode != "" ) && ( parallelMode != "Labels" ) &&
+         ( parallelMode != "Regions" ) )
+    {
+        cout << "[ERROR] Unknown parallel mode: " << parallelMode << endl;
+        return;
+    }
+
+    bool regionsMode = ( parallelMode == "Regions" );
+
+    // Energies are minus the log potentials
+
+    TCompactGraph cg;
+    getCompactGraph( graph, m_options, cg );
+    getLogPotentials( cg );
 
     const std::vector<CNodePtr> &nodes  = graph.getNodes();
-    size_t N_nodes                      = nodes.size();
+    size_t N_nodes                      = cg.N_nodes;
+
+    string &submodularApproach = m_options.particularS["submodularApproach"];
+    size_t  N_threads          = getNumberOfThreads( m_options );
+
+    boost::mt19937 rng( static_cast<unsigned int>( m_options.particularD["seed"] ) );
+
+    // The solver used to fuse the proposals. It is built before the parallel
+    // region, which then only reads the options
+
+    CBinarySolver solver( m_options );
 
     //
     // 1. Initial assignation to vbles
     //
 
     std::map<size_t,size_t> assignation;
-    std::map<size_t,size_t> assignation_old;
-
-    // Initial assignation
+    vector<size_t> labels( N_nodes );
 
     if ( m_options.initialAssignation == "MaxNodePotential" )
-        getMostProbableNodeAssignation( graph, assignation, m_options);
+    {
+        getMostProbableNodeAssignation( graph, assignation, m_options );
 
+        for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+            labels[nodeIndex] = assignation[ cg.nodeIDs[nodeIndex] ];
+    }
     else if ( m_options.initialAssignation == "Random" )
-        getRandomAssignation( graph, assignation, m_options );
-
+    {
+        // Drawn from the seed, so the results can be reproduced
+        for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        {
+            boost::uniform_int<> generator( 0, cg.N_classes[nodeIndex]-1 );
+            labels[nodeIndex] = generator( rng );
+            assignation[ cg.nodeIDs[nodeIndex] ] = labels[nodeIndex];
+        }
+    }
     else
         cout << "[ERROR] Undefined method for performing the initial assignation." << endl;
 
-    DEBUG("Computing total potential...");
-
     // Get the likelihood of this assignation. Useful for convergence checking
     double totalPotential = graph.getUnnormalizedLogLikelihood( assignation, debug );
 
     //
-    // 2. Do Alpha-expansions until convergence or a given number of iterations is reached.
+    // Nodes of each type (in each region), and the expansions to do
     //
 
-    bool convergence = false;
-    size_t iteration = 0;
+    vector<CNodeTypePtr> &nodeTypes = graph.getNodeTypes();
+    size_t N_types   = nodeTypes.size();
+    size_t N_regions = 1;
 
-    while ( !convergence && ( iteration < m_options.maxIterations ) )
+    if ( regionsMode )
     {
-        DEBUGD("Doing iteration... ",iteration);
-
-        // Store the previous assignation for convergence checking
-        assignation_old = assignation;
-
-        // Iterate over the nodeTypes while moving stuff!
-        vector<CNodeTypePtr> &nodeTypes = graph.getNodeTypes();
-        vector<CNodeTypePtr>::const_iterator itNodeTypes;
-
-        for ( itNodeTypes = nodeTypes.begin(); itNodeTypes != nodeTypes.end(); itNodeTypes++)
-        {
-            size_t nodeTypeID = (*itNodeTypes)->getID();
-            size_t N_classes  = (*itNodeTypes)->getNumberOfClasses();
-
-            //
-            // 2.1 Ok, move across all the possible classes/states of current node type
-            // For each state, check the nodes which assignation is different to
-            // such a state (alpha), and check if a move to alpha increments the likelihood.
-            //
-
-            for ( size_t state = 0; state < N_classes; state++ )
-            {
-                stringstream ss;
-                ss << "Expanding state " << state << " in nodes of type " << nodeTypeID << " with label " << (*itNodeTypes)->getLabel() << endl;
-                DEBUG(ss.str());
-
-                map<size_t,size_t>  nodesToBind;
-                size_t              nodesOfThisType = 0;
-
-                DEBUG("Getting nodes to bound...");
-
-                // Iterate over all the nodes in the graph
-                for ( size_t node = 0; node < nodes.size(); node++ )
-                {
-                    // Checking if they share the type with the current NodeType
-                    if ( nodes[node]->getType()->getID() == nodeTypeID )
-                    {
-                        // And if their assigned value is the same as the current state.
-                        // This nodes will be bound to @state, so the resultant graph only
-                        // has nodes with assignation different to @state (alpha).
-                        if ( assignation[nodes[node]->getID()] == state )
-                            nodesToBind[nodes[node]->getID()] = state;
-
-                        nodesOfThisType++;
-                    }
-                }
-
-                //
-                // 2.1.1 Get a bound graph where nodes with the current state
-                //       (alpha) are bound to @state.
-                //
-
-                DEBUG("Getting bound graph...")
+        double regions = m_options.particularD["regions"];
+        N_regions = ( regions >= 1 ) ? static_cast<size_t>( regions ) : N_threads;
+    }
 
-                CGraph boundGraph;
+    vector<size_t> region( N_nodes, 0 );
 
-                if ( nodesToBind.size() == nodesOfThisType ) // No nodes can be moved
-                    continue;
+    if ( N_regions > 1 )
+        getRegions( cg, N_regions, region );
 
-                // Bind
-                graph.getBoundGraph( boundGraph, nodesToBind );
+    map<size_t,size_t> typeIndices;
 
-                //cout << "Graph:" << endl << graph << endl;
-                //cout << "Bound Graph:" << endl << boundGraph << endl;
+    for ( size_t type = 0; type < N_types; type++ )
+        typeIndices[ nodeTypes[type]->getID() ] = type;
 
-                //
-                // Prepare the problem so it can be affordable using graph cuts
-                //
+    // Nodes of the type t in the region r are in regionTypeNodes[r*N_types+t]
+    vector<vector<size_t> > regionTypeNodes( N_regions*N_types );
+    vector<size_t>          allNodes( N_nodes );
 
-                //
-                // 2.1.2 Binarize the bound graph, so only two states are possible:
-                //       alpha, and the previous one from the node.
-                //
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+    {
+        size_t type = typeIndices[ nodes[nodeIndex]->getType()->getID() ];
 
-                DEBUG("Binarizing bound graph...")
+        regionTypeNodes[ region[nodeIndex]*N_types + type ].push_back( nodeIndex );
+        allNodes[nodeIndex] = nodeIndex;
+    }
 
-                CNodeTypePtr binaryNodeTypePtr( new CNodeType(2,1) );
-                CEdgeTypePtr binaryEdgeTypePtr( new CEdgeType(1,binaryNodeTypePtr,
-                                                              binaryNodeTypePtr) );
+    vector<size_t> expansionTypes;
+    vector<size_t> expansionStates;
 
-                 DEBUG("...nodes...")
+    for ( size_t type = 0; type < N_types; type++ )
+        for ( size_t state = 0; state < nodeTypes[type]->getNumberOfClasses(); state++ )
+        {
+            expansionTypes.push_back( type );
+            expansionStates.push_back( state );
+        }
 
-                vector<CNodePtr> &boundNodes = boundGraph.getNodes();
+    size_t N_expansions = expansionTypes.size();
 
-                for  (size_t node = 0; node < boundNodes.size(); node++ )
-                {
-                    VectorXd potentials = boundNodes[node]->getPotentials();
-                    size_t nodeID     =   boundNodes[node]->getID();
-                    size_t currentNodeTypeID =   boundNodes[node]->getType()->getID();
+    //
+    // 2. Do parallel Alpha-expansions until convergence or a given number of
+    //    iterations is reached.
+    //
 
-                    double previousClassPotential = potentials( assignation[nodeID] );
-                    double alphaClassPotential;
+    TMoveBuffers            buffers( N_nodes );
+    vector<size_t>          order( N_expansions );
+    vector<vector<size_t> > movedNodes( regionsMode ? 0 : N_expansions );
+    vector<size_t>          labels_old;
 
-                    // Check if the nodeType matches
-                    if ( currentNodeTypeID == nodeTypeID )
-                        alphaClassPotential = potentials( state );
-                    else // if not, the state of the node wont change
-                        alphaClassPotential = 0;
+    bool convergence = false;
+    size_t iteration = 0;
 
-                    Vector2d binaryPotentials;
+    while ( !convergence && ( iteration < m_options.maxIterations ) )
+    {
+        DEBUGD("Doing iteration... ",iteration);
 
-                    // First, the potential for the alpha state.
-                    // Second, the potential for the previous node assignation.
-                    binaryPotentials << alphaClassPotential, previousClassPotential;
+        // Store the previous assignation for convergence checking
+        labels_old = labels;
 
-                    boundGraph.setNodeType(boundNodes[node],binaryNodeTypePtr);
-                    boundNodes[node]->setPotentials( binaryPotentials );
+        //
+        // 2.1 Shuffle the order of the expansions
+        //
 
-                }
+        for ( size_t i = 0; i < N_expansions; i++ )
+            order[i] = i;
 
-                // ... and binary edges
+        for ( size_t i = N_expansions; i > 1; i-- )
+        {
+            boost::uniform_int<> generator( 0, i-1 );
+            std::swap( order[i-1], order[ generator( rng ) ] );
+        }
 
-                 DEBUG("...and edges!")
+        //
+        // 2.2 Do the expansions in parallel, and fuse their results
+        //
 
-                vector<CEdgePtr> &boundEdges = boundGraph.getEdges();
+        #pragma omp parallel num_threads(N_threads)
+        {
+            CBinarySolver  threadSolver( m_options );
+            TMoveBuffers   threadBuffers( N_nodes );
+            vector<size_t> threadLabels( labels );
 
-                for ( size_t edge = 0; edge < boundEdges.size(); edge++ )
+            if ( regionsMode )
+            {
+                #pragma omp for schedule(dynamic)
+                for ( int r = 0; r < (int)N_regions; r++ )
                 {
-                    CNodePtr nodePtr1, nodePtr2;
-                    boundEdges[edge]->getNodes(nodePtr1,nodePtr2);
-                    MatrixXd &potentials = boundEdges[edge]->getPotentials();
-
-                    MatrixXd binaryPotentials;
-                    binaryPotentials.resize(2,2);
-
-                    if ( ( nodePtr1->getType()->getID() == nodeTypeID) &&
-                         ( nodePtr2->getType()->getID() == nodeTypeID ) )
+                    for ( size_t i = 0; i < N_expansions; i++ )
                     {
-                        binaryPotentials(0,0) = potentials( state, state );
-                        binaryPotentials(0,1) = potentials( state, assignation[nodePtr2->getID()] );
-                        binaryPotentials(1,0) = potentials( assignation[nodePtr1->getID()], state );
-                        binaryPotentials(1,1) = potentials( assignation[nodePtr1->getID()],
-                                                            assignation[nodePtr2->getID()] );
+                        size_t type = expansionTypes[ order[i] ];
 
+                        expand( cg, regionTypeNodes[ r*N_types + type ],
+                                expansionStates[ order[i] ], submodularApproach,
+                                threadSolver, threadBuffers, threadLabels );
                     }
-                    else // Different node types
-                    {
-                        if ( ( nodePtr1->getType()->getID() != nodeTypeID) &&
-                                ( nodePtr2->getType()->getID() != nodeTypeID) ) // Both types are different to the current one
-                        {
-                            binaryPotentials(0,0) = 0;
-                            binaryPotentials(0,1) = 0;
-                            binaryPotentials(1,0) = 0;
-                            binaryPotentials(1,1) = 0;
-                        }
-                        else if ( nodePtr1->getType()->getID() != nodeTypeID)
-                        {
-                            binaryPotentials(0,0) = 0;
-                            binaryPotentials(0,1) = 0;
-                            binaryPotentials(1,0) = potentials( assignation[nodePtr1->getID()], state );
-                            binaryPotentials(1,1) = potentials( assignation[nodePtr1->getID()],
-                                                                assignation[nodePtr2->getID()] );
-                        }
-                        else // ( nodePtr2->getType()->getID() != nodeTypeID)
-                        {
-                            binaryPotentials(0,0) = 0;
-                            binaryPotentials(0,1) = potentials( state, assignation[nodePtr2->getID()] );
-                            binaryPotentials(1,0) = 0;
-                            binaryPotentials(1,1) = potentials( assignation[nodePtr1->getID()],
-                                                                assignation[nodePtr2->getID()] );
-                        }
-                    }
-
-                    // Check if the user wants to truncate supermodular
-                    // energy functions to turn them into submodular ones,
-                    // or if s/he wants to ignore graphs with supermodular
-                    // energies.
-
-                    DEBUG("Cheking submodular approaches...")
-
-                    string &submodularApproach =
-                            m_options.particularS["submodularApproach"];
 
-                    if ( ( submodularApproach == "truncate") ||
-                         ( submodularApproach == "ignore" ) )
+                    // The regions write their nodes in the proposal, and
+                    // restore their labels for the next region of the thread
+                    for ( size_t type = 0; type < N_types; type++ )
                     {
-                        Matrix2d binaryEnergies = -(binaryPotentials.array().log());
-                        double aux = binaryEnergies(0,1)+binaryEnergies(1,0)-binaryEnergies(0,0);
+                        const vector<size_t> &regionNodes = regionTypeNodes[ r*N_types + type ];
 
-                        if ( binaryEnergies(1,1) > aux )
+                        for ( size_t i = 0; i < regionNodes.size(); i++ )
                         {
-                            if ( submodularApproach == "ignore" )
-                                continue;
-
-                            // Truncate
-                            binaryEnergies(1,1) = aux;
+                            buffers.proposal[ regionNodes[i] ] = threadLabels[ regionNodes[i] ];
+                            threadLabels[ regionNodes[i] ] = labels[ regionNodes[i] ];
                         }
-
-                        binaryPotentials = (-binaryEnergies).array().exp();
                     }
-
-                    boundEdges[edge]->setType( binaryEdgeTypePtr );
-                    boundEdges[edge]->setPotentials( binaryPotentials );
-
                 }
+            }
+            else
+            {
+                #pragma omp for schedule(dynamic)
+                for ( int e = 0; e < (int)N_expansions; e++ )
+                {
+                    const vector<size_t> &typeNodesList = regionTypeNodes[ expansionTypes[e] ];
 
-                //cout << "Binary Graph:" << endl << boundGraph << endl;
-
-                //
-                // Call to the decodeGraphCuts method with the bound and tunned graph
-                //
-
-                DEBUG("Executing graph cuts...");
+                    expand( cg, typeNodesList, expansionStates[e], submodularApproach,
+                            threadSolver, threadBuffers, threadLabels );
 
-                CGraphCutsInferenceMAP decodeGraphCuts;
-                map<size_t,size_t> gcResults;
+                    // Keep the moved nodes, and restore their labels
 
-                decodeGraphCuts.infer( boundGraph, gcResults );
+                    movedNodes[e].clear();
 
-                for ( map<size_t,size_t>::iterator gcResIt = gcResults.begin(); gcResIt!= gcResults.end(); gcResIt++)
-                {
-                    if ( gcResIt->second == 0 )
+                    for ( size_t i = 0; i < typeNodesList.size(); i++ )
                     {
-                        assignation[ gcResIt->first ] = state;
+                        size_t nodeIndex = typeNodesList[i];
+
+                        if ( threadLabels[nodeIndex] != labels[nodeIndex] )
+                        {
+                            movedNodes[e].push_back( nodeIndex );
+                            threadLabels[nodeIndex] = labels[nodeIndex];
+                        }
                     }
                 }
-
             }
         }
 
+        // The fusion moves keep the labels of the nodes not labeled by QPBO,
+        // so they never increase the energy
+
+        if ( regionsMode )
+            fuse( cg, allNodes, "QPBO", solver, buffers, labels );
+        else
+            for ( size_t i = 0; i < N_expansions; i++ )
+                expand( cg, movedNodes[ order[i] ], expansionStates[ order[i] ], "QPBO",
+                        solver, buffers, labels );
+
         DEBUG("Checking convergence...");
 
         //
-        // 2.2 Check termination (convergence) conditions
+        // 2.3 Check termination (convergence) conditions
         //
 
-        if ( assignation == assignation_old) // Same assignation
+        if ( labels == labels_old ) // Same assignation
         {
-            //cout << "Convergence achieved: the same assignation" << endl;
             convergence = true;
             continue;
         }
 
+        for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+            assignation[ cg.nodeIDs[nodeIndex] ] = labels[nodeIndex];
+
         double newTotalPotential = graph.getUnnormalizedLogLikelihood( assignation );
 
-        if ( newTotalPotential = totalPotential ) // Same likelihood
+        if ( newTotalPotential == totalPotential ) // Same likelihood
         {
-            //cout << "Convergence achieved: the same likelihood" << endl;
             convergence = true;
             continue;
         }
@@ -1287,6 +2793,9 @@ void CAlphaExpansionInferenceMAP::infer( CGraph &graph,
         iteration++;
     }
 
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        assignation[ cg.nodeIDs[nodeIndex] ] = labels[nodeIndex];
+
     results = assignation;
 
     TIMER_END(m_executionTime)
@@ -1311,35 +2820,41 @@ void CAlphaBetaSwapInferenceMAP::infer( CGraph &graph,
     //    higher node potential).
     // 2. Do Alpha-beta swaps until convergence or a given number of iterations
     //    is reached.
-    //      2.1 For each nodeType, do alpha-beta sawps
-    //          2.1.1 Get a bound graph where nodes where nodes with a class
-    //                different from alpha and beta are removed.
-    //          2.1.2 Binarize the bound graph, so only two states are possible:
-    //                alpha and beta.
-    //          2.1.3 Compute graph cuts decoding on the resultant graph.
-    //          2.1.4 Do the moves between alpha and beta according to the results.
+    //      2.1 For each nodeType, do alpha-beta swaps
+    //          2.1.1 Compute the energies of the binary move, where the
+    //                nodes with the class alpha or beta take the label 0 for
+    //                alpha and 1 for beta. The rest of nodes keep their
+    //                classes, so their edges turn into node energies.
+    //          2.1.2 Compute graph cuts decoding on the move energy.
+    //          2.1.3 Do the moves between alpha and beta according to the results.
     //      2.2 Check convergency.
     //
 
-    //cout << "Decoding Alpha expansion..." << endl;
-
     if ( graph.isEmpty() )
         return;
 
     // Initialize the results vector
     results.clear();
 
-    // Direct access to useful vbles
+    if ( !checkMaxFlowMethod( m_options.particularS["maxflow"] ) )
+        return;
+
+    // Energies are minus the log potentials
+
+    TCompactGraph cg;
+    getCompactGraph( graph, m_options, cg );
+    getLogPotentials( cg );
 
     const std::vector<CNodePtr> &nodes  = graph.getNodes();
-    size_t N_nodes                      = nodes.size();
+    size_t N_nodes                      = cg.N_nodes;
+
+    string &submodularApproach = m_options.particularS["submodularApproach"];
 
     //
     // 1. Initial assignation to vbles
     //
 
     std::map<size_t,size_t> assignation;
-    std::map<size_t,size_t> assignation_old;
 
     // Choose as initial class for all the nodes their more probable class
     // according to the node potentials
@@ -1355,31 +2870,54 @@ void CAlphaBetaSwapInferenceMAP::infer( CGraph &graph,
     else
         cout << "[ERROR] Undefined method for performing the initial assignation." << endl;
 
+    vector<size_t> labels( N_nodes );
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        labels[nodeIndex] = assignation[ cg.nodeIDs[nodeIndex] ];
+
     // Get the likelihood of this assignation. Useful for convergence checking
     double totalPotential = graph.getUnnormalizedLogLikelihood( assignation );
 
+    // Nodes of each type
+
+    vector<CNodeTypePtr> &nodeTypes = graph.getNodeTypes();
+    size_t N_types = nodeTypes.size();
+
+    map<size_t,size_t> typeIndices;
+
+    for ( size_t type = 0; type < N_types; type++ )
+        typeIndices[ nodeTypes[type]->getID() ] = type;
+
+    vector<vector<size_t> > typeNodes( N_types );
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        typeNodes[ typeIndices[ nodes[nodeIndex]->getType()->getID() ] ].push_back( nodeIndex );
+
     //
     // 2. Do Alpha-beta moves until convergence or a given number of iterations
     //    is reached.
     //
 
+    CBinarySolver  solver( m_options );
+    TBinaryEnergy  energy;
+    vector<size_t> moveNodes;
+    vector<size_t> moveLabels;
+    vector<size_t> currentLabels;
+    vector<size_t> localIndex( N_nodes, NOT_IN_MOVE );
+    vector<size_t> labels_old;
+
     bool convergence = false;
     size_t iteration = 0;
 
     while ( !convergence && ( iteration < m_options.maxIterations ) )
     {
         // Store the previous assignation for convergence checking
-        assignation_old = assignation;
+        labels_old = labels;
 
-        // Iterate over the nodeTypes while swapping stuff!
-        vector<CNodeTypePtr> &nodeTypes = graph.getNodeTypes();
-        vector<CNodeTypePtr>::const_iterator itNodeTypes;
-
-        for ( itNodeTypes = nodeTypes.begin();
-              itNodeTypes != nodeTypes.end(); itNodeTypes++)
+        for ( size_t type = 0; type < N_types; type++ )
         {
-            size_t nodeTypeID = (*itNodeTypes)->getID();
-            size_t N_classes  = (*itNodeTypes)->getNumberOfClasses();
+            const vector<size_t> &typeNodesList = typeNodes[type];
+            size_t N_classes = nodeTypes[type]->getNumberOfClasses();
 
             // 2.1 Ok, move across all the possible classes/states of current node type
 
@@ -1387,142 +2925,104 @@ void CAlphaBetaSwapInferenceMAP::infer( CGraph &graph,
             {
                 for ( size_t beta = alpha+1; beta < N_classes; beta++ )
                 {
-                    size_t numOfAlphaBetas = 0;
-                    map<size_t,size_t>  nodesToBind;
-
-                    //cout << "Swaping alpha " << alpha << " beta " << beta << endl;
+                    moveNodes.clear();
 
-                    // Iterate over all the nodes in the graph
-                    for ( size_t node = 0; node < N_nodes; node++ )
+                    for ( size_t i = 0; i < typeNodesList.size(); i++ )
                     {
-                        if ( nodes[node]->getType()->getID() == nodeTypeID )
+                        size_t nodeIndex = typeNodesList[i];
+
+                        if ( ( labels[nodeIndex] == alpha ) || ( labels[nodeIndex] == beta ) )
                         {
-                            if ( ( assignation[nodes[node]->getID()] == alpha ) ||
-                                 ( assignation[nodes[node]->getID()] == beta ) )
-                                numOfAlphaBetas++;
-                            else
-                                nodesToBind[nodes[node]->getID()] =
-                                        assignation[nodes[node]->getID()];
+                            localIndex[nodeIndex] = moveNodes.size();
+                            moveNodes.push_back( nodeIndex );
                         }
-                        else
-                            nodesToBind[nodes[node]->getID()] =
-                                    assignation[nodes[node]->getID()];
                     }
 
-                    //cout << "Num of alpha betas: " << numOfAlphaBetas << endl;
-
-                    if ( numOfAlphaBetas == 0 ) // Nothing to swap
+                    if ( moveNodes.empty() ) // Nothing to swap
                         continue;
 
-                    CGraph boundGraph;
-                    graph.getBoundGraph( boundGraph, nodesToBind );
-
-                    //
-                    // Prepare the problem so it can be affordable using graph cuts
-                    //
-
                     //
-                    // 2.1.2 Binarize the bound graph, so only two states
-                    //       are possible: alpha and beta.
+                    // 2.1.1 Compute the energies of the binary move
                     //
 
-                    CNodeTypePtr binaryNodeTypePtr( new CNodeType(2,1) );
-                    CEdgeTypePtr binaryEdgeTypePtr( new CEdgeType(1,binaryNodeTypePtr,
-                                                                  binaryNodeTypePtr) );
-
-                    // Binary nodes
-
-                    vector<CNodePtr> &boundNodes = boundGraph.getNodes();
-
-                    for  (size_t node = 0; node < boundNodes.size(); node++ )
-                    {
-                        VectorXd potentials = boundNodes[node]->getPotentials();
-
-                        Vector2d binaryPotentials;
-
-                        double alphaPot;
-                        double betaPot;
-
-                        alphaPot = potentials[alpha];
-                        betaPot  = potentials[beta];
+                    size_t N_moveNodes = moveNodes.size();
 
-                        //cout << "AlphaPot: " << alphaPot << " BetaPot: " << betaPot << endl;
+                    energy.clear( N_moveNodes );
 
-                        binaryPotentials << alphaPot, betaPot;
-
-                        boundGraph.setNodeType(boundNodes[node],binaryNodeTypePtr);
-                        boundNodes[node]->setPotentials( binaryPotentials );
-
-                    }
-
-                    // ... and binary edges
-
-                    vector<CEdgePtr> &boundEdges = boundGraph.getEdges();
-
-                    for ( size_t edge = 0; edge < boundEdges.size(); edge++ )
+                    for ( size_t i = 0; i < N_moveNodes; i++ )
                     {
-                        CNodePtr nodePtr1, nodePtr2;
-                        boundEdges[edge]->getNodes(nodePtr1,nodePtr2);
-                        MatrixXd &potentials = boundEdges[edge]->getPotentials();
-
-                        MatrixXd binaryPotentials;
-                        binaryPotentials.resize(2,2);
-
-                        binaryPotentials(0,0) = potentials( alpha, alpha );
-                        binaryPotentials(0,1) = potentials( alpha, beta  );
-                        binaryPotentials(1,0) = potentials( beta,  alpha );
-                        binaryPotentials(1,1) = potentials( beta,  beta  );
+                        size_t nodeIndex = moveNodes[i];
+                        double *nodeEnergies = &energy.nodeEnergies[2*i];
 
-                        // Check if the user wants to truncate supermodular
-                        // energy functions to turn them into submodular ones,
-                        // or if s/he wants to ignore graphs with supermodular
-                        // energies.
+                        nodeEnergies[0] = -cg.logNodePotentials[nodeIndex]( alpha );
+                        nodeEnergies[1] = -cg.logNodePotentials[nodeIndex]( beta );
 
-                        string &submodularApproach =
-                                m_options.particularS["submodularApproach"];
-
-                        if ( ( submodularApproach == "truncate") ||
-                             ( submodularApproach == "ignore" ) )
+                        for ( size_t p = cg.adjOffsets[nodeIndex]; p < cg.adjOffsets[nodeIndex+1]; p++ )
                         {
-                            Matrix2d binaryEnergies = -(binaryPotentials.array().log());
-                            double aux = binaryEnergies(0,1)+binaryEnergies(1,0)-binaryEnergies(0,0);
+                            size_t neighbor = cg.adjNeighbor[p];
+                            bool   first    = cg.adjFirst[p];
+                            const MatrixXd &logPotentials = cg.logEdgePotentials[ cg.adjEdge[p] ];
 
-                            if ( binaryEnergies(1,1) > aux )
+                            if ( neighbor == nodeIndex )
                             {
-                                if ( submodularApproach == "ignore" )
-                                    continue;
-
-                                // Truncate
-                                binaryEnergies(1,1) = aux;
+                                // Self loops appear twice
+                                if ( first )
+                                {
+                                    nodeEnergies[0] -= logPotentials( alpha, alpha );
+                                    nodeEnergies[1] -= logPotentials( beta, beta );
+                                }
+                            }
+                            else if ( localIndex[neighbor] != NOT_IN_MOVE )
+                            {
+                                // Edges in the move are added from their first node
+                                if ( first )
+                                    energy.addEdge( i, localIndex[neighbor],
+                                                    -logPotentials( alpha, alpha ),
+                                                    -logPotentials( alpha, beta ),
+                                                    -logPotentials( beta, alpha ),
+                                                    -logPotentials( beta, beta ),
+                                                    submodularApproach );
+                            }
+                            else
+                            {
+                                size_t neighborLabel = labels[neighbor];
+
+                                if ( first )
+                                {
+                                    nodeEnergies[0] -= logPotentials( alpha, neighborLabel );
+                                    nodeEnergies[1] -= logPotentials( beta, neighborLabel );
+                                }
+                                else
+                                {
+                                    nodeEnergies[0] -= logPotentials( neighborLabel, alpha );
+                                    nodeEnergies[1] -= logPotentials( neighborLabel, beta );
+                                }
                             }
-
-                            binaryPotentials = (-binaryEnergies).array().exp();
                         }
-
-                        boundEdges[edge]->setType( binaryEdgeTypePtr );
-                        boundEdges[edge]->setPotentials( binaryPotentials );
-
                     }
 
-                    //cout << boundGraph << endl;
-
                     //
-                    // 2.1.3 Compute graph cuts decoding on the resultant graph.
+                    // 2.1.2 Compute graph cuts decoding on the move energy.
                     //
 
-                    CGraphCutsInferenceMAP decodeGraphCuts;
-                    map<size_t,size_t> gcResults;
+                    // Nodes not labeled by QPBO keep their classes
 
-                    decodeGraphCuts.infer( boundGraph, gcResults );
+                    currentLabels.resize( N_moveNodes );
 
-                    for ( map<size_t,size_t>::iterator gcResIt = gcResults.begin(); gcResIt!= gcResults.end(); gcResIt++)
-                    {                        
-                        if ( gcResIt->second == 0 )
-                            assignation[ gcResIt->first ] = alpha;
-                        else
-                            assignation[ gcResIt->first ] = beta;
-                    }
+                    for ( size_t i = 0; i < N_moveNodes; i++ )
+                        currentLabels[i] = ( labels[ moveNodes[i] ] == alpha ) ? 0 : 1;
+
+                    solver.solve( energy, currentLabels, moveLabels );
+
+                    //
+                    // 2.1.3 Do the moves
+                    //
 
+                    for ( size_t i = 0; i < N_moveNodes; i++ )
+                    {
+                        labels[ moveNodes[i] ] = ( moveLabels[i] == 0 ) ? alpha : beta;
+                        localIndex[ moveNodes[i] ] = NOT_IN_MOVE;
+                    }
                 }
             }
         }
@@ -1531,13 +3031,16 @@ void CAlphaBetaSwapInferenceMAP::infer( CGraph &graph,
         // 2.2 Check termination (convergence) conditions
         //
 
-        if ( assignation == assignation_old) // Same assignation
+        if ( labels == labels_old ) // Same assignation
         {
             //cout << "Convergence achieved: the same assignation" << endl;
             convergence = true;
             continue;
         }
 
+        for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+            assignation[ cg.nodeIDs[nodeIndex] ] = labels[nodeIndex];
+
         double newTotalPotential = graph.getUnnormalizedLogLikelihood( assignation );
 
         if ( newTotalPotential - totalPotential <= 0  ) // Same or lower likelihood
@@ -1552,6 +3055,9 @@ void CAlphaBetaSwapInferenceMAP::infer( CGraph &graph,
         iteration++;
     }
 
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        assignation[ cg.nodeIDs[nodeIndex] ] = labels[nodeIndex];
+
     results = assignation;
 
     TIMER_END(m_executionTime)
@@ -1584,91 +3090,190 @@ void CRestartsInferenceMAP::infer( CGraph &graph,
 {
     TIMER_START
 
+    //
+    // Method workflow:
+    // 1. Do the decodings in parallel, each one from a random assignation
+    //    drawn from its own seed.
+    // 2. Combine their results, according to particularS["combination"]:
+    //    keep the one with the highest likelihood ("Best", by default), fuse
+    //    the rest into it with QPBO fusion moves ("Fusion"), or take the
+    //    class of each node voted by more decodings ("Vote").
+    //
+
     if ( graph.isEmpty() )
         return;
 
-    map<size_t,vector<size_t> > partialResults;
+    results.clear();
+
+    string &method      = m_options.particularS["method"];
+    string &combination = m_options.particularS["combination"];
 
-    vector<CNodePtr> &nodes = graph.getNodes();
-    size_t N_nodes = nodes.size();
+    if ( ( method != "ICM" ) && ( method != "ICMGreedy" ) &&
+         ( method != "AlphaExpansion" ) && ( method != "AlphaBetaSwap" ) )
+    {
+        cout << "[ERROR] Decode with restarts not implemented for the specified decoding method." << endl;
+        return;
+    }
 
-    for ( size_t node = 0; node < N_nodes; node++ )
+    if ( ( combination != "" ) && ( combination != "Best" ) &&
+         ( combination != "Fusion" ) && ( combination != "Vote" ) )
     {
-        size_t ID = nodes[node]->getID();
-        size_t N_classes = nodes[node]->getType()->getNumberOfClasses();
+        cout << "[ERROR] Unknown combination of the restarts: " << combination << endl;
+        return;
+    }
+
+    size_t N_restarts = static_cast<size_t>( m_options.particularD["numberOfRestarts"] );
+#ifdef UPGMpp_USING_OMPENMP
+    size_t N_threads  = getNumberOfThreads( m_options );
+#endif
+
+    if ( !N_restarts )
+        return;
+
+    //
+    // 1. Do the decodings in parallel. The seeds of the restarts are
+    //    consecutive, starting from particularD["seed"] if it is set. Each
+    //    decoding uses a single thread.
+    //
+
+    unsigned int seed = m_options.particularD.count("seed") ?
+                        static_cast<unsigned int>( m_options.particularD["seed"] ) :
+                        static_cast<unsigned int>( time(0) );
 
-        partialResults[ID].resize(N_classes,0);
+    vector<TInferenceOptions> restartOptions( N_restarts, m_options );
+
+    for ( size_t restart = 0; restart < N_restarts; restart++ )
+    {
+        restartOptions[restart].initialAssignation = "Random";
+        restartOptions[restart].particularD["seed"] = seed + restart;
+        restartOptions[restart].particularD["numberOfThreads"] = 1;
     }
 
-    m_options.initialAssignation = "Random";
+    vector<map<size_t,size_t> > restartResults( N_restarts );
+    vector<double>              logLikelihoods( N_restarts );
+
+    // The decodings share the graph, so they must only read it. The caches
+    // of the graph (node colors, edge appearance probabilities) are filled
+    // lazily, so those used by the decoding method are filled here, before
+    // the parallel loop.
+    if ( method == "ICM" )
+    {
+        TCompactGraph  cg;
+        vector<size_t> colors;
+
+        getCompactGraph( graph, m_options, cg );
+        getNodeColors( graph, cg, colors );
+    }
 
-    for ( size_t restart = 0;
-          restart < m_options.particularD["numberOfRestarts"];
-          restart++ )
+    #pragma omp parallel for num_threads(N_threads) schedule(dynamic)
+    for ( int restart = 0; restart < (int)N_restarts; restart++ )
     {
-        if ( m_options.particularS["method"] == "ICM" )
+        TInferenceOptions  &options       = restartOptions[restart];
+        map<size_t,size_t> &restartResult = restartResults[restart];
+
+        if ( method == "ICM" )
         {
             CICMInferenceMAP decodeICM;
-            decodeICM.setOptions( m_options );
-            decodeICM.infer( graph, results );
-
-            updateResults(results,partialResults);
+            decodeICM.setOptions( options );
+            decodeICM.infer( graph, restartResult );
         }
-
-        else if ( m_options.particularS["method"] == "ICMGreedy" )
+        else if ( method == "ICMGreedy" )
         {
             CICMGreedyInferenceMAP decodeICMGreedy;
-            decodeICMGreedy.setOptions( m_options );
-            decodeICMGreedy.infer( graph, results );
-
-            updateResults(results,partialResults);
+            decodeICMGreedy.setOptions( options );
+            decodeICMGreedy.infer( graph, restartResult );
         }
-        else if ( m_options.particularS["method"] == "AlphaExpansion" )
+        else if ( method == "AlphaExpansion" )
         {
             CAlphaExpansionInferenceMAP decodeAlphaExpansion;
-            decodeAlphaExpansion.setOptions( m_options );
-            decodeAlphaExpansion.infer( graph, results );
-
-            updateResults(results,partialResults);
+            decodeAlphaExpansion.setOptions( options );
+            decodeAlphaExpansion.infer( graph, restartResult );
         }
-        else if ( m_options.particularS["method"] == "AlphaBetaSwap" )
+        else
         {
             CAlphaBetaSwapInferenceMAP decodeAlphaBetaSwap;
-            decodeAlphaBetaSwap.setOptions( m_options );
-            decodeAlphaBetaSwap.infer( graph, results );
-
-            updateResults(results,partialResults);
+            decodeAlphaBetaSwap.setOptions( options );
+            decodeAlphaBetaSwap.infer( graph, restartResult );
         }
-        else
-            cout << "[ERROR] Decode with restarts not implemented for the specified decoding method." << endl;
 
+        logLikelihoods[restart] = graph.getUnnormalizedLogLikelihood( restartResult );
     }
 
-    // Uncomment to see the final accumulated values
-    /*map<size_t,vector<size_t> >::iterator it;
-    for ( it = partialResults.begin(); it != partialResults.end(); it++ )
+    //
+    // 2. Combine the results
+    //
+
+    size_t best = distance( logLikelihoods.begin(),
+                            max_element( logLikelihoods.begin(), logLikelihoods.end() ) );
+
+    if ( combination == "Vote" )
     {
-        size_t ID = it->first;
-        cout << "[" << ID << "] " << endl;
-        for ( size_t i =0; i < it->second.size(); i++ )
+        map<size_t,vector<size_t> > partialResults;
+
+        vector<CNodePtr> &nodes = graph.getNodes();
+        size_t N_nodes = nodes.size();
+
+        for ( size_t node = 0; node < N_nodes; node++ )
         {
-            cout << it->second[i] << " ";
+            size_t ID = nodes[node]->getID();
+            size_t N_classes = nodes[node]->getType()->getNumberOfClasses();
+
+            partialResults[ID].resize(N_classes,0);
         }
 
-        cout << endl;
-    }*/
+        for ( size_t restart = 0; restart < N_restarts; restart++ )
+            updateResults( restartResults[restart], partialResults );
+
+        map<size_t,vector<size_t> >::iterator it;
 
-    map<size_t,vector<size_t> >::iterator it;
+        for ( it = partialResults.begin(); it != partialResults.end(); it++ )
+        {
+            size_t ID = it->first;
+            size_t index = distance( partialResults[ID].begin(),
+                                     max_element( partialResults[ID].begin(),
+                                                partialResults[ID].end()) );
 
-    for ( it = partialResults.begin(); it != partialResults.end(); it++ )
+            results[ID] = index;
+        }
+    }
+    else if ( combination == "Fusion" )
     {
-        size_t ID = it->first;
-        size_t index = distance( partialResults[ID].begin(),
-                                 max_element( partialResults[ID].begin(),
-                                            partialResults[ID].end()) );
+        // The fusion moves keep the classes of the nodes not labeled by
+        // QPBO, so the result is never worse than the best restart
+
+        TCompactGraph cg;
+        getCompactGraph( graph, m_options, cg );
+        getLogPotentials( cg );
+
+        size_t N_nodes = cg.N_nodes;
+
+        CBinarySolver  solver( m_options );
+        TMoveBuffers   buffers( N_nodes );
+        vector<size_t> labels( N_nodes );
+        vector<size_t> allNodes( N_nodes );
+
+        for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        {
+            labels[nodeIndex]   = restartResults[best][ cg.nodeIDs[nodeIndex] ];
+            allNodes[nodeIndex] = nodeIndex;
+        }
+
+        for ( size_t restart = 0; restart < N_restarts; restart++ )
+        {
+            if ( restart == best )
+                continue;
 
-        results[ID] = index;
+            for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+                buffers.proposal[nodeIndex] = restartResults[restart][ cg.nodeIDs[nodeIndex] ];
+
+            fuse( cg, allNodes, "QPBO", solver, buffers, labels );
+        }
+
+        for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+            results[ cg.nodeIDs[nodeIndex] ] = labels[nodeIndex];
     }
+    else
+        results = restartResults[best];
 
     TIMER_END(m_executionTime)
 
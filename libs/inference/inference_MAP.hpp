@@ -33,6 +33,7 @@ namespace UPGMpp
         TInferenceOptions                       m_options;
         std::map<size_t,std::vector<size_t> >   m_mask;
         double                                  m_executionTime; // execution time of the last inference in ns
+        TInferenceStatus                        m_status; // how the last inference finished (iterative methods)
 
     public:
 
@@ -67,6 +68,11 @@ namespace UPGMpp
           */
         inline double getExecutionTime() const { return m_executionTime*pow(10,-9); }
 
+        /** Returns how the last inference process finished: iterations,
+          * residual and stop cause. Only filled by iterative methods.
+          */
+        inline const TInferenceStatus& getStatus() const { return m_status; }
+
     };
 
     class CMaxNodePotInferenceMAP : public CInferenceMAP
@@ -75,12 +81,23 @@ namespace UPGMpp
         void infer( CGraph &graph, std::map<size_t,size_t> &results, bool debug=false );
     };
 
+    /** Iterated Conditional Modes over the colors of the graph (see
+      * getNodeColors): the nodes of each color, which are not neighbors,
+      * take their best class given their neighbors in parallel, so the
+      * likelihood never decreases. Sweeps are repeated until no node
+      * changes, or maxIterations sweeps are done.
+      */
     class CICMInferenceMAP : public CInferenceMAP
     {
     public:
         void infer( CGraph &graph, std::map<size_t,size_t> &results, bool debug=false );
     };
 
+    /** Greedy ICM: moves each time the node whose best class increases the
+      * likelihood the most, until no move increases it (or maxIterations
+      * moves per node are done). The gains of the nodes are kept in a heap,
+      * only updated for the neighbors of the moved node.
+      */
     class CICMGreedyInferenceMAP : public CInferenceMAP
     {
     public:
@@ -93,6 +110,53 @@ namespace UPGMpp
         void infer(CGraph &graph, std::map<size_t, size_t> &results, bool debug=false);
     };
 
+    /** Exact MAP for graphs without cycles (chains, trees and forests), by
+      * Viterbi in O(N*K^2). See getForestMAP.
+      */
+    class CTreeInferenceMAP : public CInferenceMAP
+    {
+    public:
+        void infer(CGraph &graph, std::map<size_t, size_t> &results, bool debug=false);
+    };
+
+    /** Exact MAP for graphs with a low treewidth, by max-sum message
+      * passing over a junction tree (see getJunctionTreeMAP). Options:
+      * particularS["eliminationOrder"] ("MinFill" or "MinDegree") and
+      * particularD["maxTableSize"].
+      */
+    class CJunctionTreeInferenceMAP : public CInferenceMAP
+    {
+    public:
+        void infer(CGraph &graph, std::map<size_t, size_t> &results, bool debug=false);
+    };
+
+    /** Exact MAP by variable elimination (see eliminateVariables). If the
+      * tables of a bucket exceed particularD["maxTableSize"], mini-buckets
+      * are used, so the returned labeling is approximate and getBound is an
+      * upper bound of the log score of the MAP.
+      */
+    class CVariableEliminationInferenceMAP : public CInferenceMAP
+    {
+    private:
+        double  m_bound;  //!< Max log score, or an upper bound of it.
+        bool    m_exact;  //!< False if mini-buckets were needed.
+
+    public:
+
+        CVariableEliminationInferenceMAP() : m_bound( 0 ), m_exact( true )
+        {}
+
+        void infer(CGraph &graph, std::map<size_t, size_t> &results, bool debug=false);
+
+        inline double getBound() const { return m_bound; }
+        inline bool isExact() const { return m_exact; }
+    };
+
+    /** Loopy Belief Propagation. The acyclic connected components of the
+      * graph are solved exactly by CTreeInferenceMAP, unless
+      * particularB["skipExactTrees"] is true, so messages are only passed
+      * in the components with cycles.
+      */
     class CLBPInferenceMAP : public CInferenceMAP
     {
     public:
@@ -111,12 +175,59 @@ namespace UPGMpp
         void infer(CGraph &graph, std::map<size_t, size_t> &results, bool debug=false);
     };
 
+    class CSplashInferenceMAP : public CInferenceMAP
+    {
+    public:
+        void infer(CGraph &graph, std::map<size_t, size_t> &results, bool debug=false);
+    };
+
+    /** Sequential Tree-Reweighted message passing (TRW-S). Works with the
+      * energies of the graph (minus the log potentials, as in
+      * getLogPotentials), visiting the nodes in the order they have in the
+      * graph forward and backward. Each iteration improves a lower bound of
+      * the energy and decodes a labeling, so it stops when the duality gap
+      * (energy of the best labeling minus the best bound) is not greater than
+      * particularD["dualityGap"] (0 by default), when the bound improves less
+      * than options.convergency, or after options.maxIterations.
+      */
+    class CTRWSInferenceMAP : public CInferenceMAP
+    {
+    private:
+        double  m_lowerBound; //!< Best lower bound of the energy found.
+        double  m_energy;     //!< Energy of the returned labeling.
+
+    public:
+
+        CTRWSInferenceMAP() : m_lowerBound( 0 ), m_energy( 0 )
+        {}
+
+        void infer(CGraph &graph, std::map<size_t, size_t> &results, bool debug=false);
+
+        inline double getLowerBound() const { return m_lowerBound; }
+        inline double getEnergy() const { return m_energy; }
+        inline double getDualityGap() const { return m_energy - m_lowerBound; }
+    };
+
     class CGraphCutsInferenceMAP : public CInferenceMAP
     {
     public:
         void infer(CGraph &graph, std::map<size_t, size_t> &results, bool debug=false);
     };
 
+    /** Exact decoding for ordered classes, when the energies of the edges
+      * are convex on that order (D(k,l) = E(k,l)-E(k-1,l)-E(k,l-1)+E(k-1,l-1)
+      * <= 0, e.g. convex functions of the classes difference), through a
+      * single max-flow on the Ishikawa layered network. Edges whose type is
+      * declared convex (CEdgeType::setConvex) have their positive D(k,l)
+      * truncated, while the rest of edges must fulfill it. The max-flow
+      * solver is chosen through particularS["maxflow"].
+      */
+    class CIshikawaInferenceMAP : public CInferenceMAP
+    {
+    public:
+        void infer(CGraph &graph, std::map<size_t, size_t> &results, bool debug=false);
+    };
+
     class CAlphaExpansionInferenceMAP : public CInferenceMAP
     {
     public:
@@ -133,6 +244,24 @@ namespace UPGMpp
         void infer(CGraph &graph, std::map<size_t, size_t> &results, bool debug=false);
     };
 
+    /** Alpha-expansion doing independent expansions in parallel. With
+      * particularS["parallelMode"] = "Labels" (by default), the classes are
+      * expanded in parallel from the same labels, and the nodes moved by each
+      * expansion are then fused into the labels with QPBO. With "Regions",
+      * the graph is split into particularD["regions"] regions (the number of
+      * threads by default), each one doing all the expansions while the rest
+      * of regions keep their classes, and the boundaries are reconciled
+      * fusing the result with QPBO. The order of the expansions (and the
+      * "Random" initial assignation) comes from particularD["seed"], so the
+      * results only depend on it (and the number of regions), not on the
+      * threads doing the work.
+      */
+    class CParallelAlphaExpansionInferenceMAP : public CInferenceMAP
+    {
+    public:
+        void infer(CGraph &graph, std::map<size_t, size_t> &results, bool debug=false);
+    };
+
     class CAlphaBetaSwapInferenceMAP : public CInferenceMAP
     {
     public:
@@ -149,6 +278,17 @@ namespace UPGMpp
         void infer(CGraph &graph, std::map<size_t, size_t> &results, bool debug=false);
     };
 
+    /** Runs particularD["numberOfRestarts"] decodings of the method set in
+      * particularS["method"] ("ICM", "ICMGreedy", "AlphaExpansion" or
+      * "AlphaBetaSwap") from random assignations, in parallel. The seed of
+      * each restart follows particularD["seed"] if it is set, so the results
+      * can be reproduced. They are combined as set by
+      * particularS["combination"]: "Best" (the one with the highest
+      * likelihood, by default), "Fusion" (QPBO fusion moves of the rest into
+      * the best one) or "Vote" (the most voted class of each node). The
+      * decodings share the graph, so the caches of the graph they use are
+      * filled before running them.
+      */
     class CRestartsInferenceMAP : public CInferenceMAP
     {
     public:
@@ -22,12 +22,71 @@
 #include "inference_marginal.hpp"
 #include "base_utils.hpp"
 
+#include <limits>
+#include <boost/cstdint.hpp>
+
 using namespace UPGMpp;
 using namespace std;
 using namespace Eigen;
 
 
 
+/*------------------------------------------------------------------------------
+
+                               CTreeInference
+
+------------------------------------------------------------------------------*/
+
+void CTreeInferenceMarginal::infer(CGraph &graph,
+                                   map<size_t,VectorXd> &nodeBeliefs,
+                                   map<size_t,MatrixXd> &edgeBeliefs,
+                                   double &logZ)
+{
+    nodeBeliefs.clear();
+    edgeBeliefs.clear();
+
+    logZ = getForestMarginals( graph, m_options, nodeBeliefs, edgeBeliefs );
+}
+
+
+/*------------------------------------------------------------------------------
+
+                           CJunctionTreeInference
+
+------------------------------------------------------------------------------*/
+
+void CJunctionTreeInferenceMarginal::infer(CGraph &graph,
+                                           map<size_t,VectorXd> &nodeBeliefs,
+                                           map<size_t,MatrixXd> &edgeBeliefs,
+                                           double &logZ)
+{
+    nodeBeliefs.clear();
+    edgeBeliefs.clear();
+
+    logZ = 0;
+
+    getJunctionTreeMarginals( graph, m_options, nodeBeliefs, edgeBeliefs, logZ );
+}
+
+
+/*------------------------------------------------------------------------------
+
+                        CVariableEliminationInference
+
+------------------------------------------------------------------------------*/
+
+void CVariableEliminationInferenceMarginal::infer(CGraph &graph,
+                                                  map<size_t,VectorXd> &nodeBeliefs,
+                                                  map<size_t,MatrixXd> &edgeBeliefs,
+                                                  double &logZ)
+{
+    nodeBeliefs.clear();
+    edgeBeliefs.clear();
+
+    logZ = eliminateVariables( graph, m_options, false, NULL, &m_exact );
+}
+
+
 /*------------------------------------------------------------------------------
 
                                CLBPInference
@@ -41,22 +100,39 @@ void CLBPInferenceMarginal::infer(CGraph &graph,
 {
     //
     //  Algorithm workflow:
+    //  0. Solve exactly the components without cycles
     //  1. Compute the messages passed
     //  2. Compute node beliefs
     //  3. Compute edge beliefs
     //  4. Compute logZ
     //
-    boost::posix_time::ptime time_0(boost::posix_time::microsec_clock::local_time());
 
     nodeBeliefs.clear();
     edgeBeliefs.clear();
 
-    const vector<CNodePtr> nodes = graph.getNodes();
-    const vector<CEdgePtr> edges = graph.getEdges();
-    multimap<size_t,CEdgePtr> edges_f = graph.getEdgesF();
+    //
+    // 0. Solve exactly the components without cycles, keeping the others
+    //
 
-    size_t N_nodes = nodes.size();
-    size_t N_edges = edges.size();
+    CGraph  cyclicPart;
+    bool    exactTrees = !m_options.particularB["skipExactTrees"];
+    double  forestLogZ = 0;
+
+    if ( exactTrees )
+    {
+        forestLogZ = getForestMarginals( graph, m_options, nodeBeliefs, edgeBeliefs, &cyclicPart );
+
+        if ( cyclicPart.isEmpty() )
+        {
+            m_status = TInferenceStatus();
+            m_status.stopCause = "ExactTrees";
+
+            logZ = forestLogZ;
+            return;
+        }
+    }
+
+    CGraph &loopyGraph = exactTrees ? cyclicPart : graph;
 
     //
     // 1. Compute the messages passed
@@ -65,507 +141,897 @@ void CLBPInferenceMarginal::infer(CGraph &graph,
     vector<vector<VectorXd> >   messages;
     bool                        maximize = false;
 
-    messagesLBP( graph, m_options, messages, maximize );
-
-    boost::posix_time::ptime time_1(boost::posix_time::microsec_clock::local_time());
+    messagesLBP( loopyGraph, m_options, messages, maximize, vector<size_t>(), &m_status );
 
     //
     // 2. Compute node beliefs
     //
 
-    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+    getNodeBeliefs( loopyGraph, m_options, messages, nodeBeliefs );
+
+    //
+    // 3. Compute edge beliefs
+    //
+
+    getEdgeBeliefs( loopyGraph, m_options, messages, edgeBeliefs );
+
+    //
+    // 4. Compute logZ. Z factorizes over the connected components, so the
+    //    exact logZ of the acyclic ones is added to the Bethe approximation
+    //    of the ones with cycles (the Bethe free energy is exact for trees,
+    //    so both parts are consistent)
+    //
+
+    logZ = forestLogZ + getBetheLogZ( loopyGraph, m_options, nodeBeliefs, edgeBeliefs );
+}
+
+
+/*------------------------------------------------------------------------------
+
+                               CTRPBPInference
+
+------------------------------------------------------------------------------*/
+
+void CTRPBPInferenceMarginal::infer(CGraph &graph,
+                                    map<size_t,VectorXd> &nodeBeliefs,
+                                    map<size_t,MatrixXd> &edgeBeliefs,
+                                    double &logZ)
+{
+    //
+    //  Algorithm workflow:
+    //  1. Compute the messages passed
+    //  2. Compute node beliefs
+    //  3. Compute edge beliefs
+    //  4. Compute logZ
+    //
+
+    nodeBeliefs.clear();
+    edgeBeliefs.clear();
+
+    const vector<CNodePtr> nodes = graph.getNodes();
+    const vector<CEdgePtr> edges = graph.getEdges();
+
+    size_t N_nodes = nodes.size();
+
+    //
+    // 1. Create spanning trees
+    //
+
+    bool allNodesAdded = false;
+    vector<vector<size_t > > v_trees;
+    vector<bool> v_addedNodes(N_nodes,false);
+    map<size_t,size_t> addedNodesMap;
+
+    for (size_t i = 0; i < N_nodes; i++)
+        addedNodesMap[ nodes[i]->getID() ] = i;
+
+    while (!allNodesAdded)
     {
-        const CNodePtr nodePtr = graph.getNode( nodeIndex );
-        size_t         nodeID  = nodePtr->getID();
-        VectorXd       nodePotPlusIncMsg = nodePtr->getPotentials( m_options.considerNodeFixedValues );
+        allNodesAdded = true;
 
-        NEIGHBORS_IT neighbors = edges_f.equal_range(nodeID);
+        vector<size_t> tree;
+        getSpanningTree( graph, tree );
 
-        //
-        // Get the messages for all the neighbors, and multiply them with the node potential
-        //
-        for ( multimap<size_t,CEdgePtr>::iterator itNeigbhor = neighbors.first;
-              itNeigbhor != neighbors.second;
-              itNeigbhor++ )
-        {
-            CEdgePtr edgePtr( (*itNeigbhor).second );
-            size_t edgeIndex = graph.getEdgeIndex( edgePtr->getID() );
+        // Check that the tree is not empty
+        if ( tree.size() )
+            v_trees.push_back( tree );
+
+//        cout << "Tree: ";
 
-            if ( !edgePtr->getNodePosition( nodeID ) ) // nodeID is the first node in the edge
-                nodePotPlusIncMsg = nodePotPlusIncMsg.cwiseProduct(messages[ edgeIndex ][ 1 ]);
-            else // nodeID is the second node in the dege
-                nodePotPlusIncMsg = nodePotPlusIncMsg.cwiseProduct(messages[ edgeIndex ][ 0 ]);
+        for ( size_t i_node = 0; i_node < tree.size(); i_node++ )
+        {
+            v_addedNodes[ addedNodesMap[tree[i_node]] ] = true;
+//            cout << tree[i_node] << " ";
         }
 
-        // Normalize
+//        cout << endl;
 
-        double sumNodePotPlusIncMsg = nodePotPlusIncMsg.sum();
+        for ( size_t i_node = 0; i_node < N_nodes; i_node++ )
+            if ( !v_addedNodes[i_node] )
+            {
+                allNodesAdded = false;
+                break;
+            }
 
-        if ( sumNodePotPlusIncMsg )
-            nodePotPlusIncMsg = nodePotPlusIncMsg / sumNodePotPlusIncMsg;
+    }
 
-        // Set
 
-        nodeBeliefs[ nodeID ] = nodePotPlusIncMsg;
+    //
+    // 1. Compute messages passed in each tree until convergence
+    //
 
-        //cout << "Beliefs of node " << nodeIndex << endl << nodePotPlusIncMsg.transpose() << endl;
+    vector<vector<VectorXd> >   messages;
+    vector<vector<VectorXd> >   previousMessages;
+    bool                        maximize = false;
+
+    m_status = TInferenceStatus();
+    m_status.stopCause = "MaxIterations";
+
+    size_t iteration;
+
+    for ( iteration = 0; iteration < m_options.maxIterations; iteration++ )
+    {
+        previousMessages = messages;
+
+        for ( size_t i_tree=0; i_tree < v_trees.size(); i_tree++ )
+            messagesLBP( graph, m_options, messages, maximize, v_trees[i_tree] );
+
+        m_status.residual = getMessagesResidual( previousMessages, messages );
+
+        if ( m_status.residual < m_options.convergency )
+        {
+            m_status.stopCause = "Converged";
+            iteration++;
+            break;
+        }
     }
 
-    boost::posix_time::ptime time_2(boost::posix_time::microsec_clock::local_time());
+    m_status.iterations = iteration;
+
+    //
+    // 2. Compute node beliefs
+    //
+
+    getNodeBeliefs( graph, m_options, messages, nodeBeliefs );
 
     //
     // 3. Compute edge beliefs
     //
 
-    for ( size_t edgeIndex = 0; edgeIndex < N_edges; edgeIndex++ )
-    {
-        CEdgePtr edgePtr = edges[edgeIndex];
-        size_t   edgeID  = edgePtr->getID();
+    getEdgeBeliefs( graph, m_options, messages, edgeBeliefs );
+
+    //
+    // 4. Compute logZ
+    //
 
-        size_t ID1, ID2;
-        edgePtr->getNodesID( ID1, ID2 );
+    logZ = getBetheLogZ( graph, m_options, nodeBeliefs, edgeBeliefs );
 
-        MatrixXd edgePotentials = edgePtr->getPotentials();
-        MatrixXd edgeBelief = edgePotentials;
+}
 
-        VectorXd &message1To2 = messages[edgeIndex][0];
-        VectorXd &message2To1 = messages[edgeIndex][1];
+/*------------------------------------------------------------------------------
 
-        //cout << "----------------------" << endl;
-        //cout << nodeBeliefs[ ID1 ] << endl;
-        //cout << "----------------------" << endl;
-        //cout << message2To1 << endl;
+                               CRBPInference
 
-        VectorXd node1Belief = nodeBeliefs[ ID1 ].cwiseQuotient( message2To1 );
-        VectorXd node2Belief = nodeBeliefs[ ID2 ].cwiseQuotient( message1To2 );
+------------------------------------------------------------------------------*/
 
-        //cout << "----------------------" << endl;
+void CRBPInferenceMarginal::infer(CGraph &graph,
+                                    map<size_t,VectorXd> &nodeBeliefs,
+                                    map<size_t,MatrixXd> &edgeBeliefs,
+                                    double &logZ)
+{
+    CLBPInferenceMarginal LBPinference;
 
-        MatrixXd node1BeliefMatrix ( edgePotentials.rows(), edgePotentials.cols() );
-        for ( size_t row = 0; row < edgePotentials.rows(); row++ )
-            for ( size_t col = 0; col < edgePotentials.cols(); col++ )
-                node1BeliefMatrix(row,col) = node1Belief(row);
+    m_options.particularS["order"] = "RBP";
 
-        //cout << "Node 1 belief matrix: " << endl << node1BeliefMatrix << endl;
+    LBPinference.setOptions( m_options );
+    LBPinference.infer( graph, nodeBeliefs, edgeBeliefs, logZ );
 
-        edgeBelief = edgeBelief.cwiseProduct( node1BeliefMatrix );
+    m_status = LBPinference.getStatus();
 
-        MatrixXd node2BeliefMatrix ( edgePotentials.rows(), edgePotentials.cols() );
-        for ( size_t row = 0; row < edgePotentials.rows(); row++ )
-            for ( size_t col = 0; col < edgePotentials.cols(); col++ )
-                node2BeliefMatrix(row,col) = node2Belief(col);
+}
 
-        //cout << "Node 2 belief matrix: " << endl << node2BeliefMatrix << endl;
+/*------------------------------------------------------------------------------
 
-        edgeBelief = edgeBelief.cwiseProduct( node2BeliefMatrix );
+                               CSplashInference
 
-        //cout << "Edge potentials" << endl << edgePotentials << endl;
-        //cout << "Edge beliefs" << endl << edgeBelief << endl;
+------------------------------------------------------------------------------*/
 
-        // Normalize        
+void CSplashInferenceMarginal::infer(CGraph &graph,
+                                     map<size_t,VectorXd> &nodeBeliefs,
+                                     map<size_t,MatrixXd> &edgeBeliefs,
+                                     double &logZ)
+{
+    nodeBeliefs.clear();
+    edgeBeliefs.clear();
 
-        double sumEdgeBelief = edgeBelief.sum();
+    //
+    // 1. Compute the messages passed
+    //
 
-        if (sumEdgeBelief)
-            edgeBelief = edgeBelief / sumEdgeBelief;
+    vector<vector<VectorXd> >   messages;
+    bool                        maximize = false;
 
-        // Set
+    messagesSplash( graph, m_options, messages, maximize, &m_status );
 
-        edgeBeliefs[ edgeID ] = edgeBelief;
-    }
+    //
+    // 2. Compute node and edge beliefs
+    //
 
-    boost::posix_time::ptime time_3(boost::posix_time::microsec_clock::local_time());
+    getNodeBeliefs( graph, m_options, messages, nodeBeliefs );
+    getEdgeBeliefs( graph, m_options, messages, edgeBeliefs );
 
     //
-    // 4. Compute logZ
+    // 3. Compute logZ
     //
 
-    double energyNodes  = 0;
-    double energyEdges  = 0;
-    double entropyNodes = 0;
-    double entropyEdges = 0;
+    logZ = getBetheLogZ( graph, m_options, nodeBeliefs, edgeBeliefs );
+}
+
+/*------------------------------------------------------------------------------
 
-    // Compute energy and entropy from nodes
+                               CTRWBPInference
 
-    for ( size_t nodeIndex = 0; nodeIndex < nodes.size(); nodeIndex++ )
+------------------------------------------------------------------------------*/
+
+namespace
+{
+    /** Log belief of a node in TRW-BP: its log potential plus the incoming
+      * log messages weighted by the appearance probabilities of their edges.
+      */
+    void getTRWLogBelief( const TCompactGraph &cg,
+                          const vector<double> &rho,
+                          const VectorXd &logMessages,
+                          size_t nodeIndex,
+                          VectorXd &logBelief )
     {
-        CNodePtr nodePtr     = nodes[ nodeIndex ];
-        size_t   nodeID      = nodePtr->getID();
-        size_t   N_Neighbors = graph.getNumberOfNodeNeighbors( nodeID );
+        const size_t N_classes = cg.N_classes[nodeIndex];
 
-        // Useful computations and shorcuts
-        VectorXd &nodeBelief        = nodeBeliefs[nodeID];
-        VectorXd logNodeBelief      = UPGMpp::logWithLove(nodeBeliefs[nodeID]);//[nodeID].array().log();
-        VectorXd nodePotentials    = nodePtr->getPotentials( m_options.considerNodeFixedValues );
-        VectorXd logNodePotentials = nodePotentials.array().log();
+        logBelief = cg.logNodePotentials[nodeIndex];
 
-        // Entropy from the node
-        energyNodes += N_Neighbors*( nodeBelief.cwiseProduct( logNodeBelief ).sum() );
+        for ( size_t q = cg.adjOffsets[nodeIndex]; q < cg.adjOffsets[nodeIndex+1]; q++ )
+            logBelief += rho[ cg.adjEdge[q] ]*logMessages.segment( cg.msgOffsets[ cg.adjReverse[q] ], N_classes );
+    }
 
-        // Energy from the node
-        entropyNodes += N_Neighbors*( nodeBelief.cwiseProduct( logNodePotentials ).sum() );
+    /** Sum of x*log(x), taking 0*log(0) as 0. */
+    template <typename T>
+    double sumXLogX( const T &x )
+    {
+        return ( x.array() > 0 ).select( x.array()*x.array().log(), 0 ).sum();
     }
+}
+
+void CTRWBPInferenceMarginal::infer(CGraph &graph,
+                                    map<size_t,VectorXd> &nodeBeliefs,
+                                    map<size_t,MatrixXd> &edgeBeliefs,
+                                    double &logZ)
+{
+    //
+    //  Algorithm workflow:
+    //  1. Get the edge appearance probabilities
+    //  2. Compute the messages passed
+    //  3. Compute node beliefs
+    //  4. Compute edge beliefs
+    //  5. Compute the upper bound of logZ
+    //
+
+    nodeBeliefs.clear();
+    edgeBeliefs.clear();
+    logZ = 0;
+
+    TCompactGraph cg;
+    getCompactGraph( graph, m_options, cg );
+    getLogPotentials( cg );
+
+    const vector<CEdgePtr> &edges = graph.getEdges();
+
+    size_t N_nodes = cg.N_nodes;
+    size_t N_edges = cg.N_edges;
+
+    //
+    // 1. Get the edge appearance probabilities (cached in the graph), and
+    //    weight the log edge potentials with them.
+    //
 
-    boost::posix_time::ptime time_41(boost::posix_time::microsec_clock::local_time());
+    vector<double> rho;
+    getEdgeAppearanceProbabilities( graph, rho );
 
-    // Compute energy and entropy from edges
+    vector<MatrixXd> weightedLogEdgePotentials( N_edges );
 
     for ( size_t edgeIndex = 0; edgeIndex < N_edges; edgeIndex++ )
-    {
-        boost::posix_time::ptime time_411(boost::posix_time::microsec_clock::local_time());
+        weightedLogEdgePotentials[edgeIndex] = cg.logEdgePotentials[edgeIndex] / rho[edgeIndex];
+
+    //
+    // 2. Compute the messages passed (in the log domain)
+    //
 
-        CEdgePtr edgePtr = edges[ edgeIndex ];
-        size_t   edgeID  = edgePtr->getID();
+    VectorXd logMessages = VectorXd::Zero( cg.msgOffsets.back() );
+    VectorXd logBelief( cg.maxClasses );
+    VectorXd cavity( cg.maxClasses );
+    VectorXd newMessage( cg.maxClasses );
+    MatrixXd terms( cg.maxClasses, cg.maxClasses );
 
-        boost::posix_time::ptime time_412(boost::posix_time::microsec_clock::local_time());
+    double smoothing = m_options.particularD["smoothing"];
+
+    m_status = TInferenceStatus();
+    m_status.stopCause = "MaxIterations";
+
+    size_t iteration;
 
-        // Useful computations and shorcuts
-        MatrixXd &edgeBelief       = edgeBeliefs[ edgeID ];
+    for ( iteration = 0; iteration < m_options.maxIterations; iteration++ )
+    {
+        double maxResidual = 0;
 
-        if ( ( edgeBelief.array() > 1e-10).all() )
+        for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
         {
-            //MatrixXd logEdgeBelief     = edgeBelief.array().log();
-            MatrixXd logEdgeBelief;
-            UPGMpp::logWithLove(edgeBelief,logEdgeBelief);
+            const size_t N_classes = cg.N_classes[nodeIndex];
 
-            // Entropy from the edge
-            energyEdges += edgeBelief.cwiseProduct( logEdgeBelief ).sum();
-        }
+            getTRWLogBelief( cg, rho, logMessages, nodeIndex, logBelief );
+
+            for ( size_t p = cg.adjOffsets[nodeIndex]; p < cg.adjOffsets[nodeIndex+1]; p++ )
+            {
+                const size_t N_classesNeighbor = cg.N_classes[ cg.adjNeighbor[p] ];
+                const MatrixXd &weightedLogPotentials = weightedLogEdgePotentials[ cg.adjEdge[p] ];
+
+                // Remove the whole message coming from the neighbor
+                cavity.head( N_classes ) = logBelief -
+                        logMessages.segment( cg.msgOffsets[ cg.adjReverse[p] ], N_classes );
+
+                Block<MatrixXd> nodeTerms = terms.topLeftCorner( N_classes, N_classesNeighbor );
 
-        boost::posix_time::ptime time_413(boost::posix_time::microsec_clock::local_time());
+                if ( cg.adjFirst[p] )
+                    nodeTerms = weightedLogPotentials.colwise() + cavity.head( N_classes );
+                else
+                    nodeTerms = weightedLogPotentials.transpose().colwise() + cavity.head( N_classes );
 
-        MatrixXd &edgePotentials   = edgePtr->getPotentials();
-        MatrixXd logEdgePotentials = edgePotentials.array().log();
+                for ( size_t col = 0; col < N_classesNeighbor; col++ )
+                {
+                    double maxValue = nodeTerms.col(col).maxCoeff();
+                    newMessage(col) = maxValue + std::log( ( nodeTerms.col(col).array() - maxValue ).exp().sum() );
+                }
 
-        boost::posix_time::ptime time_414(boost::posix_time::microsec_clock::local_time());
+                VectorBlock<VectorXd> message = newMessage.head( N_classesNeighbor );
+                VectorBlock<VectorXd> oldMessage = logMessages.segment( cg.msgOffsets[p], N_classesNeighbor );
 
-        // Energy from the edge
-        entropyEdges += edgeBelief.cwiseProduct( logEdgePotentials ).sum();
+                // Normalize new message
+                double maxValue = message.maxCoeff();
+                message.array() -= maxValue + std::log( ( message.array() - maxValue ).exp().sum() );
 
-        boost::posix_time::ptime time_415(boost::posix_time::microsec_clock::local_time());
+                if ( ( smoothing != 0 ) && ( smoothing < 1 ) )
+                {
+                    double logWeight = std::log( 1-smoothing );
 
-//        cout << "Time infer 411 " << boost::posix_time::time_duration(time_412 - time_411).total_nanoseconds() << endl;
-//        cout << "Time infer 412 " << boost::posix_time::time_duration(time_413 - time_412).total_nanoseconds() << endl;
-//        cout << "Time infer 413 " << boost::posix_time::time_duration(time_414 - time_413).total_nanoseconds() << endl;
-//        cout << "Time infer 414 " << boost::posix_time::time_duration(time_415 - time_414).total_nanoseconds() << endl;
+                    for ( size_t k = 0; k < N_classesNeighbor; k++ )
+                    {
+                        double a = message(k);
+                        double b = logWeight + oldMessage(k);
+                        double m = std::max( a, b );
+                        message(k) = m + std::log( std::exp( a-m ) + std::exp( b-m ) );
+                    }
+                }
+
+                maxResidual = std::max( maxResidual, ( message - oldMessage ).cwiseAbs().maxCoeff() );
+
+                oldMessage = message;
+            }
+        }
+
+        m_status.residual = maxResidual;
+
+        if ( maxResidual < m_options.convergency )
+        {
+            m_status.stopCause = "Converged";
+            iteration++;
+            break;
+        }
     }
 
-    // Final Bethe free energy
+    m_status.iterations = iteration;
 
-    double BethefreeEnergy = ( energyNodes - energyEdges ) - ( entropyNodes - entropyEdges );
+    //
+    // 3. Compute node beliefs
+    //
 
-//    if ( isnan(BethefreeEnergy) )
-//    {
-//            cout << "Messages:" << endl;
+    vector<VectorXd> logBeliefs( N_nodes );
+    vector<VectorXd> beliefs( N_nodes );
 
-//            for ( size_t i=0; i < messages.size(); i++)
-//                for ( size_t j=0; j < messages[i].size(); j++)
-//                    for ( size_t k=0; k < messages[i][j].size(); k++ )
-//                        cout << messages[i][j][k] << " ";
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+    {
+        getTRWLogBelief( cg, rho, logMessages, nodeIndex, logBeliefs[nodeIndex] );
 
-//            cout << endl;
+        VectorXd belief = ( logBeliefs[nodeIndex].array() - logBeliefs[nodeIndex].maxCoeff() ).exp();
+        beliefs[nodeIndex] = belief / belief.sum();
 
-//        for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
-//        {
-//            const CNodePtr nodePtr = graph.getNode( nodeIndex );
-//            size_t         nodeID  = nodePtr->getID();
+        nodeBeliefs[ cg.nodeIDs[nodeIndex] ] = beliefs[nodeIndex];
 
-//            cout << "Beliefs of node " << nodeIndex << endl << nodeBeliefs[ nodeID ].transpose() << endl;
-//        }
+        // Energy and entropy of the node
+        logZ += beliefs[nodeIndex].dot( cg.logNodePotentials[nodeIndex] ) - sumXLogX( beliefs[nodeIndex] );
+    }
 
-//        cout << "energyNodes: " << energyNodes << endl;
-//        cout << "energyEdges: " << energyEdges << endl;
-//        cout << "entropyNodes: " << entropyNodes << endl;
-//        cout << "entropyEdges: " << entropyEdges << endl;
-//    }
+    //
+    // 4. Compute edge beliefs
+    //
 
-    // Compute logZ
+    for ( size_t edgeIndex = 0; edgeIndex < N_edges; edgeIndex++ )
+    {
+        size_t node1 = cg.edgeNode1[edgeIndex];
+        size_t node2 = cg.edgeNode2[edgeIndex];
 
-    logZ = - BethefreeEnergy;
+        // Beliefs of the nodes without the message sent by the other one
+        VectorXd logNode1Belief = logBeliefs[node1] -
+                logMessages.segment( cg.msgOffsets[ cg.edgeAdj[2*edgeIndex+1] ], cg.N_classes[node1] );
+        VectorXd logNode2Belief = logBeliefs[node2] -
+                logMessages.segment( cg.msgOffsets[ cg.edgeAdj[2*edgeIndex] ], cg.N_classes[node2] );
 
-    boost::posix_time::ptime time_42(boost::posix_time::microsec_clock::local_time());
+        MatrixXd logEdgeBelief = weightedLogEdgePotentials[edgeIndex];
+        logEdgeBelief.colwise() += logNode1Belief;
+        logEdgeBelief.rowwise() += logNode2Belief.transpose();
 
-//    cout << "Time infer 1 " << boost::posix_time::time_duration(time_1 - time_0).total_nanoseconds() << endl;
-//    cout << "Time infer 2 " << boost::posix_time::time_duration(time_2 - time_1).total_nanoseconds() << endl;
-//    cout << "Time infer 3 " << boost::posix_time::time_duration(time_3 - time_2).total_nanoseconds() << endl;
-//    cout << "Time infer 41 " << boost::posix_time::time_duration(time_41 - time_3).total_nanoseconds() << endl;
-//    cout << "Time infer 42 " << boost::posix_time::time_duration(time_42 - time_41).total_nanoseconds() << endl;
-}
+        MatrixXd edgeBelief = ( logEdgeBelief.array() - logEdgeBelief.maxCoeff() ).exp();
+        edgeBelief /= edgeBelief.sum();
+
+        edgeBeliefs[ edges[edgeIndex]->getID() ] = edgeBelief;
 
+        //
+        // 5. Energy of the edge minus its weighted mutual information
+        //
+
+        double mutualInformation = sumXLogX( edgeBelief ) - sumXLogX( beliefs[node1] ) - sumXLogX( beliefs[node2] );
+
+        logZ += edgeBelief.cwiseProduct( cg.logEdgePotentials[edgeIndex] ).sum() - rho[edgeIndex]*mutualInformation;
+    }
+}
 
 /*------------------------------------------------------------------------------
 
-                               CTRPBPInference
+                               CGibbsInference
 
 ------------------------------------------------------------------------------*/
 
-void CTRPBPInferenceMarginal::infer(CGraph &graph,
+namespace
+{
+    /** SplitMix64 finalizer, a bijective mix of the bits of a number. */
+    inline boost::uint64_t mixBits( boost::uint64_t z )
+    {
+        z += 0x9E3779B97F4A7C15ULL;
+        z = ( z ^ ( z >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+        z = ( z ^ ( z >> 27 ) ) * 0x94D049BB133111EBULL;
+
+        return z ^ ( z >> 31 );
+    }
+
+    /** Counter based random number in [0,1): the same counter (seed,
+      * chain, sweep, node) always gets the same number, regardless of the
+      * thread drawing it.
+      */
+    inline double getCounterUniform( boost::uint64_t seed,
+                                     boost::uint64_t chain,
+                                     boost::uint64_t sweep,
+                                     boost::uint64_t node )
+    {
+        boost::uint64_t z = mixBits( mixBits( mixBits( mixBits( seed ) ^ chain ) ^ sweep ) ^ node );
+
+        // The 53 most significant bits fill the mantissa
+        return ( z >> 11 ) * ( 1.0 / 9007199254740992.0 );
+    }
+
+    /** Samples a class from its log scores, being u a uniform random number
+      * in [0,1).
+      */
+    size_t sampleClass( const VectorXd &scores,
+                        double u,
+                        VectorXd &probabilities )
+    {
+        const size_t N_classes = scores.size();
+
+        probabilities = ( scores.array() - scores.maxCoeff() ).exp();
+
+        double threshold = u*probabilities.sum();
+        double cumulative = 0;
+
+        for ( size_t k = 0; k < N_classes-1; k++ )
+        {
+            cumulative += probabilities(k);
+
+            if ( threshold < cumulative )
+                return k;
+        }
+
+        return N_classes-1;
+    }
+}
+
+void CGibbsInferenceMarginal::infer(CGraph &graph,
                                     map<size_t,VectorXd> &nodeBeliefs,
                                     map<size_t,MatrixXd> &edgeBeliefs,
                                     double &logZ)
 {
     //
     //  Algorithm workflow:
-    //  1. Compute the messages passed
-    //  2. Compute node beliefs
-    //  3. Compute edge beliefs
-    //  4. Compute logZ
+    //  1. Get the nodes of each color
+    //  2. Run the chains, counting the classes of the samples kept
+    //  3. Compute node and edge beliefs
+    //  4. Compute the split R-hat of the node beliefs
+    //  5. Approximate logZ by the Bethe free energy of the beliefs
     //
 
     nodeBeliefs.clear();
     edgeBeliefs.clear();
+    logZ = 0;
+    m_rHat = 0;
 
-    const vector<CNodePtr> nodes = graph.getNodes();
-    const vector<CEdgePtr> edges = graph.getEdges();
-    multimap<size_t,CEdgePtr> edges_f = graph.getEdgesF();
+    TCompactGraph cg;
+    getCompactGraph( graph, m_options, cg );
+    getLogPotentials( cg );
 
-    size_t N_nodes = nodes.size();
-    size_t N_edges = edges.size();
+    const vector<CEdgePtr> &edges = graph.getEdges();
 
-    //
-    // 1. Create spanning trees
-    //
+    size_t N_nodes = cg.N_nodes;
+    size_t N_edges = cg.N_edges;
 
-    bool allNodesAdded = false;
-    vector<vector<size_t > > v_trees;
-    vector<bool> v_addedNodes(N_nodes,false);
-    map<size_t,size_t> addedNodesMap;
+    size_t N_samples = m_options.particularD["samples"];
+    size_t N_burnIn  = m_options.particularD["burnIn"];
+    size_t thinning  = std::max( 1.0, m_options.particularD["thinning"] );
+    size_t N_chains  = std::max( 1.0, m_options.particularD["chains"] );
+#ifdef UPGMpp_USING_OMPENMP
+    size_t N_threads = getNumberOfThreads( m_options );
+#endif
 
-    for (size_t i = 0; i < N_nodes; i++)
-        addedNodesMap[ nodes[i]->getID() ] = i;
+    boost::uint64_t seed = m_options.particularD["seed"];
 
-    while (!allNodesAdded)
-    {
-        allNodesAdded = true;
+    if ( !N_samples )
+        N_samples = m_options.maxIterations;
 
-        vector<size_t> tree;
-        getSpanningTree( graph, tree );
+    if ( !N_samples )
+    {
+        cout << "[ERROR] Gibbs sampling needs at least one sample." << endl;
+        return;
+    }
 
-        // Check that the tree is not empty
-        if ( tree.size() )
-            v_trees.push_back( tree );
+    //
+    // 1. Nodes of each color, the color c having the nodes in
+    //    [colorOffsets[c],colorOffsets[c+1]) of colorNodes
+    //
 
-//        cout << "Tree: ";
+    vector<size_t> colors;
+    size_t N_colors = getNodeColors( graph, cg, colors );
 
-        for ( size_t i_node = 0; i_node < tree.size(); i_node++ )
-        {
-            v_addedNodes[ addedNodesMap[tree[i_node]] ] = true;
-//            cout << tree[i_node] << " ";
-        }
+    vector<size_t> colorOffsets( N_colors+1, 0 );
+    vector<size_t> colorNodes( N_nodes );
 
-//        cout << endl;
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        colorOffsets[ colors[nodeIndex]+1 ]++;
 
-        for ( size_t i_node = 0; i_node < N_nodes; i_node++ )
-            if ( !v_addedNodes[i_node] )
-            {
-                allNodesAdded = false;
-                break;
-            }
+    for ( size_t color = 0; color < N_colors; color++ )
+        colorOffsets[color+1] += colorOffsets[color];
 
-    }
+    vector<size_t> position( colorOffsets.begin(), colorOffsets.end()-1 );
 
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        colorNodes[ position[ colors[nodeIndex] ]++ ] = nodeIndex;
 
     //
-    // 1. Compute messages passed in each tree until convergence
+    // 2. Run the chains. The counts are kept in dense buffers: the classes
+    //    of the node i are in [nodeOffsets[i],nodeOffsets[i+1]) of each
+    //    half of each chain (needed by the split R-hat), and the pairs of
+    //    classes of the edge e (column major) in
+    //    [edgeOffsets[e],edgeOffsets[e+1]) of edgeCounts.
     //
 
-    vector<vector<VectorXd> >   messages;
-    bool                        maximize = false;
+    vector<size_t> nodeOffsets( N_nodes+1, 0 );
+    vector<size_t> edgeOffsets( N_edges+1, 0 );
 
-    double totalSumOfMsgs = std::numeric_limits<double>::max();
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        nodeOffsets[nodeIndex+1] = nodeOffsets[nodeIndex] + cg.N_classes[nodeIndex];
 
-    size_t iteration;
+    for ( size_t edgeIndex = 0; edgeIndex < N_edges; edgeIndex++ )
+        edgeOffsets[edgeIndex+1] = edgeOffsets[edgeIndex] +
+                cg.N_classes[ cg.edgeNode1[edgeIndex] ]*cg.N_classes[ cg.edgeNode2[edgeIndex] ];
 
-    for ( iteration = 0; iteration < m_options.maxIterations; iteration++ )
-    {
+    const size_t N_nodeEntries = nodeOffsets.back();
+    const size_t N_sweeps      = N_burnIn + N_samples*thinning;
 
-        for ( size_t i_tree=0; i_tree < v_trees.size(); i_tree++ )
-            messagesLBP( graph, m_options, messages, maximize, v_trees[i_tree] );
+    vector<double> nodeCounts( 2*N_chains*N_nodeEntries, 0 );
+    vector<double> edgeCounts( edgeOffsets.back(), 0 );
+
+    vector<size_t> labels( N_nodes );
 
-        double newTotalSumOfMsgs = 0;
-        for ( size_t i = 0; i < N_edges; i++ )
+    for ( size_t chain = 0; chain < N_chains; chain++ )
+    {
+        // Random initial assignation (sweep 0)
+        for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+            labels[nodeIndex] = std::min<size_t>( cg.N_classes[nodeIndex]-1,
+                    getCounterUniform( seed, chain, 0, nodeIndex )*cg.N_classes[nodeIndex] );
+
+        #pragma omp parallel num_threads(N_threads)
         {
-            newTotalSumOfMsgs += messages[i][0].sum() + messages[i][1].sum();
+            VectorXd scores;
+            VectorXd probabilities;
+
+            for ( size_t sweep = 1; sweep <= N_sweeps; sweep++ )
+            {
+                for ( size_t color = 0; color < N_colors; color++ )
+                {
+                    // The implicit barrier at the end of the loop keeps the
+                    // colors in order
+                    #pragma omp for schedule(static)
+                    for ( int i = colorOffsets[color]; i < (int)colorOffsets[color+1]; i++ )
+                    {
+                        size_t nodeIndex = colorNodes[i];
+
+                        getLocalScores( cg, labels, nodeIndex, scores );
+
+                        labels[nodeIndex] = sampleClass( scores,
+                                                         getCounterUniform( seed, chain, sweep, nodeIndex ),
+                                                         probabilities );
+                    }
+                }
+
+                if ( ( sweep <= N_burnIn ) || ( ( sweep - N_burnIn ) % thinning ) )
+                    continue;
+
+                // Keep the sample
+                size_t sample = ( sweep - N_burnIn ) / thinning - 1;
+                size_t half   = ( 2*sample < N_samples ) ? 0 : 1;
+                double *counts = &nodeCounts[ ( 2*chain + half )*N_nodeEntries ];
+
+                #pragma omp for schedule(static) nowait
+                for ( int nodeIndex = 0; nodeIndex < (int)N_nodes; nodeIndex++ )
+                    counts[ nodeOffsets[nodeIndex] + labels[nodeIndex] ]++;
+
+                #pragma omp for schedule(static)
+                for ( int edgeIndex = 0; edgeIndex < (int)N_edges; edgeIndex++ )
+                {
+                    size_t node1 = cg.edgeNode1[edgeIndex];
+                    size_t node2 = cg.edgeNode2[edgeIndex];
+
+                    edgeCounts[ edgeOffsets[edgeIndex] + labels[node1] +
+                                labels[node2]*cg.N_classes[node1] ]++;
+                }
+            }
         }
+    }
 
-        if ( std::abs( totalSumOfMsgs - newTotalSumOfMsgs ) <
-             m_options.convergency )
-            break;
+    //
+    // 3. Compute node and edge beliefs
+    //
 
-        totalSumOfMsgs = newTotalSumOfMsgs;
+    const double N_totalSamples = N_chains*N_samples;
 
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+    {
+        VectorXd belief = VectorXd::Zero( cg.N_classes[nodeIndex] );
+
+        for ( size_t halfChain = 0; halfChain < 2*N_chains; halfChain++ )
+            belief += Map<VectorXd>( &nodeCounts[ halfChain*N_nodeEntries + nodeOffsets[nodeIndex] ],
+                                     cg.N_classes[nodeIndex] );
+
+        nodeBeliefs[ cg.nodeIDs[nodeIndex] ] = belief / N_totalSamples;
     }
 
+    for ( size_t edgeIndex = 0; edgeIndex < N_edges; edgeIndex++ )
+        edgeBeliefs[ edges[edgeIndex]->getID() ] =
+                Map<MatrixXd>( &edgeCounts[ edgeOffsets[edgeIndex] ],
+                               cg.N_classes[ cg.edgeNode1[edgeIndex] ],
+                               cg.N_classes[ cg.edgeNode2[edgeIndex] ] ) / N_totalSamples;
+
     //
-    // 2. Compute node beliefs
+    // 4. Compute the split R-hat: each chain is split in two halves, and
+    //    the variance of the frequency of each class within them is
+    //    compared with the variance between them. Values close to 1 mean
+    //    that the chains have mixed.
     //
 
-    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+    const size_t N_halfChains = 2*N_chains;
+    const double n = N_samples / 2;
+
+    if ( N_samples >= 4 )
     {
-        const CNodePtr nodePtr = graph.getNode( nodeIndex );
-        size_t         nodeID  = nodePtr->getID();
-        VectorXd       nodePotPlusIncMsg = nodePtr->getPotentials( m_options.considerNodeFixedValues );
+        // Number of samples in each half, the first one gets the odd one
+        const double samplesInHalf[2] = { N_samples - n, n };
 
-        NEIGHBORS_IT neighbors = edges_f.equal_range(nodeID);
+        vector<double> means( N_halfChains );
 
-        //
-        // Get the messages for all the neighbors, and multiply them with the node potential
-        //
-        for ( multimap<size_t,CEdgePtr>::iterator itNeigbhor = neighbors.first;
-              itNeigbhor != neighbors.second;
-              itNeigbhor++ )
+        for ( size_t entry = 0; entry < N_nodeEntries; entry++ )
         {
-            CEdgePtr edgePtr( (*itNeigbhor).second );
-            size_t edgeIndex = graph.getEdgeIndex( edgePtr->getID() );
+            double meanOfMeans = 0;
+            double W = 0;
 
-            if ( !edgePtr->getNodePosition( nodeID ) ) // nodeID is the first node in the edge
-                nodePotPlusIncMsg = nodePotPlusIncMsg.cwiseProduct(messages[ edgeIndex ][ 1 ]);
-            else // nodeID is the second node in the dege
-                nodePotPlusIncMsg = nodePotPlusIncMsg.cwiseProduct(messages[ edgeIndex ][ 0 ]);
-        }
+            for ( size_t halfChain = 0; halfChain < N_halfChains; halfChain++ )
+            {
+                double p = nodeCounts[ halfChain*N_nodeEntries + entry ] / samplesInHalf[ halfChain % 2 ];
 
-        // Normalize
-        nodePotPlusIncMsg = nodePotPlusIncMsg / nodePotPlusIncMsg.sum();
+                means[halfChain] = p;
+                meanOfMeans += p;
+                W += n/(n-1) * p*(1-p);
+            }
 
-        nodeBeliefs[ nodeID ] = nodePotPlusIncMsg;
+            meanOfMeans /= N_halfChains;
+            W /= N_halfChains;
 
-        //cout << "Beliefs of node " << nodeIndex << endl << nodePotPlusIncMsg << endl;
+            double B = 0;
+
+            for ( size_t halfChain = 0; halfChain < N_halfChains; halfChain++ )
+                B += ( means[halfChain] - meanOfMeans )*( means[halfChain] - meanOfMeans );
+
+            B *= n / ( N_halfChains - 1 );
+
+            double rHat;
+
+            if ( W > 0 )
+                rHat = std::sqrt( ( (n-1)/n*W + B/n ) / W );
+            else
+                rHat = ( B > 0 ) ? std::numeric_limits<double>::infinity() : 1;
+
+            m_rHat = std::max( m_rHat, rHat );
+        }
     }
+    else
+        m_rHat = std::numeric_limits<double>::quiet_NaN();
+
+    m_status = TInferenceStatus();
+    m_status.iterations = N_sweeps;
+    m_status.residual   = m_rHat;
+    m_status.stopCause  = "MaxIterations";
 
     //
-    // 3. Compute edge beliefs
+    // 5. Approximate logZ by the Bethe free energy of the beliefs
     //
 
-    for ( size_t edgeIndex = 0; edgeIndex < N_edges; edgeIndex++ )
-    {
-        CEdgePtr edgePtr = edges[edgeIndex];
-        size_t   edgeID  = edgePtr->getID();
+    logZ = getBetheLogZ( graph, m_options, nodeBeliefs, edgeBeliefs );
+}
 
-        size_t ID1, ID2;
-        edgePtr->getNodesID( ID1, ID2 );
+/*------------------------------------------------------------------------------
 
-        MatrixXd edgePotentials = edgePtr->getPotentials();
-        MatrixXd edgeBelief = edgePotentials;
+                               CMeanFieldInference
 
-        VectorXd &message1To2 = messages[edgeIndex][0];
-        VectorXd &message2To1 = messages[edgeIndex][1];
+------------------------------------------------------------------------------*/
 
-        //cout << "----------------------" << endl;
-        //cout << nodeBeliefs[ ID1 ] << endl;
-        //cout << "----------------------" << endl;
-        //cout << message2To1 << endl;
+namespace
+{
+    /** Log scores of the classes of a node in mean field: its log node
+      * potentials plus the expected log potentials of its edges under the
+      * beliefs of its neighbors.
+      */
+    void getMeanFieldScores( const TCompactGraph &cg,
+                             const vector<VectorXd> &beliefs,
+                             size_t nodeIndex,
+                             VectorXd &scores )
+    {
+        scores = cg.logNodePotentials[nodeIndex];
 
-        VectorXd node1Belief = nodeBeliefs[ ID1 ].cwiseQuotient( message2To1 );
-        VectorXd node2Belief = nodeBeliefs[ ID2 ].cwiseQuotient( message1To2 );
+        for ( size_t p = cg.adjOffsets[nodeIndex]; p < cg.adjOffsets[nodeIndex+1]; p++ )
+        {
+            size_t neighbor = cg.adjNeighbor[p];
+            const MatrixXd &logPotentials = cg.logEdgePotentials[ cg.adjEdge[p] ];
 
-        //cout << "----------------------" << endl;
+            if ( neighbor == nodeIndex )
+            {
+                // Self loops appear twice, and both ends take the same class
+                if ( cg.adjFirst[p] )
+                    scores += logPotentials.diagonal();
+            }
+            else if ( cg.adjFirst[p] )
+                scores.noalias() += logPotentials * beliefs[neighbor];
+            else
+                scores.noalias() += logPotentials.transpose() * beliefs[neighbor];
+        }
+    }
+}
 
-        MatrixXd node1BeliefMatrix ( edgePotentials.rows(), edgePotentials.cols() );
-        for ( size_t row = 0; row < edgePotentials.rows(); row++ )
-            for ( size_t col = 0; col < edgePotentials.cols(); col++ )
-                node1BeliefMatrix(row,col) = node1Belief(row);
+void CMeanFieldInferenceMarginal::infer(CGraph &graph,
+                                        map<size_t,VectorXd> &nodeBeliefs,
+                                        map<size_t,MatrixXd> &edgeBeliefs,
+                                        double &logZ)
+{
+    //
+    //  Algorithm workflow:
+    //  1. Initialize the beliefs with the normalized node potentials
+    //  2. Update the beliefs until convergence
+    //  3. Compute node beliefs and the energy and entropy of the nodes
+    //  4. Compute edge beliefs and their energy (the ELBO)
+    //
 
-        //cout << "Node 1 belief matrix: " << endl << node1BeliefMatrix << endl;
+    nodeBeliefs.clear();
+    edgeBeliefs.clear();
+    logZ = 0;
 
-        edgeBelief = edgeBelief.cwiseProduct( node1BeliefMatrix );
+    TCompactGraph cg;
+    getCompactGraph( graph, m_options, cg );
+    getLogPotentials( cg );
 
-        MatrixXd node2BeliefMatrix ( edgePotentials.rows(), edgePotentials.cols() );
-        for ( size_t row = 0; row < edgePotentials.rows(); row++ )
-            for ( size_t col = 0; col < edgePotentials.cols(); col++ )
-                node2BeliefMatrix(row,col) = node2Belief(col);
+    const vector<CEdgePtr> &edges = graph.getEdges();
 
-        //cout << "Node 2 belief matrix: " << endl << node2BeliefMatrix << endl;
+    size_t N_nodes   = cg.N_nodes;
+    size_t N_edges   = cg.N_edges;
+#ifdef UPGMpp_USING_OMPENMP
+    size_t N_threads = getNumberOfThreads( m_options );
+#endif
 
-        edgeBelief = edgeBelief.cwiseProduct( node2BeliefMatrix );
+    double damping = m_options.particularD["damping"];
 
-        //cout << "Edge potentials" << endl << edgePotentials << endl;
-        //cout << "Edge beliefs" << endl << edgeBelief << endl;
+    if ( ( damping < 0 ) || ( damping >= 1 ) )
+    {
+        cout << "[ERROR] The damping of mean field must be in [0,1)." << endl;
+        return;
+    }
 
-        // Normalize
-        edgeBelief = edgeBelief / edgeBelief.sum();
+    //
+    // 1. Initialize the beliefs with the normalized node potentials
+    //
 
+    vector<VectorXd> beliefs( N_nodes );
+    vector<VectorXd> newBeliefs( N_nodes );
 
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+    {
+        const VectorXd &logPotentials = cg.logNodePotentials[nodeIndex];
 
-        edgeBeliefs[ edgeID ] = edgeBelief;
+        beliefs[nodeIndex] = ( logPotentials.array() - logPotentials.maxCoeff() ).exp();
+        beliefs[nodeIndex] /= beliefs[nodeIndex].sum();
     }
 
     //
-    // 4. Compute logZ
+    // 2. Update the beliefs of all the nodes in parallel
     //
 
-    double energyNodes  = 0;
-    double energyEdges  = 0;
-    double entropyNodes = 0;
-    double entropyEdges = 0;
+    m_status = TInferenceStatus();
+    m_status.stopCause = "MaxIterations";
 
-    // Compute energy and entropy from nodes
+    size_t iteration;
 
-    for ( size_t nodeIndex = 0; nodeIndex < nodes.size(); nodeIndex++ )
+    for ( iteration = 0; iteration < m_options.maxIterations; iteration++ )
     {
-        CNodePtr nodePtr     = nodes[ nodeIndex ];
-        size_t   nodeID      = nodePtr->getID();
-        size_t   N_Neighbors = graph.getNumberOfNodeNeighbors( nodeID );
+        double maxResidual = 0;
 
-        // Useful computations and shorcuts
-        VectorXd &nodeBelief        = nodeBeliefs[nodeID];
-        VectorXd logNodeBelief      = nodeBeliefs[nodeID].array().log();
-        VectorXd nodePotentials    = nodePtr->getPotentials( m_options.considerNodeFixedValues );
-        VectorXd logNodePotentials = nodePotentials.array().log();
+        #pragma omp parallel num_threads(N_threads)
+        {
+            VectorXd scores;
+            double threadResidual = 0;
 
-        // Entropy from the node
-        energyNodes += N_Neighbors*( nodeBelief.cwiseProduct( logNodeBelief ).sum() );
+            #pragma omp for schedule(static)
+            for ( int nodeIndex = 0; nodeIndex < (int)N_nodes; nodeIndex++ )
+            {
+                getMeanFieldScores( cg, beliefs, nodeIndex, scores );
 
-        // Energy from the node
-        entropyNodes += N_Neighbors*( nodeBelief.cwiseProduct( logNodePotentials ).sum() );
-    }
+                VectorXd &belief = newBeliefs[nodeIndex];
 
-    // Compute energy and entropy from nodes
+                belief = ( scores.array() - scores.maxCoeff() ).exp();
+                belief /= belief.sum();
 
-    for ( size_t edgeIndex = 0; edgeIndex < N_edges; edgeIndex++ )
-    {
-        CEdgePtr edgePtr = edges[ edgeIndex ];
-        size_t   edgeID  = edgePtr->getID();
-
-        // Useful computations and shorcuts
-        MatrixXd &edgeBelief       = edgeBeliefs[ edgeID ];
-        MatrixXd logEdgeBelief     = edgeBelief.array().log();
-        MatrixXd &edgePotentials   = edgePtr->getPotentials();
-        MatrixXd logEdgePotentials = edgePotentials.array().log();
+                if ( damping )
+                    belief = ( 1-damping )*belief + damping*beliefs[nodeIndex];
 
-        // Entropy from the edge
-        energyEdges += edgeBelief.cwiseProduct( logEdgeBelief ).sum();
+                threadResidual = std::max( threadResidual,
+                                           ( belief - beliefs[nodeIndex] ).cwiseAbs().maxCoeff() );
+            }
 
-        // Energy from the edge
-        entropyEdges += edgeBelief.cwiseProduct( logEdgePotentials ).sum();
+            #pragma omp critical(meanFieldResidual)
+            maxResidual = std::max( maxResidual, threadResidual );
+        }
 
-    }
+        beliefs.swap( newBeliefs );
 
-    // Final Bethe free energy
+        m_status.residual = maxResidual;
 
-    double BethefreeEnergy = ( energyNodes - energyEdges ) - ( entropyNodes - entropyEdges );
+        if ( maxResidual < m_options.convergency )
+        {
+            m_status.stopCause = "Converged";
+            iteration++;
+            break;
+        }
+    }
 
-    // Compute logZ
+    m_status.iterations = iteration;
 
-    logZ = - BethefreeEnergy;
+    //
+    // 3. Compute node beliefs, and the energy and entropy of the nodes
+    //
 
-}
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+    {
+        nodeBeliefs[ cg.nodeIDs[nodeIndex] ] = beliefs[nodeIndex];
 
-/*------------------------------------------------------------------------------
+        logZ += beliefs[nodeIndex].dot( cg.logNodePotentials[nodeIndex] ) - sumXLogX( beliefs[nodeIndex] );
+    }
 
-                               CRBPInference
+    //
+    // 4. Compute edge beliefs (independent nodes), and their energy
+    //
 
-------------------------------------------------------------------------------*/
+    for ( size_t edgeIndex = 0; edgeIndex < N_edges; edgeIndex++ )
+    {
+        size_t node1 = cg.edgeNode1[edgeIndex];
+        size_t node2 = cg.edgeNode2[edgeIndex];
 
-void CRBPInferenceMarginal::infer(CGraph &graph,
-                                    map<size_t,VectorXd> &nodeBeliefs,
-                                    map<size_t,MatrixXd> &edgeBeliefs,
-                                    double &logZ)
-{
-    CLBPInferenceMarginal LBPinference;
+        MatrixXd edgeBelief;
 
-    m_options.particularS["order"] = "RBP";
+        if ( node1 == node2 )
+            edgeBelief = beliefs[node1].asDiagonal();
+        else
+            edgeBelief = beliefs[node1] * beliefs[node2].transpose();
 
-    LBPinference.setOptions( m_options );
-    LBPinference.infer( graph, nodeBeliefs, edgeBeliefs, logZ );
+        edgeBeliefs[ edges[edgeIndex]->getID() ] = edgeBelief;
 
+        logZ += edgeBelief.cwiseProduct( cg.logEdgePotentials[edgeIndex] ).sum();
+    }
 }
@@ -33,6 +33,7 @@ namespace UPGMpp
 
         TInferenceOptions                       m_options;
         std::map<size_t,std::vector<size_t> >   m_mask; //!< This makes sense in inference?
+        TInferenceStatus                        m_status; //!< How the last inference finished.
 
     public:
 
@@ -46,8 +47,70 @@ namespace UPGMpp
         inline void setMask ( std::map<size_t,std::vector<size_t> > &mask )
             { m_mask = mask; }
 
+        /** Returns how the last inference process finished: iterations,
+          * residual and stop cause.
+          */
+        inline const TInferenceStatus& getStatus() const { return m_status; }
+
+    };
+
+    /** Exact marginals and logZ for graphs without cycles (chains, trees
+      * and forests), by forward-backward in O(N*K^2). See
+      * getForestMarginals.
+      */
+    class CTreeInferenceMarginal : public CInferenceMarginal
+    {
+    public:
+        void infer(CGraph &graph,
+                   std::map<size_t,Eigen::VectorXd> &nodeBeliefs,
+                   std::map<size_t,Eigen::MatrixXd> &edgeBeliefs,
+                   double &logZ);
+    };
+
+    /** Exact marginals and logZ for graphs with a low treewidth, by
+      * sum-product message passing over a junction tree (see
+      * getJunctionTreeMarginals). Options: particularS["eliminationOrder"]
+      * ("MinFill" or "MinDegree") and particularD["maxTableSize"].
+      */
+    class CJunctionTreeInferenceMarginal : public CInferenceMarginal
+    {
+    public:
+        void infer(CGraph &graph,
+                   std::map<size_t,Eigen::VectorXd> &nodeBeliefs,
+                   std::map<size_t,Eigen::MatrixXd> &edgeBeliefs,
+                   double &logZ);
     };
 
+    /** Computes logZ by variable elimination (see eliminateVariables),
+      * exact or, if the tables exceed particularD["maxTableSize"], an upper
+      * bound from mini-buckets. It is intended to validate the logZ of other
+      * methods, so node and edge beliefs are not computed (use the junction
+      * tree for exact marginals).
+      */
+    class CVariableEliminationInferenceMarginal : public CInferenceMarginal
+    {
+    private:
+        bool    m_exact;  //!< False if mini-buckets were needed.
+
+    public:
+
+        CVariableEliminationInferenceMarginal() : m_exact( true )
+        {}
+
+        void infer(CGraph &graph,
+                   std::map<size_t,Eigen::VectorXd> &nodeBeliefs,
+                   std::map<size_t,Eigen::MatrixXd> &edgeBeliefs,
+                   double &logZ);
+
+        inline bool isExact() const { return m_exact; }
+    };
+
+    /** Loopy Belief Propagation. The acyclic connected components of the
+      * graph are solved exactly by CTreeInferenceMarginal, unless
+      * particularB["skipExactTrees"] is true, so messages are only passed
+      * in the components with cycles and the Bethe approximation of logZ
+      * is only used for them.
+      */
     class CLBPInferenceMarginal : public CInferenceMarginal
     {
     public:
@@ -74,6 +137,84 @@ namespace UPGMpp
                    std::map<size_t,Eigen::MatrixXd> &edgeBeliefs,
                    double &logZ);
     };
+
+    class CSplashInferenceMarginal : public CInferenceMarginal
+    {
+    public:
+        void infer(CGraph &graph,
+                   std::map<size_t,Eigen::VectorXd> &nodeBeliefs,
+                   std::map<size_t,Eigen::MatrixXd> &edgeBeliefs,
+                   double &logZ);
+    };
+
+    /** Tree-reweighted belief propagation (sum-product). Messages are
+      * weighted by the edge appearance probabilities of a spanning forests
+      * cover of the graph (see getEdgeAppearanceProbabilities), computed
+      * once per topology. The returned logZ is the TRW upper bound, being
+      * exact on forests.
+      */
+    class CTRWBPInferenceMarginal : public CInferenceMarginal
+    {
+    public:
+        void infer(CGraph &graph,
+                   std::map<size_t,Eigen::VectorXd> &nodeBeliefs,
+                   std::map<size_t,Eigen::MatrixXd> &edgeBeliefs,
+                   double &logZ);
+    };
+
+    /** Gibbs sampling. The nodes are colored so neighbors have different
+      * colors (see getNodeColors), and all the nodes of a color are
+      * resampled in parallel. Random numbers are computed from a counter
+      * (chain, sweep, node) and particularD["seed"], so the samples do not
+      * depend on the number of threads. Options:
+      *  - particularD["samples"]: samples kept by each chain
+      *    (options.maxIterations if 0).
+      *  - particularD["burnIn"]: sweeps discarded at the beginning of each
+      *    chain.
+      *  - particularD["thinning"]: a sample is kept every thinning sweeps.
+      *  - particularD["chains"]: number of chains, starting at random
+      *    assignations (1 if 0).
+      * Beliefs are the frequencies of the classes in the samples of all
+      * the chains, and logZ is approximated by the Bethe free energy of
+      * them. The split R-hat of the node beliefs (the max among all the
+      * classes) is returned by getRHat and as the status residual (NaN
+      * with less than 4 samples per chain).
+      */
+    class CGibbsInferenceMarginal : public CInferenceMarginal
+    {
+    private:
+        double  m_rHat;  //!< Potential scale reduction factor of the last inference.
+
+    public:
+
+        CGibbsInferenceMarginal() : m_rHat( 0 )
+        {}
+
+        void infer(CGraph &graph,
+                   std::map<size_t,Eigen::VectorXd> &nodeBeliefs,
+                   std::map<size_t,Eigen::MatrixXd> &edgeBeliefs,
+                   double &logZ);
+
+        inline double getRHat() const { return m_rHat; }
+    };
+
+    /** Naive mean field. Each node belief is updated from the expected log
+      * potentials of its edges under the beliefs of its neighbors, one
+      * matrix-vector product per edge, in the log domain. All the nodes are
+      * updated in parallel from the beliefs of the previous iteration,
+      * mixed with them by particularD["damping"] (the weight of the old
+      * beliefs, in [0,1)) to avoid oscillations. Edge beliefs are the
+      * products of the beliefs of their nodes, and the returned logZ is
+      * the ELBO, a lower bound of the exact one.
+      */
+    class CMeanFieldInferenceMarginal : public CInferenceMarginal
+    {
+    public:
+        void infer(CGraph &graph,
+                   std::map<size_t,Eigen::VectorXd> &nodeBeliefs,
+                   std::map<size_t,Eigen::MatrixXd> &edgeBeliefs,
+                   double &logZ);
+    };
 }
 
 #endif
@@ -0,0 +1,1290 @@
+
+/*---------------------------------------------------------------------------*
+ |                               UPGM++                                      |
+ |                   Undirected Graphical Models in C++                      |
+ |                                                                           |
+ |              Copyright (C) 2014 Jose Raul Ruiz Sarmiento                  |
+ |                 University of Malaga (jotaraul@uma.es)                    |
+ |                                                                           |
+ |   This program is free software: you can redistribute it and/or modify    |
+ |   it under the terms of the GNU General Public License as published by    |
+ |   the Free Software Foundation, either version 3 of the License, or       |
+ |   (at your option) any later version.                                     |
+ |                                                                           |
+ |   This program is distributed in the hope that it will be useful,         |
+ |   but WITHOUT ANY WARRANTY; without even the implied warranty of          |
+ |   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           |
+ |   GNU General Public License for more details.                            |
+ |   <http://www.gnu.org/licenses/>                                          |
+ |                                                                           |
+ *---------------------------------------------------------------------------*/
+
+#include "inference_maxflow.hpp"
+
+#include <limits>
+#include <algorithm>
+
+using namespace UPGMpp;
+using namespace std;
+
+
+/*------------------------------------------------------------------------------
+
+                                CBKMaxFlow
+
+------------------------------------------------------------------------------*/
+
+const size_t CBKMaxFlow::NONE;
+const size_t CBKMaxFlow::TERMINAL;
+const size_t CBKMaxFlow::ORPHAN;
+
+void CBKMaxFlow::reset( size_t N_nodes )
+{
+    TNode node;
+    node.first            = NONE;
+    node.parent           = NONE;
+    node.next             = NONE;
+    node.timestamp        = 0;
+    node.distance         = 0;
+    node.isSink           = false;
+    node.isMarked         = false;
+    node.terminalResidual = 0;
+
+    m_nodes.assign( N_nodes, node );
+    m_arcs.clear();
+    m_orphans.clear();
+
+    m_flow   = 0;
+    m_time   = 0;
+    m_solved = false;
+}
+
+void CBKMaxFlow::addTerminalWeights( size_t node, double sourceCapacity, double sinkCapacity )
+{
+    // Only the difference between both capacities has to be pushed through
+    // the network, the rest is flow from the source to the sink
+
+    double residual = m_nodes[node].terminalResidual;
+
+    if ( residual > 0 )
+        sourceCapacity += residual;
+    else
+        sinkCapacity -= residual;
+
+    m_flow += std::min( sourceCapacity, sinkCapacity );
+    m_nodes[node].terminalResidual = sourceCapacity - sinkCapacity;
+
+    if ( m_solved )
+        markNode( node );
+}
+
+void CBKMaxFlow::addEdge( size_t node1, size_t node2, double capacity, double reverseCapacity )
+{
+    size_t a    = m_arcs.size();
+    size_t aRev = a + 1;
+
+    TArc arc;
+
+    arc.head     = node2;
+    arc.next     = m_nodes[node1].first;
+    arc.sister   = aRev;
+    arc.residual = capacity;
+    m_arcs.push_back( arc );
+
+    arc.head     = node1;
+    arc.next     = m_nodes[node2].first;
+    arc.sister   = a;
+    arc.residual = reverseCapacity;
+    m_arcs.push_back( arc );
+
+    m_nodes[node1].first = a;
+    m_nodes[node2].first = aRev;
+
+    if ( m_solved )
+    {
+        markNode( node1 );
+        markNode( node2 );
+    }
+}
+
+void CBKMaxFlow::addEdgeCapacities( size_t edge, double capacity, double reverseCapacity )
+{
+    size_t a     = 2*edge;
+    size_t aRev  = a + 1;
+    size_t node1 = m_arcs[aRev].head;
+    size_t node2 = m_arcs[a].head;
+
+    m_arcs[a].residual    += capacity;
+    m_arcs[aRev].residual += reverseCapacity;
+
+    // If the flow through an arc exceeds its new capacity, the excess e is
+    // moved to the reverse arc, and the energy is kept through the terminal
+    // weights: -e(1-x1)x2 = -e*x1(1-x2) + e*x1 - e*x2
+
+    if ( m_arcs[a].residual < 0 )
+    {
+        double excess = -m_arcs[a].residual;
+
+        m_arcs[a].residual = 0;
+        m_arcs[aRev].residual -= excess;
+
+        addTerminalWeights( node1, excess, 0 );
+        addTerminalWeights( node2, -excess, 0 );
+    }
+
+    if ( m_arcs[aRev].residual < 0 )
+    {
+        double excess = -m_arcs[aRev].residual;
+
+        m_arcs[aRev].residual = 0;
+        m_arcs[a].residual -= excess;
+
+        addTerminalWeights( node2, excess, 0 );
+        addTerminalWeights( node1, -excess, 0 );
+    }
+
+    if ( m_solved )
+    {
+        markNode( node1 );
+        markNode( node2 );
+    }
+}
+
+void CBKMaxFlow::markNode( size_t node )
+{
+    // Marked nodes are kept in the second queue until the next max-flow
+    if ( !m_nodes[node].isMarked )
+    {
+        setActive( node );
+        m_nodes[node].isMarked = true;
+    }
+}
+
+bool CBKMaxFlow::isSinkSegment( size_t node ) const
+{
+    const TNode &n = m_nodes[node];
+
+    // Nodes out of the source tree are not reachable from the source
+    return ( n.parent == NONE ) || n.isSink;
+}
+
+void CBKMaxFlow::setActive( size_t node )
+{
+    // Nodes activated now are processed after the current queue
+    if ( m_nodes[node].next == NONE )
+    {
+        if ( m_queueLast[1] != NONE )
+            m_nodes[ m_queueLast[1] ].next = node;
+        else
+            m_queueFirst[1] = node;
+
+        m_queueLast[1] = node;
+        m_nodes[node].next = node;
+    }
+}
+
+size_t CBKMaxFlow::getNextActive()
+{
+    while ( true )
+    {
+        size_t node = m_queueFirst[0];
+
+        if ( node == NONE )
+        {
+            m_queueFirst[0] = node = m_queueFirst[1];
+            m_queueLast[0]  = m_queueLast[1];
+            m_queueFirst[1] = NONE;
+            m_queueLast[1]  = NONE;
+
+            if ( node == NONE )
+                return NONE;
+        }
+
+        // Remove it from the queue
+        if ( m_nodes[node].next == node )
+            m_queueFirst[0] = m_queueLast[0] = NONE;
+        else
+            m_queueFirst[0] = m_nodes[node].next;
+
+        m_nodes[node].next = NONE;
+
+        // Free nodes are not active
+        if ( m_nodes[node].parent != NONE )
+            return node;
+    }
+}
+
+void CBKMaxFlow::setOrphanFront( size_t node )
+{
+    m_nodes[node].parent = ORPHAN;
+    m_orphans.push_front( node );
+}
+
+void CBKMaxFlow::setOrphanRear( size_t node )
+{
+    m_nodes[node].parent = ORPHAN;
+    m_orphans.push_back( node );
+}
+
+void CBKMaxFlow::initialize()
+{
+    m_queueFirst[0] = m_queueLast[0] = NONE;
+    m_queueFirst[1] = m_queueLast[1] = NONE;
+    m_orphans.clear();
+    m_time = 0;
+
+    for ( size_t i = 0; i < m_nodes.size(); i++ )
+    {
+        TNode &node = m_nodes[i];
+
+        node.next      = NONE;
+        node.timestamp = m_time;
+
+        if ( node.terminalResidual != 0 )
+        {
+            node.isSink   = ( node.terminalResidual < 0 );
+            node.parent   = TERMINAL;
+            node.distance = 1;
+            setActive( i );
+        }
+        else
+            node.parent = NONE;
+    }
+}
+
+void CBKMaxFlow::reuseTrees()
+{
+    // The marked nodes become children of their terminal, or orphans if
+    // they are not linked to any of them anymore, and so do the children
+    // of the nodes changing of tree.
+
+    size_t node = m_queueFirst[1];
+
+    m_queueFirst[0] = m_queueLast[0] = NONE;
+    m_queueFirst[1] = m_queueLast[1] = NONE;
+    m_orphans.clear();
+    m_time++;
+
+    while ( node != NONE )
+    {
+        TNode &n = m_nodes[node];
+
+        size_t current = node;
+        node = ( n.next == node ) ? NONE : n.next;
+
+        n.next     = NONE;
+        n.isMarked = false;
+        setActive( current );
+
+        if ( n.terminalResidual == 0 )
+        {
+            if ( n.parent != NONE )
+                setOrphanRear( current );
+
+            continue;
+        }
+
+        bool isSink = ( n.terminalResidual < 0 );
+
+        if ( ( n.parent == NONE ) || ( n.isSink != isSink ) )
+        {
+            n.isSink = isSink;
+
+            for ( size_t a = n.first; a != NONE; a = m_arcs[a].next )
+            {
+                size_t j  = m_arcs[a].head;
+                TNode &nj = m_nodes[j];
+
+                if ( nj.isMarked )
+                    continue;
+
+                if ( nj.parent == m_arcs[a].sister )
+                    setOrphanRear( j );
+
+                // Neighbors in the other tree may reach the node now
+                double residual = isSink ? m_arcs[ m_arcs[a].sister ].residual
+                                         : m_arcs[a].residual;
+
+                if ( ( nj.parent != NONE ) && ( nj.isSink != isSink ) && residual )
+                    setActive( j );
+            }
+        }
+
+        n.parent    = TERMINAL;
+        n.timestamp = m_time;
+        n.distance  = 1;
+    }
+
+    while ( !m_orphans.empty() )
+    {
+        size_t orphan = m_orphans.front();
+        m_orphans.pop_front();
+
+        if ( m_nodes[orphan].isSink )
+            processSinkOrphan( orphan );
+        else
+            processSourceOrphan( orphan );
+    }
+}
+
+void CBKMaxFlow::augment( size_t middleArc )
+{
+    // 1. Find the bottleneck of the path
+
+    double bottleneck = m_arcs[middleArc].residual;
+    size_t node, a;
+
+    for ( node = m_arcs[ m_arcs[middleArc].sister ].head; ; node = m_arcs[a].head )
+    {
+        a = m_nodes[node].parent;
+
+        if ( a == TERMINAL )
+            break;
+
+        bottleneck = std::min( bottleneck, m_arcs[ m_arcs[a].sister ].residual );
+    }
+
+    bottleneck = std::min( bottleneck, m_nodes[node].terminalResidual );
+
+    for ( node = m_arcs[middleArc].head; ; node = m_arcs[a].head )
+    {
+        a = m_nodes[node].parent;
+
+        if ( a == TERMINAL )
+            break;
+
+        bottleneck = std::min( bottleneck, m_arcs[a].residual );
+    }
+
+    bottleneck = std::min( bottleneck, -m_nodes[node].terminalResidual );
+
+    // 2. Augment, making orphans the nodes whose link to their parent
+    //    becomes saturated
+
+    m_arcs[ m_arcs[middleArc].sister ].residual += bottleneck;
+    m_arcs[middleArc].residual -= bottleneck;
+
+    for ( node = m_arcs[ m_arcs[middleArc].sister ].head; ; node = m_arcs[a].head )
+    {
+        a = m_nodes[node].parent;
+
+        if ( a == TERMINAL )
+            break;
+
+        m_arcs[a].residual += bottleneck;
+        m_arcs[ m_arcs[a].sister ].residual -= bottleneck;
+
+        if ( !m_arcs[ m_arcs[a].sister ].residual )
+            setOrphanFront( node );
+    }
+
+    m_nodes[node].terminalResidual -= bottleneck;
+
+    if ( !m_nodes[node].terminalResidual )
+        setOrphanFront( node );
+
+    for ( node = m_arcs[middleArc].head; ; node = m_arcs[a].head )
+    {
+        a = m_nodes[node].parent;
+
+        if ( a == TERMINAL )
+            break;
+
+        m_arcs[ m_arcs[a].sister ].residual += bottleneck;
+        m_arcs[a].residual -= bottleneck;
+
+        if ( !m_arcs[a].residual )
+            setOrphanFront( node );
+    }
+
+    m_nodes[node].terminalResidual += bottleneck;
+
+    if ( !m_nodes[node].terminalResidual )
+        setOrphanFront( node );
+
+    m_flow += bottleneck;
+}
+
+void CBKMaxFlow::processSourceOrphan( size_t node )
+{
+    const size_t infinite = std::numeric_limits<size_t>::max();
+
+    size_t minArc      = NONE;
+    size_t minDistance = infinite;
+
+    // Look for a new parent in the source tree, with a valid origin and the
+    // shortest distance to the source
+
+    for ( size_t a0 = m_nodes[node].first; a0 != NONE; a0 = m_arcs[a0].next )
+    {
+        if ( !m_arcs[ m_arcs[a0].sister ].residual )
+            continue;
+
+        size_t j = m_arcs[a0].head;
+        size_t a = m_nodes[j].parent;
+
+        if ( m_nodes[j].isSink || ( a == NONE ) )
+            continue;
+
+        size_t distance = 0;
+
+        while ( true )
+        {
+            if ( m_nodes[j].timestamp == m_time )
+            {
+                distance += m_nodes[j].distance;
+                break;
+            }
+
+            a = m_nodes[j].parent;
+            distance++;
+
+            if ( a == TERMINAL )
+            {
+                m_nodes[j].timestamp = m_time;
+                m_nodes[j].distance  = 1;
+                break;
+            }
+
+            if ( a == ORPHAN )
+            {
+                distance = infinite;
+                break;
+            }
+
+            j = m_arcs[a].head;
+        }
+
+        if ( distance < infinite )
+        {
+            if ( distance < minDistance )
+            {
+                minArc      = a0;
+                minDistance = distance;
+            }
+
+            // Set the marks along the path
+            for ( j = m_arcs[a0].head; m_nodes[j].timestamp != m_time; j = m_arcs[ m_nodes[j].parent ].head )
+            {
+                m_nodes[j].timestamp = m_time;
+                m_nodes[j].distance  = distance--;
+            }
+        }
+    }
+
+    m_nodes[node].parent = minArc;
+
+    if ( minArc != NONE )
+    {
+        m_nodes[node].timestamp = m_time;
+        m_nodes[node].distance  = minDistance + 1;
+        return;
+    }
+
+    // No parent found, the node becomes free and its children orphans
+
+    for ( size_t a0 = m_nodes[node].first; a0 != NONE; a0 = m_arcs[a0].next )
+    {
+        size_t j = m_arcs[a0].head;
+        size_t a = m_nodes[j].parent;
+
+        if ( m_nodes[j].isSink || ( a == NONE ) )
+            continue;
+
+        if ( m_arcs[ m_arcs[a0].sister ].residual )
+            setActive( j );
+
+        if ( ( a != TERMINAL ) && ( a != ORPHAN ) && ( m_arcs[a].head == node ) )
+            setOrphanRear( j );
+    }
+}
+
+void CBKMaxFlow::processSinkOrphan( size_t node )
+{
+    const size_t infinite = std::numeric_limits<size_t>::max();
+
+    size_t minArc      = NONE;
+    size_t minDistance = infinite;
+
+    for ( size_t a0 = m_nodes[node].first; a0 != NONE; a0 = m_arcs[a0].next )
+    {
+        if ( !m_arcs[a0].residual )
+            continue;
+
+        size_t j = m_arcs[a0].head;
+        size_t a = m_nodes[j].parent;
+
+        if ( !m_nodes[j].isSink || ( a == NONE ) )
+            continue;
+
+        size_t distance = 0;
+
+        while ( true )
+        {
+            if ( m_nodes[j].timestamp == m_time )
+            {
+                distance += m_nodes[j].distance;
+                break;
+            }
+
+            a = m_nodes[j].parent;
+            distance++;
+
+            if ( a == TERMINAL )
+            {
+                m_nodes[j].timestamp = m_time;
+                m_nodes[j].distance  = 1;
+                break;
+            }
+
+            if ( a == ORPHAN )
+            {
+                distance = infinite;
+                break;
+            }
+
+            j = m_arcs[a].head;
+        }
+
+        if ( distance < infinite )
+        {
+            if ( distance < minDistance )
+            {
+                minArc      = a0;
+                minDistance = distance;
+            }
+
+            for ( j = m_arcs[a0].head; m_nodes[j].timestamp != m_time; j = m_arcs[ m_nodes[j].parent ].head )
+            {
+                m_nodes[j].timestamp = m_time;
+                m_nodes[j].distance  = distance--;
+            }
+        }
+    }
+
+    m_nodes[node].parent = minArc;
+
+    if ( minArc != NONE )
+    {
+        m_nodes[node].timestamp = m_time;
+        m_nodes[node].distance  = minDistance + 1;
+        return;
+    }
+
+    for ( size_t a0 = m_nodes[node].first; a0 != NONE; a0 = m_arcs[a0].next )
+    {
+        size_t j = m_arcs[a0].head;
+        size_t a = m_nodes[j].parent;
+
+        if ( !m_nodes[j].isSink || ( a == NONE ) )
+            continue;
+
+        if ( m_arcs[a0].residual )
+            setActive( j );
+
+        if ( ( a != TERMINAL ) && ( a != ORPHAN ) && ( m_arcs[a].head == node ) )
+            setOrphanRear( j );
+    }
+}
+
+double CBKMaxFlow::maxFlow()
+{
+    if ( m_solved )
+        reuseTrees();
+    else
+        initialize();
+
+    m_solved = true;
+
+    size_t current = NONE;
+
+    while ( true )
+    {
+        size_t node = current;
+
+        if ( node != NONE )
+        {
+            m_nodes[node].next = NONE;
+
+            if ( m_nodes[node].parent == NONE )
+                node = NONE;
+        }
+
+        if ( node == NONE )
+        {
+            node = getNextActive();
+
+            if ( node == NONE )
+                break;
+        }
+
+        //
+        // Growth: look for a path to the other tree
+        //
+
+        size_t middleArc = NONE;
+        TNode &n = m_nodes[node];
+
+        for ( size_t a = n.first; a != NONE; a = m_arcs[a].next )
+        {
+            bool   residual = n.isSink ? ( m_arcs[ m_arcs[a].sister ].residual != 0 )
+                                       : ( m_arcs[a].residual != 0 );
+            if ( !residual )
+                continue;
+
+            size_t j  = m_arcs[a].head;
+            TNode &nj = m_nodes[j];
+
+            if ( nj.parent == NONE )
+            {
+                nj.isSink    = n.isSink;
+                nj.parent    = m_arcs[a].sister;
+                nj.timestamp = n.timestamp;
+                nj.distance  = n.distance + 1;
+                setActive( j );
+            }
+            else if ( nj.isSink != n.isSink )
+            {
+                middleArc = n.isSink ? m_arcs[a].sister : a;
+                break;
+            }
+            else if ( ( nj.timestamp <= n.timestamp ) && ( nj.distance > n.distance ) )
+            {
+                // Try to shorten the distance from j to the terminal
+                nj.parent    = m_arcs[a].sister;
+                nj.timestamp = n.timestamp;
+                nj.distance  = n.distance + 1;
+            }
+        }
+
+        m_time++;
+
+        if ( middleArc == NONE )
+        {
+            current = NONE;
+            continue;
+        }
+
+        // Keep the node active, there may be more paths through it
+        m_nodes[node].next = node;
+        current = node;
+
+        //
+        // Augmentation and adoption
+        //
+
+        augment( middleArc );
+
+        while ( !m_orphans.empty() )
+        {
+            size_t orphan = m_orphans.front();
+            m_orphans.pop_front();
+
+            if ( m_nodes[orphan].isSink )
+                processSinkOrphan( orphan );
+            else
+                processSourceOrphan( orphan );
+        }
+    }
+
+    return m_flow;
+}
+
+
+/*------------------------------------------------------------------------------
+
+                            CPushRelabelMaxFlow
+
+------------------------------------------------------------------------------*/
+
+void CPushRelabelMaxFlow::reset( size_t N_nodes )
+{
+    m_terminalResidual.assign( N_nodes, 0 );
+    m_edges.clear();
+    m_label.clear();
+
+    m_flow = 0;
+}
+
+void CPushRelabelMaxFlow::addTerminalWeights( size_t node, double sourceCapacity, double sinkCapacity )
+{
+    double residual = m_terminalResidual[node];
+
+    if ( residual > 0 )
+        sourceCapacity += residual;
+    else
+        sinkCapacity -= residual;
+
+    m_flow += std::min( sourceCapacity, sinkCapacity );
+    m_terminalResidual[node] = sourceCapacity - sinkCapacity;
+}
+
+void CPushRelabelMaxFlow::addEdge( size_t node1, size_t node2, double capacity, double reverseCapacity )
+{
+    TEdge edge;
+
+    edge.node1           = node1;
+    edge.node2           = node2;
+    edge.capacity        = capacity;
+    edge.reverseCapacity = reverseCapacity;
+
+    m_edges.push_back( edge );
+}
+
+bool CPushRelabelMaxFlow::isSinkSegment( size_t node ) const
+{
+    // After the last global relabeling, only the nodes that can reach the
+    // sink have a finite label
+    return ( node < m_label.size() ) && ( m_label[node] <= m_label.size() );
+}
+
+void CPushRelabelMaxFlow::buildNetwork()
+{
+    size_t N_nodes = m_terminalResidual.size();
+    size_t N_arcs  = 2*m_edges.size();
+
+    m_first.assign( N_nodes + 1, 0 );
+
+    for ( size_t edgeIndex = 0; edgeIndex < m_edges.size(); edgeIndex++ )
+    {
+        m_first[ m_edges[edgeIndex].node1 + 1 ]++;
+        m_first[ m_edges[edgeIndex].node2 + 1 ]++;
+    }
+
+    for ( size_t node = 0; node < N_nodes; node++ )
+        m_first[node+1] += m_first[node];
+
+    m_head.resize( N_arcs );
+    m_sister.resize( N_arcs );
+    m_residual.resize( N_arcs );
+
+    vector<size_t> position( m_first.begin(), m_first.end() - 1 );
+
+    for ( size_t edgeIndex = 0; edgeIndex < m_edges.size(); edgeIndex++ )
+    {
+        const TEdge &edge = m_edges[edgeIndex];
+
+        size_t a    = position[ edge.node1 ]++;
+        size_t aRev = position[ edge.node2 ]++;
+
+        m_head[a]        = edge.node2;
+        m_sister[a]      = aRev;
+        m_residual[a]    = edge.capacity;
+
+        m_head[aRev]     = edge.node1;
+        m_sister[aRev]   = a;
+        m_residual[aRev] = edge.reverseCapacity;
+    }
+
+    // The source edges are saturated from the beginning (the preflow)
+
+    m_excess.resize( N_nodes );
+    m_sinkResidual.resize( N_nodes );
+
+    for ( size_t node = 0; node < N_nodes; node++ )
+    {
+        m_excess[node]       = std::max(  m_terminalResidual[node], 0.0 );
+        m_sinkResidual[node] = std::max( -m_terminalResidual[node], 0.0 );
+    }
+
+    m_incoming.assign( N_nodes, 0 );
+    m_label.assign( N_nodes, N_nodes + 1 );
+    m_newLabel.assign( N_nodes, N_nodes + 1 );
+    m_count.assign( N_nodes + 2, 0 );
+    m_flag.assign( N_nodes, 0 );
+}
+
+void CPushRelabelMaxFlow::globalRelabel()
+{
+    // Breadth first search from the sink through the reverse residual arcs,
+    // setting the labels to the exact distances. Nodes not reached can not
+    // send flow to the sink.
+
+    int    N_nodes  = m_terminalResidual.size();
+    size_t infinity = N_nodes + 1;
+
+    vector<size_t> frontier;
+
+    for ( int node = 0; node < N_nodes; node++ )
+    {
+        m_label[node] = infinity;
+        m_flag[node]  = 0;
+
+        if ( m_sinkResidual[node] > 0 )
+        {
+            m_label[node] = 1;
+            m_flag[node]  = 1;
+            frontier.push_back( node );
+        }
+    }
+
+    m_count.assign( infinity + 1, 0 );
+
+    for ( size_t label = 1; !frontier.empty(); label++ )
+    {
+        m_count[label] = frontier.size();
+
+        vector<size_t> next;
+
+        #pragma omp parallel num_threads(m_threads)
+        {
+            vector<size_t> visited;
+
+            #pragma omp for schedule(dynamic,256)
+            for ( int i = 0; i < (int)frontier.size(); i++ )
+            {
+                size_t node = frontier[i];
+
+                for ( size_t a = m_first[node]; a < m_first[node+1]; a++ )
+                {
+                    // Can the neighbor send flow to the node?
+                    if ( m_residual[ m_sister[a] ] <= 0 )
+                        continue;
+
+                    size_t neighbor = m_head[a];
+                    int    wasVisited;
+
+                    #pragma omp atomic capture
+                    { wasVisited = m_flag[neighbor]; m_flag[neighbor] = 1; }
+
+                    if ( !wasVisited )
+                    {
+                        m_label[neighbor] = label + 1;
+                        visited.push_back( neighbor );
+                    }
+                }
+            }
+
+            #pragma omp critical(pushRelabelFrontier)
+            next.insert( next.end(), visited.begin(), visited.end() );
+        }
+
+        frontier.swap( next );
+    }
+
+    #pragma omp parallel for num_threads(m_threads)
+    for ( int node = 0; node < N_nodes; node++ )
+        m_flag[node] = 0;
+}
+
+double CPushRelabelMaxFlow::maxFlow()
+{
+    buildNetwork();
+
+    size_t N_nodes  = m_terminalResidual.size();
+    size_t infinity = N_nodes + 1;
+    double flow     = m_flow;
+
+    // The global relabeling is repeated after relabeling work comparable to
+    // its cost, as in the usual sequential implementations
+    double work          = 0;
+    double workThreshold = 0.5*( 6.0*N_nodes + m_head.size() );
+
+    globalRelabel();
+
+    vector<size_t> active;
+
+    for ( size_t node = 0; node < N_nodes; node++ )
+        if ( ( m_excess[node] > 0 ) && ( m_label[node] < infinity ) )
+            active.push_back( node );
+
+    while ( !active.empty() )
+    {
+        vector<size_t>  next;
+        size_t          gap = infinity;
+        double          roundWork = 0;
+
+        #pragma omp parallel num_threads(m_threads) reduction(+:flow,roundWork)
+        {
+            vector<size_t> queued;
+
+            //
+            // 1. Push the excess through the admissible arcs. Labels do not
+            //    change here, so an arc and its sister are never pushed at
+            //    the same time.
+            //
+
+            #pragma omp for schedule(dynamic,64)
+            for ( int i = 0; i < (int)active.size(); i++ )
+            {
+                size_t node   = active[i];
+                size_t label  = m_label[node];
+                double excess = m_excess[node];
+
+                if ( ( label == 1 ) && ( m_sinkResidual[node] > 0 ) )
+                {
+                    double delta = std::min( excess, m_sinkResidual[node] );
+
+                    m_sinkResidual[node] -= delta;
+                    excess -= delta;
+                    flow   += delta;
+                }
+
+                for ( size_t a = m_first[node]; ( a < m_first[node+1] ) && ( excess > 0 ); a++ )
+                {
+                    size_t neighbor = m_head[a];
+
+                    if ( ( m_label[neighbor] + 1 != label ) || ( m_residual[a] <= 0 ) )
+                        continue;
+
+                    double delta = std::min( excess, m_residual[a] );
+
+                    m_residual[a] -= delta;
+                    m_residual[ m_sister[a] ] += delta;
+                    excess -= delta;
+
+                    #pragma omp atomic
+                    m_incoming[neighbor] += delta;
+
+                    int wasQueued;
+
+                    #pragma omp atomic capture
+                    { wasQueued = m_flag[neighbor]; m_flag[neighbor] = 1; }
+
+                    if ( !wasQueued )
+                        queued.push_back( neighbor );
+                }
+
+                m_excess[node] = excess;
+            }
+
+            //
+            // 2. Relabel the nodes that still have excess. The new labels are
+            //    computed from the old ones, so they are valid even if
+            //    neighbors are relabeled at the same time.
+            //
+
+            #pragma omp for schedule(dynamic,64)
+            for ( int i = 0; i < (int)active.size(); i++ )
+            {
+                size_t node = active[i];
+
+                if ( m_excess[node] <= 0 )
+                    continue;
+
+                size_t newLabel = ( m_sinkResidual[node] > 0 ) ? 1 : infinity;
+
+                for ( size_t a = m_first[node]; a < m_first[node+1]; a++ )
+                    if ( m_residual[a] > 0 )
+                        newLabel = std::min( newLabel, m_label[ m_head[a] ] + 1 );
+
+                m_newLabel[node] = std::min( newLabel, infinity );
+                roundWork += 12 + m_first[node+1] - m_first[node];
+            }
+
+            #pragma omp for schedule(dynamic,64)
+            for ( int i = 0; i < (int)active.size(); i++ )
+            {
+                size_t node = active[i];
+
+                if ( m_excess[node] <= 0 )
+                    continue;
+
+                size_t oldLabel = m_label[node];
+                size_t newLabel = m_newLabel[node];
+                size_t remaining;
+
+                m_label[node] = newLabel;
+
+                #pragma omp atomic capture
+                remaining = --m_count[oldLabel];
+
+                if ( newLabel < infinity )
+                {
+                    #pragma omp atomic
+                    m_count[newLabel]++;
+
+                    int wasQueued;
+
+                    #pragma omp atomic capture
+                    { wasQueued = m_flag[node]; m_flag[node] = 1; }
+
+                    if ( !wasQueued )
+                        queued.push_back( node );
+                }
+
+                if ( remaining == 0 )
+                {
+                    #pragma omp critical(pushRelabelGap)
+                    gap = std::min( gap, oldLabel );
+                }
+            }
+
+            //
+            // 3. Gap heuristic: if no node has a certain label, the nodes
+            //    with a greater one can not reach the sink. The count is
+            //    checked again, since other node could take the label.
+            //
+
+            if ( ( gap < infinity ) && ( m_count[gap] == 0 ) )
+            {
+                #pragma omp for
+                for ( int node = 0; node < (int)N_nodes; node++ )
+                    if ( ( m_label[node] > gap ) && ( m_label[node] < infinity ) )
+                        m_label[node] = infinity;
+
+                #pragma omp single
+                std::fill( m_count.begin() + gap + 1, m_count.end(), 0 );
+            }
+
+            //
+            // 4. Add the excess received to the queued nodes, which are the
+            //    active ones in the next round.
+            //
+
+            vector<size_t> stillActive;
+
+            for ( size_t i = 0; i < queued.size(); i++ )
+            {
+                size_t node = queued[i];
+
+                m_flag[node] = 0;
+                m_excess[node] += m_incoming[node];
+                m_incoming[node] = 0;
+
+                if ( ( m_excess[node] > 0 ) && ( m_label[node] < infinity ) )
+                    stillActive.push_back( node );
+            }
+
+            #pragma omp critical(pushRelabelActive)
+            next.insert( next.end(), stillActive.begin(), stillActive.end() );
+        }
+
+        active.swap( next );
+        work += roundWork;
+
+        if ( work > workThreshold )
+        {
+            globalRelabel();
+            work = 0;
+
+            size_t N_active = 0;
+
+            for ( size_t i = 0; i < active.size(); i++ )
+                if ( m_label[ active[i] ] < infinity )
+                    active[N_active++] = active[i];
+
+            active.resize( N_active );
+        }
+    }
+
+    // Labels of the nodes that can reach the sink in the residual network,
+    // which are in the sink segment of the min cut
+    globalRelabel();
+
+    return flow;
+}
+
+
+/*------------------------------------------------------------------------------
+
+                                    CQPBO
+
+------------------------------------------------------------------------------*/
+
+void CQPBO::reset( size_t N_nodes )
+{
+    m_N_nodes = N_nodes;
+    m_nodeEnergies.assign( 2*N_nodes, 0 );
+    m_edgeNodes.clear();
+    m_edgeEnergies.clear();
+    m_labels.assign( N_nodes, -1 );
+}
+
+void CQPBO::addNodeEnergies( size_t node, double energy0, double energy1 )
+{
+    m_nodeEnergies[2*node]   += energy0;
+    m_nodeEnergies[2*node+1] += energy1;
+}
+
+void CQPBO::addEdgeEnergies( size_t node1, size_t node2,
+                             double energy00, double energy01,
+                             double energy10, double energy11 )
+{
+    m_edgeNodes.push_back( node1 );
+    m_edgeNodes.push_back( node2 );
+
+    m_edgeEnergies.push_back( energy00 );
+    m_edgeEnergies.push_back( energy01 );
+    m_edgeEnergies.push_back( energy10 );
+    m_edgeEnergies.push_back( energy11 );
+}
+
+void CQPBO::fix( size_t node, int label, double weight )
+{
+    // Adds the weight to the energy of the other label. The node at
+    // index + N_nodes has the opposite label.
+
+    if ( label == 0 )
+    {
+        m_maxFlow.addTerminalWeights( node, weight, 0 );
+        m_maxFlow.addTerminalWeights( m_N_nodes + node, 0, weight );
+    }
+    else
+    {
+        m_maxFlow.addTerminalWeights( node, 0, weight );
+        m_maxFlow.addTerminalWeights( m_N_nodes + node, weight, 0 );
+    }
+}
+
+void CQPBO::computeLabels( std::vector<int> &labels ) const
+{
+    labels.resize( m_N_nodes );
+
+    for ( size_t node = 0; node < m_N_nodes; node++ )
+    {
+        bool sink      = m_maxFlow.isSinkSegment( node );
+        bool sinkPrima = m_maxFlow.isSinkSegment( m_N_nodes + node );
+
+        if ( !sink && sinkPrima )
+            labels[node] = 0;
+        else if ( sink && !sinkPrima )
+            labels[node] = 1;
+        else
+            labels[node] = -1;
+    }
+}
+
+void CQPBO::solve()
+{
+    vector<double> nodeEnergies( m_nodeEnergies );
+    size_t N_edges = m_edgeNodes.size()/2;
+
+    m_maxFlow.reset( 2*m_N_nodes );
+    m_infinity = 1;
+
+    for ( size_t edge = 0; edge < N_edges; edge++ )
+    {
+        size_t node1 = m_edgeNodes[2*edge];
+        size_t node2 = m_edgeNodes[2*edge+1];
+
+        // Reparametrization, so the edge is in the normal form, i.e. the min
+        // of each row and column is 0
+
+        double normal[4] = { m_edgeEnergies[4*edge],   m_edgeEnergies[4*edge+1],
+                             m_edgeEnergies[4*edge+2], m_edgeEnergies[4*edge+3] };
+
+        for ( size_t state = 0; state < 2; state++ )
+        {
+            double delta = std::min( normal[state], normal[2+state] );
+            normal[state]   -= delta;
+            normal[2+state] -= delta;
+            nodeEnergies[2*node2+state] += delta;
+        }
+
+        for ( size_t state = 0; state < 2; state++ )
+        {
+            double delta = std::min( normal[2*state], normal[2*state+1] );
+            normal[2*state]   -= delta;
+            normal[2*state+1] -= delta;
+            nodeEnergies[2*node1+state] += delta;
+        }
+
+        // Submodular terms (E01, E10) link nodes of the same copy, and
+        // supermodular ones (E00, E11) nodes of different copies
+
+        size_t node1prima = m_N_nodes + node1;
+        size_t node2prima = m_N_nodes + node2;
+
+        if ( ( normal[1] > 0 ) || ( normal[2] > 0 ) )
+        {
+            m_maxFlow.addEdge( node1, node2, 0.5*normal[1], 0.5*normal[2] );
+            m_maxFlow.addEdge( node2prima, node1prima, 0.5*normal[1], 0.5*normal[2] );
+        }
+
+        if ( ( normal[0] > 0 ) || ( normal[3] > 0 ) )
+        {
+            m_maxFlow.addEdge( node1, node2prima, 0.5*normal[0], 0.5*normal[3] );
+            m_maxFlow.addEdge( node2, node1prima, 0.5*normal[0], 0.5*normal[3] );
+        }
+
+        m_infinity += normal[0] + normal[1] + normal[2] + normal[3];
+    }
+
+    for ( size_t node = 0; node < m_N_nodes; node++ )
+    {
+        double minEnergy = std::min( nodeEnergies[2*node], nodeEnergies[2*node+1] );
+        double energy0   = nodeEnergies[2*node] - minEnergy;
+        double energy1   = nodeEnergies[2*node+1] - minEnergy;
+
+        m_maxFlow.addTerminalWeights( node, 0.5*energy1, 0.5*energy0 );
+        m_maxFlow.addTerminalWeights( m_N_nodes + node, 0.5*energy0, 0.5*energy1 );
+
+        m_infinity += energy0 + energy1;
+    }
+
+    m_maxFlow.maxFlow();
+    computeLabels( m_labels );
+}
+
+void CQPBO::probe()
+{
+    vector<int> labels0, labels1;
+
+    for ( size_t node = 0; node < m_N_nodes; node++ )
+    {
+        if ( m_labels[node] >= 0 )
+            continue;
+
+        // Solve with the node fixed to each label
+
+        fix( node, 0, m_infinity );
+        m_maxFlow.maxFlow();
+        computeLabels( labels0 );
+        fix( node, 0, -m_infinity );
+
+        fix( node, 1, m_infinity );
+        m_maxFlow.maxFlow();
+        computeLabels( labels1 );
+        fix( node, 1, -m_infinity );
+
+        // A node taking the same label in both cases takes it in an
+        // optimal labeling too, so it is fixed
+
+        bool fixed = false;
+
+        for ( size_t other = 0; other < m_N_nodes; other++ )
+            if ( ( m_labels[other] < 0 ) && ( labels0[other] >= 0 ) &&
+                 ( labels0[other] == labels1[other] ) )
+            {
+                fix( other, labels0[other], m_infinity );
+                m_labels[other] = labels0[other];
+                fixed = true;
+            }
+
+        if ( fixed )
+        {
+            m_maxFlow.maxFlow();
+            computeLabels( m_labels );
+        }
+    }
+}
+
+void CQPBO::improve( const std::vector<size_t> &labeling )
+{
+    // The labels of the unlabeled nodes are taken from the labeling, fixing
+    // them one by one and labeling again the rest, so each step does not
+    // increase the energy of the labeling
+
+    vector<int> current( m_N_nodes );
+
+    for ( size_t node = 0; node < m_N_nodes; node++ )
+        current[node] = ( m_labels[node] >= 0 ) ? m_labels[node] : labeling[node];
+
+    for ( size_t node = 0; node < m_N_nodes; node++ )
+    {
+        if ( m_labels[node] >= 0 )
+            continue;
+
+        fix( node, current[node], m_infinity );
+        m_maxFlow.maxFlow();
+        computeLabels( m_labels );
+
+        for ( size_t other = 0; other < m_N_nodes; other++ )
+            if ( m_labels[other] >= 0 )
+                current[other] = m_labels[other];
+    }
+
+    for ( size_t node = 0; node < m_N_nodes; node++ )
+        m_labels[node] = current[node];
+}
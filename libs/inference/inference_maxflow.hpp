@@ -0,0 +1,283 @@
+
+/*---------------------------------------------------------------------------*
+ |                               UPGM++                                      |
+ |                   Undirected Graphical Models in C++                      |
+ |                                                                           |
+ |              Copyright (C) 2014 Jose Raul Ruiz Sarmiento                  |
+ |                 University of Malaga (jotaraul@uma.es)                    |
+ |                                                                           |
+ |   This program is free software: you can redistribute it and/or modify    |
+ |   it under the terms of the GNU General Public License as published by    |
+ |   the Free Software Foundation, either version 3 of the License, or       |
+ |   (at your option) any later version.                                     |
+ |                                                                           |
+ |   This program is distributed in the hope that it will be useful,         |
+ |   but WITHOUT ANY WARRANTY; without even the implied warranty of          |
+ |   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           |
+ |   GNU General Public License for more details.                            |
+ |   <http://www.gnu.org/licenses/>                                          |
+ |                                                                           |
+ *---------------------------------------------------------------------------*/
+
+#ifndef _UPGMpp_INFERENCE_MAXFLOW_
+#define _UPGMpp_INFERENCE_MAXFLOW_
+
+#include <vector>
+#include <deque>
+#include <cstddef>
+
+namespace UPGMpp
+{
+    /** Interface of the max-flow/min-cut solvers used by the graph cuts based
+      * decoding methods. Nodes are referred by their index, and are linked to
+      * the source and the sink through terminal weights. After computing the
+      * max-flow, the nodes reachable from the source in the residual network
+      * are in the source segment (label 0), and the rest in the sink segment
+      * (label 1).
+      */
+    class CMaxFlow
+    {
+    public:
+
+        virtual ~CMaxFlow() {}
+
+        /** Removes all the nodes and edges, and adds N_nodes new nodes. */
+        virtual void reset( size_t N_nodes ) = 0;
+
+        virtual size_t getNumberOfNodes() const = 0;
+
+        /** Adds capacities to the edges source->node and node->sink. */
+        virtual void addTerminalWeights( size_t node,
+                                         double sourceCapacity,
+                                         double sinkCapacity ) = 0;
+
+        /** Adds an edge with a capacity from node1 to node2, and a reverse
+          * capacity from node2 to node1. Capacities must be non negative.
+          */
+        virtual void addEdge( size_t node1,
+                              size_t node2,
+                              double capacity,
+                              double reverseCapacity ) = 0;
+
+        /** Computes the max-flow (the min cut).
+          * \return The value of the flow.
+          */
+        virtual double maxFlow() = 0;
+
+        /** Is the node in the sink segment of the min cut? */
+        virtual bool isSinkSegment( size_t node ) const = 0;
+    };
+
+    /** Boykov-Kolmogorov max-flow over adjacency lists. It grows a search
+      * tree from the source and another one from the sink, augments the flow
+      * through the paths where they meet, and adopts the orphan nodes so the
+      * trees are reused instead of rebuilt for each augmenting path. Memory is
+      * O(N+E).
+      *
+      * After computing the flow, the capacities can be edited by adding
+      * (possibly negative) amounts with addTerminalWeights and
+      * addEdgeCapacities. The next call to maxFlow reuses the flow already
+      * pushed and the search trees, only fixing them around the nodes
+      * affected by the changes (dynamic graph cuts).
+      */
+    class CBKMaxFlow : public CMaxFlow
+    {
+    private:
+
+        static const size_t NONE     = (size_t)-1; //!< No parent (free node), no next node...
+        static const size_t TERMINAL = (size_t)-2; //!< Parent of the nodes linked to a terminal.
+        static const size_t ORPHAN   = (size_t)-3; //!< Parent of the orphan nodes.
+
+        struct TArc
+        {
+            size_t  head;     //!< Node the arc points to.
+            size_t  next;     //!< Next arc leaving the same node.
+            size_t  sister;   //!< Reverse arc.
+            double  residual; //!< Residual capacity.
+        };
+
+        struct TNode
+        {
+            size_t  first;            //!< First arc leaving the node.
+            size_t  parent;           //!< Arc to the parent in its tree, TERMINAL, ORPHAN or NONE.
+            size_t  next;             //!< Next active node (itself if last), NONE if not active.
+            size_t  timestamp;        //!< Time when the distance was computed.
+            size_t  distance;         //!< Distance to the terminal of its tree.
+            bool    isSink;           //!< Is the node in the sink tree?
+            bool    isMarked;         //!< Has it changed since the last max-flow?
+            double  terminalResidual; //!< Residual to the source if positive, from the sink if negative.
+        };
+
+        std::vector<TNode>  m_nodes;
+        std::vector<TArc>   m_arcs;
+        double              m_flow;
+        size_t              m_time;
+        bool                m_solved;
+        size_t              m_queueFirst[2];
+        size_t              m_queueLast[2];
+        std::deque<size_t>  m_orphans;
+
+        void setActive( size_t node );
+        size_t getNextActive();
+        void setOrphanFront( size_t node );
+        void setOrphanRear( size_t node );
+        void initialize();
+        void reuseTrees();
+        void augment( size_t middleArc );
+        void processSourceOrphan( size_t node );
+        void processSinkOrphan( size_t node );
+
+    public:
+
+        CBKMaxFlow() : m_flow( 0 ), m_time( 0 ), m_solved( false )
+        {}
+
+        void reset( size_t N_nodes );
+
+        inline size_t getNumberOfNodes() const { return m_nodes.size(); }
+
+        void addTerminalWeights( size_t node, double sourceCapacity, double sinkCapacity );
+
+        void addEdge( size_t node1, size_t node2, double capacity, double reverseCapacity );
+
+        inline size_t getNumberOfEdges() const { return m_arcs.size()/2; }
+
+        /** Adds (possibly negative) amounts to the capacities of an edge,
+          * referred by the order in which it was added. Capacities must remain
+          * non negative.
+          */
+        void addEdgeCapacities( size_t edge, double capacity, double reverseCapacity );
+
+        /** Marks a node whose edges changed after computing the flow, so the
+          * search trees are fixed around it. The edit methods already do it.
+          */
+        void markNode( size_t node );
+
+        double maxFlow();
+
+        bool isSinkSegment( size_t node ) const;
+    };
+
+    /** Parallel push-relabel max-flow. The active nodes are processed in
+      * synchronous rounds: first they push their excess through the
+      * admissible arcs (the labels are fixed during this step, so each arc is
+      * only pushed from one of its ends, and the excess received is
+      * accumulated with atomic additions), and then the nodes still having
+      * excess are relabeled. A global relabeling (a breadth first search from
+      * the sink) is done from time to time, and the gap heuristic is used to
+      * discard the nodes that can not reach the sink anymore. Only the first
+      * phase is computed, that is, the excess that can not reach the sink is
+      * not returned to the source, which is enough to get the min cut.
+      */
+    class CPushRelabelMaxFlow : public CMaxFlow
+    {
+    private:
+
+        struct TEdge
+        {
+            size_t  node1;
+            size_t  node2;
+            double  capacity;
+            double  reverseCapacity;
+        };
+
+        size_t              m_threads;
+        double              m_flow;
+        std::vector<double> m_terminalResidual; //!< Residual to the source if positive, from the sink if negative.
+        std::vector<TEdge>  m_edges;
+
+        // Residual network, arcs are sorted by their tail node
+        std::vector<size_t> m_first;    //!< Index of the first arc of each node, and the number of arcs at the end.
+        std::vector<size_t> m_head;
+        std::vector<size_t> m_sister;
+        std::vector<double> m_residual;
+        std::vector<double> m_sinkResidual;
+
+        std::vector<double> m_excess;
+        std::vector<double> m_incoming; //!< Excess received in the current round.
+        std::vector<size_t> m_label;
+        std::vector<size_t> m_newLabel;
+        std::vector<size_t> m_count;    //!< Number of nodes with each label.
+        std::vector<int>    m_flag;     //!< Node queued (or visited).
+
+        void buildNetwork();
+        void globalRelabel();
+
+    public:
+
+        /** N_threads is the number of threads used to compute the flow. */
+        CPushRelabelMaxFlow( size_t N_threads = 1 ) : m_threads( N_threads ),
+                                                      m_flow( 0 )
+        {}
+
+        void reset( size_t N_nodes );
+
+        inline size_t getNumberOfNodes() const { return m_terminalResidual.size(); }
+
+        void addTerminalWeights( size_t node, double sourceCapacity, double sinkCapacity );
+
+        void addEdge( size_t node1, size_t node2, double capacity, double reverseCapacity );
+
+        double maxFlow();
+
+        bool isSinkSegment( size_t node ) const;
+    };
+
+    /** QPBO (roof duality) for binary energies that are not necessarily
+      * submodular. It computes the max-flow of a network with two nodes for
+      * each variable, one for each label, and returns a partial labeling:
+      * nodes not labeled by it can keep the labels of any other labeling
+      * without increasing its energy. Two extensions can label more nodes:
+      * probing (QPBO-P), which fixes each unlabeled node to both labels and
+      * keeps the labels obtained in both cases, and improving (QPBO-I), which
+      * fixes the unlabeled nodes to the labels of a given labeling, getting a
+      * complete labeling with an energy not higher than it. Unlike the ones of
+      * solve, the labels added by probing are not persistent: keeping the
+      * labels of another labeling in the rest of nodes (or improving it
+      * afterwards) can increase its energy. Both reuse the flow between their max-flow computations.
+      */
+    class CQPBO
+    {
+    private:
+
+        CBKMaxFlow          m_maxFlow;
+        size_t              m_N_nodes;
+        std::vector<double> m_nodeEnergies; //!< [2*node+label]
+        std::vector<size_t> m_edgeNodes;    //!< [2*edge] and [2*edge+1]
+        std::vector<double> m_edgeEnergies; //!< [4*edge+2*label1+label2]
+        std::vector<int>    m_labels;       //!< 0, 1 or -1 if unlabeled.
+        double              m_infinity;     //!< Weight used to fix the labels.
+
+        void fix( size_t node, int label, double weight );
+        void computeLabels( std::vector<int> &labels ) const;
+
+    public:
+
+        CQPBO() : m_N_nodes( 0 ), m_infinity( 0 )
+        {}
+
+        void reset( size_t N_nodes );
+
+        void addNodeEnergies( size_t node, double energy0, double energy1 );
+
+        void addEdgeEnergies( size_t node1, size_t node2,
+                              double energy00, double energy01,
+                              double energy10, double energy11 );
+
+        /** Computes the partial labeling. */
+        void solve();
+
+        /** Labels more nodes by probing the unlabeled ones (QPBO-P). */
+        void probe();
+
+        /** Labels the rest of nodes (QPBO-I), fixing them to the labels of
+          * labeling, which should be a complete labeling (0 or 1).
+          */
+        void improve( const std::vector<size_t> &labeling );
+
+        /** Label of a node: 0, 1 or -1 if it is unlabeled. */
+        inline int getLabel( size_t node ) const { return m_labels[node]; }
+    };
+}
+
+#endif
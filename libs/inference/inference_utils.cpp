@@ -28,357 +28,2547 @@
 
 #include <vector>
 #include <queue>
+#include <set>
+#include <list>
+#include <algorithm>
+
+#ifdef UPGMpp_USING_OMPENMP
+#include <omp.h>
+#endif
 
 using namespace UPGMpp;
 using namespace std;
 using namespace Eigen;
 
-size_t UPGMpp::messagesLBP(CGraph &graph,
-                            TInferenceOptions &options,
-                            vector<vector<VectorXd> > &messages ,
-                            bool maximize,                            
-                            const vector<size_t> &tree)
+/*------------------------------------------------------------------------------
+
+                                getCompactGraph
+
+------------------------------------------------------------------------------*/
+
+void UPGMpp::getCompactGraph( CGraph &graph,
+                              TInferenceOptions &options,
+                              TCompactGraph &cg )
+{
+    const vector<CNodePtr> &nodes = graph.getNodes();
+    const vector<CEdgePtr> &edges = graph.getEdges();
+    multimap<size_t,CEdgePtr> &edges_f = graph.getEdgesF();
+
+    cg.N_nodes    = nodes.size();
+    cg.N_edges    = edges.size();
+    cg.maxClasses = 0;
+    cg.maxDegree  = 0;
+
+    //
+    // Nodes
+    //
+
+    cg.nodeIDs.resize( cg.N_nodes );
+    cg.N_classes.resize( cg.N_nodes );
+    cg.nodePotentials.resize( cg.N_nodes );
+    cg.nodeIndices.clear();
+
+    for ( size_t nodeIndex = 0; nodeIndex < cg.N_nodes; nodeIndex++ )
+    {
+        cg.nodeIDs[nodeIndex] = nodes[nodeIndex]->getID();
+        cg.nodeIndices[ cg.nodeIDs[nodeIndex] ] = nodeIndex;
+        cg.nodePotentials[nodeIndex] = nodes[nodeIndex]->getPotentials( options.considerNodeFixedValues );
+        cg.N_classes[nodeIndex] = cg.nodePotentials[nodeIndex].rows();
+
+        if ( cg.N_classes[nodeIndex] > cg.maxClasses )
+            cg.maxClasses = cg.N_classes[nodeIndex];
+    }
+
+    //
+    // Edges
+    //
+
+    map<size_t,size_t> edgeIndices;
+
+    cg.edgeNode1.resize( cg.N_edges );
+    cg.edgeNode2.resize( cg.N_edges );
+    cg.edgePotentials.resize( cg.N_edges );
+    cg.edgeAdj.resize( 2*cg.N_edges );
+
+    cg.adjOffsets.assign( cg.N_nodes+1, 0 );
+
+    for ( size_t edgeIndex = 0; edgeIndex < cg.N_edges; edgeIndex++ )
+    {
+        size_t ID1, ID2;
+        edges[edgeIndex]->getNodesID(ID1,ID2);
+
+        edgeIndices[ edges[edgeIndex]->getID() ] = edgeIndex;
+
+        cg.edgeNode1[edgeIndex] = cg.nodeIndices[ID1];
+        cg.edgeNode2[edgeIndex] = cg.nodeIndices[ID2];
+        cg.edgePotentials[edgeIndex] = &edges[edgeIndex]->getPotentials();
+
+        cg.adjOffsets[ cg.edgeNode1[edgeIndex]+1 ]++;
+        cg.adjOffsets[ cg.edgeNode2[edgeIndex]+1 ]++;
+    }
+
+    for ( size_t nodeIndex = 0; nodeIndex < cg.N_nodes; nodeIndex++ )
+    {
+        if ( cg.adjOffsets[nodeIndex+1] > cg.maxDegree )
+            cg.maxDegree = cg.adjOffsets[nodeIndex+1];
+
+        cg.adjOffsets[nodeIndex+1] += cg.adjOffsets[nodeIndex];
+    }
+
+    //
+    // Directed edges, keeping the order in which the neighbors appear in edges_f
+    //
+
+    size_t N_directed = 2*cg.N_edges;
+
+    cg.adjEdge.resize( N_directed );
+    cg.adjNeighbor.resize( N_directed );
+    cg.adjReverse.resize( N_directed );
+    cg.adjFirst.resize( N_directed );
+
+    vector<size_t> position( cg.adjOffsets.begin(), cg.adjOffsets.end()-1 );
+
+    for ( multimap<size_t,CEdgePtr>::iterator it = edges_f.begin(); it != edges_f.end(); it++ )
+    {
+        size_t nodeIndex = cg.nodeIndices[ it->first ];
+        size_t edgeIndex = edgeIndices[ it->second->getID() ];
+        size_t p         = position[nodeIndex]++;
+        bool   first     = ( cg.edgeNode1[edgeIndex] == nodeIndex );
+
+        cg.adjEdge[p]     = edgeIndex;
+        cg.adjNeighbor[p] = first ? cg.edgeNode2[edgeIndex] : cg.edgeNode1[edgeIndex];
+        cg.adjFirst[p]    = first;
+        cg.edgeAdj[ 2*edgeIndex + ( first ? 0 : 1 ) ] = p;
+    }
+
+    cg.msgOffsets.resize( N_directed+1 );
+    cg.msgOffsets[0] = 0;
+
+    for ( size_t p = 0; p < N_directed; p++ )
+    {
+        size_t edgeIndex = cg.adjEdge[p];
+        cg.adjReverse[p] = cg.edgeAdj[ 2*edgeIndex + ( cg.adjFirst[p] ? 1 : 0 ) ];
+        cg.msgOffsets[p+1] = cg.msgOffsets[p] + cg.N_classes[ cg.adjNeighbor[p] ];
+    }
+}
+
+
+/*------------------------------------------------------------------------------
+
+                                getLogPotentials
+
+------------------------------------------------------------------------------*/
+
+void UPGMpp::getLogPotentials( TCompactGraph &cg )
+{
+    const double minValue = std::numeric_limits<double>::min();
+    const double maxValue = std::numeric_limits<double>::max();
+
+    cg.logNodePotentials.resize( cg.N_nodes );
+
+    for ( size_t nodeIndex = 0; nodeIndex < cg.N_nodes; nodeIndex++ )
+        cg.logNodePotentials[nodeIndex] =
+                cg.nodePotentials[nodeIndex].cwiseMax( minValue ).cwiseMin( maxValue ).array().log();
+
+    cg.logEdgePotentials.resize( cg.N_edges );
+
+    for ( size_t edgeIndex = 0; edgeIndex < cg.N_edges; edgeIndex++ )
+        cg.logEdgePotentials[edgeIndex] =
+                cg.edgePotentials[edgeIndex]->cwiseMax( minValue ).cwiseMin( maxValue ).array().log();
+}
+
+
+/*------------------------------------------------------------------------------
+
+                                messagesLBP
+
+------------------------------------------------------------------------------*/
+
+namespace
+{
+    /** Working memory of the message passing kernel. It is reserved once per
+      * call to messagesLBP with the maximum sizes of the graph, so no memory
+      * is allocated while iterating.
+      */
+    struct TMessagesWorkspace
+    {
+        VectorXd nodePotPlusIncMsg;
+        VectorXd newMessage;
+        ArrayXd  logBelief;     //!< Log of the non-zero factors of the node belief.
+        ArrayXi  zeros;         //!< Number of factors of the node belief being exactly zero.
+        ArrayXd  logIncoming;   //!< Log of each incoming message (0 where it is zero).
+        ArrayXd  cavity;
+        MatrixXd logTerms;      //!< Log of the terms to be maximized/summed up in a log message.
+        VectorXd oldMessages;   //!< Previous messages sent by a node, to compute their residuals.
+
+        TMessagesWorkspace( const TCompactGraph &cg ) :
+            nodePotPlusIncMsg( cg.maxClasses ),
+            newMessage( cg.maxClasses ),
+            logBelief( cg.maxClasses ),
+            zeros( cg.maxClasses ),
+            logIncoming( cg.maxClasses*cg.maxDegree ),
+            cavity( cg.maxClasses ),
+            logTerms( cg.maxClasses, cg.maxClasses ),
+            oldMessages( cg.maxClasses*cg.maxDegree )
+        {}
+    };
+
+    /** Computes the messages sent by a node to its neighbors, reading the
+      * current messages from "messages" and writing the new ones in
+      * "newMessages" (both indexed by cg.msgOffsets). They can point to the
+      * same buffer.
+      * The product of the node potential and all the incoming messages is
+      * computed once in the log domain, and the message to each neighbor is
+      * obtained by removing the contribution of the message coming from it.
+      * Factors being exactly zero are counted apart instead of taking their
+      * log, so they can also be removed. This way, the cost of a node is
+      * O(degree*K^2) instead of O(degree^2*K + degree*K^2).
+      * If decision is given, it is set to the class with the highest belief.
+      */
+    void computeNodeMessages( const TCompactGraph &cg,
+                              size_t nodeIndex,
+                              const double *messages,
+                              double *newMessages,
+                              bool maximize,
+                              double smoothing,
+                              const vector<char> *inTree,
+                              TMessagesWorkspace &ws,
+                              size_t *decision = NULL )
+    {
+        const size_t N_classes = cg.N_classes[nodeIndex];
+        const size_t begin     = cg.adjOffsets[nodeIndex];
+        const size_t end       = cg.adjOffsets[nodeIndex+1];
+
+        //
+        // Compute the belief of the node as the product of its potential and
+        // all the incoming messages.
+        //
+        VectorBlock<ArrayXd> logBelief = ws.logBelief.head( N_classes );
+        VectorBlock<ArrayXi> zeros     = ws.zeros.head( N_classes );
+
+        ArrayWrapper<const VectorXd> nodePotential = cg.nodePotentials[nodeIndex].array();
+
+        zeros     = ( nodePotential == 0 ).cast<int>();
+        logBelief = ( nodePotential == 0 ).select( 0, nodePotential.log() );
+
+        for ( size_t q = begin; q < end; q++ )
+        {
+            Map<const ArrayXd> incoming( messages + cg.msgOffsets[ cg.adjReverse[q] ], N_classes );
+            VectorBlock<ArrayXd> logIncoming = ws.logIncoming.segment( (q-begin)*N_classes, N_classes );
+
+            zeros      += ( incoming == 0 ).cast<int>();
+            logIncoming = ( incoming == 0 ).select( 0, incoming.log() );
+            logBelief  += logIncoming;
+        }
+
+        // Class with the highest belief, those with less zero factors win
+        if ( decision )
+        {
+            *decision = 0;
+
+            for ( size_t k = 1; k < N_classes; k++ )
+                if ( ( zeros(k) < zeros(*decision) ) ||
+                     ( ( zeros(k) == zeros(*decision) ) && ( logBelief(k) > logBelief(*decision) ) ) )
+                    *decision = k;
+        }
+
+        //
+        // Send a message to each neighbor
+        //
+        for ( size_t p = begin; p < end; p++ )
+        {
+            const size_t neighbor = cg.adjNeighbor[p];
+
+            // Check if we are calibrating a tree, and so if the neighbor node
+            // is not member of the tree, so we dont have to update its messages
+            if ( inTree && !(*inTree)[neighbor] )
+                continue;
+
+            //
+            // Compute the message from current node as a product of all the
+            // incoming messages less the one from the current neighbor
+            // plus the node potential of the current node.
+            //
+            Map<const ArrayXd> incoming( messages + cg.msgOffsets[ cg.adjReverse[p] ], N_classes );
+            VectorBlock<ArrayXd> cavity = ws.cavity.head( N_classes );
+
+            cavity = logBelief - ws.logIncoming.segment( (p-begin)*N_classes, N_classes );
+
+            double maxCavity = -std::numeric_limits<double>::infinity();
+
+            for ( size_t k = 0; k < N_classes; k++ )
+                if ( ( zeros(k) == ( incoming(k) == 0 ) ) && ( cavity(k) > maxCavity ) )
+                    maxCavity = cavity(k);
+
+            // The product is scaled by its maximum, it does not matter since
+            // the new message is normalized later
+            VectorBlock<VectorXd> nodePotPlusIncMsg = ws.nodePotPlusIncMsg.head( N_classes );
+
+            for ( size_t k = 0; k < N_classes; k++ )
+                nodePotPlusIncMsg(k) = ( zeros(k) == ( incoming(k) == 0 ) ) ?
+                                            std::exp( cavity(k) - maxCavity ) : 0;
+
+            //
+            // Take also the potential between the two nodes. Its rows are
+            // the classes of the first node of the edge.
+            //
+            const MatrixXd &edgePotentials = *cg.edgePotentials[ cg.adjEdge[p] ];
+            const size_t N_classesNeighbor = cg.N_classes[neighbor];
+            VectorBlock<VectorXd> newMessage = ws.newMessage.head( N_classesNeighbor );
+
+            if ( !maximize )
+            {
+                // Multiply both, and update the potential
+                if ( cg.adjFirst[p] )
+                    newMessage.noalias() = edgePotentials.transpose() * nodePotPlusIncMsg;
+                else
+                    newMessage.noalias() = edgePotentials * nodePotPlusIncMsg;
+            }
+            else
+            {
+                for ( size_t row = 0; row < N_classesNeighbor; row++ )
+                {
+                    // Potentials and messages are non negative
+                    double maxRowValue = 0;
+
+                    for ( size_t col = 0; col < N_classes; col++ )
+                    {
+                        double value = ( cg.adjFirst[p] ? edgePotentials(col,row)
+                                                        : edgePotentials(row,col) )
+                                       * nodePotPlusIncMsg(col);
+                        if ( value > maxRowValue )
+                            maxRowValue = value;
+                    }
+                    newMessage(row) = maxRowValue;
+                }
+            }
+
+            // Normalize new message
+            double sum = newMessage.sum();
+            if ( sum )
+                newMessage /= sum;
+
+            //
+            // Set the message!
+            //
+
+            Map<const VectorXd> oldMessage( messages + cg.msgOffsets[p], N_classesNeighbor );
+
+            if ( smoothing != 0 )
+                newMessage += (1-smoothing) * oldMessage;
+
+            Map<VectorXd>( newMessages + cg.msgOffsets[p], N_classesNeighbor ) = newMessage;
+        }
+    }
+}
+
+namespace
+{
+    /** Log domain version of computeNodeMessages. Messages are log messages,
+      * normalized so they sum up one in the probability domain, computed by
+      * max-sum or by sum-product with log-sum-exp, so they neither underflow
+      * nor overflow with peaked potentials. cg must have its log potentials.
+      */
+    void computeNodeLogMessages( const TCompactGraph &cg,
+                                 size_t nodeIndex,
+                                 const double *messages,
+                                 double *newMessages,
+                                 bool maximize,
+                                 double smoothing,
+                                 const vector<char> *inTree,
+                                 TMessagesWorkspace &ws,
+                                 size_t *decision = NULL )
+    {
+        const size_t N_classes = cg.N_classes[nodeIndex];
+        const size_t begin     = cg.adjOffsets[nodeIndex];
+        const size_t end       = cg.adjOffsets[nodeIndex+1];
+
+        //
+        // Compute the log belief of the node as the sum of its log potential
+        // and all the incoming log messages.
+        //
+        VectorBlock<ArrayXd> logBelief = ws.logBelief.head( N_classes );
+        logBelief = cg.logNodePotentials[nodeIndex].array();
+
+        for ( size_t q = begin; q < end; q++ )
+            logBelief += Map<const ArrayXd>( messages + cg.msgOffsets[ cg.adjReverse[q] ], N_classes );
+
+        // Class with the highest belief
+        if ( decision )
+            logBelief.maxCoeff( decision );
+
+        //
+        // Send a message to each neighbor
+        //
+        for ( size_t p = begin; p < end; p++ )
+        {
+            const size_t neighbor = cg.adjNeighbor[p];
+
+            // Check if we are calibrating a tree, and so if the neighbor node
+            // is not member of the tree, so we dont have to update its messages
+            if ( inTree && !(*inTree)[neighbor] )
+                continue;
+
+            // Remove the message coming from the current neighbor
+            VectorBlock<ArrayXd> cavity = ws.cavity.head( N_classes );
+            cavity = logBelief - Map<const ArrayXd>( messages + cg.msgOffsets[ cg.adjReverse[p] ], N_classes );
+
+            //
+            // Add the log potentials of the edge. Each column of terms
+            // contributes to an entry of the new message.
+            //
+            const MatrixXd &logEdgePotentials = cg.logEdgePotentials[ cg.adjEdge[p] ];
+            const size_t N_classesNeighbor    = cg.N_classes[neighbor];
+            Block<MatrixXd> terms = ws.logTerms.topLeftCorner( N_classes, N_classesNeighbor );
+
+            if ( cg.adjFirst[p] )
+                terms = logEdgePotentials.colwise() + cavity.matrix();
+            else
+                terms = logEdgePotentials.transpose().colwise() + cavity.matrix();
+
+            VectorBlock<VectorXd> newMessage = ws.newMessage.head( N_classesNeighbor );
+
+            for ( size_t col = 0; col < N_classesNeighbor; col++ )
+            {
+                double maxValue = terms.col(col).maxCoeff();
+
+                if ( maximize || ( maxValue == -std::numeric_limits<double>::infinity() ) )
+                    newMessage(col) = maxValue;
+                else
+                    newMessage(col) = maxValue + std::log( ( terms.col(col).array() - maxValue ).exp().sum() );
+            }
+
+            // Normalize new message
+            double maxValue = newMessage.maxCoeff();
+            newMessage.array() -= maxValue + std::log( ( newMessage.array() - maxValue ).exp().sum() );
+
+            //
+            // Set the message!
+            //
+
+            Map<const VectorXd> oldMessage( messages + cg.msgOffsets[p], N_classesNeighbor );
+
+            if ( ( smoothing != 0 ) && ( smoothing < 1 ) )
+            {
+                double logWeight = std::log( 1-smoothing );
+
+                for ( size_t k = 0; k < N_classesNeighbor; k++ )
+                {
+                    double a = newMessage(k);
+                    double b = logWeight + oldMessage(k);
+                    double m = std::max( a, b );
+                    newMessage(k) = m + std::log( std::exp( a-m ) + std::exp( b-m ) );
+                }
+            }
+
+            Map<VectorXd>( newMessages + cg.msgOffsets[p], N_classesNeighbor ) = newMessage;
+        }
+    }
+}
+
+size_t UPGMpp::getNumberOfThreads( TInferenceOptions &options )
+{
+#ifdef UPGMpp_USING_OMPENMP
+    double numberOfThreads = options.particularD["numberOfThreads"];
+
+    return ( numberOfThreads > 0 ) ? static_cast<size_t>( numberOfThreads )
+                                   : omp_get_max_threads();
+#else
+    (void)options;
+
+    return 1;
+#endif
+}
+
+namespace
+{
+    inline size_t getThreadIndex()
+    {
+#ifdef UPGMpp_USING_OMPENMP
+        return omp_get_thread_num();
+#else
+        return 0;
+#endif
+    }
+
+    /** Splits the nodes into N_blocks contiguous blocks with a similar amount
+      * of work (the size of the messages they send times their number of
+      * classes). Since the messages sent by contiguous nodes are also
+      * contiguous in the messages buffer, each block updates a contiguous
+      * chunk of it. The block b is [blocks[b],blocks[b+1]).
+      */
+    void getNodeBlocks( const TCompactGraph &cg, size_t N_blocks, vector<size_t> &blocks )
+    {
+        vector<double> work( cg.N_nodes+1, 0 );
+
+        for ( size_t nodeIndex = 0; nodeIndex < cg.N_nodes; nodeIndex++ )
+        {
+            size_t messagesSize = cg.msgOffsets[ cg.adjOffsets[nodeIndex+1] ] -
+                                  cg.msgOffsets[ cg.adjOffsets[nodeIndex] ];
+
+            work[nodeIndex+1] = work[nodeIndex] + messagesSize*cg.N_classes[nodeIndex] + 1;
+        }
+
+        blocks.assign( N_blocks+1, cg.N_nodes );
+        blocks[0] = 0;
+
+        size_t nodeIndex = 0;
+
+        for ( size_t block = 1; block < N_blocks; block++ )
+        {
+            double target = work[cg.N_nodes]*block/N_blocks;
+
+            while ( ( nodeIndex < cg.N_nodes ) && ( work[nodeIndex] < target ) )
+                nodeIndex++;
+
+            blocks[block] = nodeIndex;
+        }
+    }
+
+    /** Sets uniform messages for the edges without them. */
+    void initializeMessages( const TCompactGraph &cg,
+                             vector<vector<VectorXd> > &messages,
+                             bool logDomain )
+    {
+        if ( !messages.size() )
+            messages.resize( cg.N_edges );
+
+        for ( size_t i = 0; i < cg.N_edges; i++ )
+        {
+            if ( !messages[i].size() )
+            {
+                messages[i].resize(2);
+
+                // Messages from first node of the edge to the second one, so the size of
+                // the message has to be the same as the number of classes of the second node.
+                double N_classes = cg.N_classes[ cg.edgeNode2[i] ];
+                messages[i][0].resize( N_classes );
+                messages[i][0].fill( logDomain ? -std::log(N_classes) : 1.0/N_classes );
+                // Just the opposite as before.
+                N_classes = cg.N_classes[ cg.edgeNode1[i] ];
+                messages[i][1].resize( N_classes );
+                messages[i][1].fill( logDomain ? -std::log(N_classes) : 1.0/N_classes );
+            }
+        }
+    }
+
+    /** Copies the messages sent by the nodes in [nodeBegin,nodeEnd) to the
+      * flat buffer.
+      */
+    void copyMessagesToBuffer( const TCompactGraph &cg,
+                               const vector<vector<VectorXd> > &messages,
+                               size_t nodeBegin,
+                               size_t nodeEnd,
+                               double *buffer )
+    {
+        for ( size_t p = cg.adjOffsets[nodeBegin]; p < cg.adjOffsets[nodeEnd]; p++ )
+        {
+            const VectorXd &message = messages[ cg.adjEdge[p] ][ cg.adjFirst[p] ? 0 : 1 ];
+            Map<VectorXd>( buffer + cg.msgOffsets[p], message.rows() ) = message;
+        }
+    }
+}
+
+size_t UPGMpp::messagesLBP(CGraph &graph,
+                            TInferenceOptions &options,
+                            vector<vector<VectorXd> > &messages ,
+                            bool maximize,
+                            const vector<size_t> &tree,
+                            TInferenceStatus *status )
+{
+    TCompactGraph cg;
+    getCompactGraph( graph, options, cg );
+
+    size_t N_nodes    = cg.N_nodes;
+    size_t N_edges    = cg.N_edges;
+    size_t N_directed = 2*N_edges;
+
+    // Check if we are calibrating a tree, and so which nodes are members of it
+    bool is_tree = (tree.size()>0) ? true : false;
+    vector<char> inTree;
+
+    if ( is_tree )
+    {
+        inTree.assign( N_nodes, 0 );
+
+        for ( size_t i = 0; i < tree.size(); i++ )
+        {
+            map<size_t,size_t>::iterator it = cg.nodeIndices.find( tree[i] );
+            if ( it != cg.nodeIndices.end() )
+                inTree[ it->second ] = 1;
+        }
+    }
+
+    const vector<char> *inTreePtr = is_tree ? &inTree : NULL;
+
+    //
+    // Build the messages structure
+    //
+
+    bool logDomain = options.particularB["logDomain"];
+
+    if ( logDomain )
+        getLogPotentials( cg );
+
+    initializeMessages( cg, messages, logDomain );
+
+    //
+    // Set the schedule.
+    // - Gauss-Seidel (default): nodes are visited sequentially, and their
+    //   new messages are used as soon as they are computed.
+    // - Jacobi: all the messages of an iteration are computed in parallel
+    //   from the ones of the previous iteration (double buffer).
+    // - RBP: all the messages are computed in a candidates buffer, and only
+    //   the one with the highest residual is committed.
+    //
+
+    bool   RBP       = ( options.particularS["order"] == "RBP" );
+    bool   Jacobi    = ( options.particularS["schedule"] == "Jacobi" ) && !RBP;
+    double smoothing = options.particularD["smoothing"];
+    double tolerance = options.convergency;
+
+    size_t N_threads = Jacobi ? getNumberOfThreads( options ) : 1;
+
+    vector<size_t> blocks;
+    getNodeBlocks( cg, N_threads, blocks );
+
+    //
+    // Messages are stored in flat buffers, following the order of the
+    // directed edges in cg. Each thread fills first the chunk of the buffers
+    // that it is going to update, so it is allocated in its NUMA node.
+    //
+
+    size_t bufferSize = cg.msgOffsets.back();
+
+    VectorXd msgs( bufferSize );
+    VectorXd newMsgs( ( Jacobi || RBP ) ? bufferSize : 0 );
+
+    #pragma omp parallel num_threads(N_threads)
+    {
+        size_t thread = getThreadIndex();
+
+        copyMessagesToBuffer( cg, messages, blocks[thread], blocks[thread+1], msgs.data() );
+
+        // Messages not updated (out of the tree) have to be the same in both buffers
+        if ( Jacobi )
+            copyMessagesToBuffer( cg, messages, blocks[thread], blocks[thread+1], newMsgs.data() );
+    }
+
+    vector<TMessagesWorkspace> workspaces( N_threads, TMessagesWorkspace( cg ) );
+    vector<double>             partialResiduals( N_threads );
+
+    //
+    // Convergence is checked through the residuals of the messages, that is,
+    // the max change of their entries when they were last updated (for RBP,
+    // the change that the candidate would produce). A node only has to be
+    // updated (is pending) if some of its incoming messages changed more than
+    // the tolerance since its last update.
+    //
+
+    vector<double> residuals( N_directed, 0 );
+    vector<char>   pending( N_nodes, 1 );
+    double         maxResidual = std::numeric_limits<double>::max();
+    string         stopCause   = "MaxIterations";
+
+    //
+    // When decoding, it can also stop once the labels decoded from the
+    // messages are stable (see CDecisionStability). The label of a node is
+    // taken from the belief computed when it is updated, and kept while it is
+    // not pending. This is not checked when calibrating a tree, the caller
+    // does it. For RBP, a sweep is as many committed messages as nodes.
+    //
+
+    CDecisionStability stability( options, N_nodes );
+    bool checkDecisions = maximize && !is_tree && N_nodes && stability.isEnabled();
+
+    //
+    // Iterate until convergence or a certain maximum number of iterations is reached
+    //
+
+    size_t iteration;
+
+    for ( iteration = 0; iteration < options.maxIterations; iteration++ )
+    {
+        maxResidual = 0;
+
+        if ( Jacobi )
+        {
+            #pragma omp parallel num_threads(N_threads)
+            {
+                size_t thread = getThreadIndex();
+                double threadMaxResidual = 0;
+
+                for ( size_t nodeIndex = blocks[thread]; nodeIndex < blocks[thread+1]; nodeIndex++ )
+                {
+                    if ( is_tree && !inTree[nodeIndex] )
+                        continue;
+
+                    size_t begin = cg.msgOffsets[ cg.adjOffsets[nodeIndex] ];
+                    size_t end   = cg.msgOffsets[ cg.adjOffsets[nodeIndex+1] ];
+
+                    // Keep the messages of the nodes not updated in both buffers
+                    if ( !pending[nodeIndex] )
+                    {
+                        newMsgs.segment( begin, end-begin ) = msgs.segment( begin, end-begin );
+
+                        for ( size_t p = cg.adjOffsets[nodeIndex]; p < cg.adjOffsets[nodeIndex+1]; p++ )
+                            residuals[p] = 0;
+
+                        continue;
+                    }
+
+                    size_t threadDecision;
+
+                    if ( logDomain )
+                        computeNodeLogMessages( cg, nodeIndex, msgs.data(), newMsgs.data(), maximize,
+                                                smoothing, inTreePtr, workspaces[thread],
+                                                checkDecisions ? &threadDecision : NULL );
+                    else
+                        computeNodeMessages( cg, nodeIndex, msgs.data(), newMsgs.data(), maximize,
+                                             smoothing, inTreePtr, workspaces[thread],
+                                             checkDecisions ? &threadDecision : NULL );
+
+                    if ( checkDecisions )
+                        stability.setLabel( nodeIndex, threadDecision );
+
+                    for ( size_t p = cg.adjOffsets[nodeIndex]; p < cg.adjOffsets[nodeIndex+1]; p++ )
+                    {
+                        size_t offset = cg.msgOffsets[p];
+                        size_t length = cg.msgOffsets[p+1] - offset;
+
+                        residuals[p] = ( newMsgs.segment( offset, length ) -
+                                         msgs.segment( offset, length ) ).cwiseAbs().maxCoeff();
+
+                        if ( residuals[p] > threadMaxResidual )
+                            threadMaxResidual = residuals[p];
+                    }
+                }
+
+                partialResiduals[thread] = threadMaxResidual;
+
+                #pragma omp barrier
+
+                // Set the nodes to be updated in the next iteration
+                for ( size_t nodeIndex = blocks[thread]; nodeIndex < blocks[thread+1]; nodeIndex++ )
+                {
+                    pending[nodeIndex] = 0;
+
+                    for ( size_t q = cg.adjOffsets[nodeIndex]; q < cg.adjOffsets[nodeIndex+1]; q++ )
+                        if ( residuals[ cg.adjReverse[q] ] > tolerance )
+                        {
+                            pending[nodeIndex] = 1;
+                            break;
+                        }
+                }
+            }
+
+            msgs.swap( newMsgs );
+
+            for ( size_t thread = 0; thread < N_threads; thread++ )
+                maxResidual = std::max( maxResidual, partialResiduals[thread] );
+        }
+        else
+        {
+            TMessagesWorkspace &ws = workspaces[0];
+
+            double *buffer = RBP ? newMsgs.data() : msgs.data();
+
+            //
+            // Iterate over all the nodes
+            //
+            for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+            {
+                // Check if we are calibrating a tree, and so if the node is not member of the tree,
+                // so we dont have to update its messages
+                if ( ( is_tree && !inTree[nodeIndex] ) || !pending[nodeIndex] )
+                    continue;
+
+                pending[nodeIndex] = 0;
+
+                size_t begin = cg.msgOffsets[ cg.adjOffsets[nodeIndex] ];
+                size_t end   = cg.msgOffsets[ cg.adjOffsets[nodeIndex+1] ];
+
+                if ( !RBP )
+                    ws.oldMessages.head( end-begin ) = msgs.segment( begin, end-begin );
+
+                size_t decision;
+
+                if ( logDomain )
+                    computeNodeLogMessages( cg, nodeIndex, msgs.data(), buffer, maximize, smoothing,
+                                            inTreePtr, ws, checkDecisions ? &decision : NULL );
+                else
+                    computeNodeMessages( cg, nodeIndex, msgs.data(), buffer, maximize, smoothing,
+                                         inTreePtr, ws, checkDecisions ? &decision : NULL );
+
+                if ( checkDecisions )
+                    stability.setLabel( nodeIndex, decision );
+
+                for ( size_t p = cg.adjOffsets[nodeIndex]; p < cg.adjOffsets[nodeIndex+1]; p++ )
+                {
+                    if ( is_tree && !inTree[ cg.adjNeighbor[p] ] )
+                        continue;
+
+                    size_t offset = cg.msgOffsets[p];
+                    size_t length = cg.msgOffsets[p+1] - offset;
+
+                    // If residual belief propagation is activated, just keep the
+                    // residual of the candidate message
+                    if ( RBP )
+                        residuals[p] = ( newMsgs.segment( offset, length ) -
+                                         msgs.segment( offset, length ) ).cwiseAbs().maxCoeff();
+                    else
+                    {
+                        residuals[p] = ( msgs.segment( offset, length ) -
+                                         ws.oldMessages.segment( offset-begin, length ) ).cwiseAbs().maxCoeff();
+
+                        if ( residuals[p] > tolerance )
+                            pending[ cg.adjNeighbor[p] ] = 1;
+
+                        maxResidual = std::max( maxResidual, residuals[p] );
+                    }
+                }
+
+            } // Nodes
+
+            //
+            // RBP: commit the candidate with the highest residual. Only its
+            // receiver has to recompute its candidates.
+            //
+
+            if ( RBP )
+            {
+                int directedEdgeWithMaxResidual = -1;
+
+                for ( size_t p = 0; p < N_directed; p++ )
+                    if ( residuals[p] > maxResidual )
+                    {
+                        maxResidual = residuals[p];
+                        directedEdgeWithMaxResidual = p;
+                    }
+
+                if ( ( directedEdgeWithMaxResidual != -1 ) && ( maxResidual >= tolerance ) )
+                {
+                    size_t offset = cg.msgOffsets[directedEdgeWithMaxResidual];
+                    size_t length = cg.msgOffsets[directedEdgeWithMaxResidual+1] - offset;
+
+                    msgs.segment( offset, length ) = newMsgs.segment( offset, length );
+
+                    residuals[directedEdgeWithMaxResidual] = 0;
+                    pending[ cg.adjNeighbor[directedEdgeWithMaxResidual] ] = 1;
+                }
+            }
+        }
+
+        //
+        // Check convergency!!
+        //
+
+        if ( maxResidual < tolerance )
+        {
+            stopCause = "Converged";
+            iteration++;
+            break;
+        }
+
+        if ( checkDecisions && ( !RBP || ( ( iteration+1 ) % N_nodes == 0 ) ) && stability.endSweep() )
+        {
+            stopCause = "StableDecisions";
+            iteration++;
+            break;
+        }
+
+    } // Iterations
+
+    //
+    // Copy back the messages
+    //
+
+    for ( size_t i = 0; i < N_edges; i++ )
+        for ( size_t dir = 0; dir < 2; dir++ )
+        {
+            size_t p = cg.edgeAdj[2*i+dir];
+            messages[i][dir] = msgs.segment( cg.msgOffsets[p], messages[i][dir].rows() );
+        }
+
+    if ( status )
+    {
+        status->iterations = iteration;
+        status->residual   = maxResidual;
+        status->stopCause  = stopCause;
+    }
+
+    return iteration;
+}
+
+/*------------------------------------------------------------------------------
+
+                                messagesSplash
+
+------------------------------------------------------------------------------*/
+
+namespace
+{
+    /** Set of locks, only really used if OpenMP is enabled. */
+    class CLocks
+    {
+#ifdef UPGMpp_USING_OMPENMP
+        vector<omp_lock_t> m_locks;
+
+    public:
+        CLocks( size_t N_locks ) : m_locks( N_locks )
+        {
+            for ( size_t i = 0; i < N_locks; i++ )
+                omp_init_lock( &m_locks[i] );
+        }
+
+        ~CLocks()
+        {
+            for ( size_t i = 0; i < m_locks.size(); i++ )
+                omp_destroy_lock( &m_locks[i] );
+        }
+
+        inline bool tryLock( size_t i ) { return omp_test_lock( &m_locks[i] ) != 0; }
+        inline void lock( size_t i ) { omp_set_lock( &m_locks[i] ); }
+        inline void unlock( size_t i ) { omp_unset_lock( &m_locks[i] ); }
+#else
+    public:
+        CLocks( size_t ) {}
+
+        inline bool tryLock( size_t ) { return true; }
+        inline void lock( size_t ) {}
+        inline void unlock( size_t ) {}
+#endif
+    };
+
+    typedef std::priority_queue<std::pair<double,size_t> > TResidualsQueue;
+
+    /** Data shared by the threads running Splash Belief Propagation. */
+    struct TSplashData
+    {
+        const TCompactGraph     &cg;
+        VectorXd                &msgs;
+        vector<double>          residuals;  //!< Max change of the incoming messages of each node since it was updated.
+        vector<size_t>          owner;      //!< Thread whose queue holds each node.
+        vector<TResidualsQueue> queues;
+        CLocks                  nodeLocks;
+        CLocks                  queueLocks;
+        bool                    maximize;
+        bool                    logDomain;
+        double                  smoothing;
+        double                  tolerance;
+
+        TSplashData( const TCompactGraph &cg_, VectorXd &msgs_, size_t N_threads ) :
+            cg( cg_ ), msgs( msgs_ ),
+            residuals( cg_.N_nodes, std::numeric_limits<double>::max() ),
+            owner( cg_.N_nodes, 0 ),
+            queues( N_threads ),
+            nodeLocks( cg_.N_nodes ),
+            queueLocks( N_threads )
+        {}
+
+        void push( size_t nodeIndex, double residual )
+        {
+            size_t queue = owner[nodeIndex];
+
+            queueLocks.lock( queue );
+            queues[queue].push( std::make_pair( residual, nodeIndex ) );
+            queueLocks.unlock( queue );
+        }
+    };
+
+    /** Locks owned by a thread while building and running a splash. */
+    struct TSplashLocks
+    {
+        vector<char>    held;
+        vector<size_t>  heldList;
+
+        TSplashLocks( size_t N_nodes ) : held( N_nodes, 0 ) {}
+
+        bool tryLock( CLocks &locks, size_t nodeIndex )
+        {
+            if ( held[nodeIndex] )
+                return true;
+
+            if ( !locks.tryLock( nodeIndex ) )
+                return false;
+
+            held[nodeIndex] = 1;
+            heldList.push_back( nodeIndex );
+
+            return true;
+        }
+
+        /** Locks the scope of a node (the node and its neighbors), needed
+          * to update its messages without interfering with other threads.
+          */
+        bool tryLockScope( TSplashData &data, size_t nodeIndex )
+        {
+            bool locked = tryLock( data.nodeLocks, nodeIndex );
+
+            for ( size_t p = data.cg.adjOffsets[nodeIndex]; locked && ( p < data.cg.adjOffsets[nodeIndex+1] ); p++ )
+                locked = tryLock( data.nodeLocks, data.cg.adjNeighbor[p] );
+
+            return locked;
+        }
+
+        void unlockAll( CLocks &locks )
+        {
+            for ( size_t i = 0; i < heldList.size(); i++ )
+            {
+                held[ heldList[i] ] = 0;
+                locks.unlock( heldList[i] );
+            }
+
+            heldList.clear();
+        }
+    };
+
+    /** Sends the messages of a node, updating the residuals of its neighbors.
+      * The scope of the node has to be locked.
+      */
+    void updateSplashNode( TSplashData &data,
+                           size_t nodeIndex,
+                           TMessagesWorkspace &ws )
+    {
+        const TCompactGraph &cg = data.cg;
+
+        size_t begin = cg.msgOffsets[ cg.adjOffsets[nodeIndex] ];
+        size_t end   = cg.msgOffsets[ cg.adjOffsets[nodeIndex+1] ];
+
+        ws.oldMessages.head( end-begin ) = data.msgs.segment( begin, end-begin );
+
+        if ( data.logDomain )
+            computeNodeLogMessages( cg, nodeIndex, data.msgs.data(), data.msgs.data(),
+                                    data.maximize, data.smoothing, NULL, ws );
+        else
+            computeNodeMessages( cg, nodeIndex, data.msgs.data(), data.msgs.data(),
+                                 data.maximize, data.smoothing, NULL, ws );
+
+        data.residuals[nodeIndex] = 0;
+
+        for ( size_t p = cg.adjOffsets[nodeIndex]; p < cg.adjOffsets[nodeIndex+1]; p++ )
+        {
+            size_t offset   = cg.msgOffsets[p];
+            size_t length   = cg.msgOffsets[p+1] - offset;
+            size_t neighbor = cg.adjNeighbor[p];
+
+            double residual = ( data.msgs.segment( offset, length ) -
+                                ws.oldMessages.segment( offset-begin, length ) ).cwiseAbs().maxCoeff();
+
+            if ( residual > data.residuals[neighbor] )
+                data.residuals[neighbor] = residual;
+
+            if ( residual > data.tolerance )
+                data.push( neighbor, data.residuals[neighbor] );
+        }
+    }
+}
+
+size_t UPGMpp::messagesSplash( CGraph &graph,
+                               TInferenceOptions &options,
+                               vector<vector<VectorXd> > &messages,
+                               bool maximize,
+                               TInferenceStatus *status )
+{
+    TCompactGraph cg;
+    getCompactGraph( graph, options, cg );
+
+    size_t N_nodes = cg.N_nodes;
+
+    bool logDomain = options.particularB["logDomain"];
+
+    if ( logDomain )
+        getLogPotentials( cg );
+
+    initializeMessages( cg, messages, logDomain );
+
+    size_t splashSize = ( options.particularD["splashSize"] > 0 ) ?
+                            static_cast<size_t>( options.particularD["splashSize"] ) : 16;
+    size_t N_threads  = getNumberOfThreads( options );
+    size_t maxUpdates = options.maxIterations*N_nodes;
+
+    vector<size_t> blocks;
+    getNodeBlocks( cg, N_threads, blocks );
+
+    //
+    // Messages are stored in a flat buffer and updated in place, each thread
+    // filling first the chunk of the nodes it owns (NUMA).
+    //
+
+    VectorXd msgs( cg.msgOffsets.back() );
+
+    #pragma omp parallel num_threads(N_threads)
+    {
+        size_t thread = getThreadIndex();
+        copyMessagesToBuffer( cg, messages, blocks[thread], blocks[thread+1], msgs.data() );
+    }
+
+    TSplashData data( cg, msgs, N_threads );
+
+    data.maximize  = maximize;
+    data.logDomain = logDomain;
+    data.smoothing = options.particularD["smoothing"];
+    data.tolerance = options.convergency;
+
+    // All the nodes have to be updated at least once
+    for ( size_t thread = 0; thread < N_threads; thread++ )
+        for ( size_t nodeIndex = blocks[thread]; nodeIndex < blocks[thread+1]; nodeIndex++ )
+        {
+            data.owner[nodeIndex] = thread;
+            data.queues[thread].push( std::make_pair( data.residuals[nodeIndex], nodeIndex ) );
+        }
+
+    size_t updates = 0;
+    int    activeThreads = 0;
+
+    //
+    // Each thread repeatedly takes the node with the highest residual from its
+    // queue (or steals it from other queues), builds a splash around it and
+    // updates it, until no residual is over the tolerance.
+    //
+
+    #pragma omp parallel num_threads(N_threads)
+    {
+        size_t              thread = getThreadIndex();
+        TMessagesWorkspace  ws( cg );
+        TSplashLocks        locks( N_nodes );
+        vector<char>        inSplash( N_nodes, 0 );
+        vector<size_t>      splash;
+
+        while ( true )
+        {
+            size_t doneUpdates;
+            #pragma omp atomic read
+            doneUpdates = updates;
+
+            if ( doneUpdates >= maxUpdates )
+                break;
+
+            //
+            // 1. Take a root, from the own queue or stealing it from the others
+            //
+
+            int    root = -1;
+            double rootResidual = 0;
+
+            for ( size_t i = 0; ( i < N_threads ) && ( root == -1 ); i++ )
+            {
+                size_t queue = ( thread + i ) % N_threads;
+
+                data.queueLocks.lock( queue );
+
+                while ( !data.queues[queue].empty() && ( root == -1 ) )
+                {
+                    std::pair<double,size_t> top = data.queues[queue].top();
+                    data.queues[queue].pop();
+
+                    if ( top.first > data.tolerance )
+                    {
+                        root = top.second;
+                        rootResidual = top.first;
+
+                        #pragma omp atomic
+                        activeThreads++;
+                    }
+                }
+
+                data.queueLocks.unlock( queue );
+            }
+
+            if ( root == -1 )
+            {
+                // Finish if no other thread can generate more work
+                int stillActive;
+                #pragma omp atomic read
+                stillActive = activeThreads;
+
+                if ( !stillActive )
+                    break;
+
+                continue;
+            }
+
+            //
+            // 2. Build the splash, a bounded BFS tree from the root
+            //
+
+            splash.clear();
+
+            if ( !locks.tryLockScope( data, root ) )
+            {
+                // Another thread is working here, try it later
+                locks.unlockAll( data.nodeLocks );
+                data.push( root, rootResidual );
+
+                #pragma omp atomic
+                activeThreads--;
+
+                continue;
+            }
+
+            if ( data.residuals[root] > data.tolerance )
+            {
+                splash.push_back( root );
+                inSplash[root] = 1;
+            }
+
+            for ( size_t i = 0; ( i < splash.size() ) && ( splash.size() < splashSize ); i++ )
+                for ( size_t p = cg.adjOffsets[ splash[i] ];
+                      ( p < cg.adjOffsets[ splash[i]+1 ] ) && ( splash.size() < splashSize );
+                      p++ )
+                {
+                    size_t neighbor = cg.adjNeighbor[p];
+
+                    if ( !inSplash[neighbor] && locks.tryLockScope( data, neighbor ) )
+                    {
+                        splash.push_back( neighbor );
+                        inSplash[neighbor] = 1;
+                    }
+                }
+
+            //
+            // 3. Update the nodes from the leaves to the root, and then
+            // from the root to the leaves
+            //
+
+            for ( size_t i = splash.size(); i > 0; i-- )
+                updateSplashNode( data, splash[i-1], ws );
+
+            for ( size_t i = 1; i < splash.size(); i++ )
+                updateSplashNode( data, splash[i], ws );
+
+            for ( size_t i = 0; i < splash.size(); i++ )
+                inSplash[ splash[i] ] = 0;
+
+            locks.unlockAll( data.nodeLocks );
+
+            size_t splashUpdates = splash.size() ? 2*splash.size()-1 : 0;
+
+            #pragma omp atomic
+            updates += splashUpdates;
+
+            #pragma omp atomic
+            activeThreads--;
+        }
+    }
+
+    //
+    // Copy back the messages
+    //
+
+    for ( size_t i = 0; i < cg.N_edges; i++ )
+        for ( size_t dir = 0; dir < 2; dir++ )
+        {
+            size_t p = cg.edgeAdj[2*i+dir];
+            messages[i][dir] = msgs.segment( cg.msgOffsets[p], messages[i][dir].rows() );
+        }
+
+    if ( status )
+    {
+        double maxResidual = 0;
+
+        for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+            maxResidual = std::max( maxResidual, data.residuals[nodeIndex] );
+
+        status->iterations = N_nodes ? ( updates + N_nodes - 1 ) / N_nodes : 0;
+        status->residual   = maxResidual;
+        status->stopCause  = ( maxResidual > data.tolerance ) ? "MaxIterations" : "Converged";
+    }
+
+    return updates;
+}
+
+
+/*------------------------------------------------------------------------------
+
+                              getMessagesResidual
+
+------------------------------------------------------------------------------*/
+
+double UPGMpp::getMessagesResidual( const vector<vector<VectorXd> > &previousMessages,
+                                    const vector<vector<VectorXd> > &messages )
+{
+    if ( previousMessages.size() != messages.size() )
+        return std::numeric_limits<double>::max();
+
+    double residual = 0;
+
+    for ( size_t i = 0; i < messages.size(); i++ )
+    {
+        if ( previousMessages[i].size() != messages[i].size() )
+            return std::numeric_limits<double>::max();
+
+        for ( size_t dir = 0; dir < messages[i].size(); dir++ )
+        {
+            if ( previousMessages[i][dir].rows() != messages[i][dir].rows() )
+                return std::numeric_limits<double>::max();
+
+            if ( messages[i][dir].rows() )
+                residual = std::max( residual, ( messages[i][dir] - previousMessages[i][dir] ).cwiseAbs().maxCoeff() );
+        }
+    }
+
+    return residual;
+}
+
+/*------------------------------------------------------------------------------
+
+                              CDecisionStability
+
+------------------------------------------------------------------------------*/
+
+UPGMpp::CDecisionStability::CDecisionStability( TInferenceOptions &options,
+                                                size_t N_nodes ) :
+    m_sweep( 0 ),
+    m_labels( N_nodes, 0 ),
+    m_lastChange( N_nodes, 0 )
+{
+    double sweeps = options.particularD["decisionStabilitySweeps"];
+    double fraction = options.particularD["decisionStabilityFraction"];
+
+    m_enabled  = ( sweeps > 0 ) || ( fraction > 0 );
+    m_N_sweeps = ( sweeps >= 1 ) ? static_cast<size_t>( sweeps ) : 1;
+    m_fraction = ( fraction > 0 ) ? std::min( fraction, 1.0 ) : 1.0;
+}
+
+bool UPGMpp::CDecisionStability::endSweep()
+{
+    m_sweep++;
+
+    size_t N_nodes  = m_labels.size();
+    size_t N_stable = 0;
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        if ( m_sweep - m_lastChange[nodeIndex] > m_N_sweeps )
+            N_stable++;
+
+    return ( N_stable >= m_fraction*N_nodes );
+}
+
+/*------------------------------------------------------------------------------
+
+                                Beliefs and logZ
+
+------------------------------------------------------------------------------*/
+
+namespace
+{
+    /** Computes the unnormalized log beliefs of the nodes, as well as the log
+      * of the messages, from the messages obtained by messagesLBP. Working
+      * in the log domain avoids the underflows of long products and the
+      * divisions by zero when removing a message from a belief.
+      */
+    void getLogBeliefs( CGraph &graph,
+                        TInferenceOptions &options,
+                        vector<vector<VectorXd> > &messages,
+                        TCompactGraph &cg,
+                        vector<vector<VectorXd> > &logMessages,
+                        vector<VectorXd> &logBeliefs )
+    {
+        getCompactGraph( graph, options, cg );
+        getLogPotentials( cg );
+
+        if ( options.particularB["logDomain"] )
+            logMessages = messages;
+        else
+        {
+            const double minValue = std::numeric_limits<double>::min();
+            const double maxValue = std::numeric_limits<double>::max();
+
+            logMessages.resize( messages.size() );
+
+            for ( size_t edgeIndex = 0; edgeIndex < messages.size(); edgeIndex++ )
+            {
+                logMessages[edgeIndex].resize( messages[edgeIndex].size() );
+
+                for ( size_t dir = 0; dir < messages[edgeIndex].size(); dir++ )
+                    logMessages[edgeIndex][dir] =
+                            messages[edgeIndex][dir].cwiseMax( minValue ).cwiseMin( maxValue ).array().log();
+            }
+        }
+
+        logBeliefs.resize( cg.N_nodes );
+
+        for ( size_t nodeIndex = 0; nodeIndex < cg.N_nodes; nodeIndex++ )
+        {
+            logBeliefs[nodeIndex] = cg.logNodePotentials[nodeIndex];
+
+            for ( size_t q = cg.adjOffsets[nodeIndex]; q < cg.adjOffsets[nodeIndex+1]; q++ )
+                logBeliefs[nodeIndex] += logMessages[ cg.adjEdge[q] ][ cg.adjFirst[q] ? 1 : 0 ];
+        }
+    }
+
+    /** Sum of x*log(x), taking 0*log(0) as 0. */
+    template <typename T>
+    double sumXLogX( const T &x )
+    {
+        return ( x.array() > 0 ).select( x.array()*x.array().log(), 0 ).sum();
+    }
+}
+
+void UPGMpp::getNodeBeliefs( CGraph &graph,
+                             TInferenceOptions &options,
+                             vector<vector<VectorXd> > &messages,
+                             map<size_t,VectorXd> &nodeBeliefs )
+{
+    TCompactGraph               cg;
+    vector<vector<VectorXd> >   logMessages;
+    vector<VectorXd>            logBeliefs;
+
+    getLogBeliefs( graph, options, messages, cg, logMessages, logBeliefs );
+
+    for ( size_t nodeIndex = 0; nodeIndex < cg.N_nodes; nodeIndex++ )
+    {
+        VectorXd belief = ( logBeliefs[nodeIndex].array() - logBeliefs[nodeIndex].maxCoeff() ).exp();
+
+        nodeBeliefs[ cg.nodeIDs[nodeIndex] ] = belief / belief.sum();
+    }
+}
+
+void UPGMpp::getEdgeBeliefs( CGraph &graph,
+                             TInferenceOptions &options,
+                             vector<vector<VectorXd> > &messages,
+                             map<size_t,MatrixXd> &edgeBeliefs )
+{
+    TCompactGraph               cg;
+    vector<vector<VectorXd> >   logMessages;
+    vector<VectorXd>            logBeliefs;
+
+    getLogBeliefs( graph, options, messages, cg, logMessages, logBeliefs );
+
+    const vector<CEdgePtr> &edges = graph.getEdges();
+
+    for ( size_t edgeIndex = 0; edgeIndex < cg.N_edges; edgeIndex++ )
+    {
+        // Beliefs of the nodes without the message sent by the other one
+        VectorXd logNode1Belief = logBeliefs[ cg.edgeNode1[edgeIndex] ] - logMessages[edgeIndex][1];
+        VectorXd logNode2Belief = logBeliefs[ cg.edgeNode2[edgeIndex] ] - logMessages[edgeIndex][0];
+
+        MatrixXd logEdgeBelief = cg.logEdgePotentials[edgeIndex];
+        logEdgeBelief.colwise() += logNode1Belief;
+        logEdgeBelief.rowwise() += logNode2Belief.transpose();
+
+        MatrixXd edgeBelief = ( logEdgeBelief.array() - logEdgeBelief.maxCoeff() ).exp();
+
+        edgeBeliefs[ edges[edgeIndex]->getID() ] = edgeBelief / edgeBelief.sum();
+    }
+}
+
+double UPGMpp::getBetheLogZ( CGraph &graph,
+                             TInferenceOptions &options,
+                             map<size_t,VectorXd> &nodeBeliefs,
+                             map<size_t,MatrixXd> &edgeBeliefs )
+{
+    TCompactGraph cg;
+    getCompactGraph( graph, options, cg );
+    getLogPotentials( cg );
+
+    const vector<CEdgePtr> &edges = graph.getEdges();
+
+    double energyNodes  = 0;
+    double energyEdges  = 0;
+    double entropyNodes = 0;
+    double entropyEdges = 0;
+
+    // Compute energy and entropy from nodes. The entropy of a node is
+    // counted once, minus once per neighbor (already in its edges)
+
+    for ( size_t nodeIndex = 0; nodeIndex < cg.N_nodes; nodeIndex++ )
+    {
+        double    N_Neighbors = cg.adjOffsets[nodeIndex+1] - cg.adjOffsets[nodeIndex];
+        VectorXd &nodeBelief  = nodeBeliefs[ cg.nodeIDs[nodeIndex] ];
+
+        // Energy from the node
+        energyNodes += nodeBelief.dot( cg.logNodePotentials[nodeIndex] );
+
+        // Entropy from the node
+        entropyNodes += ( N_Neighbors - 1 )*sumXLogX( nodeBelief );
+    }
+
+    // Compute energy and entropy from edges
+
+    for ( size_t edgeIndex = 0; edgeIndex < cg.N_edges; edgeIndex++ )
+    {
+        MatrixXd &edgeBelief = edgeBeliefs[ edges[edgeIndex]->getID() ];
+
+        // Energy from the edge
+        energyEdges += edgeBelief.cwiseProduct( cg.logEdgePotentials[edgeIndex] ).sum();
+
+        // Entropy from the edge
+        entropyEdges -= sumXLogX( edgeBelief );
+    }
+
+    // Final Bethe free energy (energy minus entropy, energies being the
+    // negative log potentials)
+
+    double BethefreeEnergy = - ( energyNodes + energyEdges ) - ( entropyNodes + entropyEdges );
+
+    // Compute logZ
+
+    return - BethefreeEnergy;
+}
+
+
+/*------------------------------------------------------------------------------
+
+                        getForestMAP / getForestMarginals
+
+------------------------------------------------------------------------------*/
+
+namespace
+{
+    /** Log of the sum of the exponentials of the elements of a vector. */
+    double logSumExp( const VectorXd &v )
+    {
+        double maxValue = v.maxCoeff();
+
+        return maxValue + std::log( ( v.array() - maxValue ).exp().sum() );
+    }
+
+    /** Solves exactly the acyclic components of a graph. Each one is rooted
+      * at its first node and traversed in BFS order, so messages are sent
+      * from the leaves to the root in reverse order (Viterbi/forward pass),
+      * and the root decision or the messages to the leaves are propagated in
+      * direct order (decoding/backward pass). Messages are unnormalized and
+      * in the log domain.
+      * \return The logZ of the solved components (only if !maximize).
+      */
+    double solveForest( CGraph &graph,
+                        TInferenceOptions &options,
+                        bool maximize,
+                        map<size_t,size_t> *results,
+                        map<size_t,VectorXd> *nodeBeliefs,
+                        map<size_t,MatrixXd> *edgeBeliefs,
+                        CGraph *cyclicPart )
+    {
+        TCompactGraph cg;
+        getCompactGraph( graph, options, cg );
+        getLogPotentials( cg );
+
+        vector<vector<size_t> > components;
+        vector<bool>            acyclic;
+
+        graph.getConnectedComponents( components, acyclic );
+
+        const vector<CNodePtr> &nodes = graph.getNodes();
+        const vector<CEdgePtr> &edges = graph.getEdges();
+
+        vector<size_t>   component( cg.N_nodes );
+        vector<size_t>   parentAdj( cg.N_nodes ); // Directed edge from the node to its parent
+        vector<VectorXd> up( cg.N_nodes );        // Node potential times the messages from its children
+        vector<VectorXd> upMessage( cg.N_nodes ); // Message from the node to its parent
+        vector<VectorXd> down( cg.N_nodes );      // Message from the parent to the node
+        vector<bool>     visited( cg.N_nodes, false );
+        vector<size_t>   order;
+
+        double logZ = 0;
+
+        for ( size_t c = 0; c < components.size(); c++ )
+        {
+            for ( size_t i = 0; i < components[c].size(); i++ )
+                component[ components[c][i] ] = c;
+
+            if ( !acyclic[c] )
+                continue;
+
+            //
+            // BFS order from the root
+            //
+
+            size_t root = components[c][0];
+
+            order.clear();
+            order.push_back( root );
+            visited[root] = true;
+
+            for ( size_t i = 0; i < order.size(); i++ )
+            {
+                size_t nodeIndex = order[i];
+
+                for ( size_t p = cg.adjOffsets[nodeIndex]; p < cg.adjOffsets[nodeIndex+1]; p++ )
+                {
+                    size_t neighbor = cg.adjNeighbor[p];
+
+                    if ( !visited[neighbor] )
+                    {
+                        visited[neighbor]   = true;
+                        parentAdj[neighbor] = cg.adjReverse[p];
+                        order.push_back( neighbor );
+                    }
+                }
+            }
+
+            //
+            // From the leaves to the root
+            //
+
+            for ( size_t i = order.size(); i-- > 0; )
+            {
+                size_t nodeIndex = order[i];
+
+                up[nodeIndex] = cg.logNodePotentials[nodeIndex];
+
+                for ( size_t p = cg.adjOffsets[nodeIndex]; p < cg.adjOffsets[nodeIndex+1]; p++ )
+                    if ( ( nodeIndex == root ) || ( p != parentAdj[nodeIndex] ) )
+                        up[nodeIndex] += upMessage[ cg.adjNeighbor[p] ];
+
+                if ( nodeIndex == root )
+                    break;
+
+                size_t   p = parentAdj[nodeIndex];
+                MatrixXd logTerms = cg.logEdgePotentials[ cg.adjEdge[p] ];
+
+                if ( cg.adjFirst[p] )
+                    logTerms.colwise() += up[nodeIndex];
+                else
+                    logTerms = ( logTerms.transpose().colwise() + up[nodeIndex] ).eval();
+
+                // Rows of logTerms are now the classes of the node
+                VectorXd &message = upMessage[nodeIndex];
+                message.resize( logTerms.cols() );
+
+                for ( size_t k = 0; k < (size_t)logTerms.cols(); k++ )
+                    message(k) = maximize ? logTerms.col(k).maxCoeff()
+                                          : logSumExp( logTerms.col(k) );
+            }
+
+            if ( maximize )
+            {
+                //
+                // Decode from the root to the leaves
+                //
+
+                size_t label;
+                up[root].maxCoeff( &label );
+                (*results)[ cg.nodeIDs[root] ] = label;
+
+                for ( size_t i = 1; i < order.size(); i++ )
+                {
+                    size_t nodeIndex   = order[i];
+                    size_t p           = parentAdj[nodeIndex];
+                    size_t parentLabel = (*results)[ cg.nodeIDs[ cg.adjNeighbor[p] ] ];
+
+                    const MatrixXd &logEdgePotentials = cg.logEdgePotentials[ cg.adjEdge[p] ];
+
+                    VectorXd score = up[nodeIndex];
+
+                    if ( cg.adjFirst[p] )
+                        score += logEdgePotentials.col( parentLabel );
+                    else
+                        score += logEdgePotentials.row( parentLabel ).transpose();
+
+                    score.maxCoeff( &label );
+                    (*results)[ cg.nodeIDs[nodeIndex] ] = label;
+                }
+
+                continue;
+            }
+
+            //
+            // From the root to the leaves
+            //
+
+            logZ += logSumExp( up[root] );
+
+            down[root] = VectorXd::Zero( cg.N_classes[root] );
+
+            for ( size_t i = 0; i < order.size(); i++ )
+            {
+                size_t    nodeIndex = order[i];
+                VectorXd  logBelief = up[nodeIndex] + down[nodeIndex];
+
+                VectorXd belief = ( logBelief.array() - logBelief.maxCoeff() ).exp();
+                (*nodeBeliefs)[ cg.nodeIDs[nodeIndex] ] = belief / belief.sum();
+
+                for ( size_t p = cg.adjOffsets[nodeIndex]; p < cg.adjOffsets[nodeIndex+1]; p++ )
+                {
+                    size_t child = cg.adjNeighbor[p];
+
+                    if ( ( nodeIndex != root ) && ( p == parentAdj[nodeIndex] ) )
+                        continue;
+
+                    // Belief of the node without the message from the child
+                    VectorXd cavity   = logBelief - upMessage[child];
+                    size_t   edgeIndex = cg.adjEdge[p];
+
+                    MatrixXd logEdgeBelief = cg.logEdgePotentials[edgeIndex];
+
+                    if ( cg.adjFirst[p] )
+                    {
+                        logEdgeBelief.colwise() += cavity;
+                        logEdgeBelief.rowwise() += up[child].transpose();
+                    }
+                    else
+                    {
+                        logEdgeBelief.colwise() += up[child];
+                        logEdgeBelief.rowwise() += cavity.transpose();
+                    }
+
+                    MatrixXd edgeBelief = ( logEdgeBelief.array() - logEdgeBelief.maxCoeff() ).exp();
+                    (*edgeBeliefs)[ edges[edgeIndex]->getID() ] = edgeBelief / edgeBelief.sum();
+
+                    // Message to the child
+                    MatrixXd logTerms = cg.logEdgePotentials[edgeIndex];
+
+                    if ( cg.adjFirst[p] )
+                        logTerms.colwise() += cavity;
+                    else
+                        logTerms = ( logTerms.transpose().colwise() + cavity ).eval();
+
+                    down[child].resize( logTerms.cols() );
+
+                    for ( size_t k = 0; k < (size_t)logTerms.cols(); k++ )
+                        down[child](k) = logSumExp( logTerms.col(k) );
+                }
+            }
+        }
+
+        //
+        // Components with cycles
+        //
+
+        size_t N_cyclic = std::count( acyclic.begin(), acyclic.end(), false );
+
+        if ( !N_cyclic )
+            return logZ;
+
+        if ( !cyclicPart )
+        {
+            cout << "[ERROR] " << N_cyclic << " connected components of the graph have cycles, "
+                 << "they can not be solved by the exact tree inference." << endl;
+
+            return logZ;
+        }
+
+        for ( size_t nodeIndex = 0; nodeIndex < cg.N_nodes; nodeIndex++ )
+            if ( !acyclic[ component[nodeIndex] ] )
+                cyclicPart->addNode( nodes[nodeIndex] );
+
+        for ( size_t edgeIndex = 0; edgeIndex < cg.N_edges; edgeIndex++ )
+            if ( !acyclic[ component[ cg.edgeNode1[edgeIndex] ] ] )
+                cyclicPart->addEdge( edges[edgeIndex] );
+
+        return logZ;
+    }
+}
+
+void UPGMpp::getForestMAP( CGraph &graph,
+                           TInferenceOptions &options,
+                           map<size_t,size_t> &results,
+                           CGraph *cyclicPart )
+{
+    solveForest( graph, options, true, &results, NULL, NULL, cyclicPart );
+}
+
+double UPGMpp::getForestMarginals( CGraph &graph,
+                                   TInferenceOptions &options,
+                                   map<size_t,VectorXd> &nodeBeliefs,
+                                   map<size_t,MatrixXd> &edgeBeliefs,
+                                   CGraph *cyclicPart )
+{
+    return solveForest( graph, options, false, NULL, &nodeBeliefs, &edgeBeliefs, cyclicPart );
+}
+
+
+/*------------------------------------------------------------------------------
+
+                                getEliminationOrder
+
+------------------------------------------------------------------------------*/
+
+namespace
+{
+    /** Cost of eliminating a node: fill-in edges or neighbors, and the log
+      * of the size of the clique table as tie breaker.
+      */
+    std::pair<size_t,double> getEliminationCost( const vector<set<size_t> > &adjacency,
+                                                 const vector<size_t> &N_classes,
+                                                 size_t nodeIndex,
+                                                 bool minFill )
+    {
+        const set<size_t> &neighbors = adjacency[nodeIndex];
+
+        double logTableSize = std::log( (double)N_classes[nodeIndex] );
+        size_t N_fill       = 0;
+
+        for ( set<size_t>::const_iterator it = neighbors.begin(); it != neighbors.end(); it++ )
+        {
+            logTableSize += std::log( (double)N_classes[*it] );
+
+            if ( minFill )
+            {
+                set<size_t>::const_iterator it2 = it;
+
+                for ( it2++; it2 != neighbors.end(); it2++ )
+                    if ( !adjacency[*it].count( *it2 ) )
+                        N_fill++;
+            }
+        }
+
+        return std::make_pair( minFill ? N_fill : neighbors.size(), logTableSize );
+    }
+}
+
+size_t UPGMpp::getEliminationOrder( TCompactGraph &cg,
+                                    const std::string &heuristic,
+                                    vector<size_t> &order,
+                                    vector<vector<size_t> > *neighbors )
+{
+    size_t N_nodes = cg.N_nodes;
+    bool   minFill = ( heuristic != "MinDegree" );
+
+    vector<set<size_t> > adjacency( N_nodes );
+
+    for ( size_t edgeIndex = 0; edgeIndex < cg.N_edges; edgeIndex++ )
+    {
+        size_t node1 = cg.edgeNode1[edgeIndex];
+        size_t node2 = cg.edgeNode2[edgeIndex];
+
+        if ( node1 != node2 )
+        {
+            adjacency[node1].insert( node2 );
+            adjacency[node2].insert( node1 );
+        }
+    }
+
+    vector<std::pair<size_t,double> > cost( N_nodes );
+    vector<bool> eliminated( N_nodes, false );
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        cost[nodeIndex] = getEliminationCost( adjacency, cg.N_classes, nodeIndex, minFill );
+
+    order.clear();
+    order.reserve( N_nodes );
+
+    if ( neighbors )
+        neighbors->clear();
+
+    size_t width = 0;
+
+    for ( size_t step = 0; step < N_nodes; step++ )
+    {
+        size_t best = N_nodes;
+
+        for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+            if ( !eliminated[nodeIndex] && ( ( best == N_nodes ) || ( cost[nodeIndex] < cost[best] ) ) )
+                best = nodeIndex;
+
+        order.push_back( best );
+        eliminated[best] = true;
+
+        vector<size_t> bestNeighbors( adjacency[best].begin(), adjacency[best].end() );
+
+        if ( neighbors )
+            neighbors->push_back( bestNeighbors );
+
+        if ( bestNeighbors.size() > width )
+            width = bestNeighbors.size();
+
+        // Connect the neighbors between them, and remove the node
+
+        for ( size_t i = 0; i < bestNeighbors.size(); i++ )
+        {
+            adjacency[ bestNeighbors[i] ].erase( best );
+
+            for ( size_t j = i+1; j < bestNeighbors.size(); j++ )
+            {
+                adjacency[ bestNeighbors[i] ].insert( bestNeighbors[j] );
+                adjacency[ bestNeighbors[j] ].insert( bestNeighbors[i] );
+            }
+        }
+
+        adjacency[best].clear();
+
+        // Update the costs that could have changed
+
+        set<size_t> changed( bestNeighbors.begin(), bestNeighbors.end() );
+
+        if ( minFill )
+            for ( size_t i = 0; i < bestNeighbors.size(); i++ )
+                changed.insert( adjacency[ bestNeighbors[i] ].begin(),
+                                adjacency[ bestNeighbors[i] ].end() );
+
+        for ( set<size_t>::iterator it = changed.begin(); it != changed.end(); it++ )
+            cost[*it] = getEliminationCost( adjacency, cg.N_classes, *it, minFill );
+    }
+
+    return width;
+}
+
+
+/*------------------------------------------------------------------------------
+
+                    getJunctionTreeMAP / getJunctionTreeMarginals
+
+------------------------------------------------------------------------------*/
+
+namespace
+{
+    /** Clique of the junction tree created when eliminating a node. Its
+      * variables are the node (the fastest changing in the table) followed
+      * by the separator with its parent, the clique of the first eliminated
+      * node of the separator. So the separator table index of an entry t is
+      * t/K, being K the number of classes of the node.
+      */
+    struct TClique
+    {
+        std::vector<size_t> vars;
+        std::vector<size_t> strides;
+        size_t              size;
+        size_t              parent;        //!< Node of the parent clique (N_nodes if root).
+        std::vector<size_t> children;      //!< Nodes of the children cliques.
+        std::vector<std::vector<size_t> > childSepIndex; //!< Separator index of each child for each entry.
+        std::vector<size_t> edges;         //!< Edges whose potentials are in this clique.
+        Eigen::VectorXd     logTable;
+    };
+
+    /** Builds the cliques and their log tables, indexed by the position of
+      * their eliminated node.
+      * \return False if a table would be too large.
+      */
+    bool getJunctionTree( TCompactGraph &cg,
+                          TInferenceOptions &options,
+                          vector<size_t> &order,
+                          vector<TClique> &cliques )
+    {
+        size_t N_nodes = cg.N_nodes;
+
+        double maxTableSize = options.particularD["maxTableSize"];
+
+        if ( !maxTableSize )
+            maxTableSize = 1e7;
+
+        vector<vector<size_t> > separators;
+        getEliminationOrder( cg, options.particularS["eliminationOrder"], order, &separators );
+
+        vector<size_t> position( N_nodes );
+
+        for ( size_t i = 0; i < N_nodes; i++ )
+            position[ order[i] ] = i;
+
+        cliques.clear();
+        cliques.resize( N_nodes );
+
+        //
+        // Variables and structure
+        //
+
+        for ( size_t i = 0; i < N_nodes; i++ )
+        {
+            size_t   nodeIndex = order[i];
+            TClique &clique    = cliques[nodeIndex];
+
+            clique.vars.push_back( nodeIndex );
+            clique.vars.insert( clique.vars.end(), separators[i].begin(), separators[i].end() );
+
+            double size = 1;
+
+            for ( size_t j = 0; j < clique.vars.size(); j++ )
+            {
+                clique.strides.push_back( (size_t)size );
+                size *= cg.N_classes[ clique.vars[j] ];
+            }
+
+            if ( size > maxTableSize )
+            {
+                cout << "[ERROR] The junction tree needs a table of " << size
+                     << " entries, over the maximum of " << maxTableSize << endl;
+
+                return false;
+            }
+
+            clique.size   = (size_t)size;
+            clique.parent = N_nodes;
+
+            for ( size_t j = 1; j < clique.vars.size(); j++ )
+                if ( ( clique.parent == N_nodes ) || ( position[ clique.vars[j] ] < position[clique.parent] ) )
+                    clique.parent = clique.vars[j];
+
+            if ( clique.parent != N_nodes )
+                cliques[clique.parent].children.push_back( nodeIndex );
+        }
+
+        //
+        // Log tables: the node potentials go to their own clique, and the
+        // edge potentials to the clique of their first eliminated node
+        //
+
+        for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        {
+            TClique &clique = cliques[nodeIndex];
+            size_t   K      = cg.N_classes[nodeIndex];
+
+            clique.logTable.resize( clique.size );
+
+            for ( size_t s = 0; s < clique.size/K; s++ )
+                clique.logTable.segment( s*K, K ) = cg.logNodePotentials[nodeIndex];
+        }
+
+        for ( size_t edgeIndex = 0; edgeIndex < cg.N_edges; edgeIndex++ )
+        {
+            size_t node1 = cg.edgeNode1[edgeIndex];
+            size_t node2 = cg.edgeNode2[edgeIndex];
+
+            TClique &clique = cliques[ ( position[node1] <= position[node2] ) ? node1 : node2 ];
+            clique.edges.push_back( edgeIndex );
+
+            size_t stride1 = 0, stride2 = 0;
+
+            for ( size_t j = 0; j < clique.vars.size(); j++ )
+            {
+                if ( clique.vars[j] == node1 ) stride1 = clique.strides[j];
+                if ( clique.vars[j] == node2 ) stride2 = clique.strides[j];
+            }
+
+            const MatrixXd &logEdgePotentials = cg.logEdgePotentials[edgeIndex];
+
+            for ( size_t t = 0; t < clique.size; t++ )
+                clique.logTable(t) += logEdgePotentials( ( t/stride1 ) % cg.N_classes[node1],
+                                                         ( t/stride2 ) % cg.N_classes[node2] );
+        }
+
+        //
+        // Separator index of each child for each entry of the table
+        //
+
+        for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        {
+            TClique &clique = cliques[nodeIndex];
+
+            clique.childSepIndex.resize( clique.children.size() );
+
+            for ( size_t c = 0; c < clique.children.size(); c++ )
+            {
+                TClique &child  = cliques[ clique.children[c] ];
+                size_t   childK = cg.N_classes[ clique.children[c] ];
+
+                // Stride of each separator variable in this clique
+                vector<size_t> strides( child.vars.size(), 0 );
+
+                for ( size_t j = 1; j < child.vars.size(); j++ )
+                    for ( size_t k = 0; k < clique.vars.size(); k++ )
+                        if ( clique.vars[k] == child.vars[j] )
+                            strides[j] = clique.strides[k];
+
+                vector<size_t> &sepIndex = clique.childSepIndex[c];
+                sepIndex.assign( clique.size, 0 );
+
+                for ( size_t t = 0; t < clique.size; t++ )
+                    for ( size_t j = 1; j < child.vars.size(); j++ )
+                        sepIndex[t] += ( ( t/strides[j] ) % cg.N_classes[ child.vars[j] ] )
+                                        * ( child.strides[j]/childK );
+            }
+        }
+
+        return true;
+    }
+
+    /** Passes the messages from the leaves to the roots, in elimination
+      * order. up[i] is the table of a clique plus the messages of its
+      * children, and upMessage[i] the message to its parent.
+      * \return The sum of the messages of the roots (logZ or max log score).
+      */
+    double collectJunctionTree( TCompactGraph &cg,
+                                vector<size_t> &order,
+                                vector<TClique> &cliques,
+                                bool maximize,
+                                vector<VectorXd> &up,
+                                vector<VectorXd> &upMessage )
+    {
+        up.resize( cg.N_nodes );
+        upMessage.resize( cg.N_nodes );
+
+        double rootsSum = 0;
+
+        for ( size_t i = 0; i < order.size(); i++ )
+        {
+            size_t   nodeIndex = order[i];
+            TClique &clique    = cliques[nodeIndex];
+            size_t   K         = cg.N_classes[nodeIndex];
+
+            up[nodeIndex] = clique.logTable;
+
+            for ( size_t c = 0; c < clique.children.size(); c++ )
+            {
+                const VectorXd       &message  = upMessage[ clique.children[c] ];
+                const vector<size_t> &sepIndex = clique.childSepIndex[c];
+
+                for ( size_t t = 0; t < clique.size; t++ )
+                    up[nodeIndex](t) += message( sepIndex[t] );
+            }
+
+            VectorXd &message = upMessage[nodeIndex];
+            message.resize( clique.size/K );
+
+            for ( size_t s = 0; s < (size_t)message.rows(); s++ )
+            {
+                VectorXd::SegmentReturnType segment = up[nodeIndex].segment( s*K, K );
+
+                double maxValue = segment.maxCoeff();
+
+                message(s) = maximize ? maxValue
+                                      : maxValue + std::log( ( segment.array() - maxValue ).exp().sum() );
+            }
+
+            if ( clique.parent == cg.N_nodes )
+                rootsSum += message(0);
+        }
+
+        return rootsSum;
+    }
+}
+
+bool UPGMpp::getJunctionTreeMAP( CGraph &graph,
+                                 TInferenceOptions &options,
+                                 map<size_t,size_t> &results )
 {
+    TCompactGraph cg;
+    getCompactGraph( graph, options, cg );
+    getLogPotentials( cg );
 
-    const vector<CNodePtr> nodes = graph.getNodes();
-    const vector<CEdgePtr> edges = graph.getEdges();
-    multimap<size_t,CEdgePtr> edges_f = graph.getEdgesF();
+    vector<size_t>  order;
+    vector<TClique> cliques;
 
-    size_t N_nodes = nodes.size();
-    size_t N_edges = edges.size();
-
-    bool is_tree = (tree.size()>0) ? true : false;
+    if ( !getJunctionTree( cg, options, order, cliques ) )
+        return false;
 
-    //graph.computePotentials();
+    vector<VectorXd> up, upMessage;
+    collectJunctionTree( cg, order, cliques, true, up, upMessage );
 
     //
-    // Build the messages structure
+    // Decode in reverse elimination order, so the separator of each clique
+    // is already decoded
     //
 
-    double totalSumOfMsgs = 0;
+    vector<size_t> labels( cg.N_nodes, 0 );
+
+    for ( size_t i = order.size(); i-- > 0; )
+    {
+        size_t   nodeIndex = order[i];
+        TClique &clique    = cliques[nodeIndex];
+        size_t   K         = cg.N_classes[nodeIndex];
 
-    if ( !messages.size() )
-        messages.resize( N_edges);
+        size_t t = 0;
 
-    for ( size_t i = 0; i < N_edges; i++ )
+        for ( size_t j = 1; j < clique.vars.size(); j++ )
+            t += labels[ clique.vars[j] ]*clique.strides[j];
+
+        up[nodeIndex].segment( t, K ).maxCoeff( &labels[nodeIndex] );
+
+        results[ cg.nodeIDs[nodeIndex] ] = labels[nodeIndex];
+    }
+
+    return true;
+}
+
+bool UPGMpp::getJunctionTreeMarginals( CGraph &graph,
+                                       TInferenceOptions &options,
+                                       map<size_t,VectorXd> &nodeBeliefs,
+                                       map<size_t,MatrixXd> &edgeBeliefs,
+                                       double &logZ )
+{
+    TCompactGraph cg;
+    getCompactGraph( graph, options, cg );
+    getLogPotentials( cg );
+
+    vector<size_t>  order;
+    vector<TClique> cliques;
+
+    if ( !getJunctionTree( cg, options, order, cliques ) )
+        return false;
+
+    vector<VectorXd> up, upMessage;
+    logZ = collectJunctionTree( cg, order, cliques, false, up, upMessage );
+
+    const vector<CEdgePtr> &edges = graph.getEdges();
+
+    //
+    // From the roots to the leaves. down[i] is the message from the parent
+    // of a clique, over its separator.
+    //
+
+    vector<VectorXd> down( cg.N_nodes );
+    VectorXd         logBelief, terms;
+
+    for ( size_t i = order.size(); i-- > 0; )
     {
-        if ( !messages[i].size() )
+        size_t   nodeIndex = order[i];
+        TClique &clique    = cliques[nodeIndex];
+        size_t   K         = cg.N_classes[nodeIndex];
+
+        if ( clique.parent == cg.N_nodes )
+            down[nodeIndex] = VectorXd::Zero( 1 );
+
+        logBelief = up[nodeIndex];
+
+        for ( size_t t = 0; t < clique.size; t++ )
+            logBelief(t) += down[nodeIndex]( t/K );
+
+        // Messages to the children
+
+        for ( size_t c = 0; c < clique.children.size(); c++ )
         {
-            messages[i].resize(2);
+            size_t                child    = clique.children[c];
+            const vector<size_t> &sepIndex = clique.childSepIndex[c];
+            VectorXd             &message  = down[child];
+
+            message.setConstant( upMessage[child].rows(), -std::numeric_limits<double>::infinity() );
+
+            terms.resize( clique.size );
+
+            for ( size_t t = 0; t < clique.size; t++ )
+            {
+                terms(t) = logBelief(t) - upMessage[child]( sepIndex[t] );
+
+                if ( terms(t) > message( sepIndex[t] ) )
+                    message( sepIndex[t] ) = terms(t);
+            }
+
+            VectorXd sums = VectorXd::Zero( message.rows() );
 
-            size_t ID1, ID2;
-            edges[i]->getNodesID(ID1,ID2);
+            for ( size_t t = 0; t < clique.size; t++ )
+                sums( sepIndex[t] ) += std::exp( terms(t) - message( sepIndex[t] ) );
 
-            // Messages from first node of the edge to the second one, so the size of
-            // the message has to be the same as the number of classes of the second node.
-            double N_classes = graph.getNodeWithID( ID2 )->getPotentials( options.considerNodeFixedValues ).rows();
-            messages[i][0].resize( N_classes );
-            messages[i][0].fill(1.0/N_classes);
-            // Just the opposite as before.
-            N_classes = graph.getNodeWithID( ID1 )->getPotentials( options.considerNodeFixedValues ).rows();
-            messages[i][1].resize( N_classes );
-            messages[i][1].fill(1.0/N_classes);
+            message.array() += sums.array().log();
         }
 
-        totalSumOfMsgs += messages[i][0].rows() + messages[i][1].rows();
+        // Beliefs of the node and the edges of the clique
 
-    }
+        VectorXd belief = ( logBelief.array() - logBelief.maxCoeff() ).exp();
 
-//    cout << "Initial Messages:" << endl;
+        VectorXd nodeBelief = VectorXd::Zero( K );
 
-//    for ( size_t i=0; i < messages.size(); i++)
-//        for ( size_t j=0; j < messages[i].size(); j++)
-//            for ( size_t k=0; k < messages[i][j].size(); k++ )
-//                cout << messages[i][j][k] << " ";
+        for ( size_t t = 0; t < clique.size; t++ )
+            nodeBelief( t % K ) += belief(t);
 
-    vector<vector<VectorXd> > previousMessages;
+        nodeBeliefs[ cg.nodeIDs[nodeIndex] ] = nodeBelief / nodeBelief.sum();
 
-    if ( options.particularS["order"] == "RBP" )
-    {
-        previousMessages = messages;
-        for ( size_t i = 0; i < previousMessages.size(); i++ )
+        for ( size_t e = 0; e < clique.edges.size(); e++ )
         {
-            previousMessages[i][0].fill(0);
-            previousMessages[i][1].fill(0);
+            size_t edgeIndex = clique.edges[e];
+            size_t node1     = cg.edgeNode1[edgeIndex];
+            size_t node2     = cg.edgeNode2[edgeIndex];
+
+            size_t stride1 = 0, stride2 = 0;
+
+            for ( size_t j = 0; j < clique.vars.size(); j++ )
+            {
+                if ( clique.vars[j] == node1 ) stride1 = clique.strides[j];
+                if ( clique.vars[j] == node2 ) stride2 = clique.strides[j];
+            }
+
+            MatrixXd edgeBelief = MatrixXd::Zero( cg.N_classes[node1], cg.N_classes[node2] );
+
+            for ( size_t t = 0; t < clique.size; t++ )
+                edgeBelief( ( t/stride1 ) % cg.N_classes[node1],
+                            ( t/stride2 ) % cg.N_classes[node2] ) += belief(t);
+
+            edgeBeliefs[ edges[edgeIndex]->getID() ] = edgeBelief / edgeBelief.sum();
         }
     }
 
-    //
-    // Iterate until convergence or a certain maximum number of iterations is reached
-    //
+    return true;
+}
 
-    size_t iteration;
-//    cout << endl;
 
-    for ( iteration = 0; iteration < options.maxIterations; iteration++ )
+/*------------------------------------------------------------------------------
+
+                                eliminateVariables
+
+------------------------------------------------------------------------------*/
+
+namespace
+{
+    /** Factor over some nodes, stored as a contiguous log table. Its nodes
+      * are sorted by elimination position, the first one changing fastest.
+      */
+    struct TFactor
     {
-//        cout << "Messages " << iteration << ":" << endl;
+        std::vector<size_t> vars;
+        std::vector<size_t> strides;
+        Eigen::VectorXd     logTable;
 
-//        for ( size_t i=0; i < messages.size(); i++)
-//            for ( size_t j=0; j < messages[i].size(); j++)
-//                for ( size_t k=0; k < messages[i][j].size(); k++ )
-//                    cout << messages[i][j][k] << " ";
+        double getValue( const vector<size_t> &labels ) const
+        {
+            size_t t = 0;
 
-//        cout << endl;
+            for ( size_t j = 0; j < vars.size(); j++ )
+                t += labels[ vars[j] ]*strides[j];
 
-        // Variables used by Residual Belief Propagation
-        int edgeWithMaxDiffIndex = -1;
-        VectorXd associatedMessage;
-        bool from1to2;
-        double maxDifference = -1;
+            return logTable(t);
+        }
+    };
+
+    /** Multiplies (adds in the log domain) a set of factors, and then
+      * eliminates the first node of their scope by max or log-sum-exp.
+      */
+    void eliminateFactors( TCompactGraph &cg,
+                           const vector<size_t> &position,
+                           const vector<const TFactor*> &factors,
+                           bool maximize,
+                           TFactor &result )
+    {
+        // Scope, sorted by elimination position
+        vector<std::pair<size_t,size_t> > scope;
 
-        //
-        // Iterate over all the nodes
-        //
-        for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        for ( size_t f = 0; f < factors.size(); f++ )
+            for ( size_t j = 0; j < factors[f]->vars.size(); j++ )
+                scope.push_back( std::make_pair( position[ factors[f]->vars[j] ], factors[f]->vars[j] ) );
+
+        std::sort( scope.begin(), scope.end() );
+        scope.erase( std::unique( scope.begin(), scope.end() ), scope.end() );
+
+        vector<size_t> strides( scope.size() );
+        size_t size = 1;
+
+        for ( size_t j = 0; j < scope.size(); j++ )
         {
-            const CNodePtr nodePtr = graph.getNode( nodeIndex );
-            size_t nodeID          = nodePtr->getID();
+            strides[j] = size;
+            size *= cg.N_classes[ scope[j].second ];
+        }
 
-            // Check if we are calibrating a tree, and so if the node is not member of the tree,
-            // so we dont have to update its messages
-            if ( is_tree && ( std::find(tree.begin(), tree.end(), nodeID ) == tree.end() ) )
-                continue;
+        VectorXd logTable = VectorXd::Zero( size );
 
-            NEIGHBORS_IT neighbors;
+        for ( size_t f = 0; f < factors.size(); f++ )
+        {
+            const TFactor &factor = *factors[f];
 
-            neighbors = edges_f.equal_range(nodeID);
+            // Stride in the product table of each node of the factor
+            vector<size_t> productStrides( factor.vars.size() );
 
-            //cout << "  Sending messages ... " << endl;
+            for ( size_t j = 0; j < factor.vars.size(); j++ )
+                for ( size_t k = 0; k < scope.size(); k++ )
+                    if ( scope[k].second == factor.vars[j] )
+                        productStrides[j] = strides[k];
 
-            //
-            // Send a message to each neighbor
-            //
-            for ( multimap<size_t,CEdgePtr>::iterator itNeigbhor = neighbors.first;
-                  itNeigbhor != neighbors.second;
-                  itNeigbhor++ )
-            {
-//                cout << "sending msg to neighbor..." << endl;
-                VectorXd nodePotPlusIncMsg = nodePtr->getPotentials( options.considerNodeFixedValues );
-//                cout << "nodePotPlusIncMsg Orig: " << nodePotPlusIncMsg.transpose() << endl;
-                size_t neighborID;
-                size_t ID1, ID2;
-                CEdgePtr edgePtr( (*itNeigbhor).second );
-                edgePtr->getNodesID(ID1,ID2);
-                ( ID1 == nodeID ) ? neighborID = ID2 : neighborID = ID1;
-
-//                cout << "all ready" << endl;
-
-                // Check if we are calibrating a tree, and so if the neighbor node
-                // is not member of the tree, so we dont have to update its messages
-                if ( is_tree && ( std::find(tree.begin(), tree.end(), neighborID ) == tree.end() ))
-                    continue;
+            for ( size_t t = 0; t < size; t++ )
+            {
+                size_t index = 0;
 
-                //
-                // Compute the message from current node as a product of all the
-                // incoming messages less the one from the current neighbor
-                // plus the node potential of the current node.
-                //
-                for ( multimap<size_t,CEdgePtr>::iterator itNeigbhor2 = neighbors.first;
-                      itNeigbhor2 != neighbors.second;
-                      itNeigbhor2++ )
-                {
-                    size_t ID11, ID12;
-                    CEdgePtr edgePtr2( (*itNeigbhor2).second );
-                    edgePtr2->getNodesID(ID11,ID12);
-                    size_t edgeIndex = graph.getEdgeIndex( edgePtr2->getID() );
-//                    cout << "Edge index: " << edgeIndex << endl << "node pot" <<  nodePotPlusIncMsg << endl;
-//                    cout << "Node ID: " << nodeID << " node11 " << ID11 << " node12 " << ID12 << endl;
-                    CNodePtr n1,n2;
-                    edgePtr2->getNodes(n1,n2);
-//                    cout << "Node 1 type: " << n1->getType()->getID() << " label " << n1->getType()->getLabel() << endl;
-//                    cout << "Node 2 type: " << n2->getType()->getID() << " label " << n2->getType()->getLabel() << endl;
-                    // Check if the current neighbor appears in the edge
-                    if ( ( neighborID != ID11 ) && ( neighborID != ID12 ) )
-                    {
-                        if ( nodeID == ID11 )
-                        {
-//                            cout << "nodePotPlusIncMsg Prod: " << messages[ edgeIndex ][ 1 ].transpose() << endl;
-//                            cout << "nodePotPlusIncMsg Bis : " << messages[ edgeIndex ][ 0 ].transpose() << endl;
-                            nodePotPlusIncMsg =
-                                    nodePotPlusIncMsg.cwiseProduct(messages[ edgeIndex ][ 1 ]);
-//                            cout << "nodePotPlusIncMsg Prod2: " << nodePotPlusIncMsg.transpose() << endl;
-                        }
-                        else // nodeID == ID2
-                        {
-//                            cout << "nodePotPlusIncMsg Prod: " << messages[ edgeIndex ][ 0 ].transpose() << endl;
-//                            cout << "nodePotPlusIncMsg Bis : " << messages[ edgeIndex ][ 1 ].transpose() << endl;
-                            nodePotPlusIncMsg =
-                                    nodePotPlusIncMsg.cwiseProduct(messages[ edgeIndex ][ 0 ]);
-//                            cout << "nodePotPlusIncMsg Prod2: " << nodePotPlusIncMsg.transpose() << endl;
-                        }
-                    }
-                }
+                for ( size_t j = 0; j < factor.vars.size(); j++ )
+                    index += ( ( t/productStrides[j] ) % cg.N_classes[ factor.vars[j] ] )*factor.strides[j];
 
-//                cout << "Node pot" << endl;
+                logTable(t) += factor.logTable( index );
+            }
+        }
 
-                //cout << "Node pot" << nodePotPlusIncMsg << endl;
+        // Eliminate the first node
+        size_t K = cg.N_classes[ scope[0].second ];
 
-                //
-                // Take also the potential between the two nodes
-                //
-                MatrixXd edgePotentials;
+        result.vars.clear();
+        result.strides.clear();
 
-                if ( nodeID != ID1 )
-                    edgePotentials = edgePtr->getPotentials();
-                else
-                    edgePotentials = edgePtr->getPotentials().transpose();
+        for ( size_t j = 1; j < scope.size(); j++ )
+        {
+            result.vars.push_back( scope[j].second );
+            result.strides.push_back( strides[j]/K );
+        }
 
-                VectorXd newMessage;
-                size_t edgeIndex = graph.getEdgeIndex( edgePtr->getID() );
+        result.logTable.resize( size/K );
 
-//                cout << "get new message" << endl;
+        for ( size_t s = 0; s < size/K; s++ )
+        {
+            VectorXd::SegmentReturnType segment = logTable.segment( s*K, K );
 
-                if ( !maximize )
-                {
-                    // Multiply both, and update the potential
+            double maxValue = segment.maxCoeff();
 
-//                    cout << "Edge potentials:" << edgePotentials.transpose() << endl;
-//                    cout << "nodePotPlusIncMsg:" << nodePotPlusIncMsg.transpose() << endl;
-                    newMessage = edgePotentials * nodePotPlusIncMsg;
+            result.logTable(s) = maximize ? maxValue
+                                          : maxValue + std::log( ( segment.array() - maxValue ).exp().sum() );
+        }
+    }
 
-                    // Normalize new message
-                    if (newMessage.sum())
-                        newMessage = newMessage / newMessage.sum();
+    /** Size of the table of the product of some factors. */
+    double getProductSize( TCompactGraph &cg, const vector<const TFactor*> &factors )
+    {
+        set<size_t> scope;
 
-                    //cout << "New message 3:" << newMessage.transpose() << endl;
-                }
-                else
-                {
-                    if ( nodeID == ID1 )
-                        newMessage.resize(messages[ edgeIndex ][0].rows());
-                    else
-                        newMessage.resize(messages[ edgeIndex ][1].rows());
+        for ( size_t f = 0; f < factors.size(); f++ )
+            scope.insert( factors[f]->vars.begin(), factors[f]->vars.end() );
 
-                    for ( size_t row = 0; row < edgePotentials.rows(); row++ )
-                    {
-                        double maxRowValue = std::numeric_limits<double>::min();
+        double size = 1;
 
-                        for ( size_t col = 0; col < edgePotentials.cols(); col++ )
-                        {
-                            double value = edgePotentials(row,col)*nodePotPlusIncMsg(col);
-                            if ( value > maxRowValue )
-                                maxRowValue = value;
-                        }
-                        newMessage(row) = maxRowValue;
-                    }
+        for ( set<size_t>::iterator it = scope.begin(); it != scope.end(); it++ )
+            size *= cg.N_classes[*it];
 
-                    // Normalize new message
-                    if (newMessage.sum())
-                        newMessage = newMessage / newMessage.sum();
+        return size;
+    }
+}
 
-                    //cout << "New message: " << endl << newMessage << endl;
-                }
+double UPGMpp::eliminateVariables( CGraph &graph,
+                                   TInferenceOptions &options,
+                                   bool maximize,
+                                   map<size_t,size_t> *results,
+                                   bool *exact )
+{
+    TCompactGraph cg;
+    getCompactGraph( graph, options, cg );
+    getLogPotentials( cg );
 
-                //
-                // Set the message!
-                //
+    size_t N_nodes = cg.N_nodes;
 
-                VectorXd smoothedOldMessage(newMessage.rows());
-                smoothedOldMessage.setZero();
+    double maxTableSize = options.particularD["maxTableSize"];
 
-                double smoothing = options.particularD["smoothing"];
+    if ( !maxTableSize )
+        maxTableSize = 1e7;
 
-                if ( smoothing != 0 )
-                    if ( nodeID == ID1 )
-                        newMessage = newMessage + (1-smoothing) * messages[ edgeIndex ][0];
-                    else
-                        newMessage = newMessage + (1-smoothing) * messages[ edgeIndex ][1];
+    vector<size_t> order;
+    getEliminationOrder( cg, options.particularS["eliminationOrder"], order );
 
-                //cout << "New message:" << endl << newMessage << endl << "Smoothed" << endl << smoothedOldMessage << endl;
+    vector<size_t> position( N_nodes );
 
-                // If residual belief propagation is activated, just check if the
-                // newMessage is the one with the higest residual till the
-                // moment. Otherwise, set the new message as the current one
-                if ( options.particularS["order"] == "RBP" )
-                {                    
-                    if ( nodeID == ID1 )
-                    {
-                        VectorXd differences = messages[edgeIndex][0] - newMessage;
-                        double difference = differences.cwiseAbs().sum();
+    for ( size_t i = 0; i < N_nodes; i++ )
+        position[ order[i] ] = i;
 
-                        if ( difference > maxDifference )
-                        {
-                            from1to2 = true;
-                            edgeWithMaxDiffIndex = edgeIndex;
-                            maxDifference = difference;
-                            associatedMessage = newMessage;
-                        }
-                    }
-                    else
-                    {
-                        VectorXd differences = messages[edgeIndex][1] - newMessage;
-                        double difference = differences.cwiseAbs().sum();
+    //
+    // Initial factors, each one in the bucket of its first eliminated node.
+    // Factors are kept in lists so pointers to them remain valid.
+    //
 
-                        if ( difference > maxDifference )
-                        {
-                            from1to2 = false;
-                            edgeWithMaxDiffIndex = edgeIndex;
-                            maxDifference = difference;
-                            associatedMessage = newMessage;
-                        }
-                    }
-                }
-                else
-                {
-//                    cout << newMessage.cols() << " " << newMessage.rows() << endl;
-//                    cout << "edgeIndex" << edgeIndex << endl;
-                    if ( nodeID == ID1 )
-                    {
-//                        cout << messages[ edgeIndex ][0].cols() << " " << messages[ edgeIndex ][0].rows() << endl;
-                        messages[ edgeIndex ][0] = newMessage;
-                    }
-                    else
-                    {
-//                        cout << messages[ edgeIndex ][1].cols() << " " << messages[ edgeIndex ][1].rows() << endl;
-                        messages[ edgeIndex ][1] = newMessage;
-                    }
+    vector<std::list<TFactor> > buckets( N_nodes );
 
-//                        cout << "Wop " << endl;
-                }
-            }
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+    {
+        TFactor factor;
+        factor.vars.push_back( nodeIndex );
+        factor.strides.push_back( 1 );
+        factor.logTable = cg.logNodePotentials[nodeIndex];
+
+        buckets[nodeIndex].push_back( factor );
+    }
 
-        } // Nodes
+    for ( size_t edgeIndex = 0; edgeIndex < cg.N_edges; edgeIndex++ )
+    {
+        size_t node1 = cg.edgeNode1[edgeIndex];
+        size_t node2 = cg.edgeNode2[edgeIndex];
+
+        const MatrixXd &logEdgePotentials = cg.logEdgePotentials[edgeIndex];
 
-        if ( options.particularS["order"] == "RBP" && ( edgeWithMaxDiffIndex =! -1 ))
+        TFactor factor;
+
+        if ( node1 == node2 )
         {
-            if ( from1to2 )
-                messages[ edgeWithMaxDiffIndex ][0] = associatedMessage;
-            else
-                messages[ edgeWithMaxDiffIndex ][1] = associatedMessage;
+            factor.vars.push_back( node1 );
+            factor.strides.push_back( 1 );
+            factor.logTable = logEdgePotentials.diagonal();
+        }
+        else
+        {
+            bool   firstBefore = ( position[node1] < position[node2] );
+            size_t K1          = cg.N_classes[node1];
+            size_t K2          = cg.N_classes[node2];
+
+            factor.vars.push_back( firstBefore ? node1 : node2 );
+            factor.vars.push_back( firstBefore ? node2 : node1 );
+            factor.strides.push_back( 1 );
+            factor.strides.push_back( firstBefore ? K1 : K2 );
+
+            // Column major storage has the rows (first node) changing fastest
+            MatrixXd table = firstBefore ? logEdgePotentials : logEdgePotentials.transpose();
+            factor.logTable = Map<VectorXd>( table.data(), K1*K2 );
         }
 
-        //
-        // Check convergency!!
-        //
+        buckets[ factor.vars[0] ].push_back( factor );
+    }
 
-        double newTotalSumOfMsgs = 0;
-        for ( size_t i = 0; i < N_edges; i++ )
+    //
+    // Eliminate the nodes in order, splitting the buckets whose product
+    // would be too large into mini-buckets (first fit, largest first)
+    //
+
+    double logValue = 0;
+    bool   isExact  = true;
+
+    for ( size_t i = 0; i < N_nodes; i++ )
+    {
+        size_t nodeIndex = order[i];
+
+        vector<std::pair<size_t,const TFactor*> > bucket;
+
+        for ( std::list<TFactor>::iterator it = buckets[nodeIndex].begin(); it != buckets[nodeIndex].end(); it++ )
+            bucket.push_back( std::make_pair( it->logTable.rows(), &(*it) ) );
+
+        std::sort( bucket.rbegin(), bucket.rend() );
+
+        vector<vector<const TFactor*> > miniBuckets;
+
+        for ( size_t f = 0; f < bucket.size(); f++ )
         {
-            newTotalSumOfMsgs += messages[i][0].sum() + messages[i][1].sum();
+            size_t m = 0;
+
+            for ( ; m < miniBuckets.size(); m++ )
+            {
+                miniBuckets[m].push_back( bucket[f].second );
+
+                if ( getProductSize( cg, miniBuckets[m] ) <= maxTableSize )
+                    break;
+
+                miniBuckets[m].pop_back();
+            }
+
+            if ( m == miniBuckets.size() )
+                miniBuckets.push_back( vector<const TFactor*>( 1, bucket[f].second ) );
         }
 
-        //printf("%4.10f\n",std::abs( totalSumOfMsgs - newTotalSumOfMsgs ));
+        if ( miniBuckets.size() > 1 )
+            isExact = false;
 
-        if ( std::abs( totalSumOfMsgs - newTotalSumOfMsgs ) <
-             options.convergency )
-            break;
+        for ( size_t m = 0; m < miniBuckets.size(); m++ )
+        {
+            // Summing out a node in more than a mini-bucket is bounded by
+            // summing it in one and maximizing it in the others
+            TFactor result;
+            eliminateFactors( cg, position, miniBuckets[m], maximize || ( m > 0 ), result );
+
+            if ( result.vars.empty() )
+                logValue += result.logTable(0);
+            else
+                buckets[ result.vars[0] ].push_back( result );
+        }
+    }
 
-        totalSumOfMsgs = newTotalSumOfMsgs;
+    //
+    // Decode in reverse elimination order, maximizing the factors of each
+    // bucket given the nodes already decoded
+    //
 
-        // Show messages
-        /*cout << "Iteration:" << iteration << endl;
+    if ( results )
+    {
+        vector<size_t> labels( N_nodes, 0 );
 
-        for ( size_t i = 0; i < messages.size(); i++ )
+        for ( size_t i = N_nodes; i-- > 0; )
         {
-            cout <<  messages[i][0] << " " << messages[i][1] << endl;
-        }*/
+            size_t nodeIndex = order[i];
+            double bestValue = -std::numeric_limits<double>::infinity();
+            size_t bestLabel = 0;
 
-    } // Iterations
+            for ( size_t k = 0; k < cg.N_classes[nodeIndex]; k++ )
+            {
+                labels[nodeIndex] = k;
 
-    return 1;
+                double value = 0;
+
+                for ( std::list<TFactor>::iterator it = buckets[nodeIndex].begin(); it != buckets[nodeIndex].end(); it++ )
+                    value += it->getValue( labels );
+
+                if ( value > bestValue )
+                {
+                    bestValue = value;
+                    bestLabel = k;
+                }
+            }
+
+            labels[nodeIndex] = bestLabel;
+            (*results)[ cg.nodeIDs[nodeIndex] ] = bestLabel;
+        }
+    }
+
+    if ( exact )
+        *exact = isExact;
+
+    return logValue;
 }
 
+
 void UPGMpp::getSpanningTree( CGraph &graph, std::vector<size_t> &tree)
 {
     // TODO: The efficiency of this method can be improved
@@ -494,146 +2684,223 @@ void UPGMpp::getSpanningTree( CGraph &graph, std::vector<size_t> &tree)
     //SHOW_VECTOR("Tree: ", tree)
 }
 
+/*------------------------------------------------------------------------------
 
-// For-Fulkerson implemetation for max-flow min-cut computation adapted from:
-// http://www.geeksforgeeks.org/ford-fulkerson-algorithm-for-maximum-flow-problem
+                        getEdgeAppearanceProbabilities
 
-// Number of vertices in given graph
-//#define V 6
+------------------------------------------------------------------------------*/
 
-void getFinalCut(MatrixXd &rGraph, int s, int t, VectorXi &cut)
+namespace
 {
-    size_t N_nodes = rGraph.cols();
-    bool visited[N_nodes];
-    memset(visited, 0, sizeof(visited));
+    /** Orders edges by increasing key. */
+    struct TEdgeKeyComparator
+    {
+        const vector<double> *keys;
 
-    queue<int> q;
-    q.push(s);
+        TEdgeKeyComparator( const vector<double> &k ) : keys( &k ) {}
 
-    cut(s) = 1;
-    visited[s] = true;
+        bool operator()( size_t a, size_t b ) const { return (*keys)[a] < (*keys)[b]; }
+    };
 
-    // Standard BFS Loop
-    while (!q.empty())
+    /** Root of a node in a union-find forest (with path halving). */
+    size_t findRoot( vector<size_t> &parent, size_t node )
     {
-        int u = q.front();
-        q.pop();
-
-        for (int v=0; v<N_nodes; v++)
+        while ( parent[node] != node )
         {
-            //cout << "Visiting from " << u << " to " << v << " residual " << rGraph(u,v) << endl;
-            if (visited[v]==false && rGraph(u,v) > 0)
-            {
-                q.push(v);
-                visited[v] = true;
-                cut(v) = 1;
-            }
+            parent[node] = parent[ parent[node] ];
+            node = parent[node];
         }
-    }
 
+        return node;
+    }
 }
 
-/* Returns true if there is a path from source 's' to sink 't' in
-  residual graph. Also fills parent[] to store the path */
-bool bfs(MatrixXd &rGraph, int s, int t, int parent[])
+void UPGMpp::getEdgeAppearanceProbabilities( CGraph &graph, std::vector<double> &rho )
 {
-    size_t N_nodes = rGraph.cols();
-    // Create a visited array and mark all vertices as not visited
-    bool visited[N_nodes];
-    memset(visited, 0, sizeof(visited));
+    vector<double>         &cache = graph.getEdgeAppearanceProbs();
+    const vector<CEdgePtr> &edges = graph.getEdges();
+    const vector<CNodePtr> &nodes = graph.getNodes();
 
-    // Create a queue, enqueue source vertex and mark source vertex
-    // as visited
-    queue <int> q;
-    q.push(s);
-    visited[s] = true;
+    size_t N_edges = edges.size();
+    size_t N_nodes = nodes.size();
+
+    if ( N_edges && ( cache.size() == N_edges ) )
+    {
+        rho = cache;
+        return;
+    }
+
+    // Minimum number of forests, so the probabilities are balanced
+    const size_t minForests = 10;
+
+    map<size_t,size_t> nodeIndices;
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        nodeIndices[ nodes[nodeIndex]->getID() ] = nodeIndex;
+
+    vector<size_t> node1( N_edges ), node2( N_edges );
+    vector<size_t> counts( N_edges, 0 );
+    size_t         N_uncovered = 0;
+
+    for ( size_t edgeIndex = 0; edgeIndex < N_edges; edgeIndex++ )
+    {
+        size_t ID1, ID2;
+        edges[edgeIndex]->getNodesID( ID1, ID2 );
+
+        node1[edgeIndex] = nodeIndices[ID1];
+        node2[edgeIndex] = nodeIndices[ID2];
+
+        // Self loops are never part of a tree
+        if ( node1[edgeIndex] != node2[edgeIndex] )
+            N_uncovered++;
+    }
+
+    // Fixed seed, so the tree-reweighted methods are reproducible
+    boost::mt19937 rng( 0 );
+    boost::uniform_real<> real_generator( 0, 1 );
 
-    // Standard BFS Loop
-    while (!q.empty())
+    vector<size_t> order( N_edges );
+    vector<double> keys( N_edges );
+    vector<size_t> parent( N_nodes );
+    size_t         N_forests = 0;
+
+    while ( N_uncovered || ( N_forests < minForests ) )
     {
-        int u = q.front();
-        q.pop();
+        for ( size_t edgeIndex = 0; edgeIndex < N_edges; edgeIndex++ )
+        {
+            order[edgeIndex] = edgeIndex;
+            keys[edgeIndex]  = counts[edgeIndex] + real_generator( rng );
+        }
+
+        std::sort( order.begin(), order.end(), TEdgeKeyComparator( keys ) );
 
-        for (int v=0; v<N_nodes; v++)
+        for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+            parent[nodeIndex] = nodeIndex;
+
+        for ( size_t i = 0; i < N_edges; i++ )
         {
-            if (visited[v]==false && rGraph(u,v) > 0)
+            size_t edgeIndex = order[i];
+            size_t root1     = findRoot( parent, node1[edgeIndex] );
+            size_t root2     = findRoot( parent, node2[edgeIndex] );
+
+            if ( root1 != root2 )
             {
-                q.push(v);
-                parent[v] = u;
-                visited[v] = true;
+                parent[root1] = root2;
+
+                if ( !counts[edgeIndex] )
+                    N_uncovered--;
+
+                counts[edgeIndex]++;
             }
         }
+
+        N_forests++;
     }
 
-    // If we reached sink in BFS starting from source, then return
-    // true, else false
-    return (visited[t] == true);
+    rho.resize( N_edges );
+
+    for ( size_t edgeIndex = 0; edgeIndex < N_edges; edgeIndex++ )
+        rho[edgeIndex] = ( node1[edgeIndex] != node2[edgeIndex] ) ?
+                    static_cast<double>( counts[edgeIndex] ) / N_forests : 1;
+
+    cache = rho;
 }
 
-// Returns tne maximum flow from s to t in the given graph
-int UPGMpp::fordFulkerson(MatrixXd &graph, int s, int t, VectorXi &cut)
+
+size_t UPGMpp::getNodeColors( CGraph &graph,
+                              const TCompactGraph &cg,
+                              std::vector<size_t> &colors )
 {
-    size_t N_nodes = graph.cols();
-    int u, v;
+    vector<size_t> &cache = graph.getNodeColors();
+    size_t N_nodes = cg.N_nodes;
+
+    // The graph, and so its cache, can be shared by several threads
+    #pragma omp critical(nodeColorsCache)
+    {
+        if ( N_nodes && ( cache.size() == N_nodes ) )
+            colors = cache;
+        else
+        {
+            const size_t NO_COLOR = std::numeric_limits<size_t>::max();
 
-    // Create a residual graph and fill the residual graph with
-    // given capacities in the original graph as residual capacities
-    // in residual graph
-    MatrixXd rGraph; // Residual graph where rGraph[i][j] indicates
-    rGraph.resize(N_nodes,N_nodes);
-                     // residual capacity of edge from i to j (if there
-                     // is an edge. If rGraph[i][j] is 0, then there is not)
-    for (u = 0; u < N_nodes; u++)
-        for (v = 0; v < N_nodes; v++)
-             rGraph(u,v) = graph(u,v);
+            // Nodes sorted by decreasing degree
+            vector<pair<size_t,size_t> > order( N_nodes );
 
-    int parent[N_nodes];  // This array is filled by BFS and to store path
+            for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+                order[nodeIndex] = make_pair( N_nodes - ( cg.adjOffsets[nodeIndex+1] - cg.adjOffsets[nodeIndex] ),
+                                              nodeIndex );
 
-    double max_flow = 0;  // There is no flow initially
+            std::sort( order.begin(), order.end() );
 
+            colors.assign( N_nodes, NO_COLOR );
 
+            // Colors taken by the neighbors of a node are marked with its index
+            vector<size_t> taken;
 
-    // Augment the flow while tere is path from source to sink
-    while (bfs(rGraph, s, t, parent))
-    {
-        // Find minimum residual capacity of the edhes along the
-        // path filled by BFS. Or we can say find the maximum flow
-        // through the path found.
-        double path_flow = std::numeric_limits<double>::max();
-        for (v=t; v!=s; v=parent[v])
-        {
-            u = parent[v];
-            path_flow = min(path_flow, rGraph(u,v));
-        }
+            for ( size_t i = 0; i < N_nodes; i++ )
+            {
+                size_t nodeIndex = order[i].second;
 
-        //cout << "Path flow: " << path_flow;
+                for ( size_t p = cg.adjOffsets[nodeIndex]; p < cg.adjOffsets[nodeIndex+1]; p++ )
+                {
+                    size_t color = colors[ cg.adjNeighbor[p] ];
 
-        // update residual capacities of the edges and reverse edges
-        // along the path
-        for (v=t; v != s; v=parent[v])
-        {
-            u = parent[v];
-            rGraph(u,v) -= path_flow;
-            rGraph(v,u) += path_flow;
-        }
+                    if ( color != NO_COLOR )
+                    {
+                        if ( color >= taken.size() )
+                            taken.resize( color+1, NO_COLOR );
+
+                        taken[color] = nodeIndex;
+                    }
+                }
+
+                size_t color = 0;
+
+                while ( ( color < taken.size() ) && ( taken[color] == nodeIndex ) )
+                    color++;
+
+                colors[nodeIndex] = color;
+            }
 
-        // Add path flow to overall flow
-        max_flow += path_flow;
+            cache = colors;
+        }
     }
 
-    getFinalCut(rGraph,s,t,cut);
+    size_t N_colors = 0;
+
+    for ( size_t nodeIndex = 0; nodeIndex < N_nodes; nodeIndex++ )
+        N_colors = std::max( N_colors, colors[nodeIndex]+1 );
+
+    return N_colors;
+}
 
-    /*cout << "The minimun cut is: ";
 
-    for ( int i=0; i<N_nodes; i++ )
-        cout << cut(i) << " ";
+void UPGMpp::getLocalScores( const TCompactGraph &cg,
+                             const vector<size_t> &labels,
+                             size_t nodeIndex,
+                             VectorXd &scores )
+{
+    scores = cg.logNodePotentials[nodeIndex];
 
-    cout << endl;*/
+    for ( size_t p = cg.adjOffsets[nodeIndex]; p < cg.adjOffsets[nodeIndex+1]; p++ )
+    {
+        size_t neighbor = cg.adjNeighbor[p];
+        const MatrixXd &logPotentials = cg.logEdgePotentials[ cg.adjEdge[p] ];
 
-    // Return the overall flow
-    return max_flow;
+        if ( neighbor == nodeIndex )
+        {
+            // Self loops appear twice
+            if ( cg.adjFirst[p] )
+                scores += logPotentials.diagonal();
+        }
+        else if ( cg.adjFirst[p] )
+            scores += logPotentials.col( labels[neighbor] );
+        else
+            scores += logPotentials.row( labels[neighbor] ).transpose();
+    }
 }
 
+
 void UPGMpp::getMostProbableNodeAssignation( CGraph &graph,
                                              map<size_t,size_t> &assignation,
                                              TInferenceOptions &options)
@@ -660,13 +2927,20 @@ void UPGMpp::getRandomAssignation(CGraph &graph,
                                   map<size_t,size_t> &assignation,
                                   TInferenceOptions &options )
 {
-    static boost::mt19937 rng1;
-    static bool firstExecution = true;
+    // Each call draws from its own stream, seeded with particularD["seed"]
+    // if set, or with a seed taken from a shared generator otherwise (in a
+    // critical section, so it can be called from several threads)
 
-    if ( firstExecution )
+    boost::mt19937 rng1;
+
+    if ( options.particularD.count("seed") )
+        rng1.seed( static_cast<unsigned int>( options.particularD["seed"] ) );
+    else
     {
-        rng1.seed(std::time(0));
-        firstExecution = false;
+        static boost::mt19937 seeds( std::time(0) );
+
+        #pragma omp critical(randomAssignationSeeds)
+        rng1.seed( seeds() );
     }
 
     vector<CNodePtr> &nodes = graph.getNodes();
@@ -712,3 +2986,4 @@ void UPGMpp::applyMaskToPotentials(CGraph &graph, map<size_t,vector<size_t> > &m
         }
     }
 }
+
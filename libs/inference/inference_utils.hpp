@@ -48,21 +48,303 @@ namespace UPGMpp
         {}
     };
 
+    /** Information about how an iterative inference method finished. */
+    struct TInferenceStatus
+    {
+        size_t      iterations; //!< Number of iterations (sweeps) performed.
+        double      residual;   //!< Max change of a message in the last iteration.
+        std::string stopCause;  //!< "Converged", "MaxIterations", ...
+
+        TInferenceStatus() : iterations( 0 ),
+                             residual( 0 ),
+                             stopCause( "" )
+        {}
+    };
+
+    /** Tracks the labels decoded for the nodes along the sweeps of a MAP
+      * method, to stop iterating once the decisions are stable. A node is
+      * stable if its label has not changed in the last
+      * particularD["decisionStabilitySweeps"] sweeps (1 if not set), and the
+      * decisions are stable when a fraction
+      * particularD["decisionStabilityFraction"] of the nodes is stable (all
+      * of them if not set). It is disabled if none of these options is set.
+      */
+    class CDecisionStability
+    {
+    private:
+        bool                m_enabled;
+        size_t              m_N_sweeps;
+        double              m_fraction;
+        size_t              m_sweep;       //!< Number of finished sweeps.
+        std::vector<size_t> m_labels;      //!< Last label of each node.
+        std::vector<size_t> m_lastChange;  //!< Sweep in which the label of each node last changed.
+
+    public:
+
+        CDecisionStability( TInferenceOptions &options, size_t N_nodes );
+
+        inline bool isEnabled() const { return m_enabled; }
+
+        /** Sets the label decoded for a node in the current sweep. Different
+          * nodes can be set concurrently.
+          */
+        inline void setLabel( size_t nodeIndex, size_t label )
+        {
+            if ( !m_sweep || ( m_labels[nodeIndex] != label ) )
+            {
+                m_labels[nodeIndex]     = label;
+                m_lastChange[nodeIndex] = m_sweep;
+            }
+        }
+
+        /** Finishes the current sweep.
+          * \return True if the decisions are stable.
+          */
+        bool endSweep();
+    };
+
+    /** Compact and index based view of a graph, used by the message passing
+      * kernels to avoid searching for nodes and edges by ID and copying their
+      * potentials. Nodes and edges are referred by their position in the
+      * graph vectors, and the neighbors of each node are stored contiguously
+      * as directed edges (node -> neighbor), keeping the order of edges_f.
+      * The message sent through the directed edge p is stored at
+      * msgOffsets[p], having as many elements as classes has the neighbor.
+      */
+    struct TCompactGraph
+    {
+        size_t N_nodes;
+        size_t N_edges;
+        size_t maxClasses; //!< Maximum number of classes of a node.
+        size_t maxDegree;  //!< Maximum number of neighbors of a node.
+
+        std::vector<size_t>             nodeIDs;        //!< ID of each node.
+        std::map<size_t,size_t>         nodeIndices;    //!< Position of each node ID.
+        std::vector<size_t>             N_classes;      //!< Number of classes of each node.
+        std::vector<Eigen::VectorXd>    nodePotentials; //!< Node potentials, considering fixed values if requested.
+
+        std::vector<size_t>                 edgeNode1;      //!< Position of the first node of each edge.
+        std::vector<size_t>                 edgeNode2;      //!< Position of the second node of each edge.
+        std::vector<const Eigen::MatrixXd*> edgePotentials; //!< Edge potentials, rows are the classes of the first node.
+        std::vector<size_t>                 edgeAdj;        //!< Directed edges of each edge: [2e] from the first node, [2e+1] from the second.
+
+        std::vector<size_t> adjOffsets;  //!< Directed edges of the node i are in [adjOffsets[i],adjOffsets[i+1]).
+        std::vector<size_t> adjEdge;     //!< Edge of each directed edge.
+        std::vector<size_t> adjNeighbor; //!< Neighbor reached through each directed edge.
+        std::vector<size_t> adjReverse;  //!< Directed edge going in the opposite direction.
+        std::vector<char>   adjFirst;    //!< Is the node sending the message the first one in the edge?
+        std::vector<size_t> msgOffsets;  //!< Offset of the message of each directed edge (size 2*N_edges+1).
+
+        std::vector<Eigen::VectorXd> logNodePotentials; //!< Log of the node potentials, filled by getLogPotentials.
+        std::vector<Eigen::MatrixXd> logEdgePotentials; //!< Log of the edge potentials, filled by getLogPotentials.
+    };
+
+    /** Number of threads to be used by the parallel methods:
+      * particularD["numberOfThreads"] if set, otherwise all the available
+      * ones. Always 1 if OpenMP is not enabled.
+      */
+    extern size_t getNumberOfThreads( TInferenceOptions &options );
+
+    extern void getCompactGraph( CGraph &graph,
+                                 TInferenceOptions &options,
+                                 TCompactGraph &cg );
+
+    /** Fills the log potentials of a compact graph. Zero potentials are
+      * mapped to log(DBL_MIN) and infinite ones to log(DBL_MAX), so the log
+      * domain computations never produce NaNs.
+      */
+    extern void getLogPotentials( TCompactGraph &cg );
+
+    /** Computes the messages passed by Loopy Belief Propagation. If
+      * options.particularB["logDomain"] is true, messages are computed and
+      * returned in the log domain (max-sum or sum-product with log-sum-exp),
+      * otherwise they are normalized probabilities. Use getNodeBeliefs,
+      * getEdgeBeliefs and getBetheLogZ to process them in both cases.
+      * It stops when the max change of a message entry in an iteration is
+      * under options.convergency, only updating the nodes whose incoming
+      * messages changed more than that. When maximizing, it also stops if
+      * the decoded labels are stable (see CDecisionStability). If status is
+      * given, it is filled with the number of iterations, the last residual
+      * and the stop cause.
+      * \return The number of iterations performed.
+      */
     extern size_t messagesLBP( CGraph &graph,
                                TInferenceOptions &options,
                                std::vector<std::vector<Eigen::VectorXd> > &messages,
                                bool maximize = true,
-                               const vector<size_t> &tree = vector<size_t>());
+                               const vector<size_t> &tree = vector<size_t>(),
+                               TInferenceStatus *status = NULL );
+
+    /** Computes the messages passed by Splash Belief Propagation. Each thread
+      * takes the node with the highest residual (max change of its incoming
+      * messages), from its own queue or stealing it from the others, builds a
+      * BFS tree of up to particularD["splashSize"] nodes around it (16 by
+      * default), and updates its messages from the leaves to the root and
+      * back. It stops when no residual is over options.convergency, or after
+      * options.maxIterations*N_nodes node updates. Messages are in the same
+      * domain as in messagesLBP. If status is given, its iterations are the
+      * node updates divided by the number of nodes.
+      * \return The number of node updates.
+      */
+    extern size_t messagesSplash( CGraph &graph,
+                                  TInferenceOptions &options,
+                                  std::vector<std::vector<Eigen::VectorXd> > &messages,
+                                  bool maximize = true,
+                                  TInferenceStatus *status = NULL );
+
+    /** Max change of a message entry between two sets of messages, or the
+      * max double if they do not have the same structure.
+      */
+    extern double getMessagesResidual( const std::vector<std::vector<Eigen::VectorXd> > &previousMessages,
+                                       const std::vector<std::vector<Eigen::VectorXd> > &messages );
+
+    /** Computes the (normalized) beliefs of the nodes from the messages
+      * obtained by messagesLBP.
+      */
+    extern void getNodeBeliefs( CGraph &graph,
+                                TInferenceOptions &options,
+                                std::vector<std::vector<Eigen::VectorXd> > &messages,
+                                std::map<size_t,Eigen::VectorXd> &nodeBeliefs );
+
+    /** Computes the (normalized) beliefs of the edges from the messages
+      * obtained by messagesLBP. Rows are the classes of the first node.
+      */
+    extern void getEdgeBeliefs( CGraph &graph,
+                                TInferenceOptions &options,
+                                std::vector<std::vector<Eigen::VectorXd> > &messages,
+                                std::map<size_t,Eigen::MatrixXd> &edgeBeliefs );
+
+    /** Approximates logZ by the Bethe free energy of the given beliefs.
+      * Zero beliefs contribute with 0 (0*log(0)), and potentials are taken
+      * in the log domain as in getLogPotentials.
+      */
+    extern double getBetheLogZ( CGraph &graph,
+                                TInferenceOptions &options,
+                                std::map<size_t,Eigen::VectorXd> &nodeBeliefs,
+                                std::map<size_t,Eigen::MatrixXd> &edgeBeliefs );
+
+    /** Exact MAP of the acyclic connected components of a graph, by a
+      * Viterbi (max-sum) pass from the leaves to a root and a decoding pass
+      * back, in O(N*K^2). If cyclicPart is given, it is filled with the nodes
+      * and edges of the components having cycles (sharing them with graph),
+      * which are not solved, otherwise those components are reported as an
+      * error.
+      */
+    extern void getForestMAP( CGraph &graph,
+                              TInferenceOptions &options,
+                              std::map<size_t,size_t> &results,
+                              CGraph *cyclicPart = NULL );
+
+    /** Exact node and edge marginals of the acyclic connected components of
+      * a graph by forward-backward (sum-product) passes, in O(N*K^2). Edge
+      * beliefs have as rows the classes of the first node. The cyclic
+      * components are handled as in getForestMAP.
+      * \return The exact logZ of the solved components.
+      */
+    extern double getForestMarginals( CGraph &graph,
+                                      TInferenceOptions &options,
+                                      std::map<size_t,Eigen::VectorXd> &nodeBeliefs,
+                                      std::map<size_t,Eigen::MatrixXd> &edgeBeliefs,
+                                      CGraph *cyclicPart = NULL );
+
+    /** Computes a greedy elimination order of the nodes of a compact graph
+      * (triangulation), eliminating at each step the node that adds the
+      * fewest fill-in edges ("MinFill", the default) or the node with the
+      * fewest neighbors ("MinDegree"), breaking ties by the size of the
+      * resulting clique table.
+      * \param order: Positions of the nodes in elimination order.
+      * \param neighbors: If given, the neighbors of each eliminated node
+      * (in elimination order) when it was eliminated.
+      * \return The width of the order (size of the largest clique minus 1).
+      */
+    extern size_t getEliminationOrder( TCompactGraph &cg,
+                                       const std::string &heuristic,
+                                       std::vector<size_t> &order,
+                                       std::vector<std::vector<size_t> > *neighbors = NULL );
+
+    /** Exact MAP by max-sum message passing over a junction tree, whose
+      * cliques are those of a triangulation of the graph computed by
+      * getEliminationOrder with particularS["eliminationOrder"]. Clique
+      * potentials are stored as contiguous log tables, so the cost is
+      * O(N*K^(w+1)), w being the width of the triangulation. If a table
+      * would have more than particularD["maxTableSize"] entries (10^7 if not
+      * set) nothing is computed.
+      * \return False if the tables are too large.
+      */
+    extern bool getJunctionTreeMAP( CGraph &graph,
+                                    TInferenceOptions &options,
+                                    std::map<size_t,size_t> &results );
+
+    /** Exact node and edge marginals and logZ by sum-product message
+      * passing over a junction tree (see getJunctionTreeMAP). Edge beliefs
+      * have as rows the classes of the first node.
+      * \return False if the tables are too large.
+      */
+    extern bool getJunctionTreeMarginals( CGraph &graph,
+                                          TInferenceOptions &options,
+                                          std::map<size_t,Eigen::VectorXd> &nodeBeliefs,
+                                          std::map<size_t,Eigen::MatrixXd> &edgeBeliefs,
+                                          double &logZ );
+
+    /** Bucket (variable) elimination in the order given by
+      * getEliminationOrder with particularS["eliminationOrder"]. Each node
+      * is eliminated from the product of the log factors of its bucket by
+      * max (maximize) or log-sum-exp. If that product would have more than
+      * particularD["maxTableSize"] entries (10^7 if not set), the bucket is
+      * split into mini-buckets, eliminating the node in one of them and
+      * maximizing it in the rest, so the result becomes an upper bound.
+      * \param results: If given, filled with the labels decoded by maximizing
+      * each bucket given the nodes eliminated later (the exact MAP if
+      * maximizing without mini-buckets).
+      * \param exact: If given, set to false if mini-buckets were needed.
+      * \return The max log score (maximize) or logZ, or an upper bound.
+      */
+    extern double eliminateVariables( CGraph &graph,
+                                      TInferenceOptions &options,
+                                      bool maximize,
+                                      std::map<size_t,size_t> *results = NULL,
+                                      bool *exact = NULL );
 
     extern void getSpanningTree( CGraph &graph, std::vector<size_t> &tree);
 
+    /** Computes the edge appearance probabilities of the graph edges (in the
+      * order of the edges vector) for tree-reweighted methods, as the fraction
+      * of the spanning forests of a cover that contain each edge. The forests
+      * are built by Kruskal taking first the least used edges (random order
+      * among ties, with a fixed seed), until every edge is in some forest.
+      * The result is cached in the graph, so it is only computed once per
+      * topology.
+      */
+    extern void getEdgeAppearanceProbabilities( CGraph &graph, std::vector<double> &rho );
+
+
+    /** Greedy coloring of the nodes of a graph (visiting them by decreasing
+      * degree), so neighbors have different colors. It is cached in the
+      * graph until its nodes or edges change, and the cache can be filled
+      * from several threads at once.
+      * \return The number of colors.
+      */
+    extern size_t getNodeColors( CGraph &graph,
+                                 const TCompactGraph &cg,
+                                 std::vector<size_t> &colors );
 
-    extern int fordFulkerson(MatrixXd &graph, int s, int t, VectorXi &cut);
+    /** Log scores of the classes of a node given the classes of its
+      * neighbors (labels): its log node potentials plus the log potentials
+      * of its edges. The log potentials of cg must be filled.
+      */
+    extern void getLocalScores( const TCompactGraph &cg,
+                                const std::vector<size_t> &labels,
+                                size_t nodeIndex,
+                                Eigen::VectorXd &scores );
 
     void getMostProbableNodeAssignation( CGraph &graph,
                                          std::map<size_t,size_t> &assignation,
                                          TInferenceOptions &options);
 
+    /** Random classes for the nodes. The random numbers come from
+      * particularD["seed"] if it is set, so the assignation can be
+      * reproduced, and from a different seed in each call otherwise.
+      */
     void getRandomAssignation(CGraph &graph,
                               std::map<size_t,size_t> &assignation,
                               TInferenceOptions &options);
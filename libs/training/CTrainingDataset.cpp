@@ -1585,27 +1585,53 @@ void CTrainingDataSet::updateInference( CGraph &graph,
     map<size_t,MatrixXd> edgeBeliefs;
     double logZ;
 
+    TInferenceOptions inferenceOptions;
+    inferenceOptions.particularB["logDomain"] = m_trainingOptions.inferenceLogDomain;
+
     if ( m_trainingOptions.inferenceMethod == "LBP" )
     {
         CLBPInferenceMarginal LBPinfer;
+        LBPinfer.setOptions( inferenceOptions );
         LBPinfer.infer( graph, nodeBeliefs, edgeBeliefs, logZ );
     }
     else if ( m_trainingOptions.inferenceMethod == "TRPBP" )
     {
         CTRPBPInferenceMarginal TRPBPinfer;
+        TRPBPinfer.setOptions( inferenceOptions );
         TRPBPinfer.infer( graph, nodeBeliefs, edgeBeliefs, logZ );
     }
     else if ( m_trainingOptions.inferenceMethod == "RBP" )
     {
         CRBPInferenceMarginal RBPinfer;
+        RBPinfer.setOptions( inferenceOptions );
         RBPinfer.infer( graph, nodeBeliefs, edgeBeliefs, logZ );
     }
+    else if ( m_trainingOptions.inferenceMethod == "TRWBP" )
+    {
+        CTRWBPInferenceMarginal TRWBPinfer;
+        TRWBPinfer.setOptions( inferenceOptions );
+        TRWBPinfer.infer( graph, nodeBeliefs, edgeBeliefs, logZ );
+    }
     else
     {
         cout << "Unknown inference method specified for training." << endl;
         return;
     }
 
+    if ( m_trainingOptions.validateLogZ )
+    {
+        map<size_t,VectorXd> VEnodeBeliefs;
+        map<size_t,MatrixXd> VEedgeBeliefs;
+        double exactLogZ;
+
+        CVariableEliminationInferenceMarginal VEinfer;
+        VEinfer.setOptions( inferenceOptions );
+        VEinfer.infer( graph, VEnodeBeliefs, VEedgeBeliefs, exactLogZ );
+
+        cout << "[logZ] " << m_trainingOptions.inferenceMethod << ": " << logZ
+             << ( VEinfer.isExact() ? " exact: " : " upper bound: " ) << exactLogZ << endl;
+    }
+
 //            cout << "pre fx: " << fx << endl;
 //            cout << "logZ  : " << logZ << endl;
 //            cout << "likelihood: " << graph.getUnnormalizedLogLikelihood(groundTruth) << endl;
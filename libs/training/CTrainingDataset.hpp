@@ -89,6 +89,8 @@ namespace UPGMpp
         TSGDOptions     sgd;
         std::string     trainingType;
         std::string     inferenceMethod;
+        bool            inferenceLogDomain; // Use log domain message passing (LBP, TRPBP, RBP)
+        bool            validateLogZ; // Show the logZ of the inference method and the exact one (variable elimination)
         std::string     decodingMethod;
         std::string     optimizationMethod;
         std::vector<double>  lambda;        
@@ -104,6 +106,8 @@ namespace UPGMpp
                             classRelevance(false),
                             trainingType("pseudolikelihood"),
                             inferenceMethod("LBP"),
+                            inferenceLogDomain(false),
+                            validateLogZ(false),
                             decodingMethod("AlphaExpansions"),
                             optimizationMethod("LBFGS"),
                             numOfRandomStarts(0),                            